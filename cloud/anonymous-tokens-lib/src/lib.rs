@@ -1,7 +1,278 @@
+mod spent;
+
+use std::collections::HashMap;
+
 use anonymous_tokens::sk::pp::{KeyPair, PublicParams, Token, TokenBlinded, TokenSigned};
 use pyo3::exceptions::PyValueError;
 use pyo3::prelude::*;
 use pyo3::types::PyBytes;
+use rand_chacha::rand_core::SeedableRng;
+use rand_chacha::ChaCha20Rng;
+use rayon::prelude::*;
+use serde::de::DeserializeOwned;
+use serde::Serialize;
+use sha2::{Digest, Sha256};
+
+use spent::{MuleId, SpentSet, MULE_ID_BYTES};
+
+/// Bytes of the token length that leads a TokenList (payloads.py packs it as
+/// a native 'I').
+const TOKEN_LEN_BYTES: usize = 4;
+
+fn to_py_bytes<T: Serialize>(py: Python, value: &T) -> PyResult<PyObject> {
+    match bincode::serialize(value) {
+        Err(e) => Err(PyErr::new::<PyValueError, _>(format!("{}", e))),
+        Ok(s) => Ok(PyBytes::new(py, &s).to_object(py))
+    }
+}
+
+fn from_bytes<T: DeserializeOwned>(bytes: &[u8], what: &str) -> PyResult<T> {
+    bincode::deserialize(bytes)
+        .map_err(|e| PyErr::new::<PyValueError, _>(format!("bad {}: {}", what, e)))
+}
+
+/// The index of the first keypair each token verifies under, None if none or
+/// if it does not decode. Tokens are verified one by one, in parallel.
+fn epochs_of(keypairs: &[&KeyPair], tokens: &[&[u8]]) -> Vec<Option<usize>> {
+    tokens
+        .par_iter()
+        .map(|t| match bincode::deserialize::<Token>(t) {
+            Err(_) => None,
+            Ok(token) => keypairs.iter().position(|keypair| keypair.verify(&token).is_ok())
+        })
+        .collect()
+}
+
+/// A keypair decoded once, for servers that sign and verify many tokens
+/// with the same key; the free functions below decode theirs on every call.
+#[pyclass(name = "KeyPair")]
+struct KeyPairHandle {
+    keypair: KeyPair,
+    public_params: Vec<u8>,
+}
+
+#[pymethods]
+impl KeyPairHandle {
+    #[new]
+    fn new(keypair_bytes: &[u8]) -> PyResult<Self> {
+        let keypair: KeyPair = from_bytes(keypair_bytes, "keypair")?;
+        let public_params = bincode::serialize(&PublicParams::from(&keypair))
+            .map_err(|e| PyErr::new::<PyValueError, _>(format!("{}", e)))?;
+        Ok(KeyPairHandle { keypair, public_params })
+    }
+
+    /// The keypair of one epoch, made from a secret seed so every process
+    /// holding the seed derives the same one without sharing key files.
+    #[staticmethod]
+    fn derive(seed: &[u8], epoch: u64) -> PyResult<Self> {
+        let mut hasher = Sha256::new();
+        hasher.update(seed);
+        hasher.update(epoch.to_le_bytes());
+        let mut rng = ChaCha20Rng::from_seed(hasher.finalize().into());
+        let keypair = KeyPair::generate(&mut rng);
+        let public_params = bincode::serialize(&PublicParams::from(&keypair))
+            .map_err(|e| PyErr::new::<PyValueError, _>(format!("{}", e)))?;
+        Ok(KeyPairHandle { keypair, public_params })
+    }
+
+    /// The serialized PublicParams, derived when the key was loaded.
+    fn public_params(&self, py: Python) -> PyObject {
+        PyBytes::new(py, &self.public_params).to_object(py)
+    }
+
+    fn sign(&self, py: Python, blinded_token: &[u8]) -> PyResult<PyObject> {
+        let blinded_token: TokenBlinded = from_bytes(blinded_token, "blinded token")?;
+        match self.keypair.sign(&blinded_token.to_bytes()) {
+            None => Err(PyErr::new::<PyValueError, _>("Failed to sign token")),
+            Some(signed_token) => to_py_bytes(py, &signed_token)
+        }
+    }
+
+    /// Signs a list of blinded tokens across all cores, with the GIL released
+    /// so the server's other requests keep going. Returns the signed tokens
+    /// back to back, in order.
+    fn sign_batch(&self, py: Python, blinded_tokens: Vec<&[u8]>) -> PyResult<PyObject> {
+        // decoded while the GIL still guards the bytes they borrow
+        let blinded_tokens = blinded_tokens
+            .iter()
+            .map(|t| from_bytes::<TokenBlinded>(t, "blinded token"))
+            .collect::<PyResult<Vec<_>>>()?;
+        let keypair = &self.keypair;
+
+        let signed: Option<Vec<Vec<u8>>> = py.allow_threads(|| {
+            blinded_tokens
+                .par_iter()
+                .map(|t| {
+                    keypair
+                        .sign(&t.to_bytes())
+                        .and_then(|signed_token| bincode::serialize(&signed_token).ok())
+                })
+                .collect()
+        });
+        match signed {
+            None => Err(PyErr::new::<PyValueError, _>("Failed to sign token")),
+            Some(signed) => Ok(PyBytes::new(py, &signed.concat()).to_object(py))
+        }
+    }
+
+    /// A token that does not even decode is as invalid as a forged one.
+    fn verify(&self, token: &[u8]) -> bool {
+        match bincode::deserialize::<Token>(token) {
+            Err(_) => false,
+            Ok(token) => self.keypair.verify(&token).is_ok()
+        }
+    }
+
+    /// Sorts tokens into epochs for callers that spend them elsewhere, as
+    /// redeem does for itself: 0 for a token that verifies under this key, 1
+    /// under previous, None under neither. Each token is verified on its own,
+    /// spread across all cores with the GIL released.
+    #[pyo3(signature = (tokens, previous = None))]
+    fn epochs_of(
+        &self,
+        py: Python,
+        tokens: Vec<&[u8]>,
+        previous: Option<PyRef<KeyPairHandle>>,
+    ) -> Vec<Option<usize>> {
+        let mut keypairs = vec![&self.keypair];
+        if let Some(previous) = &previous {
+            keypairs.push(&previous.keypair);
+        }
+        py.allow_threads(|| epochs_of(&keypairs, &tokens))
+    }
+
+    /// Redeems a /redeem_tokens body, mule ID || TokenList, in one call with
+    /// the GIL released: verifies every token, adds the valid ones to spent
+    /// and charges each one already there back to the mule that spent it
+    /// first. Tokens that fail under this key are tried under previous, the
+    /// last epoch's, and go to previous_spent. A token the redeeming mule
+    /// spent before was credited then, so a batch sent again after a lost
+    /// response earns and costs nothing. Returns the serialized
+    /// TokenList of invalid tokens, the change in every affected mule's count
+    /// (the redeeming mule's first, even if 0) and the duplicates as
+    /// (previous mule or None, token, epoch), in body order, where epoch is 0
+    /// for a token spent under this key and 1 under previous.
+    #[pyo3(signature = (body, spent, previous = None, previous_spent = None))]
+    fn redeem(
+        &self,
+        py: Python,
+        body: &[u8],
+        spent: PyRef<SpentSet>,
+        previous: Option<PyRef<KeyPairHandle>>,
+        previous_spent: Option<PyRef<SpentSet>>,
+    ) -> PyResult<(PyObject, Vec<(PyObject, i64)>, Vec<(PyObject, PyObject, usize)>)> {
+        if body.len() < MULE_ID_BYTES + TOKEN_LEN_BYTES {
+            return Err(PyErr::new::<PyValueError, _>("redemption too short"));
+        }
+        let (mule_id, token_list) = body.split_at(MULE_ID_BYTES);
+        let mule_id: MuleId = mule_id.try_into().unwrap();
+        let (token_len, token_bytes) = token_list.split_at(TOKEN_LEN_BYTES);
+        let token_len = u32::from_ne_bytes(token_len.try_into().unwrap()) as usize;
+        if token_len == 0 && !token_bytes.is_empty() {
+            return Err(PyErr::new::<PyValueError, _>("bad token length"));
+        }
+        let epochs: Vec<(&KeyPair, &SpentSet)> = match (&previous, &previous_spent) {
+            (None, None) => vec![(&self.keypair, &*spent)],
+            (Some(previous), Some(previous_spent)) => {
+                vec![(&self.keypair, &*spent), (&previous.keypair, &**previous_spent)]
+            }
+            _ => return Err(PyErr::new::<PyValueError, _>("previous needs previous_spent")),
+        };
+
+        let (invalid, deltas, duplicates) = py.allow_threads(|| {
+            let tokens: Vec<&[u8]> = token_bytes.chunks(token_len.max(1)).collect();
+            let keypairs: Vec<&KeyPair> = epochs.iter().map(|(keypair, _)| *keypair).collect();
+            let epoch_of = epochs_of(&keypairs, &tokens);
+
+            let mut invalid = Vec::with_capacity(TOKEN_LEN_BYTES);
+            invalid.extend_from_slice(&0u32.to_ne_bytes());
+            for (token, epoch) in tokens.iter().zip(&epoch_of) {
+                if epoch.is_some() {
+                    continue;
+                }
+                if invalid.len() == TOKEN_LEN_BYTES {
+                    invalid[..TOKEN_LEN_BYTES].copy_from_slice(&(token.len() as u32).to_ne_bytes());
+                }
+                invalid.extend_from_slice(token);
+            }
+
+            let mut previous_owner: Vec<Option<Option<MuleId>>> = vec![None; tokens.len()];
+            for (e, (_, spent)) in epochs.iter().enumerate() {
+                let at: Vec<usize> = (0..tokens.len()).filter(|&i| epoch_of[i] == Some(e)).collect();
+                let redeemed: Vec<(&[u8], MuleId)> = at.iter().map(|&i| (tokens[i], mule_id)).collect();
+                for (i, p) in at.into_iter().zip(spent.insert_batch(&redeemed)?) {
+                    previous_owner[i] = p;
+                }
+            }
+
+            let mut deltas: Vec<(MuleId, i64)> = vec![(mule_id, 0)];
+            let mut delta_index: HashMap<MuleId, usize> = HashMap::new();
+            delta_index.insert(mule_id, 0);
+            let mut duplicates: Vec<(Option<MuleId>, &[u8], usize)> = Vec::new();
+
+            for (i, token) in tokens.iter().enumerate() {
+                let epoch = match epoch_of[i] {
+                    None => continue,
+                    Some(epoch) => epoch
+                };
+                match previous_owner[i] {
+                    None => deltas[0].1 += 1,
+                    Some(Some(owner)) if owner == mule_id => {}
+                    Some(previous) => {
+                        // a token complain() invalidated is charged to no one
+                        if let Some(owner) = previous {
+                            let d = *delta_index.entry(owner).or_insert_with(|| {
+                                deltas.push((owner, 0));
+                                deltas.len() - 1
+                            });
+                            deltas[d].1 -= 1;
+                        }
+                        duplicates.push((previous, *token, epoch));
+                    }
+                }
+            }
+            Ok::<_, std::io::Error>((invalid, deltas, duplicates))
+        })?;
+
+        Ok((
+            PyBytes::new(py, &invalid).to_object(py),
+            deltas
+                .into_iter()
+                .map(|(mule, delta)| (PyBytes::new(py, &mule).to_object(py), delta))
+                .collect(),
+            duplicates
+                .into_iter()
+                .map(|(mule, token, epoch)| {
+                    (
+                        mule.map(|m| PyBytes::new(py, &m).to_object(py)).to_object(py),
+                        PyBytes::new(py, token).to_object(py),
+                        epoch,
+                    )
+                })
+                .collect(),
+        ))
+    }
+}
+
+/// Public parameters decoded once, for generating many blinded tokens.
+#[pyclass(name = "PublicParams")]
+struct PublicParamsHandle {
+    public_params: PublicParams,
+}
+
+#[pymethods]
+impl PublicParamsHandle {
+    #[new]
+    fn new(public_params_bytes: &[u8]) -> PyResult<Self> {
+        let public_params: PublicParams = from_bytes(public_params_bytes, "public params")?;
+        Ok(PublicParamsHandle { public_params })
+    }
+
+    fn generate_token(&self, py: Python) -> PyResult<PyObject> {
+        let mut csrng = rand::rngs::OsRng;
+        to_py_bytes(py, &self.public_params.generate_token(&mut csrng))
+    }
+}
 
 #[pyfunction]
 fn generate_keypair(py: Python) -> PyResult<PyObject> {
@@ -104,6 +375,9 @@ fn tokenlib(_py: Python, m: &PyModule) -> PyResult<()> {
     m.add_wrapped(wrap_pyfunction!(sign_token))?;
     m.add_wrapped(wrap_pyfunction!(unblind_token))?;
     m.add_wrapped(wrap_pyfunction!(verify_token))?;
+    m.add_class::<KeyPairHandle>()?;
+    m.add_class::<PublicParamsHandle>()?;
+    m.add_class::<SpentSet>()?;
     Ok(())
 }
 
@@ -0,0 +1,467 @@
+use std::fs::{self, File, OpenOptions};
+use std::io;
+use std::path::{Path, PathBuf};
+use std::sync::Mutex;
+
+use memmap2::MmapMut;
+use pyo3::exceptions::PyValueError;
+use pyo3::prelude::*;
+use pyo3::types::PyBytes;
+use rayon::prelude::*;
+use sha2::{Digest, Sha256};
+
+/// Bytes of the mule ID that owns a redeemed token.
+pub const MULE_ID_BYTES: usize = 16;
+
+pub type MuleId = [u8; MULE_ID_BYTES];
+
+/// The owner of keys added without one; never a mule's.
+const NO_OWNER: MuleId = [0; MULE_ID_BYTES];
+
+/// Tokens are kept as the first 16 bytes of their SHA-256, which a forger
+/// cannot steer into someone else's token the way it could a SipHash.
+const FINGERPRINT_BYTES: usize = 16;
+
+type Fingerprint = [u8; FINGERPRINT_BYTES];
+
+/// A slot is fingerprint || owner; an all-zero fingerprint marks it empty.
+const SLOT_BYTES: usize = FINGERPRINT_BYTES + MULE_ID_BYTES;
+
+/// Each stripe's file starts with the magic and its slot count (u64 LE).
+const MAGIC: &[u8; 8] = b"NBSPENT1";
+const HEADER_BYTES: usize = 16;
+
+/// Slots a stripe starts with; a power of two, doubled past 3/4 full.
+const MIN_CAPACITY: usize = 1024;
+
+fn fingerprint(key: &[u8]) -> Fingerprint {
+    let mut fp = [0u8; FINGERPRINT_BYTES];
+    fp.copy_from_slice(&Sha256::digest(key)[..FINGERPRINT_BYTES]);
+    if fp == [0; FINGERPRINT_BYTES] {
+        fp[0] = 1;
+    }
+    fp
+}
+
+fn invalid_data(msg: String) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, msg)
+}
+
+/// Makes a file's creation or renaming in dir survive a crash.
+fn sync_dir(dir: &Path) -> io::Result<()> {
+    File::open(dir)?.sync_all()
+}
+
+/// One stripe: an open-addressed, linearly probed table of slots in a
+/// memory map, of a file if the set is persistent and anonymous otherwise.
+struct Table {
+    map: MmapMut,
+    path: Option<PathBuf>,
+    capacity: usize,
+    len: usize,
+    /// Bytes of map written since the last sync().
+    dirty: Option<(usize, usize)>,
+}
+
+impl Table {
+    fn create(path: Option<&Path>, capacity: usize) -> io::Result<Table> {
+        let bytes = HEADER_BYTES + capacity * SLOT_BYTES;
+        let mut map = match path {
+            None => MmapMut::map_anon(bytes)?,
+            Some(path) => {
+                let file = OpenOptions::new()
+                    .read(true)
+                    .write(true)
+                    .create(true)
+                    .truncate(true)
+                    .open(path)?;
+                file.set_len(bytes as u64)?;
+                unsafe { MmapMut::map_mut(&file)? }
+            }
+        };
+        map[..8].copy_from_slice(MAGIC);
+        map[8..HEADER_BYTES].copy_from_slice(&(capacity as u64).to_le_bytes());
+        Ok(Table { map, path: path.map(Path::to_path_buf), capacity, len: 0, dirty: None })
+    }
+
+    /// Maps a stripe's file, making it if there is none yet.
+    fn open(path: &Path) -> io::Result<Table> {
+        if !path.exists() {
+            let table = Table::create(Some(path), MIN_CAPACITY)?;
+            table.map.flush()?;
+            if let Some(dir) = path.parent() {
+                sync_dir(dir)?;
+            }
+            return Ok(table);
+        }
+        let file = OpenOptions::new().read(true).write(true).open(path)?;
+        let map = unsafe { MmapMut::map_mut(&file)? };
+        if map.len() < HEADER_BYTES || &map[..8] != MAGIC {
+            return Err(invalid_data(format!("{}: not a spent set", path.display())));
+        }
+        let capacity = u64::from_le_bytes(map[8..HEADER_BYTES].try_into().unwrap()) as usize;
+        if !capacity.is_power_of_two() || map.len() != HEADER_BYTES + capacity * SLOT_BYTES {
+            return Err(invalid_data(format!("{}: bad size", path.display())));
+        }
+        // counted rather than stored, so a crash cannot leave it wrong
+        let len = (0..capacity)
+            .filter(|&i| {
+                let at = HEADER_BYTES + i * SLOT_BYTES;
+                map[at..at + FINGERPRINT_BYTES] != [0; FINGERPRINT_BYTES]
+            })
+            .count();
+        Ok(Table { map, path: Some(path.to_path_buf()), capacity, len, dirty: None })
+    }
+
+    /// The slot fp is in, or the empty one it would go in.
+    fn find(&self, fp: &Fingerprint) -> usize {
+        let mask = self.capacity - 1;
+        let mut i = u64::from_le_bytes(fp[8..16].try_into().unwrap()) as usize & mask;
+        loop {
+            let at = HEADER_BYTES + i * SLOT_BYTES;
+            let slot = &self.map[at..at + FINGERPRINT_BYTES];
+            if slot == fp || slot == [0; FINGERPRINT_BYTES] {
+                return at;
+            }
+            i = (i + 1) & mask;
+        }
+    }
+
+    /// The owner fp was added with, if it is there.
+    fn get(&self, fp: &Fingerprint) -> Option<MuleId> {
+        let at = self.find(fp);
+        if self.map[at..at + FINGERPRINT_BYTES] != fp[..] {
+            return None;
+        }
+        let mut owner = NO_OWNER;
+        owner.copy_from_slice(&self.map[at + FINGERPRINT_BYTES..at + SLOT_BYTES]);
+        Some(owner)
+    }
+
+    /// Adds fp with owner unless it is already there; returns the owner it
+    /// had if so.
+    fn insert(&mut self, fp: &Fingerprint, owner: &MuleId) -> io::Result<Option<MuleId>> {
+        if (self.len + 1) * 4 > self.capacity * 3 {
+            self.grow()?;
+        }
+        let at = self.find(fp);
+        let slot = &mut self.map[at..at + SLOT_BYTES];
+        if slot[..FINGERPRINT_BYTES] == fp[..] {
+            let mut previous = NO_OWNER;
+            previous.copy_from_slice(&slot[FINGERPRINT_BYTES..]);
+            return Ok(Some(previous));
+        }
+        // owner first, so a slot never looks taken without one
+        slot[FINGERPRINT_BYTES..].copy_from_slice(owner);
+        slot[..FINGERPRINT_BYTES].copy_from_slice(fp);
+        self.len += 1;
+        self.dirty = Some(match self.dirty {
+            None => (at, at + SLOT_BYTES),
+            Some((lo, hi)) => (lo.min(at), hi.max(at + SLOT_BYTES)),
+        });
+        Ok(None)
+    }
+
+    /// Writes the slots inserted since the last sync back to a persistent
+    /// stripe's file. One msync of the span between them: the pages in it
+    /// that nothing dirtied cost nothing to write.
+    fn sync(&mut self) -> io::Result<()> {
+        match self.dirty.take() {
+            Some((lo, hi)) if self.path.is_some() => self.map.flush_range(lo, hi - lo),
+            _ => Ok(()),
+        }
+    }
+
+    /// Rehashes into a table twice the size. A persistent stripe is built
+    /// beside its file and renamed over it once flushed, so a crash leaves
+    /// one whole table or the other.
+    fn grow(&mut self) -> io::Result<()> {
+        let tmp = self.path.as_ref().map(|p| p.with_extension("grow"));
+        let mut bigger = Table::create(tmp.as_deref(), self.capacity * 2)?;
+
+        for i in 0..self.capacity {
+            let at = HEADER_BYTES + i * SLOT_BYTES;
+            let slot = &self.map[at..at + SLOT_BYTES];
+            if slot[..FINGERPRINT_BYTES] != [0; FINGERPRINT_BYTES] {
+                let to = bigger.find(slot[..FINGERPRINT_BYTES].try_into().unwrap());
+                bigger.map[to..to + SLOT_BYTES].copy_from_slice(slot);
+            }
+        }
+        bigger.len = self.len;
+
+        if let (Some(tmp), Some(path)) = (tmp, self.path.as_ref()) {
+            bigger.map.flush()?;
+            fs::rename(&tmp, path)?;
+            if let Some(dir) = path.parent() {
+                sync_dir(dir)?;
+            }
+            bigger.path = Some(path.clone());
+        }
+        *self = bigger;
+        Ok(())
+    }
+}
+
+/// The set of redeemed tokens, each with the mule that redeemed it first, at
+/// 32 bytes a slot. Striped behind locks so KeyPair.redeem and
+/// add_new_elements insert with the GIL released. Given a directory, each
+/// stripe is a memory-mapped file there and the set outlives the process:
+/// every insert is synced to disk before the caller learns the token was
+/// new, so a crash cannot bring a spent token back.
+#[pyclass(name = "SpentSet")]
+pub struct SpentSet {
+    stripes: Vec<Mutex<Table>>,
+}
+
+impl SpentSet {
+    /// Opens the set kept in dir, or makes an empty one there; without dir
+    /// the set lives in memory only. A set must be reopened with the number
+    /// of stripes it was made with.
+    pub fn open(dir: Option<&Path>, stripes: usize) -> io::Result<SpentSet> {
+        let stripes = stripes.max(1);
+        let tables = match dir {
+            None => (0..stripes)
+                .map(|_| Table::create(None, MIN_CAPACITY))
+                .collect::<io::Result<Vec<_>>>()?,
+            Some(dir) => {
+                fs::create_dir_all(dir)?;
+                let existing = fs::read_dir(dir)?
+                    .filter_map(|e| e.ok())
+                    .filter(|e| e.file_name().to_string_lossy().ends_with(".bin"))
+                    .count();
+                if existing != 0 && existing != stripes {
+                    return Err(io::Error::new(
+                        io::ErrorKind::InvalidInput,
+                        format!("{} has {} stripes, not {}", dir.display(), existing, stripes),
+                    ));
+                }
+                (0..stripes)
+                    .map(|i| Table::open(&dir.join(format!("stripe-{:03}.bin", i))))
+                    .collect::<io::Result<Vec<_>>>()?
+            }
+        };
+        Ok(SpentSet { stripes: tables.into_iter().map(Mutex::new).collect() })
+    }
+
+    fn stripe(&self, fp: &Fingerprint) -> usize {
+        (u64::from_le_bytes(fp[..8].try_into().unwrap()) % self.stripes.len() as u64) as usize
+    }
+
+    /// None if key is not there, else the mule that added it (None if it
+    /// was added without one).
+    pub fn lookup(&self, key: &[u8]) -> Option<Option<MuleId>> {
+        let fp = fingerprint(key);
+        let owner = self.stripes[self.stripe(&fp)].lock().unwrap().get(&fp);
+        owner.map(|o| if o == NO_OWNER { None } else { Some(o) })
+    }
+
+    pub fn len(&self) -> usize {
+        self.stripes.iter().map(|s| s.lock().unwrap().len).sum()
+    }
+
+    /// Adds each key with its owner unless it is already there, the first of
+    /// any repeats within keys winning. Returns, per key, None if it was new,
+    /// else the mule that added it (None if it was added without one).
+    pub fn insert_batch(&self, keys: &[(&[u8], MuleId)]) -> io::Result<Vec<Option<Option<MuleId>>>> {
+        let fps: Vec<Fingerprint> = keys.par_iter().map(|(key, _)| fingerprint(key)).collect();
+
+        let mut by_stripe: Vec<Vec<usize>> = vec![Vec::new(); self.stripes.len()];
+        for (i, fp) in fps.iter().enumerate() {
+            by_stripe[self.stripe(fp)].push(i);
+        }
+
+        let inserted = by_stripe
+            .par_iter()
+            .enumerate()
+            .filter(|(_, idx)| !idx.is_empty())
+            .map(|(s, idx)| {
+                let mut table = self.stripes[s].lock().unwrap();
+                let inserted = idx
+                    .iter()
+                    .map(|&i| Ok((i, table.insert(&fps[i], &keys[i].1)?)))
+                    .collect::<io::Result<Vec<_>>>()?;
+                table.sync()?;
+                Ok::<_, io::Error>(inserted)
+            })
+            .collect::<io::Result<Vec<_>>>()?;
+
+        let mut previous = vec![None; keys.len()];
+        for (i, owner) in inserted.into_iter().flatten() {
+            previous[i] = owner.map(|o| if o == NO_OWNER { None } else { Some(o) });
+        }
+        Ok(previous)
+    }
+}
+
+fn mule_id(owner: Option<&[u8]>) -> PyResult<MuleId> {
+    match owner {
+        None => Ok(NO_OWNER),
+        Some(o) => o
+            .try_into()
+            .map_err(|_| PyErr::new::<PyValueError, _>("owner must be a 16-byte mule ID")),
+    }
+}
+
+fn owner_bytes(py: Python, previous: Option<MuleId>) -> PyObject {
+    match previous {
+        None => PyBytes::new(py, &[]).to_object(py),
+        Some(o) => PyBytes::new(py, &o).to_object(py),
+    }
+}
+
+#[pymethods]
+impl SpentSet {
+    /// path, if given, is the directory to keep the stripes in; reopen it
+    /// with the same number of stripes.
+    #[new]
+    #[pyo3(signature = (path = None, stripes = 64))]
+    fn new(path: Option<PathBuf>, stripes: usize) -> PyResult<Self> {
+        SpentSet::open(path.as_deref(), stripes).map_err(|e| match e.kind() {
+            io::ErrorKind::InvalidInput => PyErr::new::<PyValueError, _>(e.to_string()),
+            _ => e.into(),
+        })
+    }
+
+    /// None if key was new, else the mule that added it (empty bytes if it
+    /// was added without one).
+    #[pyo3(signature = (key, owner = None))]
+    fn add_if_not_exists(&self, py: Python, key: &[u8], owner: Option<&[u8]>) -> PyResult<Option<PyObject>> {
+        let owner = mule_id(owner)?;
+        let previous = self.insert_batch(&[(key, owner)])?.remove(0);
+        Ok(previous.map(|p| owner_bytes(py, p)))
+    }
+
+    /// add_if_not_exists for a list of keys at once, with the GIL released;
+    /// owners is one mule ID per key, or None.
+    #[pyo3(signature = (keys, owners = None))]
+    fn add_new_elements(
+        &self,
+        py: Python,
+        keys: Vec<&[u8]>,
+        owners: Option<Vec<&[u8]>>,
+    ) -> PyResult<Vec<Option<PyObject>>> {
+        let items = match owners {
+            None => keys.iter().map(|&k| (k, NO_OWNER)).collect(),
+            Some(owners) if owners.len() == keys.len() => keys
+                .iter()
+                .zip(owners)
+                .map(|(&k, o)| Ok((k, mule_id(Some(o))?)))
+                .collect::<PyResult<Vec<_>>>()?,
+            Some(_) => return Err(PyErr::new::<PyValueError, _>("one owner per key")),
+        };
+        let previous = py.allow_threads(|| self.insert_batch(&items))?;
+        Ok(previous.into_iter().map(|p| p.map(|p| owner_bytes(py, p))).collect())
+    }
+
+    /// As add_if_not_exists, but only looks.
+    fn get(&self, py: Python, key: &[u8]) -> Option<PyObject> {
+        self.lookup(key).map(|p| owner_bytes(py, p))
+    }
+
+    /// Writes a persistent set's stripes back to their files; inserts sync
+    /// their own slots, so this is only needed to force everything out.
+    fn flush(&self, py: Python) -> PyResult<()> {
+        py.allow_threads(|| {
+            self.stripes.iter().try_for_each(|s| s.lock().unwrap().map.flush())
+        })?;
+        Ok(())
+    }
+
+    fn __len__(&self) -> usize {
+        self.len()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn scratch(name: &str) -> PathBuf {
+        let dir = std::env::temp_dir().join(format!("spent-{}-{}", name, std::process::id()));
+        let _ = fs::remove_dir_all(&dir);
+        dir
+    }
+
+    fn key(i: u32) -> Vec<u8> {
+        i.to_le_bytes().repeat(8)
+    }
+
+    fn owner(i: u32) -> MuleId {
+        let mut owner = [0u8; MULE_ID_BYTES];
+        owner[..4].copy_from_slice(&(i + 1).to_le_bytes());
+        owner
+    }
+
+    #[test]
+    fn reopens_what_it_added() {
+        let dir = scratch("reopen");
+        let keys: Vec<Vec<u8>> = (0..100).map(key).collect();
+        {
+            let set = SpentSet::open(Some(&dir), 4).unwrap();
+            let items: Vec<(&[u8], MuleId)> =
+                keys.iter().enumerate().map(|(i, k)| (&k[..], owner(i as u32))).collect();
+            assert!(set.insert_batch(&items).unwrap().iter().all(Option::is_none));
+            assert_eq!(set.insert_batch(&[(&keys[0][..], NO_OWNER)]).unwrap(), vec![Some(Some(owner(0)))]);
+        }
+
+        let set = SpentSet::open(Some(&dir), 4).unwrap();
+        assert_eq!(set.len(), 100);
+        for (i, k) in keys.iter().enumerate() {
+            assert_eq!(set.lookup(k), Some(Some(owner(i as u32))));
+        }
+        assert_eq!(set.lookup(&key(100)), None);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn grows_and_reopens() {
+        let dir = scratch("grow");
+        // one stripe taken past 3/4 full twice, so it doubles twice
+        let n = 2 * MIN_CAPACITY as u32;
+        {
+            let set = SpentSet::open(Some(&dir), 1).unwrap();
+            let keys: Vec<Vec<u8>> = (0..n).map(key).collect();
+            for (c, chunk) in keys.chunks(100).enumerate() {
+                // keys added without an owner must come back without one
+                let items: Vec<(&[u8], MuleId)> = chunk
+                    .iter()
+                    .enumerate()
+                    .map(|(i, k)| {
+                        let i = (c * 100 + i) as u32;
+                        (&k[..], if i % 10 == 0 { NO_OWNER } else { owner(i) })
+                    })
+                    .collect();
+                assert!(set.insert_batch(&items).unwrap().iter().all(Option::is_none));
+            }
+        }
+
+        let file = dir.join("stripe-000.bin");
+        assert_eq!(fs::metadata(&file).unwrap().len() as usize, HEADER_BYTES + 4 * MIN_CAPACITY * SLOT_BYTES);
+        assert!(!file.with_extension("grow").exists());
+        let set = SpentSet::open(Some(&dir), 1).unwrap();
+        assert_eq!(set.len(), n as usize);
+        for i in 0..n {
+            let expected = if i % 10 == 0 { None } else { Some(owner(i)) };
+            assert_eq!(set.lookup(&key(i)), Some(expected));
+        }
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn first_of_repeats_wins() {
+        let set = SpentSet::open(None, 2).unwrap();
+        let k = key(1);
+        let previous = set.insert_batch(&[(&k[..], owner(1)), (&k[..], owner(2))]).unwrap();
+        assert_eq!(previous, vec![None, Some(Some(owner(1)))]);
+        assert_eq!(set.len(), 1);
+    }
+
+    #[test]
+    fn keeps_its_stripe_count() {
+        let dir = scratch("stripes");
+        SpentSet::open(Some(&dir), 4).unwrap();
+        let err = SpentSet::open(Some(&dir), 8).err().unwrap();
+        assert_eq!(err.kind(), io::ErrorKind::InvalidInput);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+}
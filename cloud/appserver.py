@@ -3,6 +3,7 @@ import config
 import json
 import os
 import requests
+import time
 import tokenlib # type: ignore
 import util
 import payloads
@@ -10,46 +11,130 @@ import payloads
 # number of tokens to request from the provider at one time, increase if you're
 # expecting a lot of traffic
 TOKEN_REQUEST_SIZE = 10
+# how often to ask the provider for its key epoch; a token handed out a few
+# seconds after its epoch ended still redeems in the next one
+EPOCH_CHECK_SECONDS = 10
 
 # -- App Server State --
 provider_url = os.environ.get('PROVIDER_URL') 
 use_tls = os.environ.get('SERVER_TLS') == 'true'
 
-# public parameters for token generation
+# public parameters for token generation, as a tokenlib.PublicParams, and the
+# provider key epoch they belong to
 public_params = None
-# list of unused tokens to be handed out to mules
+public_params_epoch = None
+# the provider key epoch as last fetched, and when it was fetched
+current_epoch = None
+current_epoch_checked = 0.0
+# list of unused (key epoch, token) pairs to be handed out to mules
 unused_tokens = []
 # set of observed payload hashes
 seen_hashes = set()
+# the same hashes in the order they were accepted, so mules can pull what they
+# are missing for their dedup filters; the instance id tells them the log
+# started over
+seen_hashes_log = []
+seen_hashes_instance = int.from_bytes(util.get_random_bytes(4), 'little')
 # map of sensor ID -> public ECDSA key. Here we just have one sensor with a known id-key pair
 sensor_public_keys = {
     bytes.fromhex('ffffffffffffffffffffffffffffff01'): util.load_public_key('sensor-public-ecc.pem')
 }
 # map of pending data hashes -> [nonce, token] pairs
 pending_deliveries = {}
+# map of mule ID -> the latest performance snapshot it reported
+mule_metrics = {}
+# map of (sensor ID, sequence number) -> sealed broadcast reading; several
+# mules may carry the same one, and the first copy is kept
+bcast_readings = {}
 
 
-def get_public_params() -> bytes:
+def get_epoch() -> int:
+    return payloads.Epoch.deserialize(
+        requests.get(provider_url + '/epoch', verify=use_tls).content
+    )
+
+
+# the provider key epoch, fetched again at most every EPOCH_CHECK_SECONDS
+def get_current_epoch() -> int:
+    global current_epoch
+    global current_epoch_checked
+
+    now = time.monotonic()
+    if current_epoch is None or now - current_epoch_checked >= EPOCH_CHECK_SECONDS:
+        current_epoch = get_epoch()
+        current_epoch_checked = now
+    return current_epoch
+
+
+def get_public_params(epoch) -> bytes:
     return payloads.PublicParams.deserialize(
-        requests.get(provider_url + '/public_params', verify=use_tls).content
+        requests.get(provider_url + '/public_params', params={'epoch': epoch}, verify=use_tls).content
+    )
+
+
+# public keys of registered sensors, so mules can drop forged hash payloads
+# before carrying them
+def get_sensor_keys(payload=None) -> bytes:
+    return payloads.SensorKeyList.serialize([
+        (sensor_id, util.export_public_key_xy(key)) for sensor_id, key in sensor_public_keys.items()
+    ])
+
+
+# payload hashes accepted since a mule's last pull, at most limit of them
+def get_seen_hashes(since='0', limit='128', instance='0', payload=None) -> bytes:
+    since, limit = int(since), int(limit)
+    if int(instance) != seen_hashes_instance or since > len(seen_hashes_log):
+        since = 0
+    new_hashes = seen_hashes_log[since:since + limit]
+    return payloads.SeenHashDelta.serialize(
+        seen_hashes_instance, since + len(new_hashes), new_hashes
     )
 
 
+# mules report performance snapshots periodically; only the latest is kept
+def post_mule_metrics(payload=None) -> bytes:
+    metrics = payloads.MuleMetrics.deserialize(payload)
+    mule_metrics[metrics['mule_id']] = metrics
+    return b''
+
+
+def get_mule_metrics(payload=None) -> bytes:
+    return json.dumps(mule_metrics).encode()
+
+
+def post_bcast_readings(payload=None) -> bytes:
+    for sensor_id, seq, sealed in payloads.BroadcastReadings.deserialize(payload):
+        bcast_readings.setdefault((sensor_id, seq), sealed)
+    return b''
+
+
+# sealed readings per sensor, as [seq, sealed hex] pairs
+def get_bcast_readings(payload=None) -> bytes:
+    readings = {}
+    for (sensor_id, seq), sealed in sorted(bcast_readings.items()):
+        readings.setdefault(sensor_id.hex(), []).append([seq, sealed.hex()])
+    return json.dumps(readings).encode()
+
+
 # ALGORITHM 1: TOKEN PURCHASE
-# make a request to provider for more tokens
-def get_more_tokens(num_tokens: int) -> list[bytes]:
+# make a request to provider for more tokens under the given key epoch
+def get_more_tokens(num_tokens: int, epoch: int) -> list[bytes]:
 
     global public_params
+    global public_params_epoch
 
-    # if we didn't query the app server for the public parameters yet, do so now
-    if not public_params:
-        public_params = get_public_params()
+    # fetch the public parameters the first time and whenever the provider
+    # has moved to a new key epoch
+    if epoch != public_params_epoch:
+        public_params = tokenlib.PublicParams(get_public_params(epoch))
+        public_params_epoch = epoch
 
-    blinded_tokens = [tokenlib.generate_token(public_params) for _ in range(num_tokens)]
+    blinded_tokens = [public_params.generate_token() for _ in range(num_tokens)]
     blinded_token_bytes = payloads.TokenList.serialize(blinded_tokens)
     signed_tokens = payloads.TokenList.deserialize(
         requests.post(
             provider_url + '/sign_tokens',
+            params={'epoch': epoch},
             verify=use_tls,
             headers = {'Content-type': 'application/octet-stream'},
             data=blinded_token_bytes
@@ -88,9 +173,13 @@ def deliver_hash_payload(payload) -> str:
 
     # generate random nonce and get an unused token
     protocol_nonce = util.get_random_bytes(config.DELIVER_NONCE_BYTES)
+    # a token left over from an earlier key epoch may stop redeeming before
+    # the mule next gets online, so only the current epoch's are handed out
+    epoch = get_current_epoch()
+    unused_tokens = [(e, t) for e, t in unused_tokens if e == epoch]
     if len(unused_tokens) == 0:
-        unused_tokens += get_more_tokens(TOKEN_REQUEST_SIZE)
-    token = unused_tokens.pop()
+        unused_tokens += [(epoch, t) for t in get_more_tokens(TOKEN_REQUEST_SIZE, epoch)]
+    _, token = unused_tokens.pop()
 
     pending_deliveries[data_hash] = [protocol_nonce, token]
 
@@ -108,6 +197,7 @@ def deliver_hash_payload(payload) -> str:
 def deliver_data(payload) -> str:
 
     global pending_deliveries
+    global seen_hashes
 
     # Yay! We can do something with the data now!
     data = payloads.Data.deserialize(payload)
@@ -122,6 +212,10 @@ def deliver_data(payload) -> str:
     nonce, token = pending_deliveries[data_hash]
     del pending_deliveries[data_hash]
 
+    # later copies of this payload are duplicates
+    seen_hashes.add(data_hash)
+    seen_hashes_log.append(data_hash)
+
     token_payload = payloads.TokenPayload.serialize(nonce, token, data_hash)
     return payloads.SignedTokenPayload.serialize(
         token_payload, util.sign_ecdsa(util.load_private_key(), token_payload)
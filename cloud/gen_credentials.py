@@ -1,6 +1,23 @@
 # Generates credentials needed to test out the provider/appserver with test_mule.py
 
+import os
 import util
 
+# the mule checks token payload signatures against this key, compiled in
+MULE_KEY_HEADER = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                               '..', 'mule', 'main', 'appserver_key.h')
+
+
+def write_mule_key_header(path=MULE_KEY_HEADER):
+    xy = util.export_public_key_xy(util.load_public_key())
+    lines = [', '.join(f'0x{b:02x}' for b in xy[i:i + 8]) for i in range(0, len(xy), 8)]
+    with open(path, 'w') as f:
+        f.write('/* Generated by cloud/gen_credentials.py; appserver P-256 key X || Y */\n')
+        f.write('#define APPSERVER_PUBKEY_XY { \\\n    ')
+        f.write(', \\\n    '.join(lines))
+        f.write(' \\\n}\n')
+
+
 util.gen_keypair('sensor')
-util.gen_keys() # appserver credentials
\ No newline at end of file
+util.gen_keys() # appserver credentials
+write_mule_key_header()
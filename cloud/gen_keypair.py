@@ -1,6 +1,9 @@
 # Generate a keypair for the provider. Run this script once to generate a
-# `keypair.bin` file, but don't commit to the repo.
+# `keypair.bin` file, but don't commit to the repo. It also writes
+# `key_seed.bin`, the secret the provider derives a keypair per epoch from when
+# run with PROVIDER_EPOCH_SECONDS.
 
+import os
 import tokenlib
 
 keypair = tokenlib.generate_keypair()
@@ -10,3 +13,6 @@ with open('keypair.bin', 'wb') as f:
 
 with open('complaints-keypair.bin', 'wb') as f:
     f.write(keypair)
+
+with open('key_seed.bin', 'wb') as f:
+    f.write(os.urandom(32))
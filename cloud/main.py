@@ -52,6 +52,10 @@ async def root():
 
 if mode == 'provider':
 
+    @app.get('/epoch')
+    async def epoch(request: Request):
+        return await make_threaded_call(request, provider.get_epoch)
+
     @app.get('/public_params')
     async def public_params(request: Request):
         return await make_threaded_call(request, provider.get_public_params)
@@ -89,6 +93,10 @@ if mode == 'provider':
     async def new_epoch(request: Request):
         return await make_threaded_call(request, provider.new_epoch)
 
+    @app.post('/spend_tokens')
+    async def spend_tokens(request: Request):
+        return await make_threaded_call(request, provider.spend_tokens)
+
 elif mode == 'app':
 
     @app.post('/deliver_hash')
@@ -103,3 +111,26 @@ elif mode == 'app':
     async def deliver_complaint_data(request: Request):
         return await make_threaded_call(request, appserver.deliver_complaint_data)
 
+    @app.get('/sensor_keys')
+    async def sensor_keys(request: Request):
+        return await make_threaded_call(request, appserver.get_sensor_keys)
+
+    @app.get('/seen_hashes')
+    async def seen_hashes(request: Request):
+        return await make_threaded_call(request, appserver.get_seen_hashes)
+
+    @app.post('/mule_metrics')
+    async def post_mule_metrics(request: Request):
+        return await make_threaded_call(request, appserver.post_mule_metrics)
+
+    @app.get('/mule_metrics')
+    async def mule_metrics(request: Request):
+        return await make_threaded_call(request, appserver.get_mule_metrics)
+
+    @app.post('/bcast_readings')
+    async def post_bcast_readings(request: Request):
+        return await make_threaded_call(request, appserver.post_bcast_readings)
+
+    @app.get('/bcast_readings')
+    async def bcast_readings(request: Request):
+        return await make_threaded_call(request, appserver.get_bcast_readings)
@@ -19,6 +19,18 @@ class PublicParams:
         return response_body
 
 
+# the provider's current key epoch
+class Epoch:
+
+    @staticmethod
+    def serialize(epoch: int) -> bytes:
+        return struct.pack('Q', epoch)
+
+    @staticmethod
+    def deserialize(response_body: bytes) -> int:
+        return struct.unpack('Q', response_body)[0]
+
+
 class TokenList:
 
     # assumes that they all have the same size
@@ -27,6 +39,12 @@ class TokenList:
         token_len = 0 if len(tokens) == 0 else len(tokens[0])
         concat_tokens = b''.join(tokens)
         return struct.pack(f'I{len(concat_tokens)}s', token_len, concat_tokens)
+
+    # the same, for count tokens already joined into one buffer
+    @staticmethod
+    def serialize_joined(concat_tokens: bytes, count: int) -> bytes:
+        token_len = 0 if count == 0 else len(concat_tokens) // count
+        return struct.pack('I', token_len) + concat_tokens
     
     @staticmethod
     def deserialize(response_body: bytes) -> list[bytes]:
@@ -83,6 +101,138 @@ class PredeliveryPayload:
         return protocol_nonce, data_hash, encrypted_token
 
 
+# list of (sensor_id, X || Y) pairs so mules can verify hash payloads on-device
+class SensorKeyList:
+
+    @staticmethod
+    def serialize(sensor_keys: list[tuple[bytes, bytes]]) -> bytes:
+        return b''.join(struct.pack('16s64s', sensor_id, key_xy) for sensor_id, key_xy in sensor_keys)
+
+    @staticmethod
+    def deserialize(response_body: bytes) -> list[tuple[bytes, bytes]]:
+        return [struct.unpack_from('16s64s', response_body, offset=idx)
+                for idx in range(0, len(response_body) - 79, 80)]
+
+
+class SeenHashDelta:
+
+    @staticmethod
+    def serialize(instance: int, next_index: int, hashes: list[bytes]) -> bytes:
+        return struct.pack('<II', instance, next_index) + b''.join(hashes)
+
+    # returns (instance, next_index, hashes)
+    @staticmethod
+    def deserialize(response_body: bytes) -> tuple[int, int, list[bytes]]:
+        instance, next_index = struct.unpack_from('<II', response_body)
+        return instance, next_index, [response_body[idx:idx + SHA256_BYTES]
+                                      for idx in range(8, len(response_body), SHA256_BYTES)]
+
+
+# readings mules harvested from sensor broadcasts, laid out in
+# mule/main/bcast_harvest.h: (sensor_id || seq || len || sealed)*
+class BroadcastReadings:
+    HEADER = struct.Struct('<16sHB')
+
+    @staticmethod
+    def serialize(readings: list[tuple[bytes, int, bytes]]) -> bytes:
+        return b''.join(BroadcastReadings.HEADER.pack(sensor_id, seq, len(sealed)) + sealed
+                        for sensor_id, seq, sealed in readings)
+
+    # returns [(sensor_id, seq, sealed)]; a record cut short ends the list
+    @staticmethod
+    def deserialize(response_body: bytes) -> list[tuple[bytes, int, bytes]]:
+        readings = []
+        offset = 0
+        while offset + BroadcastReadings.HEADER.size <= len(response_body):
+            sensor_id, seq, n = BroadcastReadings.HEADER.unpack_from(response_body, offset)
+            offset += BroadcastReadings.HEADER.size
+            if offset + n > len(response_body):
+                break
+            readings.append((sensor_id, seq, response_body[offset:offset + n]))
+            offset += n
+        return readings
+
+
+# mule performance snapshot, laid out in mule/main/mule_metrics.h
+class MuleMetrics:
+    HEADER = struct.Struct('<BBBB16sIIIHHHHHHI')
+    TIMING = struct.Struct('<III')
+    TIMINGS = ('conn_setup', 'discovery', 'transfer')
+    TOTALS = struct.Struct('<IIII')
+    SENSOR = struct.Struct('<16sIII')
+    TASK = struct.Struct('<12sHBB')
+    # common/nebula_telemetry.h
+    TELEMETRY = struct.Struct('<BBBBI7I')
+    HIST = struct.Struct('<B3xII16H')
+    HISTS = ('hvx', 'ack', 'transfer', 'aes')
+
+    @staticmethod
+    def deserialize(response_body: bytes) -> dict:
+        (version, n_sensors, n_tasks, n_telemetry, mule_id, uptime_s, heap_free,
+         heap_min_free, msys_free_min, msys_exhausted, store_count, pool_in_use,
+         pool_blocks, pool_high_water, pool_alloc_fails) = \
+            MuleMetrics.HEADER.unpack_from(response_body)
+        offset = MuleMetrics.HEADER.size
+        metrics = {
+            'version': version, 'mule_id': mule_id.hex(), 'uptime_s': uptime_s,
+            'heap_free': heap_free, 'heap_min_free': heap_min_free,
+            'msys_free_min': msys_free_min, 'msys_exhausted': msys_exhausted,
+            'store_count': store_count, 'pool_in_use': pool_in_use,
+            'pool_blocks': pool_blocks, 'pool_high_water': pool_high_water,
+            'pool_alloc_fails': pool_alloc_fails,
+        }
+        for name in MuleMetrics.TIMINGS:
+            count, total_ms, max_ms = MuleMetrics.TIMING.unpack_from(response_body, offset)
+            offset += MuleMetrics.TIMING.size
+            metrics[name] = {'count': count, 'total_ms': total_ms, 'max_ms': max_ms}
+        (metrics['transfers'], metrics['transfer_bytes'], metrics['notifications'],
+         metrics['conn_events']) = MuleMetrics.TOTALS.unpack_from(response_body, offset)
+        offset += MuleMetrics.TOTALS.size
+
+        metrics['sensors'] = []
+        for _ in range(n_sensors):
+            sensor_id, transfers, nbytes, busy_ms = MuleMetrics.SENSOR.unpack_from(response_body, offset)
+            offset += MuleMetrics.SENSOR.size
+            metrics['sensors'].append({'sensor_id': sensor_id.hex(), 'transfers': transfers,
+                                       'bytes': nbytes, 'busy_ms': busy_ms})
+
+        metrics['tasks'] = []
+        for _ in range(n_tasks):
+            name, stack_free_min, cpu_percent, core = MuleMetrics.TASK.unpack_from(response_body, offset)
+            offset += MuleMetrics.TASK.size
+            metrics['tasks'].append({'name': name.rstrip(b'\0').decode(errors='replace'),
+                                     'stack_free_min': stack_free_min, 'cpu_percent': cpu_percent,
+                                     'core': None if core == 0xff else core})
+
+        metrics['telemetry'] = []
+        for _ in range(n_telemetry):
+            addr, length = struct.unpack_from('<6sH', response_body, offset)
+            offset += 8
+            metrics['telemetry'].append(MuleMetrics.deserialize_telemetry(
+                addr, response_body[offset:offset + length]))
+            offset += length
+        return metrics
+
+    @staticmethod
+    def deserialize_telemetry(addr: bytes, body: bytes) -> dict:
+        (version, hist_count, buckets, _, cycles_hz, transfers, transfers_skipped, bytes_sent,
+         chunks_sent, chunks_retransmitted, hvx_queue_full, backlog_bytes) = \
+            MuleMetrics.TELEMETRY.unpack_from(body)
+        telemetry = {
+            'addr': ':'.join('%02x' % b for b in reversed(addr)), 'version': version,
+            'cycles_hz': cycles_hz, 'transfers': transfers,
+            'transfers_skipped': transfers_skipped, 'bytes_sent': bytes_sent,
+            'chunks_sent': chunks_sent, 'chunks_retransmitted': chunks_retransmitted,
+            'hvx_queue_full': hvx_queue_full, 'backlog_bytes': backlog_bytes,
+        }
+        offset = MuleMetrics.TELEMETRY.size
+        for name in MuleMetrics.HISTS[:hist_count]:
+            shift, count, max_cycles, *hist = MuleMetrics.HIST.unpack_from(body, offset)
+            offset += MuleMetrics.HIST.size
+            telemetry[name] = {'shift': shift, 'count': count, 'max': max_cycles, 'buckets': hist}
+        return telemetry
+
+
 class SignedPredeliveryPayload:
 
     @staticmethod
@@ -205,26 +355,68 @@ class MissingComplaintRecord:
         return signed_pre_payload, data
 
 
+# how far a mule has been told of its duplicates: per key epoch, the position
+# after the last one reported. The mule sends back the cursor of the last
+# NewEpochResponse it received, empty if none, and only then are those
+# duplicates dropped.
+class DuplicateCursor:
+
+    @staticmethod
+    def serialize(cursor: dict[int, int]) -> bytes:
+        return b''.join(struct.pack('<QQ', epoch, end) for epoch, end in sorted(cursor.items()))
+
+    @staticmethod
+    def deserialize(cursor_bytes: bytes) -> dict[int, int]:
+        return dict(struct.iter_unpack('<QQ', cursor_bytes))
+
+
 class NewEpochRequest:
     
     @staticmethod
-    def serialize(mule_id, complaint_token_bytes) -> bytes:
-        return mule_id + complaint_token_bytes
+    def serialize(mule_id, complaint_token_bytes, cursor_bytes=b'') -> bytes:
+        return mule_id + struct.pack('I', len(cursor_bytes)) + cursor_bytes + complaint_token_bytes
     
     @staticmethod
-    def deserialize(response_body: bytes) -> tuple[bytes, bytes]:
-        return response_body[:16], response_body[16:]
+    def deserialize(response_body: bytes) -> tuple[bytes, bytes, bytes]:
+        cursor_bytes_len, = struct.unpack('I', response_body[16:20])
+        return response_body[:16], response_body[20 + cursor_bytes_len:], response_body[20:20 + cursor_bytes_len]
 
 
 class NewEpochResponse:
 
     @staticmethod
-    def serialize(complaint_token_bytes, duplicate_token_bytes) -> bytes:
-        return struct.pack(f'II{len(complaint_token_bytes)}s{len(duplicate_token_bytes)}s',
-                           len(complaint_token_bytes), len(duplicate_token_bytes),
-                           complaint_token_bytes, duplicate_token_bytes)
+    def serialize(complaint_token_bytes, duplicate_token_bytes, cursor_bytes) -> bytes:
+        return struct.pack(f'III{len(complaint_token_bytes)}s{len(duplicate_token_bytes)}s{len(cursor_bytes)}s',
+                           len(complaint_token_bytes), len(duplicate_token_bytes), len(cursor_bytes),
+                           complaint_token_bytes, duplicate_token_bytes, cursor_bytes)
     
     @staticmethod
-    def deserialize(response_body: bytes) -> tuple[bytes, bytes]:
-        complaint_token_bytes_len, duplicate_token_bytes_len = struct.unpack('II', response_body[:8])
-        return response_body[8:8 + complaint_token_bytes_len], response_body[8 + complaint_token_bytes_len:]
\ No newline at end of file
+    def deserialize(response_body: bytes) -> tuple[bytes, bytes, bytes]:
+        complaint_token_bytes_len, duplicate_token_bytes_len, cursor_bytes_len = struct.unpack('III', response_body[:12])
+        duplicates_start = 12 + complaint_token_bytes_len
+        cursor_start = duplicates_start + duplicate_token_bytes_len
+        return (response_body[12:duplicates_start],
+                response_body[duplicates_start:cursor_start],
+                response_body[cursor_start:cursor_start + cursor_bytes_len])
+
+# a shard's answer to /spend_tokens: per token, status || the mule that spent
+# it before (zeros if none) || the key epoch it was spent in (ignored if
+# invalid)
+class SpendResults:
+
+    NEW = 0
+    INVALID = 1
+    SPENT = 2
+
+    @staticmethod
+    def serialize(results: list[tuple[int, bytes, int]]) -> bytes:
+        return b''.join(struct.pack('<B16sQ', status, owner or b'', epoch or 0) for status, owner, epoch in results)
+
+    # returns list[(status, previous mule_id or None, epoch or None)]
+    @staticmethod
+    def deserialize(response_body: bytes) -> list[tuple[int, bytes, int]]:
+        results = []
+        for status, owner, epoch in struct.iter_unpack('<B16sQ', response_body):
+            results.append((status, None if owner == bytes(16) else owner,
+                            None if status == SpendResults.INVALID else epoch))
+        return results
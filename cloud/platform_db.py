@@ -1,38 +1,113 @@
+import atexit
 import sqlite3
-from concurrent.futures import ProcessPoolExecutor
+import threading
 
 DEBUG = False
 
+# Per-mule redeemed token counts in sqlite, written behind: increments only
+# add to a map in memory, and a background thread folds the map into the
+# table every flush_seconds, so redemptions never wait on the disk.
+#
+# Each flush is one transaction, so the table always holds every increment
+# up to some flush and none after it. A crash loses at most the increments
+# since the last flush; a flush that fails puts its increments back to be
+# retried by the next one, so none is applied twice.
 class KeyValueDatabase:
-    def __init__(self, db_name='mules.db'): 
+    def __init__(self, db_name='mules.db', flush_seconds=1.0):
         self.db_name = db_name
+        self._flush_seconds = flush_seconds
+        # mule ID -> increment not yet in the table
+        self._pending = {}
+        self._pending_lock = threading.Lock()
+        # set under _pending_lock, so no increment lands after the final flush
+        self._closed = False
+        # held for any use of the connection, so only one flush runs at a time
+        self._conn_lock = threading.Lock()
         self._init_db()
 
+        self._stop = threading.Event()
+        self._flusher = threading.Thread(target=self._flush_loop, daemon=True)
+        self._flusher.start()
+        atexit.register(self.close)
+
     def _init_db(self):
-        with sqlite3.connect(self.db_name, check_same_thread=False) as conn:
-            conn.execute('''CREATE TABLE IF NOT EXISTS mules (
+        self._conn = sqlite3.connect(self.db_name, check_same_thread=False)
+        # WAL lets get_counts read while a flush writes; NORMAL syncs at
+        # checkpoints rather than on every commit, and a commit is still
+        # atomic if the process dies
+        self._conn.execute('PRAGMA journal_mode=WAL')
+        self._conn.execute('PRAGMA synchronous=NORMAL')
+        self._conn.execute('''CREATE TABLE IF NOT EXISTS mules (
                                 mule_id TEXT PRIMARY KEY,
                                 count INTEGER NOT NULL
                             )''')
-            conn.commit()
+        self._conn.commit()
 
     def increment_count(self, mule_id, increment):
-        with sqlite3.connect(self.db_name, check_same_thread=False) as conn:
-            conn.execute('''INSERT OR IGNORE INTO mules (mule_id, count)
-                            VALUES (?, 0)''', (mule_id,))
-            conn.execute('''UPDATE mules
-                            SET count = count + ?
-                            WHERE mule_id = ?''', (increment, mule_id))
-            conn.commit()
+        self.batch_increment_counts([(mule_id, increment)])
 
+    # raises once the database is closed, since the increments would never
+    # reach the table
     def batch_increment_counts(self, mule_id_increments):
-        with ProcessPoolExecutor(max_workers=32) as executor:
-            executor.map(lambda x: self.increment_count(x[0], x[1]), mule_id_increments)
+        with self._pending_lock:
+            if self._closed:
+                raise sqlite3.ProgrammingError('Cannot operate on a closed database.')
+            self._add_pending(mule_id_increments)
+
+    # the caller holds _pending_lock
+    def _add_pending(self, mule_id_increments):
+        for mule_id, increment in mule_id_increments:
+            self._pending[mule_id] = self._pending.get(mule_id, 0) + increment
+
+    # writes every pending increment to the table in one upsert
+    def flush(self):
+        with self._conn_lock:
+            with self._pending_lock:
+                pending, self._pending = self._pending, {}
+            rows = [(mule_id, increment) for mule_id, increment in pending.items() if increment != 0]
+            if not rows:
+                return
+            try:
+                with self._conn:
+                    self._conn.executemany('''INSERT INTO mules (mule_id, count)
+                                              VALUES (?, ?)
+                                              ON CONFLICT (mule_id)
+                                              DO UPDATE SET count = count + excluded.count''', rows)
+            except sqlite3.Error:
+                # the transaction rolled back; keep the increments for next time
+                with self._pending_lock:
+                    self._add_pending(rows)
+                raise
 
+    def _flush_loop(self):
+        while not self._stop.wait(self._flush_seconds):
+            try:
+                self.flush()
+            except sqlite3.Error as e:
+                print('Count flush failed:', e)
+
+    # writes what is pending and closes the connection; calling it again does
+    # nothing
+    def close(self):
+        with self._pending_lock:
+            if self._closed:
+                return
+            self._closed = True
+        atexit.unregister(self.close)
+        self._stop.set()
+        self._flusher.join()
+        try:
+            self.flush()
+        finally:
+            with self._conn_lock:
+                self._conn.close()
+
+    # the counts including increments not flushed yet
     def get_counts(self):
-        with sqlite3.connect(self.db_name, check_same_thread=False) as conn:
-            cursor = conn.execute('''SELECT mule_id, count
-                                     FROM mules''')
+        self.flush()
+        with self._conn_lock:
+            cursor = self._conn.execute('''SELECT mule_id, count
+                                           FROM mules''')
             return {row[0]: row[1] for row in cursor}
 
 if DEBUG:
@@ -44,4 +119,3 @@ if DEBUG:
 
     # Retrieve the current counts
     print(db.get_counts())
-
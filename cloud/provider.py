@@ -2,20 +2,20 @@
 import config
 import tokenlib # type: ignore
 import util
-import platform_db
-import platform_tokendb
+import provider_keys
+import provider_state
 import requests
 import json
 from Crypto.Random import get_random_bytes # type: ignore
 import payloads
 import os
 
-# load keypair (generated with gen_keypair.py)
-with open('keypair.bin', 'rb') as f:
-    _keypair = f.read()
+# delivery-token keys, one per epoch (see provider_keys.py); tokenlib keeps
+# each decoded for every token operation after it is first used
+_keys = provider_keys.EpochKeys()
 
 with open('complaint_keypair.bin', 'rb') as f:
-    _complaint_keypair = f.read()
+    _complaint_keypair = tokenlib.KeyPair(f.read())
 
 # -- Provider State --
 use_tls = os.environ.get('SERVER_TLS') == 'true'
@@ -26,74 +26,75 @@ appservers = {
         'url': 'http://appserver:8080'
     }
 }
-# database of redeemed token counts per-mule
-mule_db = platform_db.KeyValueDatabase()
-# database of per-mule duplicate tokens
-mule_duplicate_db = {}
-# database of already-redeemed delivery tokens
-token_db = platform_tokendb.StringSet()
-# database of already-redeemed complaint tokens
-complaint_token_db = platform_tokendb.StringSet()
-# database of duplicates with filed complaints
-complaint_duplicate_token_db = platform_tokendb.StringSet()
+# spent tokens, duplicates and per-mule counts; see provider_state.py
+state = provider_state.open_state(_keys.seconds)
+
+
+# the keypair of the given live epoch, or of the current one; None for an
+# epoch whose tokens no longer redeem
+def _signing_keypair(epoch=None):
+    return _keys.keypair(_keys.current() if epoch is None else int(epoch))
+
+
+# CURRENT KEY EPOCH, so appservers know when to fetch new public params
+def get_epoch(payload=None) -> bytes:
+    return payloads.Epoch.serialize(_keys.current())
 
 
 # ALGORITHM 1(a) TOKEN PURCHASE (PUBLIC PARAMS)
-def get_public_params(payload=None) -> bytes:
+def get_public_params(payload=None, epoch=None) -> bytes:
+    keypair = _signing_keypair(epoch)
+    if keypair is None:
+        return None
     return payloads.PublicParams.serialize(
-        tokenlib.get_public_params(_keypair)
+        keypair.public_params()
     )
 
 
 # ALGORITHM 1(b) TOKEN PURCHASE (SIGN TOKENS)
-def sign_tokens(payload) -> bytes:
+# blinded under the public params of epoch, or of the current epoch
+def sign_tokens(payload, epoch=None) -> bytes:
     print('sign tokens', payload)
+    keypair = _signing_keypair(epoch)
+    if keypair is None:
+        print('Tokens blinded for a dead epoch')
+        return None
     blinded_tokens = payloads.TokenList.deserialize(payload)
-    return payloads.TokenList.serialize([
-        tokenlib.sign_token(_keypair, token) for token in blinded_tokens
-    ])
+    return payloads.TokenList.serialize_joined(
+        keypair.sign_batch(blinded_tokens), len(blinded_tokens)
+    )
 
 
 # ALGORITHM 3: TOKEN REDEMPTION
 def redeem_tokens(payload) -> bytes:
 
-    global token_db
-    global mule_db
-    global mule_duplicate_db
-
-    mule_id, token_bytes = payloads.TokenRedemptionPayload.deserialize(payload)
-    decoded_tokens = payloads.TokenList.deserialize(token_bytes)
-
-    valid_tokens = []
-    invalid_tokens = []
-    for token in decoded_tokens:
-        if tokenlib.verify_token(_keypair, token):
-            valid_tokens.append(token)
-        else:
-            invalid_tokens.append(token)
+    global state
 
-    duplicate_mule_list = token_db.add_new_elements(valid_tokens, [mule_id] * len(valid_tokens))
-    duplicate_tokens = 0
-    for token, previous_mule_id in zip(valid_tokens, duplicate_mule_list):
-        if previous_mule_id == None:
-            continue
+    # framing, verification and the double-spend check all happen in one
+    # call; only the bookkeeping is left here
+    invalid_token_bytes, count_deltas, duplicates = state.redeem(_keys, payload)
 
-        mule_duplicate_db[previous_mule_id] = mule_duplicate_db.get(previous_mule_id, []) + [token]
-        mule_db.increment_count(previous_mule_id, -1)
+    # each duplicate is filed under the epoch its token was spent in, so it
+    # lives and is retired with that epoch's spent set
+    mule_id = payloads.TokenRedemptionPayload.deserialize(payload)[0]
+    charged = {}
+    for previous_mule_id, token, epoch in duplicates:
+        epoch_charged = charged.setdefault(epoch, [])
+        if previous_mule_id is not None:
+            epoch_charged.append((previous_mule_id, token))
+        epoch_charged.append((mule_id, token))
+    for epoch, epoch_charged in charged.items():
+        state.add_duplicates(epoch, epoch_charged)
 
-        mule_duplicate_db[mule_id] = mule_duplicate_db.get(mule_id, []) + [token]
-        duplicate_tokens += 1
+    state.counts.batch_increment_counts(count_deltas)
 
-    num_successfully_redeemed = len(valid_tokens) - duplicate_tokens
-    mule_db.increment_count(mule_id, num_successfully_redeemed)
-
-    return payloads.TokenList.serialize(invalid_tokens)
+    return invalid_token_bytes
 
 
 # ALGORITHM 4(a): COMPLAINT (PUBLIC PARAMS)
 def get_complaint_public_params(payload=None) -> bytes:
     return payloads.PublicParams.serialize(
-        tokenlib.get_public_params(_complaint_keypair)
+        _complaint_keypair.public_params()
     )
 
 
@@ -101,9 +102,7 @@ def get_complaint_public_params(payload=None) -> bytes:
 def complain(payload) -> bytes:
 
     global appservers
-    global complaint_token_db
-    global token_db
-    global complaint_duplicate_token_db
+    global state
 
     complaint_token, blinded_token, appserver_id, complaint_type, complaint = \
         payloads.ComplaintPayload.deserialize(payload)
@@ -113,12 +112,12 @@ def complain(payload) -> bytes:
         return None
 
     # verify complaint token
-    if not tokenlib.verify_token(_complaint_keypair, complaint_token):
+    if not _complaint_keypair.verify(complaint_token):
         print('Complaint token failed to verify')
         return None
 
     # check if the complaint token has been used before
-    if complaint_token_db.add_if_not_exists(complaint_token) is not None:
+    if state.complaint_tokens.add_if_not_exists(complaint_token) is not None:
         print('Complaint token already used')
         return None
 
@@ -142,14 +141,15 @@ def complain(payload) -> bytes:
         util.load_aes_key(),
         encrypted_token
     )
-    if not tokenlib.verify_token(_keypair, decrypted_token):
+    token_epoch = _keys.epoch_of(decrypted_token)
+    if token_epoch is None:
         # if the token fails to verify after the signature worked, then the appserver is at fault
         # send a new token
-        return tokenlib.sign_token(_keypair, blinded_token)
+        return _signing_keypair().sign(blinded_token)
     
     # invalidate the token
-    already_used = token_db.add_if_not_exists(decrypted_token)
-    if already_used:
+    already_used = state.tokens(token_epoch).add_if_not_exists(decrypted_token)
+    if already_used is not None:
         print('Token already used, don\'t allow another token to be issued')
         return None
 
@@ -163,13 +163,13 @@ def complain(payload) -> bytes:
         _, token, data_hash = payloads.TokenPayload.deserialize(token_payload)
 
         # check the actual token
-        if decrypted_token != token or not tokenlib.verify_token(_keypair, token):
+        if decrypted_token != token:
             # app server gave a bad token, return a new one
-            return tokenlib.sign_token(_keypair, blinded_token)
+            return _signing_keypair().sign(blinded_token)
         
         # if the token was ok but it's a duplicate, then the first complaint wins
-        already_complained = complaint_duplicate_token_db.add_if_not_exists(token)
-        if already_complained:
+        already_complained = state.complaint_duplicates(token_epoch).add_if_not_exists(token)
+        if already_complained is not None:
             return b'' # don't return an error, but don't return a new token either
         
     else: # complaint_type == 1
@@ -188,22 +188,42 @@ def complain(payload) -> bytes:
         )
 
     # sign and return a blinded token
-    return tokenlib.sign_token(_keypair, blinded_token)
+    return _signing_keypair().sign(blinded_token)
 
 
 # ALGORITHM 5: NEW EPOCH
 def new_epoch(payload):
 
-    global mule_duplicate_db
+    global state
 
-    mule_id, blinded_token_bytes = payloads.NewEpochRequest.deserialize(payload)
+    mule_id, blinded_token_bytes, acked_bytes = payloads.NewEpochRequest.deserialize(payload)
     blinded_tokens = payloads.TokenList.deserialize(blinded_token_bytes)
 
-    signed_tokens = [tokenlib.sign_token(_complaint_keypair, b_t) for b_t in blinded_tokens]
-    signed_token_bytes = payloads.TokenList.serialize(signed_tokens)
+    signed_token_bytes = payloads.TokenList.serialize_joined(
+        _complaint_keypair.sign_batch(blinded_tokens), len(blinded_tokens)
+    )
+
+    # duplicates are reported until the mule acknowledges them by sending
+    # this response's cursor back with its next request, so a response lost
+    # on the way costs nothing but a repeat
+    acked = payloads.DuplicateCursor.deserialize(acked_bytes)
+    duplicate_tokens, cursor = state.duplicates(mule_id, _keys.live(), acked)
+
+    return payloads.NewEpochResponse.serialize(
+        signed_token_bytes,
+        payloads.TokenList.serialize(duplicate_tokens),
+        payloads.DuplicateCursor.serialize(cursor)
+    )
 
-    duplicate_tokens = mule_duplicate_db.get(mule_id, [])
-    duplicate_token_bytes = payloads.TokenList.serialize(duplicate_tokens)
 
-    return payloads.NewEpochResponse.serialize(signed_token_bytes, duplicate_token_bytes)
+# CLUSTER: SPEND A FRONT END'S SHARE OF A REDEMPTION (see provider_cluster.py)
+def spend_tokens(payload, lookup=None) -> bytes:
 
+    global state
+
+    mule_id, token_bytes = payloads.TokenRedemptionPayload.deserialize(payload)
+    tokens = payloads.TokenList.deserialize(token_bytes)
+
+    return payloads.SpendResults.serialize(
+        state.spend(_keys, mule_id, tokens, lookup is not None)
+    )
@@ -0,0 +1,148 @@
+# provider_cluster.py
+#
+# Splits the redeemed tokens across provider shards, so the spent set and the
+# work of verifying tokens grow with the number of machines instead of filling
+# one. Shards are ordinary providers. A front end (PROVIDER_SHARDS=url,url,...)
+# sends each shard its share of a redemption at /spend_tokens, where the shard
+# verifies the tokens and marks them spent, and merges the answers; it keeps
+# the counts and duplicates itself (provider_state.ClusterState).
+#
+# Tokens are placed on a consistent-hash ring, so adding or removing a shard
+# moves only the tokens on the arcs next to it. While the tokens it moved are
+# still being redeemed, run the front ends with PROVIDER_SHARDS_PREVIOUS set to
+# the old list: each moved token is then also looked up on its old shard,
+# which wins if it has seen the token. Every front end must switch rings at
+# the same time.
+import bisect
+import hashlib
+import requests
+from concurrent.futures import ThreadPoolExecutor
+
+import payloads
+
+NEW = payloads.SpendResults.NEW
+SPENT = payloads.SpendResults.SPENT
+
+
+def _hash(data: bytes) -> int:
+    return int.from_bytes(hashlib.sha256(data).digest()[:8], 'big')
+
+
+class HashRing:
+
+    # points per shard; enough to keep the shards' shares roughly even
+    VNODES = 128
+
+    def __init__(self, shards, vnodes=VNODES):
+        points = sorted((_hash(f'{shard}#{i}'.encode()), shard)
+                        for shard in shards for i in range(vnodes))
+        self._hashes = [h for h, _ in points]
+        self._shards = [s for _, s in points]
+
+    # the shard a token lives on: the first point clockwise of its hash
+    def owner(self, token: bytes) -> str:
+        i = bisect.bisect(self._hashes, _hash(token)) % len(self._hashes)
+        return self._shards[i]
+
+
+# A redemption some shards failed. The others have already marked their
+# tokens spent, so results holds their answers, None for every token whose
+# answer is missing or may be wrong without the shards that failed.
+class PartialSpend(Exception):
+
+    def __init__(self, results):
+        super().__init__('a shard failed to spend its share of the tokens')
+        self.results = results
+
+
+class Cluster:
+
+    def __init__(self, shards, previous_shards=None, timeout=10):
+        self._ring = HashRing(shards)
+        self._previous = HashRing(previous_shards) if previous_shards else None
+        self._timeout = timeout
+        self._pool = ThreadPoolExecutor(max_workers=4 * len(shards))
+
+    def _post(self, shard, mule_id, tokens, lookup):
+        response = requests.post(
+            shard + '/spend_tokens',
+            params={'lookup': '1'} if lookup else None,
+            headers={'Content-Type': 'application/octet-stream'},
+            data=payloads.TokenRedemptionPayload.serialize(mule_id, payloads.TokenList.serialize(tokens)),
+            timeout=self._timeout
+        )
+        response.raise_for_status()
+        results = payloads.SpendResults.deserialize(response.content)
+        if len(results) != len(tokens):
+            raise ValueError(f'{shard} answered for {len(results)} of {len(tokens)} tokens')
+        return results
+
+    # sends the tokens at indexes to their shards under ring; returns futures
+    # of [(index, result)]
+    def _scatter(self, ring, mule_id, tokens, indexes, lookup):
+        by_shard = {}
+        for i in indexes:
+            by_shard.setdefault(ring.owner(tokens[i]), []).append(i)
+
+        def call(shard, shard_indexes):
+            results = self._post(shard, mule_id, [tokens[i] for i in shard_indexes], lookup)
+            return list(zip(shard_indexes, results))
+
+        return [self._pool.submit(call, shard, shard_indexes) for shard, shard_indexes in by_shard.items()]
+
+    # as LocalState.spend, across the shards. A shard that fails fails the
+    # whole redemption with PartialSpend, and the mule retries it; the
+    # tokens the other shards spent come back then as this mule's own.
+    def spend(self, mule_id, tokens):
+        results = [None] * len(tokens)
+        spends = self._scatter(self._ring, mule_id, tokens, range(len(tokens)), False)
+
+        moved = []
+        lookups = []
+        if self._previous is not None:
+            moved = [i for i, token in enumerate(tokens)
+                     if self._previous.owner(token) != self._ring.owner(token)]
+            lookups = self._scatter(self._previous, mule_id, tokens, moved, True)
+
+        failure = None
+        for future in spends:
+            try:
+                for i, result in future.result():
+                    results[i] = result
+            except (requests.RequestException, ValueError) as e:
+                failure = e
+        # the new shard has marked these spent too, so it knows them once the
+        # old ring is gone, though with this redemption's mule as their owner
+        lookup_failure = None
+        for future in lookups:
+            try:
+                for i, result in future.result():
+                    if results[i] is not None and result[0] == SPENT and \
+                            results[i][0] != payloads.SpendResults.INVALID:
+                        results[i] = result
+            except (requests.RequestException, ValueError) as e:
+                lookup_failure = e
+
+        if lookup_failure is not None:
+            # any moved token may be a duplicate the old shard would have named
+            for i in moved:
+                results[i] = None
+            raise PartialSpend(results) from lookup_failure
+        if failure is not None:
+            raise PartialSpend(results) from failure
+        return results
+
+
+# The cluster's token set as the provider's complaint path uses it.
+class ClusterSpentSet:
+
+    def __init__(self, cluster):
+        self._cluster = cluster
+
+    # None if key was new, else the mule that spent it (b'' if none); a token
+    # a shard will not verify counts as spent, so it earns nothing
+    def add_if_not_exists(self, key, owner=None):
+        status, previous, _ = self._cluster.spend(owner or bytes(16), [key])[0]
+        if status == NEW:
+            return None
+        return previous or b''
@@ -0,0 +1,62 @@
+# provider_keys.py
+#
+# The provider's delivery-token keys. With PROVIDER_EPOCH_SECONDS set, time is
+# cut into epochs, each signed with its own keypair derived from key_seed.bin
+# (gen_keypair.py), so every worker, shard and restart agrees on it without
+# sharing key files. A token redeems only in the epoch it was signed in and
+# the next; the spent tokens of older epochs can never come back and are
+# dropped wholesale (provider_state.py). Without PROVIDER_EPOCH_SECONDS there
+# is a single epoch, 0, signed with keypair.bin.
+import os
+import threading
+import time
+import tokenlib # type: ignore
+
+
+class EpochKeys:
+
+    def __init__(self):
+        seconds = os.environ.get('PROVIDER_EPOCH_SECONDS')
+        self.seconds = int(seconds) if seconds else None
+        self._keys = {}
+        self._lock = threading.Lock()
+
+        if self.seconds is None:
+            with open('keypair.bin', 'rb') as f:
+                self._keys[0] = tokenlib.KeyPair(f.read())
+        else:
+            with open('key_seed.bin', 'rb') as f:
+                self._seed = f.read()
+
+    def current(self) -> int:
+        return 0 if self.seconds is None else int(time.time()) // self.seconds
+
+    # the epochs whose tokens still redeem, current first
+    def live(self) -> list[int]:
+        epoch = self.current()
+        return [epoch] if epoch == 0 else [epoch, epoch - 1]
+
+    # the keypair of a live epoch, None for any other
+    def keypair(self, epoch):
+        live = self.live()
+        if epoch not in live:
+            return None
+        if self.seconds is None:
+            return self._keys[0]
+
+        with self._lock:
+            if epoch not in self._keys:
+                self._keys[epoch] = tokenlib.KeyPair.derive(self._seed, epoch)
+                for old in [e for e in self._keys if e not in live]:
+                    del self._keys[old]
+            return self._keys[epoch]
+
+    # the live epoch each token verifies under, None if none
+    def epochs_of(self, tokens) -> list:
+        live = self.live()
+        keypairs = [self.keypair(epoch) for epoch in live]
+        found = keypairs[0].epochs_of(tokens, *keypairs[1:])
+        return [None if i is None else live[i] for i in found]
+
+    def epoch_of(self, token):
+        return self.epochs_of([token])[0]
@@ -0,0 +1,482 @@
+# provider_state.py
+#
+# Where the provider keeps the redeemed tokens, the duplicates charged to each
+# mule and the per-mule counts. PROVIDER_STATE picks the backend:
+#  * local (default): tokenlib.SpentSets, a dict and sqlite in this process;
+#    only correct with a single worker.
+#  * redis: one Redis at REDIS_URL shared by every worker and instance, so the
+#    provider can run as many of either as it likes.
+# With PROVIDER_SHARDS set the provider is a cluster front end instead: the
+# redeemed tokens live on the shards (see provider_cluster.py) and only the
+# rest is kept in the backend above.
+#
+# The redeemed tokens, the duplicates and the complaints against tokens are
+# kept per key epoch (provider_keys.py). Only the live epochs' partitions are
+# kept; an older one is dropped whole, so the state stays the size of two
+# epochs' worth of tokens however long the provider runs.
+import os
+import shutil
+import threading
+import payloads
+import platform_db
+import provider_cluster
+import tokenlib # type: ignore
+
+NEW = payloads.SpendResults.NEW
+INVALID = payloads.SpendResults.INVALID
+SPENT = payloads.SpendResults.SPENT
+
+NO_OWNER = bytes(16)
+
+
+# the mule a spent set says added a token, None for tokens added without one
+def _owner(previous):
+    return None if previous in (b'', NO_OWNER) else previous
+
+
+# Splits a redemption by the spend results of its tokens. Returns (serialized
+# invalid TokenList, [(mule_id, count delta)], [(previous mule_id or None,
+# duplicate token, epoch)]), the redeeming mule's delta first. A token the
+# same mule spent before was credited then: a mule that lost the response
+# sends the whole batch again, and must neither earn it twice nor be charged
+# for it.
+def tally(mule_id, tokens, results):
+    invalid_tokens = []
+    deltas = {mule_id: 0}
+    duplicates = []
+    for token, (status, previous_mule_id, epoch) in zip(tokens, results):
+        if status == INVALID:
+            invalid_tokens.append(token)
+        elif status == NEW:
+            deltas[mule_id] += 1
+        elif previous_mule_id == mule_id:
+            pass
+        else:
+            # a token complain() invalidated is charged to no one
+            if previous_mule_id is not None:
+                deltas[previous_mule_id] = deltas.get(previous_mule_id, 0) - 1
+            duplicates.append((previous_mule_id, token, epoch))
+    return payloads.TokenList.serialize(invalid_tokens), list(deltas.items()), duplicates
+
+
+# spend() over a state's per-epoch spent sets: verifies the tokens and marks
+# the valid ones spent by mule_id in their epoch's set, or with lookup only
+# reports which are spent already
+def _spend(state, keys, mule_id, tokens, lookup):
+    if lookup:
+        results = []
+        for token in tokens:
+            previous = ((e, state.tokens(e).get(token)) for e in keys.live())
+            epoch, p = next(((e, p) for e, p in previous if p is not None), (None, None))
+            results.append((NEW, None, None) if p is None else (SPENT, _owner(p), epoch))
+        return results
+
+    epochs = keys.epochs_of(tokens)
+    results = [(INVALID, None, None)] * len(tokens)
+    for epoch in keys.live():
+        at = [i for i, e in enumerate(epochs) if e == epoch]
+        if not at:
+            continue
+        previous = state.tokens(epoch).add_new_elements([tokens[i] for i in at], [mule_id] * len(at))
+        for i, p in zip(at, previous):
+            results[i] = (NEW, None, epoch) if p is None else (SPENT, _owner(p), epoch)
+    return results
+
+
+# Each mule's duplicates in one epoch, as an append-only log. Positions in a
+# log count from the first duplicate ever appended, so a cursor stays valid
+# however much of the log has been dropped since. With a path, every log is
+# also kept in path/<mule ID hex>.log as an 8-byte count of the duplicates
+# dropped from its front, then 4-byte length || token records, and read back
+# when the ledger is reopened.
+class DuplicateLedger:
+
+    HEADER = 8
+
+    def __init__(self, path=None):
+        self._path = path
+        # mule ID -> duplicate tokens not acknowledged yet, oldest first
+        self._logs = {}
+        # mule ID -> how many were acknowledged and dropped before them
+        self._base = {}
+        if path is None:
+            return
+        os.makedirs(path, exist_ok=True)
+        for entry in os.listdir(path):
+            name, _, ext = entry.partition('.')
+            if ext == 'log':
+                with open(os.path.join(path, entry), 'rb') as f:
+                    data = f.read()
+                mule_id = bytes.fromhex(name)
+                self._base[mule_id] = int.from_bytes(data[:self.HEADER], 'little')
+                self._logs[mule_id] = self._read_records(data[self.HEADER:])
+
+    @staticmethod
+    def _read_records(data) -> list[bytes]:
+        tokens = []
+        i = 0
+        # a record cut short by a crash mid-append is dropped
+        while i + 4 <= len(data):
+            n = int.from_bytes(data[i:i + 4], 'little')
+            if i + 4 + n > len(data):
+                break
+            tokens.append(data[i + 4:i + 4 + n])
+            i += 4 + n
+        return tokens
+
+    @staticmethod
+    def _records(tokens) -> bytes:
+        return b''.join(len(token).to_bytes(4, 'little') + token for token in tokens)
+
+    def _file(self, mule_id):
+        return os.path.join(self._path, mule_id.hex() + '.log')
+
+    def append(self, mule_tokens):
+        by_mule = {}
+        for mule_id, token in mule_tokens:
+            by_mule.setdefault(mule_id, []).append(token)
+        for mule_id, tokens in by_mule.items():
+            self._logs.setdefault(mule_id, []).extend(tokens)
+            if self._path is not None:
+                with open(self._file(mule_id), 'ab') as f:
+                    if f.tell() == 0:
+                        f.write(self._base.get(mule_id, 0).to_bytes(self.HEADER, 'little'))
+                    f.write(self._records(tokens))
+
+    # drops the mule's duplicates before position end, which a response it
+    # acknowledged reported; an old or repeated end drops nothing more
+    def acknowledge(self, mule_id, end):
+        log = self._logs.get(mule_id)
+        base = self._base.get(mule_id, 0)
+        if not log or end <= base:
+            return
+        n = min(end - base, len(log))
+        del log[:n]
+        # the log stays, empty or not, so its base outlives the duplicates
+        self._base[mule_id] = base + n
+        if self._path is not None:
+            path = self._file(mule_id)
+            with open(path + '.tmp', 'wb') as f:
+                f.write((base + n).to_bytes(self.HEADER, 'little'))
+                f.write(self._records(log))
+            os.replace(path + '.tmp', path)
+
+    # the mule's unacknowledged duplicates and the position after the last
+    def read(self, mule_id):
+        tokens = list(self._logs.get(mule_id, ()))
+        return tokens, self._base.get(mule_id, 0) + len(tokens)
+
+
+class LocalState:
+
+    def __init__(self, state_dir=None):
+        self._state_dir = state_dir
+        self._lock = threading.Lock()
+        # epoch -> already-redeemed delivery tokens -> the mule that redeemed them
+        self._tokens = {}
+        # epoch -> duplicates with filed complaints
+        self._complaint_duplicates = {}
+        # epoch -> DuplicateLedger of the duplicates found in that epoch
+        self._duplicates = {}
+        # already-redeemed complaint tokens
+        self.complaint_tokens = self._spent_set('complaint_tokens')
+        # redeemed token counts per-mule, written to sqlite in the background
+        self.counts = platform_db.KeyValueDatabase()
+
+        # reopen the partitions a previous run left, so retire() finds them
+        if state_dir is not None and os.path.isdir(state_dir):
+            for entry in os.listdir(state_dir):
+                name, _, epoch = entry.rpartition('-')
+                if name == 'tokens' and epoch.isdigit():
+                    self.tokens(int(epoch))
+                elif name == 'complaint_duplicates' and epoch.isdigit():
+                    self.complaint_duplicates(int(epoch))
+                elif name == 'duplicates' and epoch.isdigit():
+                    self._ledger(int(epoch))
+
+    # the token sets are kept in memory-mapped files under state_dir if
+    # given, so they survive a restart
+    def _spent_set(self, name):
+        return tokenlib.SpentSet(None if self._state_dir is None else os.path.join(self._state_dir, name))
+
+    def _partition(self, partitions, name, epoch):
+        with self._lock:
+            if epoch not in partitions:
+                partitions[epoch] = self._spent_set(f'{name}-{epoch}')
+            return partitions[epoch]
+
+    def _ledger(self, epoch):
+        with self._lock:
+            if epoch not in self._duplicates:
+                self._duplicates[epoch] = DuplicateLedger(
+                    None if self._state_dir is None else os.path.join(self._state_dir, f'duplicates-{epoch}')
+                )
+            return self._duplicates[epoch]
+
+    def tokens(self, epoch):
+        return self._partition(self._tokens, 'tokens', epoch)
+
+    def complaint_duplicates(self, epoch):
+        return self._partition(self._complaint_duplicates, 'complaint_duplicates', epoch)
+
+    # drops every partition of an epoch that is no longer live
+    def retire(self, live):
+        with self._lock:
+            for name, partitions in (('tokens', self._tokens),
+                                     ('complaint_duplicates', self._complaint_duplicates),
+                                     ('duplicates', self._duplicates)):
+                for epoch in [e for e in partitions if e not in live]:
+                    del partitions[epoch]
+                    if self._state_dir is not None:
+                        shutil.rmtree(os.path.join(self._state_dir, f'{name}-{epoch}'), ignore_errors=True)
+
+    # as tally(); in one tokenlib call
+    def redeem(self, keys, payload):
+        live = keys.live()
+        self.retire(live)
+        args = [arg for epoch in live for arg in (keys.keypair(epoch), self.tokens(epoch))]
+        invalid_token_bytes, deltas, duplicates = args[0].redeem(payload, *args[1:])
+        # tokenlib numbers the epochs by their place in live
+        return invalid_token_bytes, deltas, [(p, token, live[i]) for p, token, i in duplicates]
+
+    # returns [(status, previous mule_id or None, epoch or None)] per token
+    def spend(self, keys, mule_id, tokens, lookup=False):
+        self.retire(keys.live())
+        return _spend(self, keys, mule_id, tokens, lookup)
+
+    def add_duplicates(self, epoch, mule_tokens):
+        ledger = self._ledger(epoch)
+        with self._lock:
+            ledger.append(mule_tokens)
+
+    # the duplicates a mule has not acknowledged over the given epochs, and the
+    # cursor ({epoch: end}) that acknowledges them. acked is the cursor of the
+    # last response the mule received; what it covers is dropped first, in the
+    # same locked step, so concurrent calls never lose a duplicate.
+    def duplicates(self, mule_id, epochs, acked):
+        tokens = []
+        cursor = {}
+        with self._lock:
+            for epoch in sorted(epochs):
+                if epoch in self._duplicates:
+                    ledger = self._duplicates[epoch]
+                    ledger.acknowledge(mule_id, acked.get(epoch, 0))
+                    epoch_tokens, cursor[epoch] = ledger.read(mule_id)
+                    tokens += epoch_tokens
+        return tokens, cursor
+
+
+# Marks tokens spent in one epoch's hash, in order, unless they already are,
+# and returns the owner each one had: nil if it was new, '' if it was added
+# without one. ARGV is token, owner pairs, then the hash's time to live.
+_ADD_NEW_ELEMENTS = '''
+local previous = {}
+local n = (#ARGV - 1) / 2
+for i = 1, n do
+    local owner = redis.call('HGET', KEYS[1], ARGV[2 * i - 1])
+    if owner then
+        previous[i] = owner
+    else
+        redis.call('HSET', KEYS[1], ARGV[2 * i - 1], ARGV[2 * i])
+        previous[i] = false
+    end
+end
+local ttl = tonumber(ARGV[#ARGV])
+if ttl > 0 then
+    redis.call('EXPIRE', KEYS[1], ttl)
+end
+return previous
+'''
+
+
+# Acknowledges and reads a mule's duplicates across epochs in one step, as
+# DuplicateLedger does. KEYS are each epoch's list and the count of
+# duplicates already dropped from its front; ARGV is each epoch's
+# acknowledged end, then the keys' time to live. Returns {end, tokens} per
+# epoch.
+_ACKNOWLEDGE_DUPLICATES = '''
+local ttl = tonumber(ARGV[#ARGV])
+local out = {}
+for i = 1, #KEYS / 2 do
+    local list, base_key = KEYS[2 * i - 1], KEYS[2 * i]
+    local base = tonumber(redis.call('GET', base_key) or '0')
+    local n = math.min(tonumber(ARGV[i]) - base, redis.call('LLEN', list))
+    if n > 0 then
+        redis.call('LTRIM', list, n, -1)
+        base = redis.call('INCRBY', base_key, n)
+        if ttl > 0 then
+            redis.call('EXPIRE', base_key, ttl)
+        end
+    end
+    local tokens = redis.call('LRANGE', list, 0, -1)
+    out[i] = {base + #tokens, tokens}
+end
+return out
+'''
+
+
+class RedisSpentSet:
+
+    def __init__(self, client, key, ttl=0):
+        self._client = client
+        self._key = key
+        self._ttl = ttl
+        self._add_new_elements = client.register_script(_ADD_NEW_ELEMENTS)
+
+    # as tokenlib.SpentSet: one script call per batch, so a token two workers
+    # redeem at once is charged to exactly one of them
+    def add_new_elements(self, keys, owners=None) -> list:
+        if len(keys) == 0:
+            return []
+        if owners is None:
+            owners = [b''] * len(keys)
+        args = [arg for pair in zip(keys, owners) for arg in pair]
+        return self._add_new_elements(keys=[self._key], args=args + [self._ttl])
+
+    def add_if_not_exists(self, key, owner=None):
+        return self.add_new_elements([key], None if owner is None else [owner])[0]
+
+    def get(self, key):
+        return self._client.hget(self._key, key)
+
+
+class RedisCounts:
+
+    KEY = b'mule_counts'
+
+    def __init__(self, client):
+        self._client = client
+
+    def increment_count(self, mule_id, increment):
+        self._client.hincrby(self.KEY, mule_id, increment)
+
+    def batch_increment_counts(self, mule_id_increments):
+        pipe = self._client.pipeline(transaction=False)
+        for mule_id, increment in mule_id_increments:
+            pipe.hincrby(self.KEY, mule_id, increment)
+        pipe.execute()
+
+    def get_counts(self):
+        return {k: int(v) for k, v in self._client.hgetall(self.KEY).items()}
+
+
+class RedisState:
+
+    # epoch_seconds, if set, makes each epoch's keys expire two epochs after
+    # their last write, by when the epoch is no longer live
+    def __init__(self, url, epoch_seconds=None):
+        import redis # type: ignore
+        self._client = redis.Redis.from_url(url)
+        self._ttl = 0 if epoch_seconds is None else 2 * epoch_seconds + 60
+        self.complaint_tokens = RedisSpentSet(self._client, b'spent:complaint_tokens')
+        self.counts = RedisCounts(self._client)
+        self._acknowledge_duplicates = self._client.register_script(_ACKNOWLEDGE_DUPLICATES)
+
+    def tokens(self, epoch):
+        return RedisSpentSet(self._client, f'spent:tokens:{epoch}'.encode(), self._ttl)
+
+    def complaint_duplicates(self, epoch):
+        return RedisSpentSet(self._client, f'spent:complaint_duplicates:{epoch}'.encode(), self._ttl)
+
+    # the partitions of old epochs expire on their own
+    def retire(self, live):
+        pass
+
+    # as tally(); the tokens are verified here and only the valid ones go to
+    # Redis
+    def redeem(self, keys, payload):
+        mule_id, token_bytes = payloads.TokenRedemptionPayload.deserialize(payload)
+        tokens = payloads.TokenList.deserialize(token_bytes)
+        return tally(mule_id, tokens, self.spend(keys, mule_id, tokens))
+
+    def spend(self, keys, mule_id, tokens, lookup=False):
+        return _spend(self, keys, mule_id, tokens, lookup)
+
+    def _duplicate_keys(self, epoch, mule_id):
+        return f'duplicates:{epoch}:'.encode() + mule_id, f'duplicates_base:{epoch}:'.encode() + mule_id
+
+    def add_duplicates(self, epoch, mule_tokens):
+        pipe = self._client.pipeline(transaction=False)
+        for mule_id, token in mule_tokens:
+            key, base_key = self._duplicate_keys(epoch, mule_id)
+            pipe.rpush(key, token)
+            if self._ttl:
+                # the base must live as long as the list it counts from
+                pipe.expire(key, self._ttl)
+                pipe.expire(base_key, self._ttl)
+        pipe.execute()
+
+    # as LocalState.duplicates; each epoch's duplicates are a Redis list, and
+    # one script acknowledges and reads them all
+    def duplicates(self, mule_id, epochs, acked):
+        epochs = sorted(epochs)
+        keys = [key for epoch in epochs for key in self._duplicate_keys(epoch, mule_id)]
+        args = [acked.get(epoch, 0) for epoch in epochs] + [self._ttl]
+        tokens = []
+        cursor = {}
+        for epoch, (end, epoch_tokens) in zip(epochs, self._acknowledge_duplicates(keys=keys, args=args)):
+            cursor[epoch] = end
+            tokens += epoch_tokens
+        return tokens, cursor
+
+
+class ClusterState:
+
+    # everything but the redeemed tokens stays in inner
+    def __init__(self, cluster, inner):
+        self._cluster = cluster
+        self._inner = inner
+        self._tokens = provider_cluster.ClusterSpentSet(cluster)
+        self.complaint_tokens = inner.complaint_tokens
+        self.counts = inner.counts
+
+    # the shards sort tokens into epochs themselves
+    def tokens(self, epoch):
+        return self._tokens
+
+    def complaint_duplicates(self, epoch):
+        return self._inner.complaint_duplicates(epoch)
+
+    def retire(self, live):
+        self._inner.retire(live)
+
+    # as tally(); the shards verify and spend their share of the tokens
+    def redeem(self, keys, payload):
+        mule_id, token_bytes = payloads.TokenRedemptionPayload.deserialize(payload)
+        tokens = payloads.TokenList.deserialize(token_bytes)
+        self.retire(keys.live())
+        try:
+            results = self._cluster.spend(mule_id, tokens)
+        except provider_cluster.PartialSpend as e:
+            # the retry will find what the other shards spent already this
+            # mule's, and credit it nothing, so credit it now; duplicates are
+            # charged by the retry
+            answered = [(token, result) for token, result in zip(tokens, e.results) if result is not None]
+            _, deltas, _ = tally(mule_id, [t for t, _ in answered], [r for _, r in answered])
+            self.counts.batch_increment_counts(deltas[:1])
+            raise
+        return tally(mule_id, tokens, results)
+
+    def add_duplicates(self, epoch, mule_tokens):
+        self._inner.add_duplicates(epoch, mule_tokens)
+
+    def duplicates(self, mule_id, epochs, acked):
+        return self._inner.duplicates(mule_id, epochs, acked)
+
+
+def open_state(epoch_seconds=None):
+    backend = os.environ.get('PROVIDER_STATE', 'local')
+    if backend == 'local':
+        state = LocalState(os.environ.get('PROVIDER_STATE_DIR'))
+    elif backend == 'redis':
+        state = RedisState(os.environ.get('REDIS_URL', 'redis://localhost:6379/0'), epoch_seconds)
+    else:
+        raise ValueError(f'unknown PROVIDER_STATE {backend}')
+
+    shards = os.environ.get('PROVIDER_SHARDS')
+    if shards:
+        previous_shards = os.environ.get('PROVIDER_SHARDS_PREVIOUS')
+        state = ClusterState(provider_cluster.Cluster(
+            shards.split(','), previous_shards.split(',') if previous_shards else None
+        ), state)
+    return state
@@ -182,7 +182,8 @@ def complain_deliver(_provider_url, appserver_url):
             print(f'  Error getting complaint tokens, got status code {response.status_code}')
             return False, None
 
-        complaint_bytes, dup_bytes = payloads.NewEpochResponse.deserialize(response.content)
+        # a real mule would send the cursor back with its next request
+        complaint_bytes, dup_bytes, _ = payloads.NewEpochResponse.deserialize(response.content)
         signed_tokens = payloads.TokenList.deserialize(complaint_bytes)
         complaint_tokens = [tokenlib.unblind_token(b_t, s_t) for b_t, s_t in zip(blinded_tokens, signed_tokens)]
 
@@ -0,0 +1,119 @@
+# test_provider_cluster.py
+#
+# Redemptions through a cluster front end whose shards fail part way; the
+# shards are dicts in this process. Run with python -m unittest.
+import unittest
+import requests
+
+import payloads
+import provider_cluster
+import provider_state
+
+NEW = payloads.SpendResults.NEW
+SPENT = payloads.SpendResults.SPENT
+
+EPOCH = 7
+
+
+class FakeCluster(provider_cluster.Cluster):
+
+    def __init__(self, shards):
+        super().__init__(shards)
+        # shard -> token -> the mule that spent it
+        self.spent = {shard: {} for shard in shards}
+        self.down = set()
+
+    def _post(self, shard, mule_id, tokens, lookup):
+        if shard in self.down:
+            raise requests.ConnectionError(f'{shard} is down')
+        results = []
+        for token in tokens:
+            previous = self.spent[shard].get(token)
+            if previous is None and not lookup:
+                self.spent[shard][token] = mule_id
+            results.append((NEW, None, EPOCH) if previous is None else (SPENT, previous, EPOCH))
+        return results
+
+
+class FakeCounts:
+
+    def __init__(self):
+        self.counts = {}
+
+    def batch_increment_counts(self, mule_id_increments):
+        for mule_id, increment in mule_id_increments:
+            self.counts[mule_id] = self.counts.get(mule_id, 0) + increment
+
+
+class FakeInner:
+
+    complaint_tokens = None
+
+    def __init__(self):
+        self.counts = FakeCounts()
+
+    def retire(self, live):
+        pass
+
+
+class FakeKeys:
+
+    def live(self):
+        return [EPOCH]
+
+
+class ClusterRedeemTest(unittest.TestCase):
+
+    def setUp(self):
+        self.cluster = FakeCluster(['http://a', 'http://b', 'http://c'])
+        self.state = provider_state.ClusterState(self.cluster, FakeInner())
+        self.tokens = [i.to_bytes(4, 'big') * 8 for i in range(60)]
+
+    # as provider.redeem_tokens: the counts, and the duplicates it files
+    def redeem(self, mule_id, tokens):
+        payload = payloads.TokenRedemptionPayload.serialize(mule_id, payloads.TokenList.serialize(tokens))
+        _, deltas, duplicates = self.state.redeem(FakeKeys(), payload)
+        self.state.counts.batch_increment_counts(deltas)
+        return duplicates
+
+    def count(self, mule_id):
+        return self.state.counts.counts.get(mule_id, 0)
+
+    def on_shard(self, shard):
+        return [t for t in self.tokens if self.cluster._ring.owner(t) == shard]
+
+    def test_retry_after_a_shard_fails_credits_every_token_once(self):
+        mule = b'm' * 16
+        self.cluster.down.add('http://b')
+        with self.assertRaises(provider_cluster.PartialSpend):
+            self.redeem(mule, self.tokens)
+        self.assertEqual(self.count(mule), len(self.tokens) - len(self.on_shard('http://b')))
+
+        self.cluster.down.clear()
+        self.assertEqual(self.redeem(mule, self.tokens), [])
+        self.assertEqual(self.count(mule), len(self.tokens))
+
+    def test_retry_charges_a_duplicate_once(self):
+        first, second = b'f' * 16, b's' * 16
+        reused = self.on_shard('http://a')[:3] + self.on_shard('http://b')[:2]
+        self.redeem(first, reused)
+
+        self.cluster.down.add('http://b')
+        with self.assertRaises(provider_cluster.PartialSpend):
+            self.redeem(second, self.tokens)
+        self.cluster.down.clear()
+        duplicates = self.redeem(second, self.tokens)
+
+        self.assertEqual(sorted(t for _, t, _ in duplicates), sorted(reused))
+        self.assertEqual(self.count(first), 0)
+        self.assertEqual(self.count(second), len(self.tokens) - len(reused))
+
+    def test_batch_sent_again_after_a_lost_response_changes_nothing(self):
+        mule = b'm' * 16
+        self.redeem(mule, self.tokens)
+        self.assertEqual(self.redeem(mule, self.tokens), [])
+        self.assertEqual(self.count(mule), len(self.tokens))
+
+
+if __name__ == '__main__':
+    unittest.main()
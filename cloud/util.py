@@ -58,6 +58,10 @@ def load_aes_key():
         return f.read()
 
 
+def export_public_key_xy(publickey) -> bytes:
+    return int(publickey.pointQ.x).to_bytes(32, 'big') + int(publickey.pointQ.y).to_bytes(32, 'big')
+
+
 def hash_sha256(_data):
     hash_object = SHA256.new(data=_data)
     return hash_object.digest()
@@ -0,0 +1,138 @@
+/*
+ * Broadcast reading and ack list encoding; see nebula_bcast.h.
+ */
+
+#include <string.h>
+#include "nebula_bcast.h"
+
+#define NEBULA_BCAST_COUNT_OFFSET   (2 + NEBULA_SENSOR_ID_BYTES)
+
+/**
+ * Checks the header of a sensor's broadcast service data, already past its
+ * UUID, and sets bc up to walk the readings.
+ *
+ * @return                      0 on success; -1 if it is not a broadcast this
+ *                                  mule understands.
+ */
+int
+nebula_bcast_parse(struct nebula_bcast *bc, const uint8_t *svc_data,
+                   size_t len)
+{
+    if (len < NEBULA_BCAST_HEADER_BYTES ||
+            svc_data[0] != NEBULA_BCAST_VERSION) {
+        return -1;
+    }
+
+    bc->flags = svc_data[1];
+    bc->sensor_id = &svc_data[2];
+    bc->count = svc_data[NEBULA_BCAST_COUNT_OFFSET];
+    bc->next = &svc_data[NEBULA_BCAST_HEADER_BYTES];
+    bc->left = len - NEBULA_BCAST_HEADER_BYTES;
+    return 0;
+}
+
+/**
+ * Steps to the next reading.  A reading cut short by the end of the data
+ * ends the walk.
+ *
+ * @return                      1 if out holds a reading; 0 at the end.
+ */
+int
+nebula_bcast_next(struct nebula_bcast *bc, struct nebula_bcast_reading *out)
+{
+    size_t n;
+
+    if (bc->count == 0 || bc->left < NEBULA_BCAST_READING_HEADER_BYTES) {
+        return 0;
+    }
+    n = bc->next[2];
+    if (bc->left < NEBULA_BCAST_READING_HEADER_BYTES + n) {
+        bc->left = 0;
+        return 0;
+    }
+
+    out->seq = (uint16_t)(bc->next[0] | bc->next[1] << 8);
+    out->len = (uint8_t)n;
+    out->sealed = &bc->next[NEBULA_BCAST_READING_HEADER_BYTES];
+    bc->next += NEBULA_BCAST_READING_HEADER_BYTES + n;
+    bc->left -= NEBULA_BCAST_READING_HEADER_BYTES + n;
+    bc->count--;
+    return 1;
+}
+
+/**
+ * Writes a broadcast header with no readings yet; out needs room for
+ * NEBULA_BCAST_HEADER_BYTES.
+ *
+ * @return                      The bytes written.
+ */
+size_t
+nebula_bcast_begin(uint8_t *out, uint8_t flags, const uint8_t *sensor_id)
+{
+    out[0] = NEBULA_BCAST_VERSION;
+    out[1] = flags;
+    memcpy(&out[2], sensor_id, NEBULA_SENSOR_ID_BYTES);
+    out[NEBULA_BCAST_COUNT_OFFSET] = 0;
+    return NEBULA_BCAST_HEADER_BYTES;
+}
+
+/**
+ * Appends a reading to a broadcast of used bytes, if it fits in cap.
+ *
+ * @return                      The new length; used if it did not fit.
+ */
+size_t
+nebula_bcast_add(uint8_t *out, size_t used, size_t cap, uint16_t seq,
+                 const uint8_t *sealed, uint8_t len)
+{
+    if (used + NEBULA_BCAST_READING_HEADER_BYTES + len > cap ||
+            out[NEBULA_BCAST_COUNT_OFFSET] == UINT8_MAX) {
+        return used;
+    }
+
+    out[used] = (uint8_t)seq;
+    out[used + 1] = (uint8_t)(seq >> 8);
+    out[used + 2] = len;
+    memcpy(&out[used + NEBULA_BCAST_READING_HEADER_BYTES], sealed, len);
+    out[NEBULA_BCAST_COUNT_OFFSET]++;
+    return used + NEBULA_BCAST_READING_HEADER_BYTES + len;
+}
+
+/**
+ * Writes the ack list for base and the sequence numbers after it set in
+ * bitmap, dropping trailing empty bitmap bytes; out needs room for
+ * NEBULA_BCAST_ACK_MAX_BYTES.
+ *
+ * @return                      The list's length; 0 if it acks nothing.
+ */
+size_t
+nebula_bcast_ack_encode(uint8_t *out, uint16_t base, uint64_t bitmap)
+{
+    size_t n = 0;
+
+    out[0] = (uint8_t)base;
+    out[1] = (uint8_t)(base >> 8);
+    while (bitmap != 0) {
+        out[2 + n++] = (uint8_t)bitmap;
+        bitmap >>= 8;
+    }
+    return n == 0 ? 0 : 2 + n;
+}
+
+/**
+ * @return                      1 if the ack list acks seq; 0 otherwise.
+ */
+int
+nebula_bcast_ack_contains(const uint8_t *list, size_t len, uint16_t seq)
+{
+    uint16_t bit;
+
+    if (len < 2) {
+        return 0;
+    }
+    bit = (uint16_t)(seq - (uint16_t)(list[0] | list[1] << 8));
+    if (bit >= 8 * (len - 2)) {
+        return 0;
+    }
+    return list[2 + bit / 8] >> (bit % 8) & 1;
+}
@@ -0,0 +1,102 @@
+/*
+ * Connectionless broadcast of small sensor readings.
+ *
+ * A sensor in broadcast mode keeps its last few readings, each sealed for the
+ * appserver, in the service data of its extended advertising.  Mules harvest
+ * them from scan reports without connecting.  Readings stay on the air until
+ * a mule acks them, which it does by writing an ack list to the sensor the
+ * next time it connects, or until newer ones push them out.  Any number of
+ * mules may carry the same reading; the appserver keeps one per sensor and
+ * sequence number.
+ *
+ * Service data (AD type 0x16) under NEBULA_BCAST_SVC_UUID16:
+ *
+ *   version || flags || sensor_id || count || reading...
+ *   reading: seq (u16, little-endian) || len || sealed[len]
+ *
+ * A sealed reading is IV || AES-GCM ciphertext || tag, as cloud/aes_decrypt.py
+ * expects; mules treat it as opaque.
+ *
+ * Ack list, written to the NEBULA_BCAST_ACK_UUID16 characteristic:
+ *
+ *   base (u16, little-endian) || bitmap
+ *
+ * Bit i of the bitmap, least significant bit of each byte first, acks
+ * sequence number base + i.  Sequence numbers wrap.
+ */
+
+#ifndef H_NEBULA_BCAST_
+#define H_NEBULA_BCAST_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "nebula_proto.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NEBULA_BCAST_SVC_UUID16             0x180A
+#define NEBULA_BCAST_ACK_UUID16             0x8914
+#define NEBULA_BCAST_VERSION                1
+
+/* The sensor has a transfer waiting; connect to it. */
+#define NEBULA_BCAST_F_BULK                 0x01
+/* Its readings are close to being pushed out unacked; connect to ack. */
+#define NEBULA_BCAST_F_ACK                  0x02
+
+#define NEBULA_BCAST_HEADER_BYTES           (3 + NEBULA_SENSOR_ID_BYTES)
+#define NEBULA_BCAST_READING_HEADER_BYTES   3
+
+/* IV and tag around a sealed reading. */
+#define NEBULA_BCAST_SEAL_IV_BYTES          12
+#define NEBULA_BCAST_SEAL_TAG_BYTES         16
+#define NEBULA_BCAST_SEAL_OVERHEAD \
+    (NEBULA_BCAST_SEAL_IV_BYTES + NEBULA_BCAST_SEAL_TAG_BYTES)
+#define NEBULA_BCAST_SEALED_MAX             64
+
+/*
+ * Service data the sensor can fit: a connectable extended advertisement is
+ * one AUX_ADV_IND, of which the s140 SoftDevice allows 238 bytes, less the
+ * UUID list and the service data's own AD header and UUID.
+ */
+#define NEBULA_BCAST_SVC_DATA_MAX           (238 - 4 - 4)
+
+#define NEBULA_BCAST_ACK_BITMAP_BYTES       8
+#define NEBULA_BCAST_ACK_WINDOW             (8 * NEBULA_BCAST_ACK_BITMAP_BYTES)
+#define NEBULA_BCAST_ACK_MAX_BYTES          (2 + NEBULA_BCAST_ACK_BITMAP_BYTES)
+
+struct nebula_bcast {
+    uint8_t flags;
+    const uint8_t *sensor_id;
+    uint8_t count;
+    /* The readings, for nebula_bcast_next(). */
+    const uint8_t *next;
+    size_t left;
+};
+
+struct nebula_bcast_reading {
+    uint16_t seq;
+    uint8_t len;
+    const uint8_t *sealed;
+};
+
+int nebula_bcast_parse(struct nebula_bcast *bc, const uint8_t *svc_data,
+                       size_t len);
+int nebula_bcast_next(struct nebula_bcast *bc,
+                      struct nebula_bcast_reading *out);
+
+size_t nebula_bcast_begin(uint8_t *out, uint8_t flags,
+                          const uint8_t *sensor_id);
+size_t nebula_bcast_add(uint8_t *out, size_t used, size_t cap, uint16_t seq,
+                        const uint8_t *sealed, uint8_t len);
+
+size_t nebula_bcast_ack_encode(uint8_t *out, uint16_t base,
+                               uint64_t bitmap);
+int nebula_bcast_ack_contains(const uint8_t *list, size_t len, uint16_t seq);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
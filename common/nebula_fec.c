@@ -0,0 +1,213 @@
+/*
+ * Cauchy Reed-Solomon erasure code for FEC transfers; see nebula_fec.h.
+ */
+
+#include <string.h>
+#include "nebula_fec.h"
+
+/* x^8 + x^4 + x^3 + x^2 + 1; 2 generates the field's multiplicative group. */
+#define NEBULA_FEC_POLY     0x11d
+
+/* exp is doubled so a product's logs can be added without reducing. */
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static int gf_ready;
+
+/**
+ * Builds the field's tables; cheap to call again.
+ */
+void
+nebula_fec_init(void)
+{
+    unsigned x = 1;
+    int i;
+
+    if (gf_ready) {
+        return;
+    }
+    for (i = 0; i < 255; i++) {
+        gf_exp[i] = (uint8_t)x;
+        gf_log[x] = (uint8_t)i;
+        x <<= 1;
+        if (x & 0x100) {
+            x ^= NEBULA_FEC_POLY;
+        }
+    }
+    for (i = 255; i < 512; i++) {
+        gf_exp[i] = gf_exp[i - 255];
+    }
+    gf_ready = 1;
+}
+
+static uint8_t
+gf_mul(uint8_t a, uint8_t b)
+{
+    if (a == 0 || b == 0) {
+        return 0;
+    }
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static uint8_t
+gf_inv(uint8_t a)
+{
+    return gf_exp[255 - gf_log[a]];
+}
+
+/* dst += c * src */
+static void
+gf_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n)
+{
+    unsigned lc;
+    size_t i;
+
+    if (c == 0) {
+        return;
+    }
+    lc = gf_log[c];
+    for (i = 0; i < n; i++) {
+        if (src[i] != 0) {
+            dst[i] ^= gf_exp[gf_log[src[i]] + lc];
+        }
+    }
+}
+
+/* Weight of source symbol i in repair symbol j; never 0, as K + j > i. */
+static uint8_t
+nebula_fec_coef(uint8_t j, uint8_t i)
+{
+    return gf_inv((uint8_t)((NEBULA_FEC_K + j) ^ i));
+}
+
+/* Bytes of source symbol i the payload has; the rest are zero padding. */
+static size_t
+nebula_fec_sym_len(size_t block_len, uint16_t sym, uint8_t i)
+{
+    size_t at = (size_t)i * sym;
+
+    if (at >= block_len) {
+        return 0;
+    }
+    return block_len - at < sym ? block_len - at : sym;
+}
+
+/**
+ * Makes repair symbol j of a block.
+ *
+ * @param out                   Where the sym bytes of the symbol go.
+ * @param block                 The block's source symbols, back to back.
+ * @param block_len             Bytes of payload in the block; the last
+ *                                  symbol may be short.
+ */
+void
+nebula_fec_repair(uint8_t *out, const uint8_t *block, size_t block_len,
+                  uint16_t sym, uint8_t k, uint8_t j)
+{
+    uint8_t i;
+
+    memset(out, 0, sym);
+    for (i = 0; i < k; i++) {
+        gf_mul_add(out, block + (size_t)i * sym, nebula_fec_coef(j, i),
+                   nebula_fec_sym_len(block_len, sym, i));
+    }
+}
+
+/**
+ * Fills in a block's missing source symbols from its repair symbols.
+ *
+ * @param block                 The block's source symbols, back to back;
+ *                                  the ones in present are read, the rest
+ *                                  written.
+ * @param present               Bit i set if source symbol i is in place.
+ * @param repairs               nrepairs repair symbols of sym bytes each,
+ *                                  repairs[t] being repair repair_idx[t];
+ *                                  used as scratch.
+ *
+ * @return                      0 if the block is whole; -1 if it is missing
+ *                                  more symbols than there are repairs.
+ */
+int
+nebula_fec_decode(uint8_t *block, size_t block_len, uint16_t sym,
+                  uint8_t k, uint32_t present, uint8_t *repairs,
+                  const uint8_t *repair_idx, uint8_t nrepairs)
+{
+    uint8_t missing[NEBULA_FEC_K];
+    uint8_t a[NEBULA_FEC_K][NEBULA_FEC_K];
+    uint8_t inv[NEBULA_FEC_K][NEBULA_FEC_K];
+    uint8_t m = 0;
+    uint8_t i, t, u, r, c, f;
+    uint8_t *y;
+    size_t n;
+
+    for (i = 0; i < k; i++) {
+        if (!(present & (1u << i))) {
+            missing[m++] = i;
+        }
+    }
+    if (m == 0) {
+        return 0;
+    }
+    if (m > nrepairs) {
+        return -1;
+    }
+
+    /*
+     * Take the source symbols in hand out of the first m repairs, which
+     * leaves m equations in the missing ones.
+     */
+    for (t = 0; t < m; t++) {
+        y = repairs + (size_t)t * sym;
+        for (i = 0; i < k; i++) {
+            if (present & (1u << i)) {
+                gf_mul_add(y, block + (size_t)i * sym,
+                           nebula_fec_coef(repair_idx[t], i),
+                           nebula_fec_sym_len(block_len, sym, i));
+            }
+        }
+        for (u = 0; u < m; u++) {
+            a[t][u] = nebula_fec_coef(repair_idx[t], missing[u]);
+            inv[t][u] = t == u;
+        }
+    }
+
+    /* Gauss-Jordan; a is a Cauchy matrix, so a pivot is there unless
+     * repair_idx repeats itself. */
+    for (c = 0; c < m; c++) {
+        for (r = c; r < m && a[r][c] == 0; r++) {
+        }
+        if (r == m) {
+            return -1;
+        }
+        if (r != c) {
+            for (u = 0; u < m; u++) {
+                f = a[r][u]; a[r][u] = a[c][u]; a[c][u] = f;
+                f = inv[r][u]; inv[r][u] = inv[c][u]; inv[c][u] = f;
+            }
+        }
+        f = gf_inv(a[c][c]);
+        for (u = 0; u < m; u++) {
+            a[c][u] = gf_mul(a[c][u], f);
+            inv[c][u] = gf_mul(inv[c][u], f);
+        }
+        for (r = 0; r < m; r++) {
+            if (r == c || a[r][c] == 0) {
+                continue;
+            }
+            f = a[r][c];
+            for (u = 0; u < m; u++) {
+                a[r][u] ^= gf_mul(a[c][u], f);
+                inv[r][u] ^= gf_mul(inv[c][u], f);
+            }
+        }
+    }
+
+    for (u = 0; u < m; u++) {
+        y = block + (size_t)missing[u] * sym;
+        n = nebula_fec_sym_len(block_len, sym, missing[u]);
+        memset(y, 0, n);
+        for (t = 0; t < m; t++) {
+            gf_mul_add(y, repairs + (size_t)t * sym, inv[u][t], n);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * Erasure code for FEC transfers (nebula_xfer_tx_fec()): a systematic
+ * Cauchy Reed-Solomon code over GF(2^8), applied byte-wise across the
+ * symbols of a block.
+ *
+ * A transfer's payload is cut into symbols of chunk_size minus the header,
+ * the last one zero-padded, and the symbols into blocks of NEBULA_FEC_K.
+ * Repair symbol j of a block is the sum over its source symbols i of
+ * src_i * 1 / ((NEBULA_FEC_K + j) ^ i).  Every square part of a Cauchy
+ * matrix is invertible, so any k distinct symbols of a k-symbol block,
+ * source or repair, give back the whole block.  The sensor makes each repair
+ * symbol from the payload in place with one symbol of scratch; the mule keeps
+ * the repair symbols of the block in hand, at most k of them.
+ *
+ * Each symbol goes out as one data notification:
+ * generation:4 block:4 || index || total length (u16, little-endian) ||
+ * symbol.  The generation tells transfers apart, so a symbol the stack was
+ * late with is not taken for one of the next transfer.  Indexes below the
+ * block's k are its source symbols, the rest repair symbols index - k;
+ * NEBULA_FEC_END marks the last symbol of a burst.
+ */
+
+#ifndef H_NEBULA_FEC_
+#define H_NEBULA_FEC_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Source symbols per block; the last block of a transfer may have fewer. */
+#define NEBULA_FEC_K                16
+
+#define NEBULA_FEC_HEADER_BYTES     4
+/* 255 chunks make at most 16 blocks. */
+#define NEBULA_FEC_BLOCK_MASK       0x0f
+#define NEBULA_FEC_GEN_SHIFT        4
+#define NEBULA_FEC_END              0x80
+/* Symbol indexes a block can use, source and repair. */
+#define NEBULA_FEC_INDEX_MAX        0x7f
+
+/* Largest notification a FEC transfer sends: an ATT MTU of 247. */
+#define NEBULA_FEC_CHUNK_MAX        244
+
+void nebula_fec_init(void);
+void nebula_fec_repair(uint8_t *out, const uint8_t *block, size_t block_len,
+                       uint16_t sym, uint8_t k, uint8_t j);
+int nebula_fec_decode(uint8_t *block, size_t block_len, uint16_t sym,
+                      uint8_t k, uint32_t present, uint8_t *repairs,
+                      const uint8_t *repair_idx, uint8_t nrepairs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
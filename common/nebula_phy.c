@@ -0,0 +1,117 @@
+/*
+ * Adaptive PHY policy; see nebula_phy.h.
+ */
+
+#include <string.h>
+#include "nebula_phy.h"
+
+/* Samples averaged before the first move up; each new one weighs 1/4. */
+#define NEBULA_PHY_WARMUP   4
+#define NEBULA_PHY_SHIFT    2
+
+/**
+ * Fills in thresholds that leave a few dB above each PHY's sensitivity
+ * (2M -92, 1M -95, coded S8 -103 dBm on the parts in use) for the average to
+ * lag a falling signal, and enough hysteresis between the ways up and down
+ * that RSSI noise does not bounce a link.
+ */
+void
+nebula_phy_cfg_default(struct nebula_phy_cfg *cfg)
+{
+    cfg->up_1m = -82;
+    cfg->up_2m = -70;
+    cfg->down_1m = -80;
+    cfg->down_coded = -89;
+    cfg->dwell_us = 2000000;
+}
+
+/**
+ * Starts a policy for a link that came up on phy.
+ */
+void
+nebula_phy_init(struct nebula_phy_policy *p, const struct nebula_phy_cfg *cfg,
+                uint8_t phy, uint64_t now_us)
+{
+    memset(p, 0, sizeof *p);
+    p->cfg = *cfg;
+    p->phy = phy;
+    p->since_us = now_us;
+}
+
+static uint8_t
+nebula_phy_target(const struct nebula_phy_policy *p, int rssi)
+{
+    const struct nebula_phy_cfg *cfg = &p->cfg;
+
+    if (rssi < cfg->down_coded && p->phy != NEBULA_PHY_CODED) {
+        return NEBULA_PHY_CODED;
+    }
+    if (rssi < cfg->down_1m && p->phy == NEBULA_PHY_2M) {
+        return NEBULA_PHY_1M;
+    }
+    if (p->samples < NEBULA_PHY_WARMUP) {
+        return p->phy;
+    }
+    /* One step at a time, so 2M is only reached through a working 1M. */
+    if (p->phy == NEBULA_PHY_CODED && rssi >= cfg->up_1m) {
+        return NEBULA_PHY_1M;
+    }
+    if (p->phy == NEBULA_PHY_1M && rssi >= cfg->up_2m) {
+        return NEBULA_PHY_2M;
+    }
+    return p->phy;
+}
+
+/**
+ * Feeds the policy an RSSI sample.
+ *
+ * @return                      The PHY to ask the peer for; NEBULA_PHY_NONE
+ *                                  to stay put, or while an earlier request
+ *                                  is outstanding.
+ */
+uint8_t
+nebula_phy_sample(struct nebula_phy_policy *p, int8_t rssi, uint64_t now_us)
+{
+    uint8_t want;
+    int up;
+
+    if (p->samples == 0) {
+        p->avg = (int16_t)(rssi * 16);
+    } else {
+        p->avg += (int16_t)((rssi * 16 - p->avg) >> NEBULA_PHY_SHIFT);
+    }
+    if (p->samples < NEBULA_PHY_WARMUP) {
+        p->samples++;
+    }
+
+    want = nebula_phy_target(p, nebula_phy_rssi(p));
+    if (want == p->phy) {
+        return NEBULA_PHY_NONE;
+    }
+    /* The peer may turn a request down; ask again once it has had time. */
+    if (p->requested == want && now_us - p->requested_us < p->cfg.dwell_us) {
+        return NEBULA_PHY_NONE;
+    }
+    /* Falling back is immediate; moving up waits out the dwell. */
+    up = want != NEBULA_PHY_CODED &&
+         (p->phy == NEBULA_PHY_CODED || want > p->phy);
+    if (up && now_us - p->since_us < p->cfg.dwell_us) {
+        return NEBULA_PHY_NONE;
+    }
+    p->requested = want;
+    p->requested_us = now_us;
+    return want;
+}
+
+/**
+ * Records the PHY the link is on after an update, whoever started it.
+ */
+void
+nebula_phy_updated(struct nebula_phy_policy *p, uint8_t phy, uint64_t now_us)
+{
+    if (phy != p->phy) {
+        p->phy = phy;
+        p->since_us = now_us;
+    }
+    p->requested = NEBULA_PHY_NONE;
+}
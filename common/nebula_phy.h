@@ -0,0 +1,97 @@
+/*
+ * Adaptive PHY policy for a sensor-mule connection, independent of any BLE
+ * stack.
+ *
+ * Links start on the PHY they were discovered on, the coded PHY for a sensor
+ * at the edge of range.  Each side feeds the policy RSSI samples; it keeps a
+ * moving average and says when to ask for another PHY: down to the coded PHY
+ * as the average nears the 1M sensitivity, up through 1M to 2M as it
+ * improves.  Moving down is immediate; moving up needs the average to clear
+ * a higher threshold and the link to have stayed put for a while, so a link
+ * on the boundary does not flap.
+ *
+ * Both sides run it on their own readings.  The central's controller settles
+ * a peripheral's request against the central's preferences for the link, so
+ * the mule asks for nebula_phy_at_most() its choice: the sensor can then
+ * always fall back further, but only moves up once the mule's readings agree.
+ */
+
+#ifndef H_NEBULA_PHY_
+#define H_NEBULA_PHY_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The HCI PHY numbers, which NimBLE uses as is. */
+enum nebula_phy {
+    NEBULA_PHY_NONE,
+    NEBULA_PHY_1M,
+    NEBULA_PHY_2M,
+    NEBULA_PHY_CODED,
+};
+
+struct nebula_phy_cfg {
+    /* Average RSSI thresholds, dBm. */
+    int8_t up_1m;               /* coded -> 1M at or above */
+    int8_t up_2m;               /* 1M -> 2M at or above */
+    int8_t down_1m;             /* 2M -> 1M below */
+    int8_t down_coded;          /* 1M or 2M -> coded below */
+    /* Time on a PHY before moving up, and before repeating a request. */
+    uint32_t dwell_us;
+};
+
+struct nebula_phy_policy {
+    struct nebula_phy_cfg cfg;
+    uint8_t phy;
+    uint8_t requested;
+    uint8_t samples;
+    /* Average RSSI in 1/16 dBm. */
+    int16_t avg;
+    uint64_t since_us;
+    uint64_t requested_us;
+};
+
+void nebula_phy_cfg_default(struct nebula_phy_cfg *cfg);
+void nebula_phy_init(struct nebula_phy_policy *p,
+                     const struct nebula_phy_cfg *cfg, uint8_t phy,
+                     uint64_t now_us);
+uint8_t nebula_phy_sample(struct nebula_phy_policy *p, int8_t rssi,
+                          uint64_t now_us);
+void nebula_phy_updated(struct nebula_phy_policy *p, uint8_t phy,
+                        uint64_t now_us);
+
+/* The PHY's bit in HCI PHY masks, which the SoftDevice's match. */
+static inline uint8_t
+nebula_phy_bit(uint8_t phy)
+{
+    return (uint8_t)(1 << (phy - 1));
+}
+
+/* A PHY mask of phy and every slower one. */
+static inline uint8_t
+nebula_phy_at_most(uint8_t phy)
+{
+    switch (phy) {
+    case NEBULA_PHY_2M:
+        return 0x07;
+    case NEBULA_PHY_1M:
+        return 0x05;
+    default:
+        return 0x04;
+    }
+}
+
+static inline int
+nebula_phy_rssi(const struct nebula_phy_policy *p)
+{
+    return p->avg / 16;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,72 @@
+/*
+ * Wire-level constants shared by the sensor and mule firmware.  Sizes mirror
+ * cloud/config.py and the struct layouts in cloud/payloads.py.
+ */
+
+#ifndef H_NEBULA_PROTO_
+#define H_NEBULA_PROTO_
+
+#define NEBULA_CHUNK_SIZE                   200
+
+#define NEBULA_SENSOR_ID_BYTES              16
+#define NEBULA_SHA256_BYTES                 32
+#define NEBULA_SIGNATURE_BYTES              64
+#define NEBULA_DELIVER_NONCE_BYTES          16
+#define NEBULA_TOKEN_BYTES                  64
+
+/* HashPayload: sensor_id || H(data) */
+#define NEBULA_HASH_PAYLOAD_BYTES \
+    (NEBULA_SENSOR_ID_BYTES + NEBULA_SHA256_BYTES)
+/* SignedHashPayload: HashPayload || ECDSA-P256(HashPayload) */
+#define NEBULA_SIGNED_HASH_PAYLOAD_BYTES \
+    (NEBULA_HASH_PAYLOAD_BYTES + NEBULA_SIGNATURE_BYTES)
+
+/* TokenPayload: nonce || token || H(data) */
+#define NEBULA_TOKEN_PAYLOAD_BYTES \
+    (NEBULA_DELIVER_NONCE_BYTES + NEBULA_TOKEN_BYTES + NEBULA_SHA256_BYTES)
+#define NEBULA_SIGNED_TOKEN_PAYLOAD_BYTES \
+    (NEBULA_TOKEN_PAYLOAD_BYTES + NEBULA_SIGNATURE_BYTES)
+
+/* Uncompressed P-256 public key without the 0x04 prefix: X || Y */
+#define NEBULA_P256_PUBKEY_BYTES            64
+
+/* SensorKeyList entry served by the appserver: sensor_id || X || Y */
+#define NEBULA_SENSOR_KEY_ENTRY_BYTES \
+    (NEBULA_SENSOR_ID_BYTES + NEBULA_P256_PUBKEY_BYTES)
+
+/* SignedPredeliveryPayload: nonce || H(data) || enc(token) || signature */
+#define NEBULA_SIGNED_PREDELIVERY_MAX_BYTES 256
+
+/*
+ * SeenHashDelta served by the appserver: instance || next || H(data)...
+ * Both header words are little-endian.  instance changes whenever the
+ * appserver's seen-hash log starts over; next is the cursor to ask from.
+ */
+#define NEBULA_SEEN_DELTA_HEADER_BYTES      8
+
+/*
+ * A sensor transfer is a SignedHashPayload immediately followed by the data
+ * it covers, split into NEBULA_CHUNK_SIZE notifications.
+ */
+#define NEBULA_TRANSFER_HEADER_BYTES        NEBULA_SIGNED_HASH_PAYLOAD_BYTES
+
+/* Metadata characteristic: [0] chunks announced, [1] chunks acked, [2] state */
+#define NEBULA_META_CHUNKS                  0
+#define NEBULA_META_ACKED                   1
+#define NEBULA_META_STATE                   2
+#define NEBULA_META_LEN                     3
+
+#define NEBULA_META_IDLE                    0x00
+#define NEBULA_META_SENDING                 0x01
+#define NEBULA_META_DONE                    0x02
+/* Written by the mule: it already has this payload, stop sending. */
+#define NEBULA_META_SKIP                    0x03
+/*
+ * Announced by a sensor sending symbols of nebula_fec.h in blocks; the
+ * chunks announced are source symbols, and [1] holds the transfer's
+ * generation.  The mule's acks count blocks it has decoded in [1] and the
+ * symbols it still needs of the next one in [0].
+ */
+#define NEBULA_META_SENDING_FEC             0x04
+
+#endif
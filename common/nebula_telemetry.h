@@ -0,0 +1,60 @@
+/*
+ * Layout of the sensor's read-only telemetry characteristic, which mules
+ * read after a transfer.  All fields are little-endian and naturally
+ * aligned; new fields go at the end and bump the version.
+ */
+
+#ifndef H_NEBULA_TELEMETRY_
+#define H_NEBULA_TELEMETRY_
+
+#include <stdint.h>
+
+#define NEBULA_TELEMETRY_UUID16             0x8913
+#define NEBULA_TELEMETRY_VERSION            1
+
+/*
+ * Histograms of cycle counts, in log2 buckets: bucket i counts samples of
+ * [2^(shift+i), 2^(shift+i+1)) cycles, with everything below the first
+ * bucket in bucket 0 and everything above the last in the last.
+ */
+#define NEBULA_TELEMETRY_BUCKETS            16
+
+enum nebula_telemetry_hist_id {
+    NEBULA_HIST_HVX,            /* one sd_ble_gatts_hvx() call */
+    NEBULA_HIST_ACK,            /* chunk notified until the mule's ack */
+    NEBULA_HIST_TRANSFER,       /* whole ble_write_long() */
+    NEBULA_HIST_AES,            /* one encrypt_character_array() */
+    NEBULA_HIST_COUNT
+};
+
+struct nebula_telemetry_hist {
+    uint8_t shift;
+    uint8_t reserved[3];
+    uint32_t count;
+    uint32_t max;
+    uint16_t buckets[NEBULA_TELEMETRY_BUCKETS];
+};
+
+struct nebula_telemetry {
+    uint8_t version;
+    uint8_t hist_count;
+    uint8_t buckets;
+    uint8_t reserved;
+    /* Rate of the cycle counter the histograms are in. */
+    uint32_t cycles_hz;
+
+    uint32_t transfers;
+    uint32_t transfers_skipped;
+    uint32_t bytes_sent;
+    uint32_t chunks_sent;
+    /* Notifications re-issued after the SoftDevice refused them. */
+    uint32_t chunks_retransmitted;
+    /* Refusals because the SoftDevice's notification queue was full. */
+    uint32_t hvx_queue_full;
+    /* Bytes of the current transfer not yet notified. */
+    uint32_t backlog_bytes;
+
+    struct nebula_telemetry_hist hist[NEBULA_HIST_COUNT];
+};
+
+#endif
@@ -0,0 +1,154 @@
+/*
+ * Multi-producer ring behind the NTRACE_* trace points.
+ *
+ * A writer takes the next position with one atomic add and fills the slot
+ * seqlock-style: seq goes to zero, the fields are written, then seq is
+ * published.  Writers never wait, so trace points are safe from tasks on
+ * either core and from interrupt handlers.  The drain copies a slot and
+ * keeps it only if seq was the expected value both before and after; a
+ * slot still being filled stops the drain until the next call, and one
+ * overwritten by a lapping writer is counted as lost.
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include "nebula_trace.h"
+
+#if (NEBULA_TRACE_RECORDS & (NEBULA_TRACE_RECORDS - 1)) != 0
+#error "NEBULA_TRACE_RECORDS must be a power of two"
+#endif
+
+/* Records per "#NT" line; keeps lines well under typical console limits. */
+#define NEBULA_TRACE_RECS_PER_LINE  4
+
+struct nebula_trace_slot {
+    _Atomic uint32_t seq;
+    struct nebula_trace_rec rec;
+};
+
+static struct nebula_trace_slot ring[NEBULA_TRACE_RECORDS];
+static _Atomic uint32_t head;
+static uint32_t tail;
+static uint32_t lost;
+static atomic_flag draining = ATOMIC_FLAG_INIT;
+static uint32_t (*trace_now)(void);
+
+void
+nebula_trace_init(uint32_t (*now)(void))
+{
+    trace_now = now;
+}
+
+void
+nebula_trace_emit(uint16_t event, uint16_t a0, uint32_t a1, uint32_t a2)
+{
+    uint32_t pos = atomic_fetch_add_explicit(&head, 1, memory_order_relaxed);
+    struct nebula_trace_slot *slot = &ring[pos & (NEBULA_TRACE_RECORDS - 1)];
+
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    slot->rec.ts = trace_now != NULL ? trace_now() : 0;
+    slot->rec.event = event;
+    slot->rec.a0 = a0;
+    slot->rec.a1 = a1;
+    slot->rec.a2 = a2;
+
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+static void
+nebula_trace_hex(char *out, const void *buf, size_t len)
+{
+    static const char digits[] = "0123456789abcdef";
+    const uint8_t *p = buf;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        out[2 * i] = digits[p[i] >> 4];
+        out[2 * i + 1] = digits[p[i] & 0xf];
+    }
+}
+
+/**
+ * Writes out up to max_records pending records as "#NT <hex>" lines on
+ * stdout.  Only one caller drains at a time; a concurrent call returns 0.
+ *
+ * @return                      The number of records written.
+ */
+int
+nebula_trace_drain(int max_records)
+{
+    char line[4 + NEBULA_TRACE_RECS_PER_LINE * 2 *
+              sizeof(struct nebula_trace_rec) + 1];
+    struct nebula_trace_slot *slot;
+    struct nebula_trace_rec rec;
+    uint32_t end;
+    uint32_t seq;
+    size_t used;
+    int in_line;
+    int written;
+
+    if (atomic_flag_test_and_set_explicit(&draining, memory_order_acquire)) {
+        return 0;
+    }
+
+    end = atomic_load_explicit(&head, memory_order_relaxed);
+    if (end - tail > NEBULA_TRACE_RECORDS) {
+        lost += end - tail - NEBULA_TRACE_RECORDS;
+        tail = end - NEBULA_TRACE_RECORDS;
+    }
+
+    written = 0;
+    in_line = 0;
+    used = 0;
+    while (tail != end && written < max_records) {
+        slot = &ring[tail & (NEBULA_TRACE_RECORDS - 1)];
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq != tail + 1 && (seq == 0 || seq - (tail + 1) > 0x7fffffff)) {
+            /* Still being filled; pick it up next time. */
+            break;
+        }
+        rec = slot->rec;
+        atomic_thread_fence(memory_order_acquire);
+        if (seq != tail + 1 ||
+                atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) {
+            /* Lapped by a writer. */
+            lost++;
+            tail++;
+            continue;
+        }
+        rec.seq = seq;
+        tail++;
+
+        if (in_line == 0) {
+            line[0] = '#';
+            line[1] = 'N';
+            line[2] = 'T';
+            line[3] = ' ';
+            used = 4;
+        }
+        nebula_trace_hex(&line[used], &rec, sizeof rec);
+        used += 2 * sizeof rec;
+        written++;
+        if (++in_line == NEBULA_TRACE_RECS_PER_LINE) {
+            line[used] = '\0';
+            puts(line);
+            in_line = 0;
+        }
+    }
+    if (in_line > 0) {
+        line[used] = '\0';
+        puts(line);
+    }
+
+    atomic_flag_clear_explicit(&draining, memory_order_release);
+    return written;
+}
+
+/** Records overwritten before they could be drained. */
+uint32_t
+nebula_trace_lost(void)
+{
+    return lost;
+}
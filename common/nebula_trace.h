@@ -0,0 +1,139 @@
+/*
+ * Binary deferred trace shared by the sensor and mule firmware.
+ *
+ * A trace point stores a fixed-size record (event, timestamp, three
+ * arguments) into a RAM ring and returns; nothing is formatted on the data
+ * path.  nebula_trace_drain() later writes the records out as "#NT" hex
+ * lines from wherever the firmware has time to spare, and
+ * host/trace_decode.py turns a captured console log back into text using
+ * the event table below.  The ring overwrites its oldest records when the
+ * drain falls behind; the decoder reports the gap from the sequence numbers.
+ *
+ * Trace points below NEBULA_TRACE_LEVEL compile away entirely.
+ */
+
+#ifndef H_NEBULA_TRACE_
+#define H_NEBULA_TRACE_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NEBULA_TRACE_LEVEL_NONE     0
+#define NEBULA_TRACE_LEVEL_ERROR    1
+#define NEBULA_TRACE_LEVEL_WARN     2
+#define NEBULA_TRACE_LEVEL_INFO     3
+#define NEBULA_TRACE_LEVEL_DEBUG    4
+
+#ifndef NEBULA_TRACE_LEVEL
+#define NEBULA_TRACE_LEVEL          NEBULA_TRACE_LEVEL_DEBUG
+#endif
+
+/* Records kept; a power of two. */
+#ifndef NEBULA_TRACE_RECORDS
+#define NEBULA_TRACE_RECORDS        512
+#endif
+
+/*
+ * Event table: X(name, format).  The format is applied to a0, a1 and a2 in
+ * order by the decoder, which reads this table from the header, so new
+ * events only need adding here.  Append only; the decoder and a captured
+ * log have to agree on the numbering.
+ */
+#define NEBULA_TRACE_EVENTS(X) \
+    X(NT_MULE_NOTIFY,       "conn=%u attr=%u len=%u") \
+    X(NT_MULE_META,         "conn=%u chunks=%u acked=%u") \
+    X(NT_MULE_CHUNK,        "conn=%u chunk=%u len=%u") \
+    X(NT_MULE_CHUNK_DROP,   "conn=%u chunk=%u cap=%u") \
+    X(NT_MULE_ACK,          "conn=%u acked=%u") \
+    X(NT_MULE_DONE,         "conn=%u bytes=%u") \
+    X(NT_MULE_UNKNOWN_ATTR, "conn=%u attr=%u") \
+    X(NT_MULE_UNKNOWN_LINK, "conn=%u") \
+    X(NT_MULE_SKIP,         "conn=%u") \
+    X(NT_MULE_DUPLICATE,    "conn=%u bytes=%u") \
+    X(NT_MULE_BAD_HASH,     "conn=%u bytes=%u") \
+    X(NT_MULE_RX_DROP,      "conn=%u type=%u") \
+    X(NT_MULE_TX_DROP,      "conn=%u type=%u") \
+    X(NT_MULE_TX_FAIL,      "conn=%u attr=%u rc=%d") \
+    X(NT_MULE_LINK_FREE,    "conn=%u blocks=%u") \
+    X(NT_SENSOR_START,      "bytes=%u chunks=%u") \
+    X(NT_SENSOR_CHUNK,      "chunk=%u len=%u rc=%d") \
+    X(NT_SENSOR_ACK_WAIT,   "sent=%u acked=%u") \
+    X(NT_SENSOR_ACK,        "acked=%u") \
+    X(NT_SENSOR_DONE,       "bytes=%u") \
+    X(NT_SENSOR_SKIPPED,    "bytes=%u") \
+    X(NT_SENSOR_NOT_READY,  "state=%u") \
+    X(NT_SENSOR_BCAST,      "seq=%u live=%u") \
+    X(NT_SENSOR_BCAST_ACK,  "acked=%u live=%u") \
+    X(NT_MULE_PHY_REQ,      "conn=%u phy=%u rssi=%d") \
+    X(NT_MULE_PHY,          "conn=%u phy=%u status=%d") \
+    X(NT_SENSOR_PHY_REQ,    "phy=%u rssi=%d") \
+    X(NT_SENSOR_PHY,        "phy=%u status=%u") \
+    X(NT_MULE_SYMBOL,       "conn=%u block=%u index=%u") \
+    X(NT_MULE_WRITE_DONE,   "conn=%u attr=%u")
+
+#define NEBULA_TRACE_ENUM_(name, fmt)   name,
+enum nebula_trace_event {
+    NEBULA_TRACE_EVENTS(NEBULA_TRACE_ENUM_)
+    NT_EVENT_COUNT
+};
+#undef NEBULA_TRACE_ENUM_
+
+/*
+ * 20 bytes, little-endian on both targets; the hex lines carry it verbatim.
+ * seq is one more than the record's position in the ring's history, and
+ * zero while a writer is filling the slot.
+ */
+struct nebula_trace_rec {
+    uint32_t seq;
+    uint32_t ts;
+    uint16_t event;
+    uint16_t a0;
+    uint32_t a1;
+    uint32_t a2;
+};
+
+/**
+ * @param now                   Timestamp source; the decoder is told its
+ *                                  rate.  Safe to call from any context.
+ */
+void nebula_trace_init(uint32_t (*now)(void));
+void nebula_trace_emit(uint16_t event, uint16_t a0, uint32_t a1, uint32_t a2);
+int nebula_trace_drain(int max_records);
+uint32_t nebula_trace_lost(void);
+
+#if NEBULA_TRACE_LEVEL >= NEBULA_TRACE_LEVEL_ERROR
+#define NTRACE_ERROR(ev, a0, a1, a2) \
+    nebula_trace_emit((ev), (uint16_t)(a0), (uint32_t)(a1), (uint32_t)(a2))
+#else
+#define NTRACE_ERROR(ev, a0, a1, a2)    ((void)0)
+#endif
+
+#if NEBULA_TRACE_LEVEL >= NEBULA_TRACE_LEVEL_WARN
+#define NTRACE_WARN(ev, a0, a1, a2) \
+    nebula_trace_emit((ev), (uint16_t)(a0), (uint32_t)(a1), (uint32_t)(a2))
+#else
+#define NTRACE_WARN(ev, a0, a1, a2)     ((void)0)
+#endif
+
+#if NEBULA_TRACE_LEVEL >= NEBULA_TRACE_LEVEL_INFO
+#define NTRACE_INFO(ev, a0, a1, a2) \
+    nebula_trace_emit((ev), (uint16_t)(a0), (uint32_t)(a1), (uint32_t)(a2))
+#else
+#define NTRACE_INFO(ev, a0, a1, a2)     ((void)0)
+#endif
+
+#if NEBULA_TRACE_LEVEL >= NEBULA_TRACE_LEVEL_DEBUG
+#define NTRACE_DEBUG(ev, a0, a1, a2) \
+    nebula_trace_emit((ev), (uint16_t)(a0), (uint32_t)(a1), (uint32_t)(a2))
+#else
+#define NTRACE_DEBUG(ev, a0, a1, a2)    ((void)0)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
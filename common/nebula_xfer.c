@@ -0,0 +1,657 @@
+/*
+ * Sensor-to-mule transfer engines.
+ *
+ * Neither side blocks or allocates: the sensor polls its engine until the
+ * transfer settles, and the mule feeds its engine each notification as it
+ * is processed.  A send the radio cannot queue yet is simply retried on
+ * the next poll, since every decision is made afresh from the counters.
+ *
+ * The link layer delivers in order, but the engines still make sense of a
+ * chunk that overtakes its announcement: the mule treats it as the start
+ * of the transfer, and the late announcement does not reset the count.
+ *
+ * A FEC transfer instead waits for the mule to answer its announcement with
+ * the symbols it wants of the first block.  The sensor then sends those and
+ * fec_repair repair symbols on top in one burst, the last one marked.  The
+ * mule acks once it has decoded the block, asking for the next one, or on
+ * the marked symbol with how many more it needs, which the sensor sends
+ * with as many repair symbols on top in another burst.  The mule knows a FEC
+ * transfer is done when it decodes the last block, so no final metadata
+ * follows that could be overtaken by the next announcement.
+ *
+ * That leaves the mule done before the sensor: if the link drops with the
+ * final ack in flight, the sensor sees a failed transfer.  It retries it
+ * with nebula_xfer_tx_retry(), under the same generation, and a mule that
+ * kept its engine across the reconnect (nebula_xfer_rx_reconnect()) answers
+ * the announcement with the transfer acked in full instead of taking it
+ * again.
+ */
+
+#include <string.h>
+#include "nebula_xfer.h"
+
+void
+nebula_xfer_tx_init(struct nebula_xfer_tx *tx, const struct nebula_radio *radio,
+                    uint16_t chunk_size)
+{
+    memset(tx, 0, sizeof *tx);
+    tx->radio = *radio;
+    tx->chunk_size = chunk_size;
+}
+
+/**
+ * Makes the transfers that follow FEC ones, each burst carrying repair
+ * more symbols than the mule asked for.
+ *
+ * @return                      0 on success; NEBULA_XFER_EBUSY if a
+ *                                  transfer is still in progress;
+ *                                  NEBULA_XFER_ESIZE if a chunk cannot hold
+ *                                  a symbol.
+ */
+int
+nebula_xfer_tx_fec(struct nebula_xfer_tx *tx, uint8_t repair)
+{
+    if (tx->status == NEBULA_XFER_TX_SENDING) {
+        return NEBULA_XFER_EBUSY;
+    }
+    if (tx->chunk_size <= NEBULA_FEC_HEADER_BYTES ||
+        tx->chunk_size > NEBULA_FEC_CHUNK_MAX) {
+        return NEBULA_XFER_ESIZE;
+    }
+    nebula_fec_init();
+    tx->fec = 1;
+    tx->fec_repair = repair;
+    return 0;
+}
+
+/* Sets up a transfer without touching the FEC generation. */
+static int
+nebula_xfer_tx_begin(struct nebula_xfer_tx *tx, const uint8_t *buf, size_t len)
+{
+    size_t per = tx->fec ? tx->chunk_size - NEBULA_FEC_HEADER_BYTES
+                         : tx->chunk_size;
+    size_t chunks = (len + per - 1) / per;
+
+    if (tx->status == NEBULA_XFER_TX_SENDING) {
+        return NEBULA_XFER_EBUSY;
+    }
+    if (chunks > NEBULA_XFER_MAX_CHUNKS) {
+        return NEBULA_XFER_ESIZE;
+    }
+
+    tx->buf = buf;
+    tx->len = len;
+    tx->chunks = (uint8_t)chunks;
+    tx->sent = 0;
+    tx->announced = 0;
+    tx->block = 0;
+    tx->budget = 0;
+    tx->waited = 0;
+    tx->acked = 0;
+    tx->skip = 0;
+    tx->need = 0;
+    tx->status = NEBULA_XFER_TX_SENDING;
+    return 0;
+}
+
+/**
+ * Sets up a transfer of buf, which must stay valid until it settles; the
+ * first nebula_xfer_tx_poll() announces it.
+ *
+ * @return                      0 on success; NEBULA_XFER_EBUSY if a
+ *                                  transfer is still in progress;
+ *                                  NEBULA_XFER_ESIZE if it needs more chunks
+ *                                  than the metadata can count.
+ */
+int
+nebula_xfer_tx_start(struct nebula_xfer_tx *tx, const uint8_t *buf, size_t len)
+{
+    int rc;
+
+    rc = nebula_xfer_tx_begin(tx, buf, len);
+    if (rc == 0) {
+        tx->gen = (tx->gen + 1) & NEBULA_FEC_BLOCK_MASK;
+    }
+    return rc;
+}
+
+/**
+ * Starts a failed transfer over from the beginning, under the same FEC
+ * generation, so a mule that had already decoded it can say so.
+ *
+ * @return                      0 on success; NEBULA_XFER_EBUSY if the last
+ *                                  transfer did not fail.
+ */
+int
+nebula_xfer_tx_retry(struct nebula_xfer_tx *tx)
+{
+    if (tx->status != NEBULA_XFER_TX_FAILED) {
+        return NEBULA_XFER_EBUSY;
+    }
+    return nebula_xfer_tx_begin(tx, tx->buf, tx->len);
+}
+
+/**
+ * Takes the metadata the mule wrote back.  Only records it, so it is safe
+ * to call from the stack's event handler while the sensor polls.
+ *
+ * @return                      1 if it acked another chunk or asked to skip,
+ *                                  or for a FEC transfer asked for symbols;
+ *                                  0 otherwise.
+ */
+int
+nebula_xfer_tx_on_meta(struct nebula_xfer_tx *tx, const uint8_t *meta,
+                       uint16_t len)
+{
+    if (len < NEBULA_META_LEN || tx->status != NEBULA_XFER_TX_SENDING) {
+        return 0;
+    }
+    if (meta[NEBULA_META_STATE] == NEBULA_META_SKIP) {
+        tx->skip = 1;
+        return 1;
+    }
+    if (tx->fec) {
+        if (meta[NEBULA_META_ACKED] < tx->acked) {
+            return 0;
+        }
+        tx->acked = meta[NEBULA_META_ACKED];
+        tx->need = meta[NEBULA_META_CHUNKS];
+        return 1;
+    }
+    if (meta[NEBULA_META_ACKED] > tx->acked) {
+        tx->acked = meta[NEBULA_META_ACKED];
+        return 1;
+    }
+    return 0;
+}
+
+static int
+nebula_xfer_tx_meta(struct nebula_xfer_tx *tx, uint8_t chunks, uint8_t state)
+{
+    uint8_t meta[NEBULA_META_LEN];
+
+    meta[NEBULA_META_CHUNKS] = chunks;
+    meta[NEBULA_META_ACKED] = state == NEBULA_META_SENDING_FEC ? tx->gen : 0;
+    meta[NEBULA_META_STATE] = state;
+    return tx->radio.send(tx->radio.ctx, NEBULA_CHR_META, meta, sizeof meta);
+}
+
+/* Nothing to send until the mule answers. */
+#define NEBULA_XFER_WAIT    1
+
+/*
+ * Sends the next symbol of a FEC transfer's current block, if the mule has
+ * asked for it.
+ */
+static int
+nebula_xfer_tx_symbol(struct nebula_xfer_tx *tx)
+{
+    uint16_t sym = tx->chunk_size - NEBULA_FEC_HEADER_BYTES;
+    uint8_t blocks = (uint8_t)((tx->chunks + NEBULA_FEC_K - 1) / NEBULA_FEC_K);
+    uint8_t block = tx->acked;
+    uint8_t idx = tx->sent;
+    unsigned budget;
+    size_t at, block_len, n;
+    uint8_t k;
+    int rc;
+
+    if (block >= blocks) {
+        tx->status = NEBULA_XFER_TX_DONE;
+        return 0;
+    }
+    if (block != tx->block) {
+        tx->block = block;
+        tx->sent = 0;
+        tx->budget = 0;
+        idx = 0;
+    }
+
+    if (idx == tx->budget) {
+        if (tx->need == 0) {
+            if (++tx->waited < NEBULA_XFER_FEC_PATIENCE) {
+                return NEBULA_XFER_WAIT;
+            }
+            tx->waited = 0;
+            if (block == 0 && tx->budget == 0) {
+                /* Never asked for anything; the announcement went astray. */
+                tx->announced = 0;
+                return 0;
+            }
+            tx->need = 1;
+        }
+        if (idx > NEBULA_FEC_INDEX_MAX) {
+            /* Out of repair symbols; something is badly wrong. */
+            return NEBULA_XFER_ESIZE;
+        }
+        budget = idx + tx->need + tx->fec_repair;
+        tx->budget = budget > NEBULA_FEC_INDEX_MAX + 1 ? NEBULA_FEC_INDEX_MAX + 1
+                                                       : budget;
+        tx->need = 0;
+        tx->waited = 0;
+    }
+
+    k = tx->chunks - block * NEBULA_FEC_K < NEBULA_FEC_K
+            ? (uint8_t)(tx->chunks - block * NEBULA_FEC_K)
+            : NEBULA_FEC_K;
+    at = (size_t)block * NEBULA_FEC_K * sym;
+    block_len = tx->len - at < (size_t)k * sym ? tx->len - at
+                                               : (size_t)k * sym;
+
+    tx->symbol[0] = (uint8_t)(tx->gen << NEBULA_FEC_GEN_SHIFT) | block;
+    tx->symbol[1] = idx | (idx + 1 == tx->budget ? NEBULA_FEC_END : 0);
+    tx->symbol[2] = (uint8_t)tx->len;
+    tx->symbol[3] = (uint8_t)(tx->len >> 8);
+    if (idx < k) {
+        n = block_len - (size_t)idx * sym < sym ? block_len - (size_t)idx * sym
+                                                : sym;
+        memcpy(&tx->symbol[NEBULA_FEC_HEADER_BYTES],
+               &tx->buf[at + (size_t)idx * sym], n);
+    } else {
+        n = sym;
+        nebula_fec_repair(&tx->symbol[NEBULA_FEC_HEADER_BYTES], &tx->buf[at],
+                          block_len, sym, k, idx - k);
+    }
+
+    rc = tx->radio.send(tx->radio.ctx, NEBULA_CHR_DATA, tx->symbol,
+                        (uint16_t)(NEBULA_FEC_HEADER_BYTES + n));
+    if (rc == 0) {
+        tx->sent++;
+    }
+    return rc;
+}
+
+/**
+ * Sends whatever the transfer is ready for: the announcement, the next chunk
+ * once the previous one is acked, or the final metadata.  Call until it
+ * returns something other than NEBULA_XFER_TX_SENDING.
+ *
+ * @return                      The transfer's nebula_xfer_tx_status.
+ */
+int
+nebula_xfer_tx_poll(struct nebula_xfer_tx *tx)
+{
+    size_t offset;
+    size_t n;
+    int rc;
+
+    while (tx->status == NEBULA_XFER_TX_SENDING) {
+        if (tx->skip) {
+            rc = nebula_xfer_tx_meta(tx, 0, NEBULA_META_IDLE);
+            if (rc == 0) {
+                tx->status = NEBULA_XFER_TX_SKIPPED;
+            }
+        } else if (!tx->announced) {
+            rc = nebula_xfer_tx_meta(tx, tx->chunks,
+                                     tx->fec ? NEBULA_META_SENDING_FEC
+                                             : NEBULA_META_SENDING);
+            if (rc == 0) {
+                tx->announced = 1;
+            }
+        } else if (tx->fec) {
+            rc = nebula_xfer_tx_symbol(tx);
+            if (rc == NEBULA_XFER_WAIT) {
+                break;
+            }
+        } else if (tx->sent < tx->chunks) {
+            if (tx->acked < tx->sent) {
+                break;
+            }
+            offset = (size_t)tx->sent * tx->chunk_size;
+            n = tx->len - offset < tx->chunk_size ? tx->len - offset
+                                                  : tx->chunk_size;
+            rc = tx->radio.send(tx->radio.ctx, NEBULA_CHR_DATA,
+                                &tx->buf[offset], (uint16_t)n);
+            if (rc == 0) {
+                tx->sent++;
+            }
+        } else {
+            if (tx->acked < tx->chunks) {
+                break;
+            }
+            rc = nebula_xfer_tx_meta(tx, tx->chunks, NEBULA_META_DONE);
+            if (rc == 0) {
+                tx->status = NEBULA_XFER_TX_DONE;
+            }
+        }
+
+        if (rc == NEBULA_XFER_EAGAIN) {
+            break;
+        }
+        if (rc != 0) {
+            tx->status = NEBULA_XFER_TX_FAILED;
+        }
+    }
+    return tx->status;
+}
+
+/**
+ * Abandons the transfer in progress, e.g. on disconnect; the mule starts
+ * over on its next connection.
+ */
+void
+nebula_xfer_tx_abort(struct nebula_xfer_tx *tx)
+{
+    if (tx->status == NEBULA_XFER_TX_SENDING) {
+        tx->status = NEBULA_XFER_TX_FAILED;
+    }
+}
+
+void
+nebula_xfer_rx_init(struct nebula_xfer_rx *rx, const struct nebula_radio *radio,
+                    uint16_t chunk_size)
+{
+    memset(rx, 0, sizeof *rx);
+    rx->radio = *radio;
+    rx->chunk_size = chunk_size;
+    rx->fec_done_gen = NEBULA_XFER_RX_NO_GEN;
+    nebula_fec_init();
+}
+
+/**
+ * Readies the engine for a new connection to the same sensor, forgetting
+ * the transfer in progress but not the last FEC transfer decoded.  A mule
+ * that cannot tell sensors apart across connections calls
+ * nebula_xfer_rx_init() instead.
+ */
+void
+nebula_xfer_rx_reconnect(struct nebula_xfer_rx *rx,
+                         const struct nebula_radio *radio)
+{
+    uint8_t *store = rx->fec_store;
+    size_t store_cap = rx->fec_store_cap;
+    uint8_t done_gen = rx->fec_done_gen;
+    uint8_t done_chunks = rx->fec_done_chunks;
+
+    nebula_xfer_rx_init(rx, radio, rx->chunk_size);
+    nebula_xfer_rx_fec_store(rx, store, store_cap);
+    rx->fec_done_gen = done_gen;
+    rx->fec_done_chunks = done_chunks;
+}
+
+static int
+nebula_xfer_rx_active(const struct nebula_xfer_rx *rx)
+{
+    return rx->meta[NEBULA_META_STATE] == NEBULA_META_SENDING ||
+           rx->meta[NEBULA_META_STATE] == NEBULA_META_SKIP;
+}
+
+/**
+ * Takes a metadata notification from the sensor.
+ *
+ * @return                      The nebula_xfer_rx_event it amounts to.
+ */
+int
+nebula_xfer_rx_on_meta(struct nebula_xfer_rx *rx, const uint8_t *meta,
+                       uint16_t len)
+{
+    if (len < NEBULA_META_LEN) {
+        return NEBULA_XFER_RX_NONE;
+    }
+
+    switch (meta[NEBULA_META_STATE]) {
+    case NEBULA_META_SENDING:
+        rx->meta[NEBULA_META_CHUNKS] = meta[NEBULA_META_CHUNKS];
+        if (nebula_xfer_rx_active(rx) && !rx->fec) {
+            /* Its first chunk got here first. */
+            return NEBULA_XFER_RX_NONE;
+        }
+        rx->meta[NEBULA_META_ACKED] = 0;
+        rx->meta[NEBULA_META_STATE] = NEBULA_META_SENDING;
+        rx->fec = 0;
+        return NEBULA_XFER_RX_START;
+
+    case NEBULA_META_SENDING_FEC:
+        /* Symbols wait for the ack, so this always comes first. */
+        rx->meta[NEBULA_META_CHUNKS] = meta[NEBULA_META_CHUNKS];
+        rx->meta[NEBULA_META_ACKED] = 0;
+        rx->meta[NEBULA_META_STATE] = NEBULA_META_SENDING;
+        rx->fec = 1;
+        rx->fec_gen = meta[NEBULA_META_ACKED] & NEBULA_FEC_BLOCK_MASK;
+        rx->fec_len = 0;
+        rx->fec_present = 0;
+        rx->fec_repairs = 0;
+        rx->ack_due = 1;
+        if (rx->fec_gen == rx->fec_done_gen &&
+            meta[NEBULA_META_CHUNKS] == rx->fec_done_chunks) {
+            /* A retry of the transfer just decoded, whose final ack was
+             * lost: ack every block again. */
+            rx->meta[NEBULA_META_ACKED] =
+                (uint8_t)((rx->fec_done_chunks + NEBULA_FEC_K - 1) /
+                          NEBULA_FEC_K);
+            rx->meta[NEBULA_META_STATE] = NEBULA_META_DONE;
+            return NEBULA_XFER_RX_REPEAT;
+        }
+        return NEBULA_XFER_RX_START;
+
+    case NEBULA_META_DONE:
+        if (rx->fec) {
+            return NEBULA_XFER_RX_NONE;
+        }
+        rx->meta[NEBULA_META_CHUNKS] = meta[NEBULA_META_CHUNKS];
+        rx->meta[NEBULA_META_STATE] = NEBULA_META_DONE;
+        return NEBULA_XFER_RX_DONE;
+
+    case NEBULA_META_IDLE:
+        memset(rx->meta, 0, sizeof rx->meta);
+        rx->fec = 0;
+        return NEBULA_XFER_RX_IDLE;
+
+    default:
+        return NEBULA_XFER_RX_NONE;
+    }
+}
+
+/**
+ * Counts a data notification from the sensor.  Ack it with
+ * nebula_xfer_rx_ack() once it has been dealt with.
+ *
+ * @return                      Where the chunk goes in the transfer.
+ */
+size_t
+nebula_xfer_rx_on_chunk(struct nebula_xfer_rx *rx)
+{
+    size_t offset;
+
+    if (!nebula_xfer_rx_active(rx)) {
+        /* Overtook its announcement; the size is not known yet. */
+        rx->meta[NEBULA_META_CHUNKS] = 0;
+        rx->meta[NEBULA_META_ACKED] = 0;
+        rx->meta[NEBULA_META_STATE] = NEBULA_META_SENDING;
+    }
+
+    offset = (size_t)rx->meta[NEBULA_META_ACKED] * rx->chunk_size;
+    if (rx->meta[NEBULA_META_ACKED] < NEBULA_XFER_MAX_CHUNKS) {
+        rx->meta[NEBULA_META_ACKED]++;
+    }
+    return offset;
+}
+
+/**
+ * Lends a FEC transfer room for the repair symbols of a block,
+ * nebula_xfer_rx_fec_store_len() bytes; without it a block takes every
+ * source symbol.
+ */
+void
+nebula_xfer_rx_fec_store(struct nebula_xfer_rx *rx, uint8_t *store,
+                         size_t cap)
+{
+    rx->fec_store = store;
+    rx->fec_store_cap = cap;
+    rx->fec_repairs = 0;
+}
+
+static uint8_t
+nebula_xfer_rx_fec_k(const struct nebula_xfer_rx *rx)
+{
+    unsigned left = rx->meta[NEBULA_META_CHUNKS] -
+                    rx->meta[NEBULA_META_ACKED] * NEBULA_FEC_K;
+
+    return left < NEBULA_FEC_K ? (uint8_t)left : NEBULA_FEC_K;
+}
+
+/* Symbols the current block is still short of. */
+static uint8_t
+nebula_xfer_rx_fec_need(const struct nebula_xfer_rx *rx)
+{
+    uint8_t have = rx->fec_repairs;
+    uint32_t present;
+    uint8_t k;
+
+    if ((unsigned)rx->meta[NEBULA_META_ACKED] * NEBULA_FEC_K >=
+        rx->meta[NEBULA_META_CHUNKS]) {
+        return 0;
+    }
+    k = nebula_xfer_rx_fec_k(rx);
+    for (present = rx->fec_present; present != 0; present &= present - 1) {
+        have++;
+    }
+    return have < k ? k - have : 0;
+}
+
+/* Bytes of the payload decoded in order. */
+static size_t
+nebula_xfer_rx_fec_ready(const struct nebula_xfer_rx *rx)
+{
+    size_t n = (size_t)rx->meta[NEBULA_META_ACKED] * NEBULA_FEC_K *
+               (rx->chunk_size - NEBULA_FEC_HEADER_BYTES);
+
+    return n < rx->fec_len ? n : rx->fec_len;
+}
+
+/**
+ * Takes a data notification of a FEC transfer: puts a source symbol in place
+ * in buf, keeps a repair symbol, and decodes the block once it has enough.
+ * Ack with nebula_xfer_rx_ack() once it has been dealt with.
+ *
+ * @param ready                 Set to the bytes of the payload whole at the
+ *                                  start of buf.
+ *
+ * @return                      NEBULA_XFER_RX_DONE once the last block is
+ *                                  decoded, NEBULA_XFER_RX_NONE otherwise;
+ *                                  -1 if the symbol is malformed or the
+ *                                  payload would not fit in cap bytes.
+ */
+int
+nebula_xfer_rx_on_symbol(struct nebula_xfer_rx *rx, const uint8_t *data,
+                         uint16_t len, uint8_t *buf, size_t cap,
+                         size_t *ready)
+{
+    uint16_t sym = rx->chunk_size - NEBULA_FEC_HEADER_BYTES;
+    uint8_t chunks = rx->meta[NEBULA_META_CHUNKS];
+    uint8_t block, idx, k, j, i;
+    size_t total, at, block_len, n;
+
+    *ready = nebula_xfer_rx_fec_ready(rx);
+    if (len < NEBULA_FEC_HEADER_BYTES) {
+        return -1;
+    }
+    if (rx->meta[NEBULA_META_STATE] != NEBULA_META_SENDING ||
+        data[0] >> NEBULA_FEC_GEN_SHIFT != rx->fec_gen) {
+        /* Left over from a transfer already decoded or skipped. */
+        return NEBULA_XFER_RX_NONE;
+    }
+
+    total = data[2] | (size_t)data[3] << 8;
+    if (chunks == 0 || total > (size_t)chunks * sym ||
+        total <= (size_t)(chunks - 1) * sym || total > cap ||
+        (rx->fec_len != 0 && total != rx->fec_len)) {
+        return -1;
+    }
+    rx->fec_len = (uint16_t)total;
+
+    block = data[0] & NEBULA_FEC_BLOCK_MASK;
+    idx = data[1] & NEBULA_FEC_INDEX_MAX;
+    if (block != rx->meta[NEBULA_META_ACKED]) {
+        /* Left over from a block already decoded. */
+        return NEBULA_XFER_RX_NONE;
+    }
+    k = nebula_xfer_rx_fec_k(rx);
+    at = (size_t)block * NEBULA_FEC_K * sym;
+    block_len = total - at < (size_t)k * sym ? total - at : (size_t)k * sym;
+    len -= NEBULA_FEC_HEADER_BYTES;
+
+    if (idx < k) {
+        n = block_len - (size_t)idx * sym < sym ? block_len - (size_t)idx * sym
+                                                : sym;
+        if (len < n) {
+            return -1;
+        }
+        if (!(rx->fec_present & (1u << idx))) {
+            memcpy(&buf[at + (size_t)idx * sym], &data[NEBULA_FEC_HEADER_BYTES],
+                   n);
+            rx->fec_present |= 1u << idx;
+        }
+    } else {
+        if (len < sym) {
+            return -1;
+        }
+        j = idx - k;
+        for (i = 0; i < rx->fec_repairs && rx->fec_repair_idx[i] != j; i++) {
+        }
+        if (i == rx->fec_repairs && rx->fec_repairs < k &&
+            (size_t)(rx->fec_repairs + 1) * sym <= rx->fec_store_cap) {
+            memcpy(&rx->fec_store[(size_t)rx->fec_repairs * sym],
+                   &data[NEBULA_FEC_HEADER_BYTES], sym);
+            rx->fec_repair_idx[rx->fec_repairs++] = j;
+        }
+    }
+
+    if (nebula_xfer_rx_fec_need(rx) == 0 &&
+        nebula_fec_decode(&buf[at], block_len, sym, k, rx->fec_present,
+                          rx->fec_store, rx->fec_repair_idx,
+                          rx->fec_repairs) == 0) {
+        rx->meta[NEBULA_META_ACKED]++;
+        rx->fec_present = 0;
+        rx->fec_repairs = 0;
+        rx->ack_due = 1;
+        *ready = nebula_xfer_rx_fec_ready(rx);
+        if (*ready == total) {
+            rx->meta[NEBULA_META_STATE] = NEBULA_META_DONE;
+            rx->fec_done_gen = rx->fec_gen;
+            rx->fec_done_chunks = chunks;
+            return NEBULA_XFER_RX_DONE;
+        }
+    } else if (data[1] & NEBULA_FEC_END) {
+        rx->ack_due = 1;
+    }
+    return NEBULA_XFER_RX_NONE;
+}
+
+/**
+ * Writes the metadata back to the sensor, acking every chunk counted so far
+ * and, after nebula_xfer_rx_skip(), telling it to stop.  For a FEC transfer
+ * the ack carries the symbols still needed in place of the chunk count, and
+ * goes out only when the sensor is waiting on one.
+ *
+ * @return                      The radio's result.
+ */
+int
+nebula_xfer_rx_ack(struct nebula_xfer_rx *rx)
+{
+    uint8_t ack[NEBULA_META_LEN];
+    int rc;
+
+    if (!rx->fec) {
+        return rx->radio.send(rx->radio.ctx, NEBULA_CHR_META, rx->meta,
+                              sizeof rx->meta);
+    }
+    if (!rx->ack_due) {
+        return 0;
+    }
+    ack[NEBULA_META_CHUNKS] = nebula_xfer_rx_fec_need(rx);
+    ack[NEBULA_META_ACKED] = rx->meta[NEBULA_META_ACKED];
+    ack[NEBULA_META_STATE] = rx->meta[NEBULA_META_STATE];
+    rc = rx->radio.send(rx->radio.ctx, NEBULA_CHR_META, ack, sizeof ack);
+    if (rc == 0) {
+        rx->ack_due = 0;
+    }
+    return rc;
+}
+
+/** Makes acks for the rest of this transfer ask the sensor to stop. */
+void
+nebula_xfer_rx_skip(struct nebula_xfer_rx *rx)
+{
+    rx->meta[NEBULA_META_STATE] = NEBULA_META_SKIP;
+    rx->ack_due = 1;
+}
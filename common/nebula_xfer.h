@@ -0,0 +1,193 @@
+/*
+ * Sensor-to-mule transfer protocol, independent of any BLE stack.
+ *
+ * The sensor notifies a transfer's metadata, then its chunks one at a time,
+ * each after the mule has acked the previous one by writing the metadata
+ * back with the acked count raised; a final metadata notification marks it
+ * done.  A sensor can instead send FEC transfers (nebula_fec.h), streaming a
+ * block of symbols per ack in place of a chunk.  The engines here only decide what goes on the air and where
+ * received chunks belong.  The firmware binds struct nebula_radio to its
+ * stack; host/ble_emu.c binds it to an emulated link.
+ */
+
+#ifndef H_NEBULA_XFER_
+#define H_NEBULA_XFER_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "nebula_fec.h"
+#include "nebula_proto.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Chunk counts travel in one metadata byte. */
+#define NEBULA_XFER_MAX_CHUNKS      255
+
+#define NEBULA_XFER_EAGAIN          (-1)    /* radio queue full; retry */
+#define NEBULA_XFER_ELINK           (-2)    /* not connected */
+#define NEBULA_XFER_EBUSY           (-3)    /* a transfer is in progress */
+#define NEBULA_XFER_ESIZE           (-4)    /* too many chunks */
+
+/*
+ * Polls a FEC transfer waits for the mule's answer to a burst before
+ * sending one more symbol to ask again, in case the burst's last symbol
+ * never made it.
+ */
+#ifndef NEBULA_XFER_FEC_PATIENCE
+#define NEBULA_XFER_FEC_PATIENCE    200
+#endif
+
+enum nebula_chr {
+    NEBULA_CHR_DATA,
+    NEBULA_CHR_META,
+};
+
+/*
+ * Sends one value on a characteristic of the peer: a notification from the
+ * sensor, a write from the mule.
+ *
+ * @return                      0 once queued; NEBULA_XFER_EAGAIN if the
+ *                                  stack has no room right now; another
+ *                                  negative value if the link is gone.
+ */
+typedef int nebula_radio_send_fn(void *ctx, enum nebula_chr chr,
+                                 const uint8_t *data, uint16_t len);
+
+struct nebula_radio {
+    nebula_radio_send_fn *send;
+    void *ctx;
+};
+
+/*** Sensor side. */
+
+enum nebula_xfer_tx_status {
+    NEBULA_XFER_TX_IDLE,
+    NEBULA_XFER_TX_SENDING,
+    NEBULA_XFER_TX_DONE,
+    NEBULA_XFER_TX_SKIPPED,     /* the mule already had the payload */
+    NEBULA_XFER_TX_FAILED,      /* the link went away */
+};
+
+struct nebula_xfer_tx {
+    struct nebula_radio radio;
+    uint16_t chunk_size;
+
+    const uint8_t *buf;
+    size_t len;
+    uint8_t chunks;
+    uint8_t sent;
+    uint8_t announced;
+    uint8_t status;
+
+    /*
+     * FEC transfers: acked counts blocks, sent the symbols of the current
+     * one, and its bursts so far run to budget symbols.
+     */
+    uint8_t fec;
+    uint8_t fec_repair;
+    uint8_t gen;
+    uint8_t block;
+    uint8_t budget;
+    uint16_t waited;
+    uint8_t symbol[NEBULA_FEC_CHUNK_MAX];
+
+    /* Written from the stack's event handler by nebula_xfer_tx_on_meta(). */
+    volatile uint8_t acked;
+    volatile uint8_t skip;
+    volatile uint8_t need;
+};
+
+void nebula_xfer_tx_init(struct nebula_xfer_tx *tx,
+                         const struct nebula_radio *radio,
+                         uint16_t chunk_size);
+int nebula_xfer_tx_fec(struct nebula_xfer_tx *tx, uint8_t repair);
+int nebula_xfer_tx_start(struct nebula_xfer_tx *tx, const uint8_t *buf,
+                         size_t len);
+int nebula_xfer_tx_retry(struct nebula_xfer_tx *tx);
+int nebula_xfer_tx_on_meta(struct nebula_xfer_tx *tx, const uint8_t *meta,
+                           uint16_t len);
+int nebula_xfer_tx_poll(struct nebula_xfer_tx *tx);
+void nebula_xfer_tx_abort(struct nebula_xfer_tx *tx);
+
+/*** Mule side. */
+
+enum nebula_xfer_rx_event {
+    NEBULA_XFER_RX_NONE,
+    NEBULA_XFER_RX_START,       /* a new transfer was announced */
+    NEBULA_XFER_RX_DONE,        /* the sensor has sent everything, or a
+                                   FEC transfer is decoded */
+    NEBULA_XFER_RX_IDLE,        /* the sensor gave up on a skipped transfer */
+    NEBULA_XFER_RX_REPEAT,      /* the sensor retried a FEC transfer already
+                                   decoded; ack it, but it is not new */
+};
+
+struct nebula_xfer_rx {
+    struct nebula_radio radio;
+    uint16_t chunk_size;
+    /* What the mule writes back: [0] chunks, [1] acked, [2] state. */
+    uint8_t meta[NEBULA_META_LEN];
+
+    /*
+     * FEC transfers: acked counts blocks decoded, and the current one has
+     * the source symbols in fec_present and fec_repairs repair symbols in
+     * fec_store.  Acks go out only when ack_due.
+     */
+    uint8_t fec;
+    uint8_t fec_gen;
+    uint8_t fec_repairs;
+    uint8_t ack_due;
+    uint16_t fec_len;
+    uint32_t fec_present;
+    uint8_t fec_repair_idx[NEBULA_FEC_K];
+    uint8_t *fec_store;
+    size_t fec_store_cap;
+
+    /*
+     * The generation and chunk count of the last FEC transfer decoded,
+     * fec_done_gen NEBULA_XFER_RX_NO_GEN if none; kept by
+     * nebula_xfer_rx_reconnect() so a retry after a lost final ack is
+     * recognised.
+     */
+    uint8_t fec_done_gen;
+    uint8_t fec_done_chunks;
+};
+
+#define NEBULA_XFER_RX_NO_GEN       0xff
+
+void nebula_xfer_rx_init(struct nebula_xfer_rx *rx,
+                         const struct nebula_radio *radio,
+                         uint16_t chunk_size);
+void nebula_xfer_rx_reconnect(struct nebula_xfer_rx *rx,
+                              const struct nebula_radio *radio);
+int nebula_xfer_rx_on_meta(struct nebula_xfer_rx *rx, const uint8_t *meta,
+                           uint16_t len);
+size_t nebula_xfer_rx_on_chunk(struct nebula_xfer_rx *rx);
+void nebula_xfer_rx_fec_store(struct nebula_xfer_rx *rx, uint8_t *store,
+                              size_t cap);
+int nebula_xfer_rx_on_symbol(struct nebula_xfer_rx *rx, const uint8_t *data,
+                             uint16_t len, uint8_t *buf, size_t cap,
+                             size_t *ready);
+int nebula_xfer_rx_ack(struct nebula_xfer_rx *rx);
+void nebula_xfer_rx_skip(struct nebula_xfer_rx *rx);
+
+/* Bytes the announced transfer can take up, for sizing a buffer. */
+static inline size_t
+nebula_xfer_rx_expected(const struct nebula_xfer_rx *rx)
+{
+    return (size_t)rx->meta[NEBULA_META_CHUNKS] * rx->chunk_size;
+}
+
+/* Room nebula_xfer_rx_fec_store() needs for a block's repair symbols. */
+static inline size_t
+nebula_xfer_rx_fec_store_len(const struct nebula_xfer_rx *rx)
+{
+    return (size_t)NEBULA_FEC_K * (rx->chunk_size - NEBULA_FEC_HEADER_BYTES);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,522 @@
+/*
+ * Emulated BLE connection; see ble_emu.h.
+ */
+
+#include <math.h>
+#include <string.h>
+#include "ble_emu.h"
+
+#define BLE_EMU_T_IFS_US        150
+/* L2CAP header and ATT opcode and handle in front of every value. */
+#define BLE_EMU_PDU_OVERHEAD    7
+/* Connection events from a PHY update request to its instant. */
+#define BLE_EMU_PHY_INSTANT     3
+/* Path loss at 1 m at 2.4 GHz, dB. */
+#define BLE_EMU_LOSS_1M         40.0
+
+/* Sensitivity, dBm, of the nRF52840 and ESP32 parts in use, by PHY. */
+static const double ble_emu_sensitivity[] = {
+    [NEBULA_PHY_1M] = -95.0,
+    [NEBULA_PHY_2M] = -92.0,
+    [NEBULA_PHY_CODED] = -103.0,
+};
+
+void
+ble_emu_config_default(struct ble_emu_config *cfg)
+{
+    memset(cfg, 0, sizeof *cfg);
+    cfg->mtu = 247;
+    cfg->ll_octets = 251;
+    cfg->phy = NEBULA_PHY_1M;
+    cfg->queue_depth = 1;
+    /* The sensor asks for 500-1000 ms (sensor/app/main.c ble_config). */
+    cfg->interval_us = 500000;
+    cfg->reconnect_us = 1000000;
+    cfg->seed = 1;
+    cfg->closest_m = 10;
+    cfg->pass_m = 400;
+    cfg->path_loss_exp = 2.7;
+    cfg->rssi_noise_db = 3;
+    /* NimBLE's default, which the mule connects with. */
+    cfg->supervision_us = 2560000;
+}
+
+/* xorshift64*; plenty for loss and ordering decisions. */
+uint32_t
+ble_emu_random(struct ble_emu *emu)
+{
+    emu->rng ^= emu->rng >> 12;
+    emu->rng ^= emu->rng << 25;
+    emu->rng ^= emu->rng >> 27;
+    return (uint32_t)((emu->rng * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+static int
+ble_emu_chance(struct ble_emu *emu, double p)
+{
+    return p > 0 && ble_emu_random(emu) < p * 4294967296.0;
+}
+
+/**
+ * Mean received signal at the current point of the pass, in dBm; fixed at
+ * closest_m when the link is not a pass.
+ */
+double
+ble_emu_rssi(const struct ble_emu *emu)
+{
+    const struct ble_emu_config *cfg = &emu->cfg;
+    double x = 0;
+    double d;
+
+    if (cfg->speed_mps > 0) {
+        x = cfg->speed_mps * (emu->now / 1e6) - cfg->pass_m;
+    }
+    d = sqrt(x * x + cfg->closest_m * cfg->closest_m);
+    if (d < 1) {
+        d = 1;
+    }
+    return cfg->tx_dbm - BLE_EMU_LOSS_1M - 10 * cfg->path_loss_exp * log10(d);
+}
+
+/** An RSSI reading as a controller would report it, with fading noise. */
+int8_t
+ble_emu_rssi_sample(struct ble_emu *emu)
+{
+    double noise = 0;
+    int i;
+
+    /* Roughly normal, with rssi_noise_db standard deviation. */
+    for (i = 0; i < 12; i++) {
+        noise += ble_emu_random(emu) / 4294967296.0;
+    }
+    return (int8_t)lrint(ble_emu_rssi(emu) +
+                         (noise - 6) * emu->cfg.rssi_noise_db);
+}
+
+/** Simulated time the pass takes end to end; 0 if the link is not a pass. */
+uint64_t
+ble_emu_pass_us(const struct ble_emu *emu)
+{
+    if (emu->cfg.speed_mps <= 0) {
+        return 0;
+    }
+    return (uint64_t)(2 * emu->cfg.pass_m / emu->cfg.speed_mps * 1e6);
+}
+
+/*
+ * Chance of losing a packet on phy at the current signal: half at the
+ * sensitivity, falling off within a few dB either side.  Nothing is lost to
+ * range on a fixed link.
+ */
+static double
+ble_emu_range_loss(const struct ble_emu *emu, uint8_t phy)
+{
+    if (emu->cfg.speed_mps <= 0) {
+        return 0;
+    }
+    return 1 / (1 + exp((ble_emu_rssi(emu) - ble_emu_sensitivity[phy]) / 1.5));
+}
+
+static int
+ble_emu_lost(struct ble_emu *emu)
+{
+    if (ble_emu_chance(emu, emu->cfg.loss) ||
+            ble_emu_chance(emu, ble_emu_range_loss(emu, emu->phy))) {
+        emu->stats.ll_lost++;
+        return 1;
+    }
+    emu->heard_us = emu->now;
+    return 0;
+}
+
+static int
+ble_emu_timer_before(const struct ble_emu_timer *a,
+                     const struct ble_emu_timer *b)
+{
+    return a->at < b->at || (a->at == b->at && a->seq < b->seq);
+}
+
+/**
+ * Runs fn(arg) at at_us of simulated time; timers due at the same time run
+ * in the order they were set.
+ *
+ * @return                      0 on success; -1 if the timer queue is full.
+ */
+int
+ble_emu_at(struct ble_emu *emu, uint64_t at_us, ble_emu_timer_fn *fn, void *arg)
+{
+    struct ble_emu_timer t = { at_us, emu->timer_seq++, fn, arg };
+    struct ble_emu_timer tmp;
+    int i;
+
+    if (emu->ntimers == BLE_EMU_TIMERS) {
+        return -1;
+    }
+    i = emu->ntimers++;
+    emu->timers[i] = t;
+    while (i > 0 &&
+           ble_emu_timer_before(&emu->timers[i], &emu->timers[(i - 1) / 2])) {
+        tmp = emu->timers[i];
+        emu->timers[i] = emu->timers[(i - 1) / 2];
+        emu->timers[(i - 1) / 2] = tmp;
+        i = (i - 1) / 2;
+    }
+    return 0;
+}
+
+static struct ble_emu_timer
+ble_emu_pop(struct ble_emu *emu)
+{
+    struct ble_emu_timer top = emu->timers[0];
+    struct ble_emu_timer tmp;
+    int i = 0;
+    int c;
+
+    emu->timers[0] = emu->timers[--emu->ntimers];
+    for (;;) {
+        c = 2 * i + 1;
+        if (c >= emu->ntimers) {
+            break;
+        }
+        if (c + 1 < emu->ntimers &&
+                ble_emu_timer_before(&emu->timers[c + 1], &emu->timers[c])) {
+            c++;
+        }
+        if (!ble_emu_timer_before(&emu->timers[c], &emu->timers[i])) {
+            break;
+        }
+        tmp = emu->timers[i];
+        emu->timers[i] = emu->timers[c];
+        emu->timers[c] = tmp;
+        i = c;
+    }
+    return top;
+}
+
+static int
+ble_emu_send(void *ctx, enum nebula_chr chr, const uint8_t *data, uint16_t len)
+{
+    struct ble_emu_end *end = ctx;
+    struct ble_emu *emu = end->emu;
+    struct ble_emu_pdu *pdu;
+
+    if (!emu->connected) {
+        return NEBULA_XFER_ELINK;
+    }
+    if (len > emu->cfg.mtu - 3 || len > BLE_EMU_MAX_ATT) {
+        return NEBULA_XFER_ESIZE;
+    }
+    if (end->count == emu->cfg.queue_depth) {
+        emu->stats.queue_full++;
+        return NEBULA_XFER_EAGAIN;
+    }
+
+    pdu = &end->queue[(end->head + end->count) % BLE_EMU_QUEUE_MAX];
+    pdu->chr = (uint8_t)chr;
+    pdu->len = len;
+    pdu->done = 0;
+    memcpy(pdu->data, data, len);
+    end->count++;
+    return 0;
+}
+
+void
+ble_emu_radio(struct ble_emu *emu, enum ble_emu_side side,
+              struct nebula_radio *out)
+{
+    out->send = ble_emu_send;
+    out->ctx = &emu->end[side];
+}
+
+/* Air time of one LL packet with the given payload. */
+static uint32_t
+ble_emu_air_us(const struct ble_emu *emu, uint16_t octets)
+{
+    /* preamble, access address, header, payload, CRC */
+    switch (emu->phy) {
+    case NEBULA_PHY_2M:
+        return (2 + 4 + 2 + octets + 3) * 4;
+    case NEBULA_PHY_CODED:
+        /* 80 us preamble, access address to TERM1 at S=8, then 64 us a
+         * byte and TERM2 */
+        return 80 + 296 + (2 + octets + 3) * 64 + 24;
+    default:
+        return (1 + 4 + 2 + octets + 3) * 8;
+    }
+}
+
+static uint16_t
+ble_emu_fragment(const struct ble_emu *emu, const struct ble_emu_end *from)
+{
+    const struct ble_emu_pdu *pdu;
+    uint16_t left;
+
+    if (from->count == 0) {
+        return 0;
+    }
+    pdu = &from->queue[from->head];
+    left = pdu->len + BLE_EMU_PDU_OVERHEAD - pdu->done;
+    return left < emu->cfg.ll_octets ? left : emu->cfg.ll_octets;
+}
+
+static void
+ble_emu_deliver(struct ble_emu_end *to, const struct ble_emu_pdu *pdu)
+{
+    to->handler.receive(to->handler.arg, (enum nebula_chr)pdu->chr,
+                        pdu->data, pdu->len);
+}
+
+/*
+ * A fragment made it across.  Once a PDU is complete it goes to the other
+ * side, unless it is held back to follow the next one.
+ */
+static void
+ble_emu_advance(struct ble_emu *emu, int side, uint16_t octets)
+{
+    struct ble_emu_end *from = &emu->end[side];
+    struct ble_emu_end *to = &emu->end[!side];
+    struct ble_emu_pdu pdu;
+
+    emu->stats.ll_packets++;
+    from->queue[from->head].done += octets;
+    if (from->queue[from->head].done <
+            from->queue[from->head].len + BLE_EMU_PDU_OVERHEAD) {
+        return;
+    }
+
+    pdu = from->queue[from->head];
+    from->head = (from->head + 1) % BLE_EMU_QUEUE_MAX;
+    from->count--;
+    emu->stats.pdus[side]++;
+
+    if (side == BLE_EMU_PERIPHERAL && pdu.chr == NEBULA_CHR_DATA &&
+            ble_emu_chance(emu, emu->cfg.drop)) {
+        emu->stats.dropped++;
+        return;
+    }
+    if (!from->holding && ble_emu_chance(emu, emu->cfg.reorder)) {
+        from->held = pdu;
+        from->holding = 1;
+        emu->stats.reordered++;
+        return;
+    }
+    ble_emu_deliver(to, &pdu);
+    if (from->holding && emu->connected) {
+        from->holding = 0;
+        ble_emu_deliver(to, &from->held);
+    }
+}
+
+static void
+ble_emu_flush_held(struct ble_emu *emu)
+{
+    int side;
+
+    for (side = 0; side < BLE_EMU_SIDES; side++) {
+        if (emu->end[side].holding && emu->connected) {
+            emu->end[side].holding = 0;
+            ble_emu_deliver(&emu->end[!side], &emu->end[side].held);
+        }
+    }
+}
+
+static void ble_emu_event(void *arg);
+
+static void
+ble_emu_reconnect(void *arg)
+{
+    struct ble_emu *emu = arg;
+    int side;
+
+    /* Out of range of the advertising: try again at the next one. */
+    if (ble_emu_chance(emu, ble_emu_range_loss(emu, emu->cfg.adv_phy))) {
+        ble_emu_at(emu, emu->now + emu->cfg.reconnect_us, ble_emu_reconnect,
+                   emu);
+        return;
+    }
+    emu->connected = 1;
+    emu->phy = emu->cfg.phy;
+    emu->phy_instant = 0;
+    emu->heard_us = emu->now;
+    for (side = 0; side < BLE_EMU_SIDES; side++) {
+        emu->end[side].handler.connected(emu->end[side].handler.arg);
+    }
+    ble_emu_at(emu, emu->now + emu->cfg.interval_us, ble_emu_event, emu);
+}
+
+/**
+ * Drops the link now; both sides hear about it and it comes back after
+ * reconnect_us.
+ */
+void
+ble_emu_disconnect(struct ble_emu *emu)
+{
+    int side;
+
+    if (!emu->connected) {
+        return;
+    }
+    emu->connected = 0;
+    emu->stats.disconnects++;
+    for (side = 0; side < BLE_EMU_SIDES; side++) {
+        emu->end[side].count = 0;
+        emu->end[side].holding = 0;
+    }
+    for (side = 0; side < BLE_EMU_SIDES; side++) {
+        emu->end[side].handler.disconnected(emu->end[side].handler.arg);
+    }
+    ble_emu_at(emu, emu->now + emu->cfg.reconnect_us, ble_emu_reconnect, emu);
+}
+
+/**
+ * Starts a PHY update procedure; the link moves to phy a few connection
+ * events later, at the procedure's instant, unless it drops first.  Read
+ * where it is with ble_emu_phy().
+ *
+ * @return                      0 on success; -1 if not connected or another
+ *                                  update is under way.
+ */
+int
+ble_emu_set_phy(struct ble_emu *emu, uint8_t phy)
+{
+    if (!emu->connected || emu->phy_instant > 0 ||
+            phy < NEBULA_PHY_1M || phy > NEBULA_PHY_CODED) {
+        return -1;
+    }
+    emu->next_phy = phy;
+    emu->phy_instant = BLE_EMU_PHY_INSTANT;
+    return 0;
+}
+
+/*
+ * One connection event.  The central opens each exchange and the
+ * peripheral answers; whichever packet is lost ends the event.
+ */
+static void
+ble_emu_event(void *arg)
+{
+    struct ble_emu *emu = arg;
+    uint64_t start = emu->now;
+    uint32_t budget = emu->cfg.event_us != 0 &&
+                      emu->cfg.event_us < emu->cfg.interval_us ?
+                      emu->cfg.event_us : emu->cfg.interval_us;
+    uint32_t elapsed = 0;
+    uint32_t m_us;
+    uint32_t s_us;
+    uint16_t m;
+    uint16_t s;
+
+    if (!emu->connected) {
+        return;
+    }
+    if (ble_emu_chance(emu, emu->cfg.disconnect) ||
+            (emu->cfg.speed_mps > 0 &&
+             emu->now - emu->heard_us >= emu->cfg.supervision_us)) {
+        ble_emu_disconnect(emu);
+        return;
+    }
+    if (emu->phy_instant > 0 && --emu->phy_instant == 0 &&
+            emu->next_phy != emu->phy) {
+        emu->phy = emu->next_phy;
+        emu->stats.phy_updates++;
+    }
+    emu->stats.events++;
+    emu->stats.phy_us[emu->phy] += emu->cfg.interval_us;
+
+    for (;;) {
+        m = ble_emu_fragment(emu, &emu->end[BLE_EMU_CENTRAL]);
+        s = ble_emu_fragment(emu, &emu->end[BLE_EMU_PERIPHERAL]);
+        m_us = ble_emu_air_us(emu, m);
+        s_us = ble_emu_air_us(emu, s);
+        if (elapsed + m_us + s_us + 2 * BLE_EMU_T_IFS_US > budget) {
+            break;
+        }
+
+        emu->now = start + elapsed + m_us;
+        if (ble_emu_lost(emu)) {
+            break;
+        }
+        if (m > 0) {
+            ble_emu_advance(emu, BLE_EMU_CENTRAL, m);
+        }
+
+        emu->now += BLE_EMU_T_IFS_US + s_us;
+        if (!emu->connected) {
+            return;
+        }
+        if (ble_emu_lost(emu)) {
+            break;
+        }
+        if (s > 0) {
+            ble_emu_advance(emu, BLE_EMU_PERIPHERAL, s);
+        }
+        if (!emu->connected) {
+            return;
+        }
+
+        elapsed += m_us + s_us + 2 * BLE_EMU_T_IFS_US;
+        /* Neither side has more data: the event closes. */
+        if (emu->end[BLE_EMU_CENTRAL].count == 0 &&
+                emu->end[BLE_EMU_PERIPHERAL].count == 0) {
+            break;
+        }
+    }
+    ble_emu_flush_held(emu);
+
+    ble_emu_at(emu, start + emu->cfg.interval_us, ble_emu_event, emu);
+}
+
+/**
+ * Sets up the link; it connects at time zero once ble_emu_run() starts.
+ *
+ * @return                      0 on success; -1 if the configuration is
+ *                                  unusable.
+ */
+int
+ble_emu_init(struct ble_emu *emu, const struct ble_emu_config *cfg,
+             const struct ble_emu_handler *central,
+             const struct ble_emu_handler *peripheral)
+{
+    if (cfg->mtu < 23 || cfg->ll_octets < 27 || cfg->ll_octets > 251 ||
+            cfg->queue_depth == 0 || cfg->queue_depth > BLE_EMU_QUEUE_MAX ||
+            cfg->interval_us < 7500 ||
+            cfg->phy < NEBULA_PHY_1M || cfg->phy > NEBULA_PHY_CODED ||
+            cfg->adv_phy > NEBULA_PHY_CODED) {
+        return -1;
+    }
+
+    memset(emu, 0, sizeof *emu);
+    emu->cfg = *cfg;
+    if (emu->cfg.adv_phy == 0) {
+        emu->cfg.adv_phy = cfg->phy;
+    }
+    emu->rng = ((uint64_t)cfg->seed << 32) ^ 0x9e3779b97f4a7c15ULL;
+    emu->end[BLE_EMU_CENTRAL].emu = emu;
+    emu->end[BLE_EMU_CENTRAL].handler = *central;
+    emu->end[BLE_EMU_PERIPHERAL].emu = emu;
+    emu->end[BLE_EMU_PERIPHERAL].handler = *peripheral;
+    return ble_emu_at(emu, 0, ble_emu_reconnect, emu);
+}
+
+/**
+ * Runs timers until done(arg) is true, nothing is left to run, or simulated
+ * time passes limit_us.
+ *
+ * @return                      0 if done(arg) became true; -1 otherwise.
+ */
+int
+ble_emu_run(struct ble_emu *emu, int (*done)(void *arg), void *arg,
+            uint64_t limit_us)
+{
+    struct ble_emu_timer t;
+
+    while (!done(arg)) {
+        if (emu->ntimers == 0 || emu->timers[0].at > limit_us) {
+            return -1;
+        }
+        t = ble_emu_pop(emu);
+        emu->now = t.at;
+        t.fn(t.arg);
+    }
+    return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * In-process emulation of one BLE connection, for running the transfer
+ * engines (common/nebula_xfer.h) on a host in simulated time.
+ *
+ * The central (mule) and peripheral (sensor) each get a struct nebula_radio
+ * whose sends queue ATT PDUs.  Every connection interval the link runs a
+ * connection event: the two sides alternate link layer packets, each PDU
+ * split into ll_octets fragments, until both queues are empty, the event
+ * runs out of time, or a packet is lost, which ends the event and resends
+ * that fragment at the next one.  Writes are modelled without the ATT
+ * response.  Everything, including the endpoints' own work, runs off one
+ * timer queue, so a run is deterministic for a given seed.
+ *
+ * With speed_mps set the link is a drive-by instead of a fixed one: the mule
+ * passes the sensor in a straight line, closest_m away at the midpoint, and
+ * the received signal follows a log-distance path loss.  Each LL packet is
+ * lost with a chance that climbs steeply as the signal nears the current
+ * PHY's sensitivity, the link drops after supervision_us without a packet
+ * through, and it only comes back once an advertisement on adv_phy is heard
+ * again.
+ */
+
+#ifndef H_BLE_EMU_
+#define H_BLE_EMU_
+
+#include <stdint.h>
+#include "nebula_phy.h"
+#include "nebula_xfer.h"
+
+#define BLE_EMU_MAX_ATT         512     /* largest ATT value */
+#define BLE_EMU_QUEUE_MAX       16      /* PDUs either side can queue */
+#define BLE_EMU_TIMERS          64
+
+enum ble_emu_side {
+    BLE_EMU_CENTRAL,
+    BLE_EMU_PERIPHERAL,
+    BLE_EMU_SIDES
+};
+
+struct ble_emu_config {
+    uint16_t mtu;               /* ATT MTU; values carry up to mtu - 3 */
+    uint16_t ll_octets;         /* LL payload: 27, or up to 251 with DLE */
+    uint8_t phy;                /* NEBULA_PHY_1M, _2M or _CODED (S=8) */
+    uint8_t adv_phy;            /* PHY sensors are discovered on; 0: phy */
+    uint8_t queue_depth;        /* PDUs a side's stack buffers, at most
+                                   BLE_EMU_QUEUE_MAX */
+    uint32_t interval_us;       /* connection interval */
+    uint32_t event_us;          /* connection event limit; 0: the interval */
+    double loss;                /* chance a LL packet is lost */
+    double reorder;             /* chance a PDU is delivered after the next */
+    double drop;                /* chance a sensor's data notification is
+                                   lost past the LL, e.g. to a receiving
+                                   stack out of buffers */
+    double disconnect;          /* chance the link drops at an event */
+    uint32_t reconnect_us;      /* advertising and connecting after a drop */
+    uint32_t seed;
+    /* Drive-by pass; 0 speed_mps for a fixed link in range. */
+    double speed_mps;
+    double closest_m;
+    double pass_m;              /* distance covered either side of closest */
+    double tx_dbm;
+    double path_loss_exp;
+    double rssi_noise_db;       /* spread of RSSI samples */
+    uint32_t supervision_us;
+};
+
+struct ble_emu_handler {
+    void (*connected)(void *arg);
+    void (*disconnected)(void *arg);
+    void (*receive)(void *arg, enum nebula_chr chr, const uint8_t *data,
+                    uint16_t len);
+    void *arg;
+};
+
+struct ble_emu_stats {
+    uint32_t events;
+    uint32_t ll_packets;        /* carrying data, including resends */
+    uint32_t ll_lost;
+    uint32_t pdus[BLE_EMU_SIDES];
+    uint32_t queue_full;
+    uint32_t reordered;
+    uint32_t dropped;
+    uint32_t disconnects;
+    uint32_t phy_updates;
+    uint64_t phy_us[NEBULA_PHY_CODED + 1];  /* connected on each PHY */
+};
+
+typedef void ble_emu_timer_fn(void *arg);
+
+struct ble_emu_pdu {
+    uint8_t chr;
+    uint16_t len;
+    uint16_t done;              /* L2CAP bytes through so far */
+    uint8_t data[BLE_EMU_MAX_ATT];
+};
+
+struct ble_emu_end {
+    struct ble_emu *emu;
+    struct ble_emu_handler handler;
+    struct ble_emu_pdu queue[BLE_EMU_QUEUE_MAX];
+    int head;
+    int count;
+    /* A PDU held back to be delivered after the next one. */
+    struct ble_emu_pdu held;
+    int holding;
+};
+
+struct ble_emu_timer {
+    uint64_t at;
+    uint64_t seq;
+    ble_emu_timer_fn *fn;
+    void *arg;
+};
+
+struct ble_emu {
+    struct ble_emu_config cfg;
+    struct ble_emu_end end[BLE_EMU_SIDES];
+    struct ble_emu_timer timers[BLE_EMU_TIMERS];
+    int ntimers;
+    uint64_t timer_seq;
+    uint64_t now;
+    uint64_t rng;
+    int connected;
+    uint8_t phy;
+    uint8_t next_phy;
+    int phy_instant;            /* events until next_phy takes effect */
+    uint64_t heard_us;          /* last LL packet through */
+    struct ble_emu_stats stats;
+};
+
+void ble_emu_config_default(struct ble_emu_config *cfg);
+int ble_emu_init(struct ble_emu *emu, const struct ble_emu_config *cfg,
+                 const struct ble_emu_handler *central,
+                 const struct ble_emu_handler *peripheral);
+void ble_emu_radio(struct ble_emu *emu, enum ble_emu_side side,
+                   struct nebula_radio *out);
+int ble_emu_at(struct ble_emu *emu, uint64_t at_us, ble_emu_timer_fn *fn,
+               void *arg);
+void ble_emu_disconnect(struct ble_emu *emu);
+int ble_emu_run(struct ble_emu *emu, int (*done)(void *arg), void *arg,
+                uint64_t limit_us);
+uint32_t ble_emu_random(struct ble_emu *emu);
+int ble_emu_set_phy(struct ble_emu *emu, uint8_t phy);
+double ble_emu_rssi(const struct ble_emu *emu);
+int8_t ble_emu_rssi_sample(struct ble_emu *emu);
+uint64_t ble_emu_pass_us(const struct ble_emu *emu);
+
+static inline uint64_t
+ble_emu_now(const struct ble_emu *emu)
+{
+    return emu->now;
+}
+
+static inline uint8_t
+ble_emu_phy(const struct ble_emu *emu)
+{
+    return emu->phy;
+}
+
+#endif
@@ -0,0 +1,187 @@
+/*
+ * Replays recorded sensor transfers at BLE pace and measures how long each
+ * takes to reach the appserver, cut through versus store-and-forward.
+ *
+ * Each transfer is fed into a pool block one NEBULA_CHUNK_SIZE chunk per
+ * chunk interval, the way the mule's BLE task reassembles notifications.
+ * In cut-through mode the forwarder streams it as it arrives; in
+ * store-and-forward mode it is stored once complete and drained by the
+ * uplink.  Latency is measured from the first chunk to the token.
+ *
+ * Usage: cutthrough_host <payload file> [host] [port] [chunk interval ms]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cutthrough.h"
+#include "payload_pool.h"
+#include "payload_store.h"
+#include "uplink.h"
+#include "mule_port.h"
+
+#define SIM_CONN_HANDLE     1
+#define TOKEN_WAIT_MS       10000
+
+static mule_event_t token_event;
+
+static void
+on_token(const uint8_t *signed_token_payload, size_t len, void *arg)
+{
+    mule_event_signal(&token_event);
+}
+
+static void *
+forwarder_main(void *arg)
+{
+    cutthrough_run();
+    return NULL;
+}
+
+static int
+read_payload(FILE *f, uint8_t **out, uint32_t *out_len)
+{
+    uint8_t hdr[4];
+    uint32_t len;
+
+    if (fread(hdr, 1, sizeof hdr, f) != sizeof hdr) {
+        return -1;
+    }
+    len = hdr[0] | (hdr[1] << 8) | (hdr[2] << 16) | ((uint32_t)hdr[3] << 24);
+    *out = malloc(len);
+    if (*out == NULL || fread(*out, 1, len, f) != len) {
+        free(*out);
+        return -1;
+    }
+    *out_len = len;
+    return 0;
+}
+
+/**
+ * Feeds one transfer chunk by chunk, the way NOTIFY_RX does.
+ *
+ * @return                      Microseconds from the first chunk to the token,
+ *                                  or -1 if no token arrived.
+ */
+static int64_t
+replay(const uint8_t *transfer, uint32_t len, uint32_t interval_ms, int cut)
+{
+    uint8_t *block;
+    uint32_t off;
+    uint32_t n;
+    int64_t start;
+    int streaming;
+
+    block = payload_pool_alloc(len, SIM_CONN_HANDLE);
+    if (block == NULL) {
+        return -1;
+    }
+
+    start = mule_time_us();
+    streaming = 0;
+    for (off = 0; off < len; off += n) {
+        n = len - off < NEBULA_CHUNK_SIZE ? len - off : NEBULA_CHUNK_SIZE;
+        mule_sleep_ms(interval_ms);
+        memcpy(block + off, transfer + off, n);
+
+        if (streaming) {
+            cutthrough_progress(SIM_CONN_HANDLE, off + n);
+        } else if (cut && cutthrough_begin(SIM_CONN_HANDLE, block, off + n) == 0) {
+            streaming = 1;
+        }
+    }
+
+    if (streaming) {
+        cutthrough_end(SIM_CONN_HANDLE, len, NULL);
+    } else {
+        if (payload_store_add(block, len, NULL) != 0) {
+            payload_pool_free(block);
+            return -1;
+        }
+        while (payload_store_count() > 0) {
+            if (uplink_drain() < 0) {
+                break;
+            }
+        }
+    }
+
+    if (!mule_event_wait(&token_event, TOKEN_WAIT_MS)) {
+        return -1;
+    }
+    return mule_time_us() - start;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct cutthrough_config cut_cfg;
+    struct uplink_config up_cfg;
+    pthread_t forwarder;
+    uint8_t *transfer;
+    uint32_t interval_ms;
+    uint32_t len;
+    int64_t sum[2];
+    int64_t lat;
+    int count[2];
+    int ble_ms;
+    FILE *f;
+    int mode;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <payload file> [host] [port] [chunk interval ms]\n",
+                argv[0]);
+        return 2;
+    }
+
+    payload_pool_init();
+    payload_store_init();
+    mule_event_init(&token_event);
+
+    memset(&up_cfg, 0, sizeof up_cfg);
+    up_cfg.host = argc > 2 ? argv[2] : "127.0.0.1";
+    up_cfg.port = argc > 3 ? (uint16_t)atoi(argv[3]) : 8080;
+    up_cfg.window = 1;
+    up_cfg.backoff_min_ms = 100;
+    up_cfg.backoff_max_ms = 2000;
+    up_cfg.on_token = on_token;
+    uplink_init(&up_cfg);
+
+    memset(&cut_cfg, 0, sizeof cut_cfg);
+    cut_cfg.host = up_cfg.host;
+    cut_cfg.port = up_cfg.port;
+    cut_cfg.on_token = on_token;
+    cutthrough_init(&cut_cfg);
+    pthread_create(&forwarder, NULL, forwarder_main, NULL);
+
+    interval_ms = argc > 4 ? (uint32_t)atoi(argv[4]) : 15;
+
+    f = fopen(argv[1], "rb");
+    if (f == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    memset(sum, 0, sizeof sum);
+    memset(count, 0, sizeof count);
+    ble_ms = 0;
+    while (read_payload(f, &transfer, &len) == 0) {
+        ble_ms = ((len + NEBULA_CHUNK_SIZE - 1) / NEBULA_CHUNK_SIZE) * interval_ms;
+        for (mode = 0; mode < 2; mode++) {
+            lat = replay(transfer, len, interval_ms, mode);
+            if (lat >= 0) {
+                sum[mode] += lat;
+                count[mode]++;
+            }
+        }
+        free(transfer);
+    }
+    fclose(f);
+
+    printf("BLE transfer time %d ms per payload\n", ble_ms);
+    printf("store-and-forward: %d payloads, mean %.1f ms to token\n", count[0],
+           count[0] ? sum[0] / 1000.0 / count[0] : 0.0);
+    printf("cut-through:       %d payloads, mean %.1f ms to token\n", count[1],
+           count[1] ? sum[1] / 1000.0 / count[1] : 0.0);
+    return 0;
+}
@@ -0,0 +1,102 @@
+# gen_payloads.py
+#
+# Writes signed sensor transfers in the format uplink_host replays:
+#   u32 length (little endian) || SignedHashPayload || data
+#
+# Run from this directory with the sensor key in ../cloud:
+#   python gen_payloads.py payloads.bin --count 100 --size 512
+#
+# With --tokens it instead writes SignedTokenPayloads for wallet_host, the
+# tokens signed by a running provider and the payloads by the appserver key,
+# plus the appserver public key as X || Y:
+#   python gen_payloads.py tokens.bin --tokens --count 200
+
+import argparse
+import os
+import struct
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'cloud'))
+
+import payloads  # noqa: E402
+import util  # noqa: E402
+
+SENSOR_ID = 0xffffffffffffffffffffffffffffff01
+
+
+def make_transfer(sensor_id_bytes, sensor_private_key, size):
+    data = util.get_random_bytes(size)
+    hash_payload = payloads.HashPayload.serialize(sensor_id_bytes, util.hash_sha256(data))
+    signed_hash_payload = payloads.SignedHashPayload.serialize(
+        hash_payload,
+        util.sign_ecdsa(sensor_private_key, hash_payload)
+    )
+    return signed_hash_payload + data
+
+
+# what the appserver does in get_more_tokens() and deliver_data()
+def make_token_payloads(provider_url, appserver_private_key, count):
+    import requests
+    import tokenlib  # type: ignore
+
+    public_params = payloads.PublicParams.deserialize(
+        requests.get(provider_url + '/public_params').content
+    )
+    blinded_tokens = [tokenlib.generate_token(public_params) for _ in range(count)]
+    signed_tokens = payloads.TokenList.deserialize(
+        requests.post(
+            provider_url + '/sign_tokens',
+            headers={'Content-type': 'application/octet-stream'},
+            data=payloads.TokenList.serialize(blinded_tokens)
+        ).content
+    )
+
+    signed_token_payloads = []
+    for b_token, s_token in zip(blinded_tokens, signed_tokens):
+        token_payload = payloads.TokenPayload.serialize(
+            util.get_random_bytes(16),
+            tokenlib.unblind_token(b_token, s_token),
+            util.hash_sha256(util.get_random_bytes(32))
+        )
+        signed_token_payloads.append(payloads.SignedTokenPayload.serialize(
+            token_payload, util.sign_ecdsa(appserver_private_key, token_payload)
+        ))
+    return signed_token_payloads
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('output')
+    parser.add_argument('--count', type=int, default=32)
+    parser.add_argument('--size', type=int, default=512)
+    parser.add_argument('--key', default=os.path.join('..', 'cloud', 'sensor-private-ecc.pem'))
+    parser.add_argument('--tokens', action='store_true')
+    parser.add_argument('--provider', default='http://localhost:8000')
+    parser.add_argument('--appserver-key', default=os.path.join('..', 'cloud', 'appserver-private-ecc.pem'))
+    parser.add_argument('--xy-output', default='appserver_xy.bin')
+    args = parser.parse_args()
+
+    if args.tokens:
+        appserver_private_key = util.load_private_key(args.appserver_key)
+        with open(args.output, 'wb') as f:
+            for signed_token_payload in make_token_payloads(args.provider, appserver_private_key, args.count):
+                f.write(signed_token_payload)
+        with open(args.xy_output, 'wb') as f:
+            f.write(util.export_public_key_xy(appserver_private_key.public_key()))
+        print(f'wrote {args.count} token payloads to {args.output}, key to {args.xy_output}')
+        return
+
+    sensor_id_bytes = SENSOR_ID.to_bytes(16, 'big')
+    sensor_private_key = util.load_private_key(args.key)
+
+    with open(args.output, 'wb') as f:
+        for _ in range(args.count):
+            transfer = make_transfer(sensor_id_bytes, sensor_private_key, args.size)
+            f.write(struct.pack('<I', len(transfer)))
+            f.write(transfer)
+
+    print(f'wrote {args.count} transfers of {args.size} bytes to {args.output}')
+
+
+if __name__ == '__main__':
+    main()
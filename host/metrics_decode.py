@@ -0,0 +1,39 @@
+# metrics_decode.py
+#
+# Turns the "#NM" lines that mule_metrics_print() writes to the mule's
+# console into JSON, one snapshot per line, using the same decoder the
+# appserver's /mule_metrics endpoint does:
+#   idf.py monitor | tee mule.log; python metrics_decode.py mule.log
+
+import argparse
+import json
+import os
+import struct
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'cloud'))
+import payloads  # noqa: E402
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode mule metrics snapshot lines')
+    parser.add_argument('log', nargs='?', help='captured console log; stdin if omitted')
+    parser.add_argument('--indent', type=int, default=None, help='pretty-print with this indent')
+    args = parser.parse_args()
+
+    src = open(args.log, errors='replace') if args.log else sys.stdin
+    with src:
+        for line in src:
+            start = line.find('#NM ')
+            if start < 0:
+                continue
+            try:
+                metrics = payloads.MuleMetrics.deserialize(bytes.fromhex(line[start + 4:].strip()))
+            except (ValueError, struct.error):
+                print('-- malformed metrics line', file=sys.stderr)
+                continue
+            print(json.dumps(metrics, indent=args.indent))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,105 @@
+# trace_decode.py
+#
+# Turns the "#NT" lines that nebula_trace_drain() writes to a firmware
+# console back into text, using the event table in common/nebula_trace.h.
+# Other lines in the log are passed through unless --only is given.
+#
+# The mule timestamps in microseconds; the sensor uses the 64 MHz cycle
+# counter:
+#   idf.py monitor | tee mule.log; python trace_decode.py mule.log
+#   python trace_decode.py sensor.log --hz 64000000
+
+import argparse
+import os
+import re
+import struct
+import sys
+
+HEADER = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'common', 'nebula_trace.h')
+
+# struct nebula_trace_rec
+RECORD = struct.Struct('<IIHHII')
+
+EVENT_RE = re.compile(r'X\((NT_\w+),\s*"([^"]*)"\)')
+SPEC_RE = re.compile(r'%[ud]')
+
+
+def load_events(path):
+    with open(path) as f:
+        return EVENT_RE.findall(f.read())
+
+
+def format_args(fmt, args):
+    specs = SPEC_RE.findall(fmt)
+    values = []
+    for spec, value in zip(specs, args):
+        if spec == '%d' and value >= 0x80000000:
+            value -= 1 << 32
+        values.append(value)
+    return fmt % tuple(values)
+
+
+class Decoder:
+    def __init__(self, events, hz):
+        self.events = events
+        self.hz = hz
+        self.next_seq = None
+        self.last_ts = None
+        self.elapsed = 0
+        self.lost = 0
+
+    def decode(self, rec):
+        seq, ts, event, a0, a1, a2 = RECORD.unpack(rec)
+        out = []
+        if self.next_seq is not None and seq != self.next_seq:
+            missing = (seq - self.next_seq) & 0xffffffff
+            self.lost += missing
+            out.append('-- %d records lost' % missing)
+        self.next_seq = (seq + 1) & 0xffffffff
+
+        # timestamps wrap at 32 bits; assume records are less than a wrap apart
+        if self.last_ts is not None:
+            self.elapsed += (ts - self.last_ts) & 0xffffffff
+        self.last_ts = ts
+
+        if event < len(self.events):
+            name, fmt = self.events[event]
+            text = '%s %s' % (name, format_args(fmt, (a0, a1, a2)))
+        else:
+            text = 'event %d a0=%u a1=%u a2=%u' % (event, a0, a1, a2)
+        out.append('%12.6f %8d %s' % (self.elapsed / self.hz, seq, text))
+        return out
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode nebula binary trace lines')
+    parser.add_argument('log', nargs='?', help='captured console log; stdin if omitted')
+    parser.add_argument('--hz', type=float, default=1e6, help='timestamp rate (default 1 MHz)')
+    parser.add_argument('--header', default=HEADER, help='nebula_trace.h with the event table')
+    parser.add_argument('--only', action='store_true', help='drop lines that are not trace records')
+    args = parser.parse_args()
+
+    decoder = Decoder(load_events(args.header), args.hz)
+    src = open(args.log, errors='replace') if args.log else sys.stdin
+    with src:
+        for line in src:
+            start = line.find('#NT ')
+            if start < 0:
+                if not args.only:
+                    sys.stdout.write(line)
+                continue
+            try:
+                blob = bytes.fromhex(line[start + 4:].strip())
+            except ValueError:
+                print('-- malformed trace line', file=sys.stderr)
+                continue
+            for off in range(0, len(blob) - RECORD.size + 1, RECORD.size):
+                for text in decoder.decode(blob[off:off + RECORD.size]):
+                    print(text)
+
+    if decoder.lost:
+        print('-- %d records lost in total' % decoder.lost, file=sys.stderr)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,139 @@
+/*
+ * Drains a file of recorded sensor transfers to an appserver using the
+ * mule's uplink code, so the pipelined client can be exercised on a laptop.
+ *
+ * The input is a sequence of records as written by gen_payloads.py:
+ *
+ *     u32 length (little endian) || SignedHashPayload || data
+ *
+ * Usage: uplink_host <payload file> [host] [port] [window]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "payload_pool.h"
+#include "payload_store.h"
+#include "uplink.h"
+#include "mule_port.h"
+
+static uint32_t tokens;
+
+static void
+on_token(const uint8_t *signed_token_payload, size_t len, void *arg)
+{
+    tokens++;
+}
+
+/*
+ * Moves records from the file into the store until the file, the store or the
+ * pool runs out, like sensors handing off transfers while the uplink drains.
+ *
+ * @return                      Records loaded, or -1 on a malformed file.
+ */
+static int
+load_payloads(FILE *f)
+{
+    uint8_t hdr[4];
+    uint8_t *block;
+    uint32_t len;
+    int count;
+
+    count = 0;
+    while (fread(hdr, 1, sizeof hdr, f) == sizeof hdr) {
+        len = hdr[0] | (hdr[1] << 8) | (hdr[2] << 16) | ((uint32_t)hdr[3] << 24);
+        block = payload_pool_alloc(len, PAYLOAD_POOL_OWNER_NONE);
+        if (block == NULL) {
+            fseek(f, -(long)sizeof hdr, SEEK_CUR);
+            break;
+        }
+        if (fread(block, 1, len, f) != len) {
+            fprintf(stderr, "truncated payload file\n");
+            payload_pool_free(block);
+            return -1;
+        }
+        if (payload_store_add(block, len, NULL) != 0) {
+            payload_pool_free(block);
+            fseek(f, -(long)(sizeof hdr + len), SEEK_CUR);
+            break;
+        }
+        count++;
+    }
+    return count;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct uplink_config cfg;
+    struct uplink_stats stats;
+    struct timespec start, end;
+    double elapsed;
+    FILE *f;
+    int loaded;
+    int rc;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <payload file> [host] [port] [window]\n",
+                argv[0]);
+        return 2;
+    }
+
+    payload_pool_init();
+    payload_store_init();
+
+    f = fopen(argv[1], "rb");
+    if (f == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    memset(&cfg, 0, sizeof cfg);
+    cfg.host = argc > 2 ? argv[2] : "127.0.0.1";
+    cfg.port = argc > 3 ? (uint16_t)atoi(argv[3]) : 8080;
+    cfg.window = argc > 4 ? atoi(argv[4]) : 8;
+    cfg.max_attempts = 3;
+    cfg.backoff_min_ms = 100;
+    cfg.backoff_max_ms = 2000;
+    cfg.on_token = on_token;
+    uplink_init(&cfg);
+
+    printf("draining %s to %s:%u with window %d\n",
+           argv[1], cfg.host, (unsigned)cfg.port, cfg.window);
+
+    loaded = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+        rc = load_payloads(f);
+        if (rc < 0) {
+            break;
+        }
+        loaded += rc;
+        if (payload_store_count() == 0) {
+            break;
+        }
+
+        rc = uplink_drain();
+        if (rc < 0) {
+            if (uplink_backoff_ms() >= cfg.backoff_max_ms) {
+                break;
+            }
+            mule_sleep_ms(uplink_backoff_ms());
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uplink_close();
+    fclose(f);
+
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    uplink_get_stats(&stats);
+    printf("%d payloads, %u tokens in %.3f s; connects=%u requests=%u delivered=%u "
+           "rejected=%u io_errors=%u; %d payloads left\n",
+           loaded, (unsigned)tokens, elapsed, (unsigned)stats.connects,
+           (unsigned)stats.requests, (unsigned)stats.delivered,
+           (unsigned)stats.rejected, (unsigned)stats.io_errors,
+           payload_store_count());
+
+    return payload_store_count() == 0 ? 0 : 1;
+}
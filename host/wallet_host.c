@@ -0,0 +1,94 @@
+/*
+ * Redeems a file of earned token payloads with a provider using the mule's
+ * token wallet, so batching, retries and persistence can be exercised on a
+ * laptop.
+ *
+ * The key file holds the appserver's P-256 public key as X || Y, and the
+ * token file a sequence of SignedTokenPayloads, both as written by
+ * gen_payloads.py --tokens.  Given a store directory the wallet keeps its
+ * tokens there; run again with an empty token file to pick up what is left.
+ *
+ * Usage: wallet_host <key file> <token file> [host] [port] [store dir]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "token_wallet.h"
+#include "mule_port.h"
+
+int
+main(int argc, char **argv)
+{
+    uint8_t payload[NEBULA_SIGNED_TOKEN_PAYLOAD_BYTES];
+    struct token_wallet_config cfg;
+    struct token_wallet_stats stats;
+    struct timespec start, end;
+    double elapsed;
+    int offered;
+    int rounds;
+    int rc;
+    FILE *f;
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <key file> <token file> [host] [port] "
+                "[store dir]\n", argv[0]);
+        return 2;
+    }
+
+    memset(&cfg, 0, sizeof cfg);
+    f = fopen(argv[1], "rb");
+    if (f == NULL || fread(cfg.appserver_xy, 1, sizeof cfg.appserver_xy, f) !=
+            sizeof cfg.appserver_xy) {
+        fprintf(stderr, "%s: expected a %u byte public key\n", argv[1],
+                (unsigned)sizeof cfg.appserver_xy);
+        return 1;
+    }
+    fclose(f);
+
+    memcpy(cfg.mule_id, "wallet_host_mule", TOKEN_WALLET_MULE_ID_BYTES);
+    cfg.host = argc > 3 ? argv[3] : "127.0.0.1";
+    cfg.port = argc > 4 ? (uint16_t)atoi(argv[4]) : 8000;
+    cfg.store_dir = argc > 5 ? argv[5] : NULL;
+    cfg.batch_min = 1;
+    cfg.max_attempts = 3;
+    token_wallet_init(&cfg);
+    printf("%d tokens in the wallet at start\n", token_wallet_count());
+
+    f = fopen(argv[2], "rb");
+    if (f == NULL) {
+        perror(argv[2]);
+        return 1;
+    }
+    offered = 0;
+    while (fread(payload, 1, sizeof payload, f) == sizeof payload) {
+        token_wallet_add(payload, sizeof payload);
+        offered++;
+    }
+    fclose(f);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    rc = 0;
+    for (rounds = 0; rounds < cfg.max_attempts && token_wallet_count() > 0;
+            rounds++) {
+        rc = token_wallet_redeem();
+        if (rc < 0) {
+            break;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    token_wallet_get_stats(&stats);
+    printf("%d payloads offered in %.3f s; earned=%u bad_signature=%u "
+           "duplicates=%u full=%u requests=%u redeemed=%u invalid=%u "
+           "dropped=%u; %d tokens left\n",
+           offered, elapsed, (unsigned)stats.earned,
+           (unsigned)stats.bad_signature, (unsigned)stats.duplicates,
+           (unsigned)stats.full, (unsigned)stats.requests,
+           (unsigned)stats.redeemed, (unsigned)stats.invalid,
+           (unsigned)stats.dropped, token_wallet_count());
+
+    return rc < 0 ? 1 : 0;
+}
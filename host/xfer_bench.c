@@ -0,0 +1,598 @@
+/*
+ * Runs sensor-to-mule transfers through the same engines the firmware uses
+ * (common/nebula_xfer.c) over an emulated BLE link, and reports goodput and
+ * latency in simulated time.  Every transfer is checked byte for byte and
+ * must arrive exactly once, so the exit status doubles as a regression
+ * check:
+ *
+ *   ./xfer_bench -n 100 -s 2048 --interval-ms 30 --loss 0.05
+ *
+ * With --pass-kmh the link is a mule driving past the sensor instead, and the
+ * bench reports what one pass delivers, on a fixed PHY or with both sides
+ * running the adaptive PHY policy (common/nebula_phy.h):
+ *
+ *   ./xfer_bench --pass-kmh 50 --phy 1
+ *   ./xfer_bench --pass-kmh 50 --phy adaptive
+ *
+ * With --fec the sensor sends FEC transfers (common/nebula_fec.h), a block of
+ * symbols per ack, and --drop loses data notifications past the link layer
+ * for the repair symbols to make up:
+ *
+ *   ./xfer_bench --fec 2 --drop 0.02
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ble_emu.h"
+#include "nebula_phy.h"
+#include "nebula_xfer.h"
+
+/* How often each side reads the link's RSSI, at most once an event. */
+#define BENCH_PHY_SAMPLE_US     200000
+
+struct bench {
+    struct ble_emu emu;
+    struct nebula_xfer_tx tx;
+    struct nebula_xfer_rx rx;
+    uint16_t chunk_size;
+    uint32_t poll_us;
+    uint32_t mule_delay_us;
+
+    size_t size;
+    int count;
+    uint8_t *payload;
+    uint8_t *expect;
+    uint8_t *rx_buf;
+    size_t rx_cap;
+    size_t rx_len;
+    uint8_t *fec_store;
+
+    int next;                   /* transfer the sensor is on */
+    int finished;               /* transfers the mule has completed */
+    int corrupt;
+    int duplicates;
+    int restarts;
+    int polling;
+    uint64_t *started_us;       /* first attempt at each transfer */
+    uint8_t *delivered;
+    uint64_t *latency_us;
+
+    int adaptive;
+    int sampling;
+    struct nebula_phy_policy sensor_phy;
+    struct nebula_phy_policy mule_phy;
+    uint8_t mule_prefer;
+};
+
+/*
+ * Transfer n's contents: its number, then bytes derived from it, so the
+ * mule can tell which transfer it got and check it independently.
+ */
+static void
+bench_fill(uint8_t *buf, size_t len, int n)
+{
+    uint32_t x = 2463534242u ^ (uint32_t)n * 0x9e3779b9u;
+    size_t i;
+
+    for (i = 0; i < 4; i++) {
+        buf[i] = (uint8_t)((uint32_t)n >> (8 * i));
+    }
+    for (i = 4; i < len; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        buf[i] = (uint8_t)x;
+    }
+}
+
+/* Sensor: the firmware's ble_write_long() loop, one poll per timer. */
+static void
+sensor_poll(void *arg)
+{
+    struct bench *b = arg;
+    int status;
+    int rc;
+
+    b->polling = 0;
+    if (!b->emu.connected) {
+        return;
+    }
+
+    status = b->tx.status;
+    if (status != NEBULA_XFER_TX_SENDING) {
+        if (status == NEBULA_XFER_TX_DONE || status == NEBULA_XFER_TX_SKIPPED) {
+            b->next++;
+        } else if (status == NEBULA_XFER_TX_FAILED) {
+            b->restarts++;
+        }
+        if (b->next == b->count) {
+            return;
+        }
+        if (status == NEBULA_XFER_TX_FAILED) {
+            /* The same transfer again, so a mule that finished it can
+             * say so rather than take it twice. */
+            rc = nebula_xfer_tx_retry(&b->tx);
+        } else {
+            bench_fill(b->payload, b->size, b->next);
+            b->started_us[b->next] = ble_emu_now(&b->emu);
+            rc = nebula_xfer_tx_start(&b->tx, b->payload, b->size);
+        }
+        if (rc != 0) {
+            fprintf(stderr, "transfer too large for %u byte chunks\n",
+                    b->chunk_size);
+            exit(2);
+        }
+    }
+
+    nebula_xfer_tx_poll(&b->tx);
+    b->polling = 1;
+    ble_emu_at(&b->emu, ble_emu_now(&b->emu) + b->poll_us, sensor_poll, b);
+}
+
+/*
+ * Both sides' PHY policies, each on its own RSSI readings, as in
+ * sensor/app/phy.c and the mule's mule_phy_tick().  The mule's request
+ * leaves it preferring that PHY or slower ones, and a sensor's request only
+ * goes through within the mule's preference.
+ */
+static void
+phy_tick(void *arg)
+{
+    struct bench *b = arg;
+    uint64_t now = ble_emu_now(&b->emu);
+    uint8_t phy = ble_emu_phy(&b->emu);
+    uint8_t want;
+
+    b->sampling = 0;
+    if (!b->emu.connected) {
+        return;
+    }
+    if (phy != b->sensor_phy.phy) {
+        nebula_phy_updated(&b->sensor_phy, phy, now);
+        nebula_phy_updated(&b->mule_phy, phy, now);
+    }
+
+    want = nebula_phy_sample(&b->mule_phy, ble_emu_rssi_sample(&b->emu), now);
+    if (want != NEBULA_PHY_NONE) {
+        b->mule_prefer = nebula_phy_at_most(want);
+        ble_emu_set_phy(&b->emu, want);
+    }
+    want = nebula_phy_sample(&b->sensor_phy, ble_emu_rssi_sample(&b->emu),
+                             now);
+    if (want != NEBULA_PHY_NONE && (b->mule_prefer & nebula_phy_bit(want))) {
+        ble_emu_set_phy(&b->emu, want);
+    }
+
+    b->sampling = 1;
+    ble_emu_at(&b->emu, now + (b->emu.cfg.interval_us > BENCH_PHY_SAMPLE_US ?
+                               b->emu.cfg.interval_us : BENCH_PHY_SAMPLE_US),
+               phy_tick, b);
+}
+
+static void
+sensor_connected(void *arg)
+{
+    struct bench *b = arg;
+    struct nebula_phy_cfg phy_cfg;
+    uint64_t now = ble_emu_now(&b->emu);
+
+    if (!b->polling) {
+        b->polling = 1;
+        ble_emu_at(&b->emu, now, sensor_poll, b);
+    }
+    if (b->adaptive) {
+        nebula_phy_cfg_default(&phy_cfg);
+        nebula_phy_init(&b->sensor_phy, &phy_cfg, ble_emu_phy(&b->emu), now);
+        nebula_phy_init(&b->mule_phy, &phy_cfg, ble_emu_phy(&b->emu), now);
+        b->mule_prefer = nebula_phy_at_most(NEBULA_PHY_2M);
+        if (!b->sampling) {
+            b->sampling = 1;
+            ble_emu_at(&b->emu, now, phy_tick, b);
+        }
+    }
+}
+
+static void
+sensor_disconnected(void *arg)
+{
+    struct bench *b = arg;
+
+    nebula_xfer_tx_abort(&b->tx);
+}
+
+static void
+sensor_receive(void *arg, enum nebula_chr chr, const uint8_t *data,
+               uint16_t len)
+{
+    struct bench *b = arg;
+
+    if (chr == NEBULA_CHR_META) {
+        nebula_xfer_tx_on_meta(&b->tx, data, len);
+    }
+}
+
+/* Mule: the rx task's link_on_notify(), without the hashing and storing. */
+static void
+mule_ack(void *arg)
+{
+    struct bench *b = arg;
+
+    nebula_xfer_rx_ack(&b->rx);
+}
+
+static void
+mule_connected(void *arg)
+{
+    struct bench *b = arg;
+    struct nebula_radio radio;
+
+    /* There is only the one sensor, so the mule knows it is the same. */
+    ble_emu_radio(&b->emu, BLE_EMU_CENTRAL, &radio);
+    nebula_xfer_rx_reconnect(&b->rx, &radio);
+    b->rx_len = 0;
+}
+
+static void
+mule_disconnected(void *arg)
+{
+}
+
+static void
+mule_done(struct bench *b)
+{
+    uint32_t n;
+
+    if (b->rx_len != b->size) {
+        b->corrupt++;
+        return;
+    }
+    n = b->rx_buf[0] | b->rx_buf[1] << 8 | b->rx_buf[2] << 16 |
+        (uint32_t)b->rx_buf[3] << 24;
+    if (n >= (uint32_t)b->count) {
+        b->corrupt++;
+        return;
+    }
+    bench_fill(b->expect, b->size, n);
+    if (memcmp(b->rx_buf, b->expect, b->size) != 0) {
+        b->corrupt++;
+    } else if (b->delivered[n]) {
+        b->duplicates++;
+    } else {
+        b->delivered[n] = 1;
+        b->latency_us[b->finished++] = ble_emu_now(&b->emu) - b->started_us[n];
+    }
+}
+
+static void
+mule_schedule_ack(struct bench *b)
+{
+    if (b->mule_delay_us == 0) {
+        nebula_xfer_rx_ack(&b->rx);
+    } else {
+        ble_emu_at(&b->emu, ble_emu_now(&b->emu) + b->mule_delay_us,
+                   mule_ack, b);
+    }
+}
+
+static void
+mule_receive(void *arg, enum nebula_chr chr, const uint8_t *data,
+             uint16_t len)
+{
+    struct bench *b = arg;
+    size_t offset;
+    size_t ready;
+
+    if (chr == NEBULA_CHR_META) {
+        switch (nebula_xfer_rx_on_meta(&b->rx, data, len)) {
+        case NEBULA_XFER_RX_START:
+            b->rx_len = 0;
+            /* A FEC transfer waits to be asked for its first block. */
+            if (b->rx.fec) {
+                mule_schedule_ack(b);
+            }
+            break;
+        case NEBULA_XFER_RX_IDLE:
+            b->rx_len = 0;
+            break;
+        case NEBULA_XFER_RX_REPEAT:
+            b->rx_len = 0;
+            mule_schedule_ack(b);
+            break;
+        case NEBULA_XFER_RX_DONE:
+            mule_done(b);
+            break;
+        }
+        return;
+    }
+
+    if (b->rx.fec) {
+        if (nebula_xfer_rx_on_symbol(&b->rx, data, len, b->rx_buf,
+                                     b->rx_cap, &ready) ==
+                NEBULA_XFER_RX_DONE) {
+            b->rx_len = ready;
+            mule_done(b);
+        }
+        mule_schedule_ack(b);
+        return;
+    }
+
+    offset = nebula_xfer_rx_on_chunk(&b->rx);
+    if (offset == 0) {
+        b->rx_len = 0;
+    }
+    if (offset + len <= b->rx_cap) {
+        memcpy(&b->rx_buf[offset], data, len);
+        b->rx_len = offset + len;
+    }
+    mule_schedule_ack(b);
+}
+
+static int
+bench_done(void *arg)
+{
+    struct bench *b = arg;
+    const struct ble_emu_end *sensor = &b->emu.end[BLE_EMU_PERIPHERAL];
+
+    /* Everything sent, and the last of it delivered or lost with the link. */
+    return b->next == b->count && sensor->count == 0 && !sensor->holding;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* 1, 2 or coded; adaptive as well where allowed. */
+static int
+parse_phy(const char *arg, int adaptive_ok)
+{
+    if (strcmp(arg, "1") == 0) {
+        return NEBULA_PHY_1M;
+    }
+    if (strcmp(arg, "2") == 0) {
+        return NEBULA_PHY_2M;
+    }
+    if (strcmp(arg, "coded") == 0) {
+        return NEBULA_PHY_CODED;
+    }
+    if (adaptive_ok && strcmp(arg, "adaptive") == 0) {
+        return 0;
+    }
+    return -1;
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -n, --count N          transfers (100)\n"
+            "  -s, --size BYTES       bytes per transfer (2048)\n"
+            "  -c, --chunk BYTES      chunk size, at most mtu - 3 (%d)\n"
+            "      --mtu N            ATT MTU (247)\n"
+            "      --ll-octets N      LL payload, 27..251 (251)\n"
+            "      --phy 1|2|coded|adaptive\n"
+            "                         PHY, or the adaptive policy (1)\n"
+            "      --adv-phy 1|coded  PHY sensors are discovered on (the\n"
+            "                         connection's; coded if adaptive)\n"
+            "      --queue N          notifications the stack buffers (1)\n"
+            "      --interval-ms MS   connection interval (500)\n"
+            "      --event-ms MS      connection event limit (interval)\n"
+            "      --loss P           LL packet loss rate (0)\n"
+            "      --reorder P        PDUs delivered after the next one (0)\n"
+            "      --drop P           data notifications lost past the LL (0)\n"
+            "      --disconnect P     link drops per connection event (0)\n"
+            "      --reconnect-ms MS  time to reconnect after a drop (1000)\n"
+            "      --poll-ms MS       sensor ack poll period (10)\n"
+            "      --mule-delay-us US mule processing before each ack (1000)\n"
+            "      --seed N           random seed (1)\n"
+            "      --fec R            FEC transfers, R repair symbols a burst\n"
+            "      --pass-kmh KMH     drive past the sensor at this speed\n"
+            "      --closest-m M      distance at the closest point (10)\n"
+            "      --pass-m M         distance driven either side of it (400)\n",
+            prog, NEBULA_CHUNK_SIZE);
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        { "count", required_argument, NULL, 'n' },
+        { "size", required_argument, NULL, 's' },
+        { "chunk", required_argument, NULL, 'c' },
+        { "mtu", required_argument, NULL, 'm' },
+        { "ll-octets", required_argument, NULL, 'o' },
+        { "phy", required_argument, NULL, 'p' },
+        { "queue", required_argument, NULL, 'q' },
+        { "interval-ms", required_argument, NULL, 'i' },
+        { "event-ms", required_argument, NULL, 'e' },
+        { "loss", required_argument, NULL, 'l' },
+        { "reorder", required_argument, NULL, 'r' },
+        { "drop", required_argument, NULL, 'x' },
+        { "disconnect", required_argument, NULL, 'd' },
+        { "reconnect-ms", required_argument, NULL, 'R' },
+        { "poll-ms", required_argument, NULL, 'P' },
+        { "mule-delay-us", required_argument, NULL, 'D' },
+        { "seed", required_argument, NULL, 'S' },
+        { "adv-phy", required_argument, NULL, 'A' },
+        { "pass-kmh", required_argument, NULL, 'K' },
+        { "closest-m", required_argument, NULL, 'C' },
+        { "pass-m", required_argument, NULL, 'M' },
+        { "fec", required_argument, NULL, 'F' },
+        { NULL, 0, NULL, 0 },
+    };
+    static struct bench b;
+    struct ble_emu_config cfg;
+    struct ble_emu_handler central = {
+        mule_connected, mule_disconnected, mule_receive, &b
+    };
+    struct ble_emu_handler peripheral = {
+        sensor_connected, sensor_disconnected, sensor_receive, &b
+    };
+    struct nebula_radio radio;
+    uint64_t elapsed;
+    uint64_t total;
+    uint64_t limit;
+    int chunk = NEBULA_CHUNK_SIZE;
+    int count_set = 0;
+    int phy = NEBULA_PHY_1M;
+    int adv_phy = 0;
+    int fec = -1;
+    int opt;
+    int rc;
+    int i;
+
+    ble_emu_config_default(&cfg);
+    b.count = 100;
+    b.size = 2048;
+    b.poll_us = 10000;
+    b.mule_delay_us = 1000;
+
+    while ((opt = getopt_long(argc, argv, "n:s:c:", options, NULL)) != -1) {
+        switch (opt) {
+        case 'n': b.count = atoi(optarg); count_set = 1; break;
+        case 's': b.size = strtoul(optarg, NULL, 0); break;
+        case 'c': chunk = atoi(optarg); break;
+        case 'm': cfg.mtu = atoi(optarg); break;
+        case 'o': cfg.ll_octets = atoi(optarg); break;
+        case 'p': phy = parse_phy(optarg, 1); break;
+        case 'q': cfg.queue_depth = atoi(optarg); break;
+        case 'i': cfg.interval_us = (uint32_t)(atof(optarg) * 1000); break;
+        case 'e': cfg.event_us = (uint32_t)(atof(optarg) * 1000); break;
+        case 'l': cfg.loss = atof(optarg); break;
+        case 'r': cfg.reorder = atof(optarg); break;
+        case 'x': cfg.drop = atof(optarg); break;
+        case 'd': cfg.disconnect = atof(optarg); break;
+        case 'R': cfg.reconnect_us = (uint32_t)(atof(optarg) * 1000); break;
+        case 'P': b.poll_us = (uint32_t)(atof(optarg) * 1000); break;
+        case 'D': b.mule_delay_us = strtoul(optarg, NULL, 0); break;
+        case 'S': cfg.seed = strtoul(optarg, NULL, 0); break;
+        case 'A': adv_phy = parse_phy(optarg, 0); break;
+        case 'K': cfg.speed_mps = atof(optarg) / 3.6; break;
+        case 'C': cfg.closest_m = atof(optarg); break;
+        case 'M': cfg.pass_m = atof(optarg); break;
+        case 'F': fec = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (phy < 0 || adv_phy < 0 || adv_phy == NEBULA_PHY_2M) {
+        usage(argv[0]);
+    }
+    /* Adaptive links come up on the PHY they were found on. */
+    b.adaptive = phy == 0;
+    if (b.adaptive) {
+        phy = adv_phy != 0 ? adv_phy : NEBULA_PHY_CODED;
+    }
+    cfg.phy = (uint8_t)phy;
+    cfg.adv_phy = (uint8_t)adv_phy;
+    /* A pass runs out of road rather than transfers. */
+    if (cfg.speed_mps > 0 && !count_set) {
+        b.count = 10000;
+    }
+    if (b.count <= 0 || b.size < 4 || chunk <= 0 || chunk > cfg.mtu - 3 ||
+            b.poll_us == 0 || cfg.speed_mps < 0 || fec > NEBULA_FEC_INDEX_MAX) {
+        usage(argv[0]);
+    }
+
+    b.chunk_size = (uint16_t)chunk;
+    b.payload = malloc(b.size);
+    b.expect = malloc(b.size);
+    b.rx_cap = b.size;
+    b.rx_buf = malloc(b.rx_cap);
+    b.fec_store = malloc(NEBULA_FEC_K * (size_t)b.chunk_size);
+    b.started_us = calloc(b.count, sizeof *b.started_us);
+    b.delivered = calloc(b.count, 1);
+    b.latency_us = calloc(b.count, sizeof *b.latency_us);
+    if (b.payload == NULL || b.expect == NULL || b.rx_buf == NULL ||
+            b.fec_store == NULL || b.started_us == NULL || b.delivered == NULL ||
+            b.latency_us == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+
+    if (ble_emu_init(&b.emu, &cfg, &central, &peripheral) != 0) {
+        fprintf(stderr, "bad link configuration\n");
+        return 2;
+    }
+    ble_emu_radio(&b.emu, BLE_EMU_PERIPHERAL, &radio);
+    nebula_xfer_tx_init(&b.tx, &radio, b.chunk_size);
+    ble_emu_radio(&b.emu, BLE_EMU_CENTRAL, &radio);
+    nebula_xfer_rx_init(&b.rx, &radio, b.chunk_size);
+    nebula_xfer_rx_fec_store(&b.rx, b.fec_store,
+                             nebula_xfer_rx_fec_store_len(&b.rx));
+    if (fec >= 0 && nebula_xfer_tx_fec(&b.tx, (uint8_t)fec) != 0) {
+        fprintf(stderr, "FEC needs chunks of %d to %d bytes\n",
+                NEBULA_FEC_HEADER_BYTES + 1, NEBULA_FEC_CHUNK_MAX);
+        return 2;
+    }
+    /* The first poll starts transfer 0. */
+    b.tx.status = NEBULA_XFER_TX_DONE;
+    b.next = -1;
+
+    /* A day of simulated time is plenty for any sane configuration. */
+    limit = cfg.speed_mps > 0 ? ble_emu_pass_us(&b.emu) : 86400ULL * 1000000;
+    rc = ble_emu_run(&b.emu, bench_done, &b, limit);
+
+    elapsed = b.finished > 0 ? ble_emu_now(&b.emu) - b.started_us[0] : 0;
+    total = 0;
+    for (i = 0; i < b.finished; i++) {
+        total += b.latency_us[i];
+    }
+    qsort(b.latency_us, b.finished, sizeof *b.latency_us, cmp_u64);
+
+    printf("transfers   %d of %d delivered, %d lost, %d corrupt, "
+           "%d duplicated\n", b.finished, b.count, b.count - b.finished,
+           b.corrupt, b.duplicates);
+    printf("restarts    %d after %u disconnects\n", b.restarts,
+           b.emu.stats.disconnects);
+    printf("payload     %zu bytes in %u byte chunks%s\n", b.size, b.chunk_size,
+           fec >= 0 ? " (FEC)" : "");
+    printf("elapsed     %.3f s simulated\n", elapsed / 1e6);
+    if (b.finished > 0) {
+        printf("goodput     %.1f B/s\n",
+               elapsed > 0 ? (double)b.finished * b.size * 1e6 / elapsed : 0);
+        printf("latency     mean %.1f ms, p50 %.1f ms, p95 %.1f ms, "
+               "max %.1f ms\n",
+               total / 1e3 / b.finished,
+               b.latency_us[b.finished / 2] / 1e3,
+               b.latency_us[(b.finished * 95 - 1) / 100] / 1e3,
+               b.latency_us[b.finished - 1] / 1e3);
+    }
+    printf("link        %u events, %u LL packets, %u lost, "
+           "%.2f notifications/event\n",
+           b.emu.stats.events, b.emu.stats.ll_packets, b.emu.stats.ll_lost,
+           b.emu.stats.events > 0 ?
+           (double)b.emu.stats.pdus[BLE_EMU_PERIPHERAL] / b.emu.stats.events : 0);
+    printf("stack       %u queue full, %u reordered, %u dropped\n",
+           b.emu.stats.queue_full, b.emu.stats.reordered,
+           b.emu.stats.dropped);
+    printf("phy         1M %.1f s, 2M %.1f s, coded %.1f s connected, "
+           "%u updates\n",
+           b.emu.stats.phy_us[NEBULA_PHY_1M] / 1e6,
+           b.emu.stats.phy_us[NEBULA_PHY_2M] / 1e6,
+           b.emu.stats.phy_us[NEBULA_PHY_CODED] / 1e6,
+           b.emu.stats.phy_updates);
+    if (cfg.speed_mps > 0) {
+        printf("pass        %.1f s at %.0f km/h, closest %.0f m: "
+               "%zu bytes in %.1f s of contact\n",
+               limit / 1e6, cfg.speed_mps * 3.6, cfg.closest_m,
+               (size_t)b.finished * b.size,
+               (b.emu.stats.phy_us[NEBULA_PHY_1M] +
+                b.emu.stats.phy_us[NEBULA_PHY_2M] +
+                b.emu.stats.phy_us[NEBULA_PHY_CODED]) / 1e6);
+        return b.corrupt > 0 || b.duplicates > 0 ? 1 : 0;
+    }
+
+    if (rc != 0) {
+        fprintf(stderr, "transfers stalled\n");
+        return 1;
+    }
+    return b.corrupt > 0 || b.duplicates > 0 ? 1 : 0;
+}
@@ -0,0 +1,300 @@
+/*
+ * Readings harvested from sensors' broadcasts.
+ *
+ * The host task hands every scan report carrying a sensor broadcast to
+ * bcast_harvest_on_adv().  Each sensor gets a window of NEBULA_BCAST_ACK_WINDOW
+ * sequence numbers, a bitmap of the ones harvested and another of the ones
+ * acked back to it; a reading already seen is skipped, a new one is queued
+ * for the uplink and only then counted as seen, so a mule whose queue is full
+ * leaves it unacked for the next mule.  Readings just behind the window are
+ * taken as already harvested; ones far behind it mean the sensor restarted
+ * its sequence.  Once everything at the bottom of the window is acked, the
+ * window moves up.
+ *
+ * The uplink task takes whole records off the queue with bcast_harvest_peek()
+ * and drops them once the appserver has them.
+ */
+
+#include <string.h>
+#include "bcast_harvest.h"
+#include "mule_port.h"
+
+static const char *tag = "BCAST";
+
+struct bcast_sensor {
+    uint8_t in_use;
+    uint8_t addr[BCAST_HARVEST_ADDR_BYTES];
+    /* Flags of its latest broadcast. */
+    uint8_t flags;
+    uint16_t base;
+    /* Bit i is sequence number base + i; acked and inflight are within seen. */
+    uint64_t seen;
+    uint64_t acked;
+    /* In the ack list being written. */
+    uint64_t inflight;
+    int64_t heard_us;
+};
+
+/* Host task only. */
+static struct bcast_sensor sensors[BCAST_HARVEST_SENSORS];
+
+static uint8_t queue[BCAST_HARVEST_QUEUE_BYTES];
+static size_t queue_len;
+static struct bcast_harvest_stats stats;
+static mule_lock_t queue_lock = MULE_LOCK_INITIALIZER;
+
+static struct bcast_sensor *
+bcast_sensor_find(const uint8_t *addr)
+{
+    int i;
+
+    for (i = 0; i < BCAST_HARVEST_SENSORS; i++) {
+        if (sensors[i].in_use &&
+                memcmp(sensors[i].addr, addr, BCAST_HARVEST_ADDR_BYTES) == 0) {
+            return &sensors[i];
+        }
+    }
+    return NULL;
+}
+
+/* Finds the sensor, or makes room for it in place of the longest silent. */
+static struct bcast_sensor *
+bcast_sensor_get(const uint8_t *addr)
+{
+    struct bcast_sensor *s = bcast_sensor_find(addr);
+    int i;
+
+    if (s != NULL) {
+        return s;
+    }
+    s = &sensors[0];
+    for (i = 0; i < BCAST_HARVEST_SENSORS && s->in_use; i++) {
+        if (!sensors[i].in_use || sensors[i].heard_us < s->heard_us) {
+            s = &sensors[i];
+        }
+    }
+    memset(s, 0, sizeof *s);
+    s->in_use = 1;
+    memcpy(s->addr, addr, BCAST_HARVEST_ADDR_BYTES);
+    return s;
+}
+
+static void
+bcast_sensor_shift(struct bcast_sensor *s, uint16_t n)
+{
+    if (n >= NEBULA_BCAST_ACK_WINDOW) {
+        s->seen = s->acked = s->inflight = 0;
+    } else {
+        s->seen >>= n;
+        s->acked >>= n;
+        s->inflight >>= n;
+    }
+    s->base += n;
+}
+
+/*
+ * Where seq falls in the sensor's window, moving the window up to it if it
+ * is newer.
+ *
+ * @return                      The bit for seq; -1 if it is behind the window.
+ */
+static int
+bcast_sensor_bit(struct bcast_sensor *s, uint16_t seq)
+{
+    uint16_t d = (uint16_t)(seq - s->base);
+
+    if (s->seen == 0) {
+        s->base = seq;
+        return 0;
+    }
+    if (d < NEBULA_BCAST_ACK_WINDOW) {
+        return d;
+    }
+    if (d >= 0x8000 &&
+            (uint16_t)(s->base - seq) <= NEBULA_BCAST_ACK_WINDOW) {
+        return -1;
+    }
+    if (d >= 0x8000) {
+        /* Far behind: the sensor started over. */
+        s->seen = s->acked = s->inflight = 0;
+        s->base = seq;
+        return 0;
+    }
+    bcast_sensor_shift(s, (uint16_t)(d - (NEBULA_BCAST_ACK_WINDOW - 1)));
+    return NEBULA_BCAST_ACK_WINDOW - 1;
+}
+
+/* Call with queue_lock held. */
+static int
+bcast_queue_put(const uint8_t *sensor_id, const struct nebula_bcast_reading *r)
+{
+    uint8_t *rec = &queue[queue_len];
+
+    if (queue_len + BCAST_HARVEST_RECORD_HEADER_BYTES + r->len > sizeof queue) {
+        return -1;
+    }
+    memcpy(rec, sensor_id, NEBULA_SENSOR_ID_BYTES);
+    rec += NEBULA_SENSOR_ID_BYTES;
+    rec[0] = (uint8_t)r->seq;
+    rec[1] = (uint8_t)(r->seq >> 8);
+    rec[2] = r->len;
+    memcpy(&rec[NEBULA_BCAST_READING_HEADER_BYTES], r->sealed, r->len);
+    queue_len += BCAST_HARVEST_RECORD_HEADER_BYTES + r->len;
+    return 0;
+}
+
+/**
+ * Harvests the readings in a sensor's broadcast service data, past its UUID.
+ * Host task.
+ *
+ * @param addr                  The advertiser's address.
+ *
+ * @return                      1 if the mule should connect to the sensor:
+ *                                  it has a transfer waiting, or asks for
+ *                                  acks and this mule has some for it;
+ *                                  0 otherwise.
+ */
+int
+bcast_harvest_on_adv(const uint8_t *addr, const uint8_t *svc_data, size_t len)
+{
+    struct nebula_bcast bc;
+    struct nebula_bcast_reading r;
+    struct bcast_sensor *s;
+    uint32_t harvested = 0;
+    int bit;
+
+    if (nebula_bcast_parse(&bc, svc_data, len) != 0) {
+        mule_lock(&queue_lock);
+        stats.malformed++;
+        mule_unlock(&queue_lock);
+        return 0;
+    }
+    s = bcast_sensor_get(addr);
+    s->flags = bc.flags;
+    s->heard_us = mule_time_us();
+
+    mule_lock(&queue_lock);
+    stats.reports++;
+    while (nebula_bcast_next(&bc, &r)) {
+        bit = bcast_sensor_bit(s, r.seq);
+        if (bit < 0 || (s->seen >> bit & 1)) {
+            stats.duplicates++;
+        } else if (bcast_queue_put(bc.sensor_id, &r) != 0) {
+            stats.queue_full++;
+        } else {
+            s->seen |= (uint64_t)1 << bit;
+            harvested++;
+        }
+    }
+    stats.harvested += harvested;
+    mule_unlock(&queue_lock);
+
+    if (harvested > 0) {
+        ESP_LOGI(tag, "%u readings from %02x:%02x:%02x:%02x:%02x:%02x",
+                 (unsigned)harvested, addr[5], addr[4], addr[3], addr[2],
+                 addr[1], addr[0]);
+    }
+    return (bc.flags & NEBULA_BCAST_F_BULK) ||
+           ((bc.flags & NEBULA_BCAST_F_ACK) && (s->seen & ~s->acked) != 0);
+}
+
+/**
+ * Builds the ack list for a sensor this mule is connected to, covering every
+ * reading harvested from it and not yet acked.  Report the write's outcome
+ * with bcast_harvest_ack_done().  Host task.
+ *
+ * @param out                   Room for NEBULA_BCAST_ACK_MAX_BYTES.
+ *
+ * @return                      The list's length; 0 if there is nothing to
+ *                                  ack.
+ */
+size_t
+bcast_harvest_ack_list(const uint8_t *addr, uint8_t *out)
+{
+    struct bcast_sensor *s = bcast_sensor_find(addr);
+
+    if (s == NULL) {
+        return 0;
+    }
+    s->inflight = s->seen & ~s->acked;
+    return nebula_bcast_ack_encode(out, s->base, s->inflight);
+}
+
+/**
+ * Records whether the ack list reached the sensor.  Host task.
+ *
+ * @return                      1 if the sensor has a transfer waiting, so
+ *                                  the connection is worth keeping; 0
+ *                                  otherwise.
+ */
+int
+bcast_harvest_ack_done(const uint8_t *addr, int ok)
+{
+    struct bcast_sensor *s = bcast_sensor_find(addr);
+    uint16_t n = 0;
+
+    if (s == NULL) {
+        return 0;
+    }
+    if (ok) {
+        s->acked |= s->inflight;
+        while (n < NEBULA_BCAST_ACK_WINDOW &&
+               ((s->seen & s->acked) >> n & 1)) {
+            n++;
+        }
+        bcast_sensor_shift(s, n);
+        mule_lock(&queue_lock);
+        stats.acks_written++;
+        mule_unlock(&queue_lock);
+    }
+    s->inflight = 0;
+    return (s->flags & NEBULA_BCAST_F_BULK) != 0;
+}
+
+/**
+ * Copies as many whole queued records as fit in cap, oldest first, without
+ * taking them off the queue.
+ *
+ * @return                      The bytes copied.
+ */
+size_t
+bcast_harvest_peek(uint8_t *out, size_t cap)
+{
+    size_t len = 0;
+    size_t n;
+
+    mule_lock(&queue_lock);
+    while (len + BCAST_HARVEST_RECORD_HEADER_BYTES <= queue_len) {
+        n = BCAST_HARVEST_RECORD_HEADER_BYTES +
+            queue[len + BCAST_HARVEST_RECORD_HEADER_BYTES - 1];
+        if (len + n > cap) {
+            break;
+        }
+        len += n;
+    }
+    memcpy(out, queue, len);
+    mule_unlock(&queue_lock);
+    return len;
+}
+
+/** Takes the first len bytes, as returned by bcast_harvest_peek(), off the
+ * queue. */
+void
+bcast_harvest_drop(size_t len)
+{
+    mule_lock(&queue_lock);
+    if (len > queue_len) {
+        len = queue_len;
+    }
+    memmove(queue, &queue[len], queue_len - len);
+    queue_len -= len;
+    mule_unlock(&queue_lock);
+}
+
+void
+bcast_harvest_get_stats(struct bcast_harvest_stats *out)
+{
+    mule_lock(&queue_lock);
+    *out = stats;
+    mule_unlock(&queue_lock);
+}
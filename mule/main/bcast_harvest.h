@@ -0,0 +1,57 @@
+/*
+ * Readings harvested from sensors' broadcasts (common/nebula_bcast.h).
+ */
+
+#ifndef H_BCAST_HARVEST_
+#define H_BCAST_HARVEST_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "nebula_bcast.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Broadcasting sensors tracked at once, least recently heard replaced. */
+#ifndef BCAST_HARVEST_SENSORS
+#define BCAST_HARVEST_SENSORS       16
+#endif
+
+/** Bytes of harvested readings held for the uplink. */
+#ifndef BCAST_HARVEST_QUEUE_BYTES
+#define BCAST_HARVEST_QUEUE_BYTES   4096
+#endif
+
+#define BCAST_HARVEST_ADDR_BYTES    6
+
+/*
+ * Each queued reading is laid out for the appserver's /bcast_readings as
+ * sensor_id || seq (u16, little-endian) || len || sealed[len].
+ */
+#define BCAST_HARVEST_RECORD_HEADER_BYTES \
+    (NEBULA_SENSOR_ID_BYTES + NEBULA_BCAST_READING_HEADER_BYTES)
+
+struct bcast_harvest_stats {
+    uint32_t reports;
+    uint32_t harvested;
+    uint32_t duplicates;
+    /* Dropped, and left unacked, because the queue was full. */
+    uint32_t queue_full;
+    uint32_t malformed;
+    uint32_t acks_written;
+};
+
+int bcast_harvest_on_adv(const uint8_t *addr, const uint8_t *svc_data,
+                         size_t len);
+size_t bcast_harvest_ack_list(const uint8_t *addr, uint8_t *out);
+int bcast_harvest_ack_done(const uint8_t *addr, int ok);
+size_t bcast_harvest_peek(uint8_t *out, size_t cap);
+void bcast_harvest_drop(size_t len);
+void bcast_harvest_get_stats(struct bcast_harvest_stats *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
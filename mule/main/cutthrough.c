@@ -0,0 +1,351 @@
+/*
+ * Cut-through forwarding: streams a sensor transfer to the appserver while it
+ * is still arriving over BLE.
+ *
+ * A transfer starts with the sensor's SignedHashPayload, so as soon as the
+ * first chunk lands the mule knows everything /deliver_hash needs.  The
+ * forwarder then writes /deliver_hash and a chunked /deliver_data on its own
+ * keep-alive connection without waiting for either answer; the appserver
+ * handles the two in order, so the predelivery is in place before it reads
+ * the data.  Every chunk the BLE task reassembles is forwarded as an HTTP
+ * chunk, and the last one closes the body.  Sensor-to-appserver latency is
+ * then the BLE transfer time plus one round trip, instead of the transfer
+ * time plus two.
+ *
+ * The BLE task keeps writing into the same pool block the forwarder reads
+ * from; it only publishes how many bytes are valid.  Only one transfer is cut
+ * through at a time.  Anything else, or a stream that fails part way, goes to
+ * the payload store and is delivered by the regular uplink instead.
+ */
+
+#include <string.h>
+#include "cutthrough.h"
+#include "http_conn.h"
+#include "payload_pool.h"
+#include "payload_store.h"
+#include "mule_port.h"
+
+static const char *tag = "CUTTHROUGH";
+
+#define CUT_MAX_BODY        512
+#define CUT_POLL_MS         1000
+
+/* Shared between the BLE task, which fills it in, and the forwarder. */
+struct cut_stream {
+    uint16_t conn_handle;
+    uint8_t active;
+    uint8_t done;
+    uint8_t aborted;
+    uint8_t *block;
+    size_t avail;
+    uint8_t has_digest;
+    uint8_t digest[NEBULA_SHA256_BYTES];
+};
+
+static struct cutthrough_config cfg;
+static struct cutthrough_stats stats;
+static struct http_conn conn;
+
+static struct cut_stream stream;
+static mule_lock_t stream_lock = MULE_LOCK_INITIALIZER;
+static mule_event_t stream_wake;
+
+int
+cutthrough_init(const struct cutthrough_config *config)
+{
+    cfg = *config;
+    memset(&stats, 0, sizeof stats);
+    memset(&stream, 0, sizeof stream);
+    http_conn_init(&conn, cfg.host, cfg.port);
+    mule_event_init(&stream_wake);
+    return 0;
+}
+
+void
+cutthrough_get_stats(struct cutthrough_stats *out)
+{
+    *out = stats;
+}
+
+/**
+ * Offers a transfer for cut-through.  On success the forwarder owns the pool
+ * block: the caller keeps filling it, reports progress, and must not free it.
+ *
+ * @param block                 Reassembly block for the transfer.
+ * @param avail                 Bytes received so far; must cover the
+ *                                  SignedHashPayload.
+ *
+ * @return                      0 if the transfer is being cut through; -1 if
+ *                                  the caller should store it as usual.
+ */
+int
+cutthrough_begin(uint16_t conn_handle, uint8_t *block, size_t avail)
+{
+    if (block == NULL || avail < NEBULA_SIGNED_HASH_PAYLOAD_BYTES) {
+        return -1;
+    }
+
+    mule_lock(&stream_lock);
+    if (stream.active) {
+        mule_unlock(&stream_lock);
+        return -1;
+    }
+    stream.conn_handle = conn_handle;
+    stream.active = 1;
+    stream.done = 0;
+    stream.aborted = 0;
+    stream.block = block;
+    stream.avail = avail;
+    stream.has_digest = 0;
+    mule_unlock(&stream_lock);
+
+    /* A disconnect must not free the block out from under the forwarder. */
+    payload_pool_set_owner(block, PAYLOAD_POOL_OWNER_NONE);
+    mule_event_signal(&stream_wake);
+    return 0;
+}
+
+static void
+cutthrough_update(uint16_t conn_handle, size_t avail, uint8_t done,
+                  uint8_t aborted, const uint8_t *digest)
+{
+    mule_lock(&stream_lock);
+    if (stream.active && stream.conn_handle == conn_handle &&
+            !stream.done && !stream.aborted) {
+        if (avail > stream.avail) {
+            stream.avail = avail;
+        }
+        if (digest != NULL) {
+            memcpy(stream.digest, digest, NEBULA_SHA256_BYTES);
+            stream.has_digest = 1;
+        }
+        stream.done = done;
+        stream.aborted = aborted;
+    }
+    mule_unlock(&stream_lock);
+    mule_event_signal(&stream_wake);
+}
+
+void
+cutthrough_progress(uint16_t conn_handle, size_t avail)
+{
+    cutthrough_update(conn_handle, avail, 0, 0, NULL);
+}
+
+/**
+ * Marks the transfer complete.  The block stays with the forwarder, which
+ * frees it once delivered or hands it to the payload store along with the
+ * digest computed while it was received.
+ */
+void
+cutthrough_end(uint16_t conn_handle, size_t len, const uint8_t *digest)
+{
+    cutthrough_update(conn_handle, len, 1, 0, digest);
+}
+
+/**
+ * Drops a transfer that will never complete, e.g. on disconnect.  The
+ * forwarder abandons the request and frees the block.
+ */
+void
+cutthrough_abort(uint16_t conn_handle)
+{
+    cutthrough_update(conn_handle, 0, 0, 1, NULL);
+}
+
+static void
+cut_snapshot(struct cut_stream *out)
+{
+    mule_lock(&stream_lock);
+    *out = stream;
+    mule_unlock(&stream_lock);
+}
+
+/**
+ * Reads the /deliver_hash and /deliver_data answers and checks that the token
+ * payload echoes the nonce and hash of the predelivery.
+ */
+static int
+cut_finish(const uint8_t *block)
+{
+    static uint8_t body[CUT_MAX_BODY];
+    uint8_t nonce[NEBULA_DELIVER_NONCE_BYTES];
+    const uint8_t *data_hash;
+    size_t body_len;
+    int server_close;
+    int hash_ok;
+    int status;
+    int rc;
+
+    data_hash = block + NEBULA_SENSOR_ID_BYTES;
+
+    rc = http_conn_read_response(&conn, &status, body, sizeof body, &body_len,
+                                 &server_close);
+    if (rc != 0 && rc != HTTP_CONN_E2BIG) {
+        return rc;
+    }
+    hash_ok = rc == 0 && status == 200 &&
+              body_len >= NEBULA_DELIVER_NONCE_BYTES + NEBULA_SHA256_BYTES &&
+              memcmp(body + NEBULA_DELIVER_NONCE_BYTES, data_hash,
+                     NEBULA_SHA256_BYTES) == 0;
+    if (hash_ok) {
+        memcpy(nonce, body, sizeof nonce);
+    } else {
+        /* The data request is answered regardless; drain it below. */
+        ESP_LOGW(tag, "appserver refused hash; status=%d", status);
+    }
+
+    if (server_close) {
+        http_conn_close(&conn);
+        return HTTP_CONN_EIO;
+    }
+
+    rc = http_conn_read_response(&conn, &status, body, sizeof body, &body_len,
+                                 &server_close);
+    if (server_close) {
+        http_conn_close(&conn);
+    }
+    if (rc != 0) {
+        return rc;
+    }
+    if (!hash_ok || status != 200 ||
+            body_len != NEBULA_SIGNED_TOKEN_PAYLOAD_BYTES ||
+            memcmp(body, nonce, NEBULA_DELIVER_NONCE_BYTES) != 0 ||
+            memcmp(body + NEBULA_DELIVER_NONCE_BYTES + NEBULA_TOKEN_BYTES,
+                   data_hash, NEBULA_SHA256_BYTES) != 0) {
+        ESP_LOGW(tag, "appserver refused data; status=%d", status);
+        return HTTP_CONN_EPROTO;
+    }
+
+    if (cfg.on_token != NULL) {
+        cfg.on_token(body, body_len, cfg.on_token_arg);
+    }
+    return 0;
+}
+
+/**
+ * Forwards the current stream until the BLE side finishes or abandons it.
+ */
+static void
+cut_stream_run(void)
+{
+    struct cut_stream snap;
+    int64_t last_progress;
+    uint8_t *block;
+    size_t sent;
+    int ok;
+    int rc;
+
+    cut_snapshot(&snap);
+    block = snap.block;
+    sent = NEBULA_SIGNED_HASH_PAYLOAD_BYTES;
+    stats.started++;
+
+    if (http_conn_is_open(&conn) && !http_conn_alive(&conn)) {
+        http_conn_close(&conn);
+    }
+    rc = 0;
+    if (!http_conn_is_open(&conn)) {
+        rc = http_conn_open(&conn);
+    }
+    if (rc == 0) {
+        rc = http_conn_post(&conn, "/deliver_hash", block,
+                            NEBULA_SIGNED_HASH_PAYLOAD_BYTES);
+    }
+    if (rc == 0) {
+        rc = http_conn_post_chunked(&conn, "/deliver_data");
+    }
+    if (rc == 0) {
+        rc = http_conn_flush(&conn);
+    }
+    ok = rc == 0;
+    if (!ok) {
+        http_conn_close(&conn);
+    }
+
+    last_progress = mule_time_us();
+    for (;;) {
+        cut_snapshot(&snap);
+
+        if (snap.aborted) {
+            /* Half a chunked body cannot be finished; drop the connection. */
+            http_conn_close(&conn);
+            payload_pool_free(block);
+            stats.aborted++;
+            break;
+        }
+
+        if (ok && snap.avail > sent) {
+            rc = http_conn_write_chunk(&conn, block + sent, snap.avail - sent);
+            if (rc == 0) {
+                rc = http_conn_flush(&conn);
+            }
+            if (rc != 0) {
+                ok = 0;
+                http_conn_close(&conn);
+            }
+            sent = snap.avail;
+            last_progress = mule_time_us();
+        }
+
+        if (snap.done) {
+            if (ok) {
+                rc = http_conn_end_chunks(&conn);
+                if (rc == 0) {
+                    rc = http_conn_flush(&conn);
+                }
+                if (rc == 0) {
+                    rc = cut_finish(block);
+                }
+                ok = rc == 0;
+                if (rc == HTTP_CONN_EIO) {
+                    http_conn_close(&conn);
+                }
+            }
+
+            if (ok) {
+                stats.delivered++;
+                payload_pool_free(block);
+            } else {
+                stats.fallbacks++;
+                if (payload_store_add(block, snap.avail,
+                                      snap.has_digest ? snap.digest : NULL) != 0) {
+                    payload_pool_free(block);
+                }
+            }
+            break;
+        }
+
+        if (ok && mule_time_us() - last_progress >
+                (int64_t)CUTTHROUGH_STALL_MS * 1000) {
+            /* Don't hold the appserver's request open for a stalled sensor. */
+            ESP_LOGW(tag, "sensor stalled; falling back to store-and-forward");
+            ok = 0;
+            http_conn_close(&conn);
+        }
+
+        mule_event_wait(&stream_wake, CUT_POLL_MS);
+    }
+
+    mule_lock(&stream_lock);
+    memset(&stream, 0, sizeof stream);
+    mule_unlock(&stream_lock);
+}
+
+/**
+ * Forwarder loop; run it in its own task so that socket I/O never blocks the
+ * BLE host.
+ */
+void
+cutthrough_run(void)
+{
+    struct cut_stream snap;
+
+    for (;;) {
+        mule_event_wait(&stream_wake, CUT_POLL_MS);
+        cut_snapshot(&snap);
+        if (snap.active) {
+            cut_stream_run();
+        }
+    }
+}
@@ -0,0 +1,50 @@
+/*
+ * Cut-through forwarding: streams a sensor transfer to the appserver while it
+ * is still arriving over BLE.
+ */
+
+#ifndef H_CUTTHROUGH_
+#define H_CUTTHROUGH_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "uplink.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** A stream whose sensor sends nothing for this long is given up on. */
+#define CUTTHROUGH_STALL_MS     10000
+
+struct cutthrough_config {
+    const char *host;
+    uint16_t port;
+
+    /** Receives the SignedTokenPayload for every streamed delivery. */
+    uplink_token_fn *on_token;
+    void *on_token_arg;
+};
+
+struct cutthrough_stats {
+    uint32_t started;
+    uint32_t delivered;
+    uint32_t fallbacks;
+    uint32_t aborted;
+};
+
+int cutthrough_init(const struct cutthrough_config *cfg);
+void cutthrough_run(void);
+
+int cutthrough_begin(uint16_t conn_handle, uint8_t *block, size_t avail);
+void cutthrough_progress(uint16_t conn_handle, size_t avail);
+void cutthrough_end(uint16_t conn_handle, size_t len, const uint8_t *digest);
+void cutthrough_abort(uint16_t conn_handle);
+
+void cutthrough_get_stats(struct cutthrough_stats *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,302 @@
+/*
+ * Approximate set of payload hashes this mule has already handled.
+ *
+ * Sensors offer the same payload to several mules, and the appserver only
+ * rejects a copy once it has crossed the WAN.  The mule keeps the hashes of
+ * payloads it stored or delivered, plus the appserver's own seen hashes
+ * pulled as a delta, so a known payload is turned away after its first
+ * chunk.
+ *
+ * The set is a Bloom filter in two generations: hashes go into the current
+ * one and lookups check both.  Once the current generation has taken
+ * DEDUP_FILTER_GEN_ENTRIES hashes it becomes the previous one and the old
+ * previous is dropped, so the filter ages out instead of saturating.  The
+ * probes are taken straight from the SHA-256 digest, which is already
+ * uniform.  A false positive only costs the sensor a hand-off to another
+ * mule.  On ESP the filter and the delta cursor are kept in NVS.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include "dedup_filter.h"
+#include "mule_port.h"
+
+#ifdef ESP_PLATFORM
+#include "nvs.h"
+
+#define DEDUP_FILTER_NVS_NAMESPACE  "nebula"
+#define DEDUP_FILTER_NVS_KEY        "dedup_filter"
+#endif
+
+#define DEDUP_FILTER_BYTES      (DEDUP_FILTER_BITS / 8)
+
+#if (DEDUP_FILTER_BITS & (DEDUP_FILTER_BITS - 1)) != 0
+#error "DEDUP_FILTER_BITS must be a power of two"
+#endif
+#if DEDUP_FILTER_PROBES > NEBULA_SHA256_BYTES / 4
+#error "DEDUP_FILTER_PROBES must fit in one digest"
+#endif
+
+static const char *tag = "DEDUP";
+
+/* Also the NVS layout; bits and probes guard against a changed config. */
+struct dedup_state {
+    uint16_t bits_log2;
+    uint8_t probes;
+    uint8_t reserved;
+    uint32_t entries;
+    uint32_t delta_instance;
+    uint32_t delta_next;
+    uint8_t gen[2][DEDUP_FILTER_BYTES];     /* current, previous */
+};
+
+static struct dedup_state filter;
+static int dirty;
+static struct dedup_filter_stats stats;
+static mule_lock_t filter_lock = MULE_LOCK_INITIALIZER;
+
+static uint16_t
+dedup_bits_log2(void)
+{
+    uint16_t n = 0;
+
+    while ((1u << n) < DEDUP_FILTER_BITS) {
+        n++;
+    }
+    return n;
+}
+
+static uint32_t
+dedup_load_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+           (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t
+dedup_probe(const uint8_t *digest, int i)
+{
+    return dedup_load_le32(digest + 4 * i) & (DEDUP_FILTER_BITS - 1);
+}
+
+static int
+dedup_gen_contains(const uint8_t *gen, const uint8_t *digest)
+{
+    uint32_t bit;
+    int i;
+
+    for (i = 0; i < DEDUP_FILTER_PROBES; i++) {
+        bit = dedup_probe(digest, i);
+        if ((gen[bit >> 3] & (1u << (bit & 7))) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Call with filter_lock held. */
+static void
+dedup_add_locked(const uint8_t *digest)
+{
+    uint8_t *gen = filter.gen[0];
+    uint8_t mask;
+    uint32_t bit;
+    int fresh = 0;
+    int i;
+
+    for (i = 0; i < DEDUP_FILTER_PROBES; i++) {
+        bit = dedup_probe(digest, i);
+        mask = 1u << (bit & 7);
+        if ((gen[bit >> 3] & mask) == 0) {
+            gen[bit >> 3] |= mask;
+            fresh = 1;
+        }
+    }
+    if (!fresh) {
+        return;
+    }
+
+    dirty = 1;
+    if (++filter.entries >= DEDUP_FILTER_GEN_ENTRIES) {
+        memcpy(filter.gen[1], filter.gen[0], DEDUP_FILTER_BYTES);
+        memset(filter.gen[0], 0, DEDUP_FILTER_BYTES);
+        filter.entries = 0;
+        stats.rotations++;
+    }
+}
+
+int
+dedup_filter_init(void)
+{
+    memset(&filter, 0, sizeof filter);
+    filter.bits_log2 = dedup_bits_log2();
+    filter.probes = DEDUP_FILTER_PROBES;
+    dirty = 0;
+    memset(&stats, 0, sizeof stats);
+
+#ifdef ESP_PLATFORM
+    static struct dedup_state saved;
+    size_t len = sizeof saved;
+    nvs_handle_t nvs;
+
+    if (nvs_open(DEDUP_FILTER_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        if (nvs_get_blob(nvs, DEDUP_FILTER_NVS_KEY, &saved, &len) == ESP_OK &&
+                len == sizeof saved && saved.bits_log2 == filter.bits_log2 &&
+                saved.probes == filter.probes) {
+            filter = saved;
+            ESP_LOGI(tag, "loaded filter from nvs; delta cursor %" PRIu32,
+                     filter.delta_next);
+        }
+        nvs_close(nvs);
+    }
+#endif
+
+    return 0;
+}
+
+/**
+ * Records a payload hash as handled.
+ */
+void
+dedup_filter_add(const uint8_t *digest)
+{
+    mule_lock(&filter_lock);
+    dedup_add_locked(digest);
+    stats.added++;
+    mule_unlock(&filter_lock);
+}
+
+/**
+ * Whether a payload hash has (probably) been handled already.
+ */
+int
+dedup_filter_contains(const uint8_t *digest)
+{
+    int found;
+
+    mule_lock(&filter_lock);
+    found = dedup_gen_contains(filter.gen[0], digest) ||
+            dedup_gen_contains(filter.gen[1], digest);
+    if (found) {
+        stats.hits++;
+    }
+    mule_unlock(&filter_lock);
+    return found;
+}
+
+/**
+ * Builds the appserver request for the seen hashes added since the last
+ * delta applied.
+ *
+ * @param limit                 The most hashes to ask for.
+ *
+ * @return                      0 on success; -1 if path is too small.
+ */
+int
+dedup_filter_delta_path(char *path, size_t cap, uint32_t limit)
+{
+    uint32_t instance;
+    uint32_t next;
+    int n;
+
+    mule_lock(&filter_lock);
+    instance = filter.delta_instance;
+    next = filter.delta_next;
+    mule_unlock(&filter_lock);
+
+    n = snprintf(path, cap,
+                 "/seen_hashes?since=%" PRIu32 "&limit=%" PRIu32
+                 "&instance=%" PRIu32, next, limit, instance);
+    return n < 0 || (size_t)n >= cap ? -1 : 0;
+}
+
+/**
+ * Merges a SeenHashDelta from the appserver and advances the cursor.
+ *
+ * @return                      The number of hashes merged; -1 if the delta
+ *                                  is malformed.
+ */
+int
+dedup_filter_apply_delta(const uint8_t *delta, size_t len)
+{
+    const uint8_t *digest;
+    size_t n;
+    size_t i;
+
+    if (len < NEBULA_SEEN_DELTA_HEADER_BYTES ||
+            (len - NEBULA_SEEN_DELTA_HEADER_BYTES) % NEBULA_SHA256_BYTES != 0) {
+        ESP_LOGW(tag, "malformed seen hash delta; %u bytes", (unsigned)len);
+        return -1;
+    }
+    n = (len - NEBULA_SEEN_DELTA_HEADER_BYTES) / NEBULA_SHA256_BYTES;
+    digest = delta + NEBULA_SEEN_DELTA_HEADER_BYTES;
+
+    mule_lock(&filter_lock);
+    for (i = 0; i < n; i++) {
+        dedup_add_locked(digest);
+        digest += NEBULA_SHA256_BYTES;
+    }
+    filter.delta_instance = dedup_load_le32(delta);
+    filter.delta_next = dedup_load_le32(delta + 4);
+    stats.delta_hashes += n;
+    dirty = 1;
+    mule_unlock(&filter_lock);
+
+    return (int)n;
+}
+
+/**
+ * Writes the filter to NVS if it changed since the last save.  Flash wear
+ * is the caller's concern; call it on a timer rather than per hash.
+ *
+ * @return                      0 on success or if there was nothing to save.
+ */
+int
+dedup_filter_save(void)
+{
+#ifdef ESP_PLATFORM
+    static struct dedup_state snapshot;
+    nvs_handle_t nvs;
+    esp_err_t err;
+
+    mule_lock(&filter_lock);
+    if (!dirty) {
+        mule_unlock(&filter_lock);
+        return 0;
+    }
+    snapshot = filter;
+    dirty = 0;
+    mule_unlock(&filter_lock);
+
+    err = nvs_open(DEDUP_FILTER_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(nvs, DEDUP_FILTER_NVS_KEY, &snapshot, sizeof snapshot);
+        if (err == ESP_OK) {
+            err = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(tag, "failed to persist filter; err=%d", err);
+        mule_lock(&filter_lock);
+        dirty = 1;
+        mule_unlock(&filter_lock);
+        return -1;
+    }
+#else
+    mule_lock(&filter_lock);
+    dirty = 0;
+    mule_unlock(&filter_lock);
+#endif
+
+    return 0;
+}
+
+void
+dedup_filter_get_stats(struct dedup_filter_stats *out)
+{
+    mule_lock(&filter_lock);
+    *out = stats;
+    mule_unlock(&filter_lock);
+}
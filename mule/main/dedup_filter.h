@@ -0,0 +1,56 @@
+/*
+ * Approximate set of payload hashes this mule has already handled.
+ */
+
+#ifndef H_DEDUP_FILTER_
+#define H_DEDUP_FILTER_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "nebula_proto.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Bits in each of the two filter generations; a power of two. */
+#ifndef DEDUP_FILTER_BITS
+#define DEDUP_FILTER_BITS       16384
+#endif
+
+/** Probes per hash. */
+#ifndef DEDUP_FILTER_PROBES
+#define DEDUP_FILTER_PROBES     7
+#endif
+
+/*
+ * Hashes added to a generation before it is retired.  ~12 bits per entry
+ * keeps the false positive rate of both generations together under 1%.
+ */
+#ifndef DEDUP_FILTER_GEN_ENTRIES
+#define DEDUP_FILTER_GEN_ENTRIES    (DEDUP_FILTER_BITS / 12)
+#endif
+
+struct dedup_filter_stats {
+    uint32_t added;
+    uint32_t hits;
+    uint32_t delta_hashes;
+    uint32_t rotations;
+};
+
+int dedup_filter_init(void);
+void dedup_filter_add(const uint8_t *digest);
+int dedup_filter_contains(const uint8_t *digest);
+
+int dedup_filter_delta_path(char *path, size_t cap, uint32_t limit);
+int dedup_filter_apply_delta(const uint8_t *delta, size_t len);
+
+int dedup_filter_save(void);
+
+void dedup_filter_get_stats(struct dedup_filter_stats *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,412 @@
+/*
+ * Minimal keep-alive HTTP/1.1 client connection for talking to the appserver.
+ *
+ * Only what the Nebula endpoints need: GET, POST with a Content-Length or
+ * chunked body, and responses carrying a Content-Length.  Requests are buffered so
+ * that several can be pipelined in one write.  Like the uplink it serves,
+ * nothing here is ESP-specific beyond the socket headers.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "http_conn.h"
+#include "mule_port.h"
+
+#ifdef ESP_PLATFORM
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+#else
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static const char *tag = "HTTP_CONN";
+
+void
+http_conn_init(struct http_conn *conn, const char *host, uint16_t port)
+{
+    memset(conn, 0, sizeof *conn);
+    conn->host = host;
+    conn->port = port;
+    conn->sock = -1;
+}
+
+int
+http_conn_is_open(const struct http_conn *conn)
+{
+    return conn->sock >= 0;
+}
+
+void
+http_conn_close(struct http_conn *conn)
+{
+    if (conn->sock >= 0) {
+        close(conn->sock);
+        conn->sock = -1;
+    }
+    conn->tx_len = 0;
+    conn->rx_off = 0;
+    conn->rx_len = 0;
+}
+
+int
+http_conn_open(struct http_conn *conn)
+{
+    struct addrinfo hints;
+    struct addrinfo *res;
+    struct timeval tv;
+    char port[8];
+    int one;
+    int rc;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof port, "%u", conn->port);
+
+    rc = getaddrinfo(conn->host, port, &hints, &res);
+    if (rc != 0 || res == NULL) {
+        ESP_LOGW(tag, "cannot resolve %s; rc=%d", conn->host, rc);
+        return HTTP_CONN_ECONNECT;
+    }
+
+    conn->sock = socket(res->ai_family, res->ai_socktype, 0);
+    if (conn->sock < 0) {
+        freeaddrinfo(res);
+        return HTTP_CONN_ECONNECT;
+    }
+
+    tv.tv_sec = HTTP_CONN_IO_TIMEOUT_MS / 1000;
+    tv.tv_usec = (HTTP_CONN_IO_TIMEOUT_MS % 1000) * 1000;
+    setsockopt(conn->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    setsockopt(conn->sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+
+    /* Requests are coalesced in tx_buf already; don't let Nagle hold them. */
+    one = 1;
+    setsockopt(conn->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+    rc = connect(conn->sock, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if (rc != 0) {
+        ESP_LOGW(tag, "connect to %s:%u failed; errno=%d", conn->host,
+                 conn->port, errno);
+        http_conn_close(conn);
+        return HTTP_CONN_ECONNECT;
+    }
+    return 0;
+}
+
+/**
+ * Checks whether the server closed an idle keep-alive connection, so a stale
+ * socket is replaced before requests are written.
+ */
+int
+http_conn_alive(struct http_conn *conn)
+{
+    uint8_t b;
+    int rc;
+
+    if (conn->sock < 0) {
+        return 0;
+    }
+    rc = recv(conn->sock, &b, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (rc == 0) {
+        return 0;
+    }
+    if (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        return 0;
+    }
+    return 1;
+}
+
+static int
+http_conn_send_all(struct http_conn *conn, const uint8_t *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = send(conn->sock, buf, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return HTTP_CONN_EIO;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int
+http_conn_flush(struct http_conn *conn)
+{
+    int rc;
+
+    if (conn->tx_len == 0) {
+        return 0;
+    }
+    rc = http_conn_send_all(conn, conn->tx_buf, conn->tx_len);
+    conn->tx_len = 0;
+    return rc;
+}
+
+/**
+ * Appends bytes to the transmit buffer.  Anything that does not fit is
+ * written straight from the caller's buffer after a flush.
+ */
+static int
+http_conn_write(struct http_conn *conn, const void *buf, size_t len)
+{
+    int rc;
+
+    if (conn->tx_len + len <= sizeof conn->tx_buf) {
+        memcpy(conn->tx_buf + conn->tx_len, buf, len);
+        conn->tx_len += len;
+        return 0;
+    }
+
+    rc = http_conn_flush(conn);
+    if (rc != 0) {
+        return rc;
+    }
+    if (len <= sizeof conn->tx_buf) {
+        memcpy(conn->tx_buf, buf, len);
+        conn->tx_len = len;
+        return 0;
+    }
+    return http_conn_send_all(conn, buf, len);
+}
+
+/**
+ * Appends one POST to the transmit buffer.  Small bodies are coalesced with
+ * the headers; large ones are written straight from the caller's buffer.
+ */
+int
+http_conn_post(struct http_conn *conn, const char *path, const uint8_t *body,
+               size_t body_len)
+{
+    char hdr[160];
+    int hdr_len;
+    int rc;
+
+    hdr_len = snprintf(hdr, sizeof hdr,
+                       "POST %s HTTP/1.1\r\n"
+                       "Host: %s:%u\r\n"
+                       "Content-Type: application/octet-stream\r\n"
+                       "Content-Length: %u\r\n\r\n",
+                       path, conn->host, conn->port, (unsigned)body_len);
+
+    rc = http_conn_write(conn, hdr, hdr_len);
+    if (rc != 0) {
+        return rc;
+    }
+    return http_conn_write(conn, body, body_len);
+}
+
+int
+http_conn_get(struct http_conn *conn, const char *path)
+{
+    char hdr[160];
+    int hdr_len;
+
+    hdr_len = snprintf(hdr, sizeof hdr,
+                       "GET %s HTTP/1.1\r\n"
+                       "Host: %s:%u\r\n\r\n",
+                       path, conn->host, conn->port);
+
+    return http_conn_write(conn, hdr, hdr_len);
+}
+
+/**
+ * Starts a POST whose body follows in http_conn_write_chunk() calls, for
+ * bodies whose length is not known when the request has to go out.
+ */
+int
+http_conn_post_chunked(struct http_conn *conn, const char *path)
+{
+    char hdr[160];
+    int hdr_len;
+
+    hdr_len = snprintf(hdr, sizeof hdr,
+                       "POST %s HTTP/1.1\r\n"
+                       "Host: %s:%u\r\n"
+                       "Content-Type: application/octet-stream\r\n"
+                       "Transfer-Encoding: chunked\r\n\r\n",
+                       path, conn->host, conn->port);
+
+    return http_conn_write(conn, hdr, hdr_len);
+}
+
+int
+http_conn_write_chunk(struct http_conn *conn, const uint8_t *data, size_t len)
+{
+    char size[12];
+    int size_len;
+    int rc;
+
+    if (len == 0) {
+        return 0;
+    }
+
+    size_len = snprintf(size, sizeof size, "%x\r\n", (unsigned)len);
+    rc = http_conn_write(conn, size, size_len);
+    if (rc == 0) {
+        rc = http_conn_write(conn, data, len);
+    }
+    if (rc == 0) {
+        rc = http_conn_write(conn, "\r\n", 2);
+    }
+    return rc;
+}
+
+int
+http_conn_end_chunks(struct http_conn *conn)
+{
+    return http_conn_write(conn, "0\r\n\r\n", 5);
+}
+
+static int
+http_conn_recv_more(struct http_conn *conn)
+{
+    ssize_t n;
+
+    if (conn->rx_off > 0) {
+        memmove(conn->rx_buf, conn->rx_buf + conn->rx_off,
+                conn->rx_len - conn->rx_off);
+        conn->rx_len -= conn->rx_off;
+        conn->rx_off = 0;
+    }
+    if (conn->rx_len == sizeof conn->rx_buf) {
+        return HTTP_CONN_EPROTO;
+    }
+
+    n = recv(conn->sock, conn->rx_buf + conn->rx_len,
+             sizeof conn->rx_buf - conn->rx_len, 0);
+    if (n <= 0) {
+        return HTTP_CONN_EIO;
+    }
+    conn->rx_len += n;
+    return 0;
+}
+
+static const uint8_t *
+http_conn_find_hdr_end(const struct http_conn *conn)
+{
+    size_t i;
+
+    for (i = conn->rx_off; i + 4 <= conn->rx_len; i++) {
+        if (memcmp(conn->rx_buf + i, "\r\n\r\n", 4) == 0) {
+            return conn->rx_buf + i;
+        }
+    }
+    return NULL;
+}
+
+/* Whether a comma-separated header value, ending at CRLF or NUL, lists
+ * token. */
+static int
+http_conn_hdr_has_token(const char *value, const char *token)
+{
+    size_t token_len = strlen(token);
+    size_t len;
+
+    for (;;) {
+        while (*value == ' ' || *value == '\t' || *value == ',') {
+            value++;
+        }
+        if (*value == '\0' || *value == '\r') {
+            return 0;
+        }
+        len = strcspn(value, ",\r");
+        while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t')) {
+            len--;
+        }
+        if (len == token_len && strncasecmp(value, token, len) == 0) {
+            return 1;
+        }
+        value += strcspn(value, ",\r");
+    }
+}
+
+/**
+ * Reads one response off the connection.  A body longer than body_cap is
+ * still consumed, so the connection stays usable, but the call returns
+ * HTTP_CONN_E2BIG with *body_len set to the full Content-Length and only the
+ * first body_cap bytes in body.
+ */
+int
+http_conn_read_response(struct http_conn *conn, int *status, uint8_t *body,
+                        size_t body_cap, size_t *body_len, int *server_close)
+{
+    const uint8_t *end;
+    const char *line;
+    size_t content_len;
+    size_t total_len;
+    size_t take;
+    int rc;
+
+    while ((end = http_conn_find_hdr_end(conn)) == NULL) {
+        rc = http_conn_recv_more(conn);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+
+    /* Status line and headers are NUL-terminated in place for parsing. */
+    conn->rx_buf[end - conn->rx_buf] = '\0';
+    line = (const char *)conn->rx_buf + conn->rx_off;
+    if (sscanf(line, "HTTP/1.%*d %d", status) != 1) {
+        return HTTP_CONN_EPROTO;
+    }
+
+    content_len = 0;
+    *server_close = 0;
+    while ((line = strstr(line, "\r\n")) != NULL) {
+        line += 2;
+        if (strncasecmp(line, "content-length:", 15) == 0) {
+            content_len = strtoul(line + 15, NULL, 10);
+        } else if (strncasecmp(line, "connection:", 11) == 0 &&
+                   http_conn_hdr_has_token(line + 11, "close")) {
+            *server_close = 1;
+        } else if (strncasecmp(line, "transfer-encoding:", 18) == 0) {
+            return HTTP_CONN_EPROTO;
+        }
+    }
+    conn->rx_off = (end - conn->rx_buf) + 4;
+
+    *body_len = 0;
+    total_len = content_len;
+    while (content_len > 0) {
+        if (conn->rx_off == conn->rx_len) {
+            conn->rx_off = conn->rx_len = 0;
+            rc = http_conn_recv_more(conn);
+            if (rc != 0) {
+                return rc;
+            }
+        }
+        take = conn->rx_len - conn->rx_off;
+        if (take > content_len) {
+            take = content_len;
+        }
+        if (*body_len < body_cap) {
+            size_t copy = body_cap - *body_len < take ? body_cap - *body_len : take;
+            memcpy(body + *body_len, conn->rx_buf + conn->rx_off, copy);
+            *body_len += copy;
+        }
+        conn->rx_off += take;
+        content_len -= take;
+    }
+    if (total_len > body_cap) {
+        *body_len = total_len;
+        return HTTP_CONN_E2BIG;
+    }
+    return 0;
+}
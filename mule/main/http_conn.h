@@ -0,0 +1,63 @@
+/*
+ * Minimal keep-alive HTTP/1.1 client connection for talking to the appserver.
+ */
+
+#ifndef H_HTTP_CONN_
+#define H_HTTP_CONN_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HTTP_CONN_IO_TIMEOUT_MS 5000
+
+#define HTTP_CONN_TX_BUF        2048
+#define HTTP_CONN_RX_BUF        2048
+
+#define HTTP_CONN_EIO           (-1)
+#define HTTP_CONN_ECONNECT      (-2)
+#define HTTP_CONN_EPROTO        (-3)
+#define HTTP_CONN_E2BIG         (-4)    /* body larger than the caller's buffer */
+
+/*
+ * Requests are coalesced in tx_buf until flushed; responses are parsed out
+ * of rx_buf, which may hold the start of the next pipelined response.
+ */
+struct http_conn {
+    const char *host;
+    uint16_t port;
+    int sock;
+
+    uint8_t tx_buf[HTTP_CONN_TX_BUF];
+    size_t tx_len;
+
+    uint8_t rx_buf[HTTP_CONN_RX_BUF];
+    size_t rx_off;
+    size_t rx_len;
+};
+
+void http_conn_init(struct http_conn *conn, const char *host, uint16_t port);
+int http_conn_open(struct http_conn *conn);
+int http_conn_is_open(const struct http_conn *conn);
+int http_conn_alive(struct http_conn *conn);
+void http_conn_close(struct http_conn *conn);
+int http_conn_flush(struct http_conn *conn);
+int http_conn_get(struct http_conn *conn, const char *path);
+int http_conn_post(struct http_conn *conn, const char *path,
+                   const uint8_t *body, size_t body_len);
+int http_conn_post_chunked(struct http_conn *conn, const char *path);
+int http_conn_write_chunk(struct http_conn *conn, const uint8_t *data,
+                          size_t len);
+int http_conn_end_chunks(struct http_conn *conn);
+int http_conn_read_response(struct http_conn *conn, int *status,
+                            uint8_t *body, size_t body_cap, size_t *body_len,
+                            int *server_close);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
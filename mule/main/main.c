@@ -12,6 +12,7 @@
 #include "freertos/task.h"
 #include "esp_chip_info.h"
 #include "esp_flash.h"
+#include "esp_mac.h"
 #include "nvs.h"
 #include "nvs_flash.h"
 #include "esp_log.h"
@@ -26,6 +27,23 @@
 #include "services/gap/ble_svc_gap.h"
 #include "blecent.h"
 #include "esp_central.h"
+#include "bcast_harvest.h"
+#include "cutthrough.h"
+#include "dedup_filter.h"
+#include "mule_metrics.h"
+#include "mule_port.h"
+#include "nebula_phy.h"
+#include "nebula_trace.h"
+#include "nebula_xfer.h"
+#include "payload_pool.h"
+#include "payload_store.h"
+#include "sensor_keys.h"
+#include "sensor_telemetry.h"
+#include "sensor_verify.h"
+#include "spsc_ring.h"
+#include "token_wallet.h"
+#include "uplink.h"
+#include "wifi_sta.h"
 
 // mbedtls and/or crypto headers
 #include "mbedtls/ctr_drbg.h"
@@ -39,6 +57,7 @@
 #include "mbedtls/net_sockets.h"
 #include "mbedtls/ssl_cookie.h"
 #include "certs.h"
+#include "appserver_key.h"
 #include "time.h"
 
 struct ble_hs_adv_fields;
@@ -68,28 +87,90 @@ static const ble_uuid_t *metadata_chr_uuid = BLE_UUID128_DECLARE(
     0xB5, 0x4D, 0x22, 0x2B, 0x12, 0x89, 0xE6, 0x32
 );
 
-#define CHUNK_SIZE 200
-#define MAX_PAYLOADS 10
+// Read-only sensor telemetry (NEBULA_TELEMETRY_UUID16); older sensors lack it
+static const ble_uuid_t *telemetry_chr_uuid = BLE_UUID128_DECLARE(
+    0x70, 0x6C, 0x98, 0x41, 0xCE, 0x43, 0x14, 0xA9,
+    0xB5, 0x4D, 0x22, 0x2B, 0x13, 0x89, 0xE6, 0x32
+);
+
+// Broadcast ack list (NEBULA_BCAST_ACK_UUID16); only broadcasting sensors have it
+static const ble_uuid_t *bcast_ack_chr_uuid = BLE_UUID128_DECLARE(
+    0x70, 0x6C, 0x98, 0x41, 0xCE, 0x43, 0x14, 0xA9,
+    0xB5, 0x4D, 0x22, 0x2B, 0x14, 0x89, 0xE6, 0x32
+);
+
+#define CHUNK_SIZE NEBULA_CHUNK_SIZE
 #define READ_TIMEOUT_MS 1000
 #define MAX_RETRY       5
 #define SERVER_NAME "SENSOR_LAB11"
 
+// Discovery pool sizing per link: GAP, GATT and the Nebula service plus spares
+#define PEER_SVCS_PER_LINK  6
+#define PEER_CHRS_PER_LINK  12
+#define PEER_DSCS_PER_LINK  12
+
+// Buffers for the blocking DTLS bio path (ble_read_long / ble_write_long)
 uint8_t sensor_state [CHUNK_SIZE];
-uint8_t sensor_state_data [1500]; // for storing the data 
-uint8_t sensor_state_str [1500]; //for storing the certs 
 uint8_t metadata_state [3];
 
-uint8_t big_data [10000];
-uint8_t *payloads [MAX_PAYLOADS];
-int num_payloads;
+/*
+ * Per-connection receive state. The link and its reassembly buffer are both
+ * allocated from the payload pool under the connection handle, so a
+ * disconnect returns all of it in one payload_pool_release_owner() call.
+ */
+struct mule_link {
+    uint16_t conn_handle;
+    uint16_t metadata_val_handle;
+    uint16_t data_val_handle;
+    /* Metadata, chunk placement and acks for the sensor's transfers. */
+    struct nebula_xfer_rx xfer;
+
+    uint8_t *rx_buf;
+    size_t rx_cap;
+    size_t rx_len;
+    /* A FEC transfer's repair symbols, taken on its first FEC transfer. */
+    uint8_t *fec_store;
+
+    /* rx_buf is being streamed to the appserver and belongs to cutthrough. */
+    uint8_t cut;
+
+    /* Running SHA-256 of the data received so far, past the signed hash. */
+    mule_sha256_t rx_sha;
+    size_t rx_hashed;
+    uint8_t rx_hashing;
+
+    /* sensor_verify ticket for the signed hash, or one of LINK_VERIFY_*. */
+    int verify_ticket;
+    /* The signed hash failed verification; the rest is not kept. */
+    uint8_t rejected;
+    /* The payload is a known duplicate; the sensor was told to stop. */
+    uint8_t skipped;
+
+    /* For mule_metrics: the connection interval, in 1.25 ms units, and the
+     * current transfer's start and notification count. */
+    uint16_t conn_itvl;
+    int64_t rx_started_us;
+    uint32_t rx_notifies;
+};
+
+#define LINK_VERIFY_NONE        (-1)
+#define LINK_VERIFY_UNCHECKED   (-2)
+
+static struct mule_link *links[MYNEWT_VAL(BLE_MAX_CONNECTIONS)];
 
 
 static const char *tag = "MULE_LAB11"; // The Mule is an ESP32 device
 static int mule_ble_gap_event(struct ble_gap_event *event, void *arg);
+static int ble_on_write(uint16_t conn_handle, const struct ble_gatt_error *error,
+                        struct ble_gatt_attr *attr, void *arg);
+static int ble_on_subscribe_meta(uint16_t conn_handle, const struct ble_gatt_error *error,
+                                 struct ble_gatt_attr *attr, void *arg);
+static nebula_radio_send_fn link_radio_send;
 
 uint16_t ble_conn_handle;
-uint16_t metadata_attr_handle;
-uint16_t sensor_attr_handle;
+
+//When the pending ble_gap_connect() was issued; NimBLE allows only one
+static int64_t connect_started_us;
 
 //Silly semaphore to signal when data has been written 
 bool sema_metadata;
@@ -97,6 +178,795 @@ bool sema_data;
 
 void ble_store_config_init();
 
+static struct mule_link *
+link_find(uint16_t conn_handle)
+{
+    int i;
+
+    for (i = 0; i < MYNEWT_VAL(BLE_MAX_CONNECTIONS); i++) {
+        if (links[i] != NULL && links[i]->conn_handle == conn_handle) {
+            return links[i];
+        }
+    }
+    return NULL;
+}
+
+static struct mule_link *
+link_add(uint16_t conn_handle)
+{
+    struct nebula_radio radio;
+    struct mule_link *link;
+    int i;
+
+    for (i = 0; i < MYNEWT_VAL(BLE_MAX_CONNECTIONS); i++) {
+        if (links[i] == NULL) {
+            break;
+        }
+    }
+    if (i == MYNEWT_VAL(BLE_MAX_CONNECTIONS)) {
+        return NULL;
+    }
+
+    link = payload_pool_alloc(sizeof *link, conn_handle);
+    if (link == NULL) {
+        return NULL;
+    }
+
+    memset(link, 0, sizeof *link);
+    link->conn_handle = conn_handle;
+    link->verify_ticket = LINK_VERIFY_NONE;
+    radio.send = link_radio_send;
+    radio.ctx = link;
+    nebula_xfer_rx_init(&link->xfer, &radio, CHUNK_SIZE);
+    links[i] = link;
+    return link;
+}
+
+static void
+link_rx_hash_reset(struct mule_link *link)
+{
+    if (link->rx_hashing) {
+        mule_sha256_abort(&link->rx_sha);
+    }
+    link->rx_hashing = 0;
+    link->rx_hashed = 0;
+}
+
+/*
+ * Folds newly reassembled data into the transfer's running hash, so the
+ * digest is ready the moment the last chunk lands instead of costing a pass
+ * over the whole buffer afterwards.
+ */
+static void
+link_rx_hash(struct mule_link *link)
+{
+    size_t from = link->rx_hashed;
+
+    if (from < NEBULA_SIGNED_HASH_PAYLOAD_BYTES) {
+        from = NEBULA_SIGNED_HASH_PAYLOAD_BYTES;
+    }
+    if (link->rx_len <= from) {
+        return;
+    }
+
+    if (!link->rx_hashing) {
+        mule_sha256_start(&link->rx_sha);
+        link->rx_hashing = 1;
+    }
+    mule_sha256_update(&link->rx_sha, &link->rx_buf[from], link->rx_len - from);
+    link->rx_hashed = link->rx_len;
+}
+
+static void
+link_rx_verify_reset(struct mule_link *link)
+{
+    if (link->verify_ticket >= 0) {
+        sensor_verify_release(link->verify_ticket);
+    }
+    link->verify_ticket = LINK_VERIFY_NONE;
+    link->rejected = 0;
+}
+
+/*
+ * Submits the transfer's signed hash for verification once it has arrived
+ * and reports the verdict so far. Junk from forged or unregistered sensors
+ * is then dropped before it takes up store space or uplink time.
+ */
+static int
+link_rx_verify(struct mule_link *link)
+{
+    if (link->verify_ticket == LINK_VERIFY_NONE &&
+            link->rx_len >= NEBULA_SIGNED_HASH_PAYLOAD_BYTES) {
+        link->verify_ticket = sensor_verify_submit(link->rx_buf);
+        if (link->verify_ticket < 0) {
+            link->verify_ticket = LINK_VERIFY_UNCHECKED;
+        }
+    }
+
+    if (link->verify_ticket >= 0) {
+        return sensor_verify_result(link->verify_ticket);
+    }
+    if (link->verify_ticket == LINK_VERIFY_UNCHECKED) {
+        return SENSOR_VERIFY_ACCEPT;
+    }
+    return SENSOR_VERIFY_PENDING;
+}
+
+/*
+ * Turns away a transfer whose signed hash is already in the dedup filter,
+ * before the rest of it costs airtime or store space. Acks from here on
+ * carry NEBULA_META_SKIP, which tells the sensor to stop; older sensors
+ * just finish sending and the chunks are dropped.
+ */
+static int
+link_rx_skip_known(struct mule_link *link)
+{
+    if (link->verify_ticket != LINK_VERIFY_NONE ||
+            link->rx_len < NEBULA_SIGNED_HASH_PAYLOAD_BYTES ||
+            !dedup_filter_contains(&link->rx_buf[NEBULA_SENSOR_ID_BYTES])) {
+        return 0;
+    }
+
+    NTRACE_INFO(NT_MULE_SKIP, link->conn_handle, 0, 0);
+    link_rx_hash_reset(link);
+    link->rx_len = 0;
+    link->skipped = 1;
+    nebula_xfer_rx_skip(&link->xfer);
+    return 1;
+}
+
+static void
+link_delete(uint16_t conn_handle)
+{
+    int released;
+    int i;
+
+    for (i = 0; i < MYNEWT_VAL(BLE_MAX_CONNECTIONS); i++) {
+        if (links[i] != NULL && links[i]->conn_handle == conn_handle) {
+            link_rx_hash_reset(links[i]);
+            link_rx_verify_reset(links[i]);
+            links[i] = NULL;
+        }
+    }
+
+    /* A transfer being cut through never finishes; the forwarder frees it. */
+    cutthrough_abort(conn_handle);
+
+    released = payload_pool_release_owner(conn_handle);
+    NTRACE_INFO(NT_MULE_LINK_FREE, conn_handle, released, 0);
+    payload_pool_log_stats();
+}
+
+/*
+ * Makes sure the link has a reassembly buffer large enough for the transfer
+ * announced in its metadata. Buffers are sized by the announced chunk count
+ * rather than a worst-case static array.
+ */
+static int
+link_rx_prepare(struct mule_link *link)
+{
+    size_t need = nebula_xfer_rx_expected(&link->xfer);
+
+    //without room for repair symbols a FEC block needs all of its own
+    if (link->xfer.fec && link->fec_store == NULL) {
+        link->fec_store = payload_pool_alloc(
+            nebula_xfer_rx_fec_store_len(&link->xfer), link->conn_handle);
+        if (link->fec_store != NULL) {
+            nebula_xfer_rx_fec_store(&link->xfer, link->fec_store,
+                                     payload_pool_block_size(link->fec_store));
+        }
+    }
+
+    if (need == 0) {
+        return 0;
+    }
+    if (link->rx_buf != NULL && link->rx_cap >= need) {
+        return 0;
+    }
+
+    if (link->cut) {
+        cutthrough_abort(link->conn_handle);
+        link->rx_buf = NULL;
+        link->cut = 0;
+    }
+    payload_pool_free(link->rx_buf);
+    link->rx_buf = payload_pool_alloc(need, link->conn_handle);
+    if (link->rx_buf == NULL) {
+        link->rx_cap = 0;
+        MODLOG_DFLT(ERROR, "no pool block for %u byte transfer; conn_handle=%d\n",
+                    (unsigned)need, link->conn_handle);
+        return BLE_HS_ENOMEM;
+    }
+    link->rx_cap = payload_pool_block_size(link->rx_buf);
+    link->rx_len = 0;
+    link_rx_hash_reset(link);
+    link_rx_verify_reset(link);
+    return 0;
+}
+
+/*
+ * Hands a finished transfer to the payload store, or to the forwarder if it
+ * was cut through. Either takes the pool block as is, so the link starts its
+ * next transfer with a fresh buffer. A transfer whose data does not match the
+ * hash the sensor signed, or whose signature was rejected, is dropped here;
+ * the appserver would refuse it. One still awaiting its verdict goes to the
+ * verifier, which stores it once accepted.
+ */
+static void
+link_rx_commit(struct mule_link *link)
+{
+    uint8_t digest[NEBULA_SHA256_BYTES];
+    int verdict;
+    int valid;
+
+    if (link->skipped) {
+        link->rx_len = 0;
+        link->skipped = 0;
+        return;
+    }
+
+    verdict = link->rejected ? SENSOR_VERIFY_REJECT : link_rx_verify(link);
+
+    link_rx_hash(link);
+    valid = link->rx_hashing && link->rx_len > NEBULA_SIGNED_HASH_PAYLOAD_BYTES;
+    if (valid) {
+        mule_sha256_finish(&link->rx_sha, digest);
+        link->rx_hashing = 0;
+        valid = memcmp(digest, &link->rx_buf[NEBULA_SENSOR_ID_BYTES],
+                       NEBULA_SHA256_BYTES) == 0;
+        if (!valid) {
+            NTRACE_ERROR(NT_MULE_BAD_HASH, link->conn_handle, link->rx_len, 0);
+        }
+    }
+    link_rx_hash_reset(link);
+    valid = valid && verdict != SENSOR_VERIFY_REJECT;
+
+    /* The filter may have learned this hash from the appserver meanwhile. */
+    if (valid && !link->cut && dedup_filter_contains(digest)) {
+        NTRACE_INFO(NT_MULE_DUPLICATE, link->conn_handle, link->rx_len, 0);
+        valid = 0;
+    }
+
+    if (link->cut) {
+        if (valid) {
+            cutthrough_end(link->conn_handle, link->rx_len, digest);
+            dedup_filter_add(digest);
+        } else {
+            cutthrough_abort(link->conn_handle);
+        }
+        link->rx_buf = NULL;
+        link->rx_cap = 0;
+    } else if (valid && verdict == SENSOR_VERIFY_PENDING) {
+        if (sensor_verify_defer(link->verify_ticket, link->rx_buf,
+                                link->rx_len, digest) == 0) {
+            link->verify_ticket = LINK_VERIFY_NONE;
+            link->rx_buf = NULL;
+            link->rx_cap = 0;
+        }
+    } else if (valid &&
+               payload_store_add(link->rx_buf, link->rx_len, digest) == 0) {
+        dedup_filter_add(digest);
+        link->rx_buf = NULL;
+        link->rx_cap = 0;
+    }
+    link->rx_len = 0;
+    link->cut = 0;
+    link_rx_verify_reset(link);
+}
+
+/*
+ * The NimBLE host task runs on core 0 next to the controller and Wi-Fi, and
+ * keeps to radio work: its GAP callbacks copy each event into rx_ring and
+ * return.  mule_rx_task on MULE_PIPELINE_CORE owns the links and does the
+ * reassembly, hashing, dedup and verification, then hands the metadata ack
+ * back through tx_ring for the host task to write.  Each ring has exactly
+ * one producer and one consumer, so neither side takes a lock.
+ */
+#define MULE_PIPELINE_CORE      1
+
+#define RX_RING_SLOTS           32      /* power of two */
+/* Slots notifications may not take, so connection events always fit. */
+#define RX_RING_RESERVE         4
+#define TX_RING_SLOTS           16      /* power of two */
+
+enum rx_event_type {
+    RX_EV_CONNECT,
+    RX_EV_HANDLES,
+    RX_EV_NOTIFY,
+    RX_EV_DISCONNECT,
+};
+
+struct rx_event {
+    uint16_t conn_handle;
+    uint8_t type;
+    uint16_t len;
+    uint16_t attr_handle;
+    /* RX_EV_CONNECT: the connection interval, in 1.25 ms units. */
+    uint16_t conn_itvl;
+    /* RX_EV_HANDLES: the sensor's characteristic value handles. */
+    uint16_t metadata_val_handle;
+    uint16_t data_val_handle;
+    uint8_t data[CHUNK_SIZE];
+};
+
+enum tx_event_type {
+    TX_EV_WRITE,
+    TX_EV_TERMINATE,
+    TX_EV_READ_TELEMETRY,
+};
+
+struct tx_event {
+    uint16_t conn_handle;
+    uint16_t attr_handle;
+    uint8_t type;
+    uint8_t len;
+    uint8_t data[3];
+};
+
+static struct rx_event rx_slots[RX_RING_SLOTS];
+static struct tx_event tx_slots[TX_RING_SLOTS];
+static struct spsc_ring rx_ring;
+static struct spsc_ring tx_ring;
+static mule_event_t rx_wake;
+static struct ble_npl_event tx_drain_ev;
+
+static uint32_t rx_ring_drops;
+static uint32_t tx_ring_drops;
+
+/* Host task: disconnects that found the ring full, oldest first. */
+static uint16_t rx_pending_disconnects[MYNEWT_VAL(BLE_MAX_CONNECTIONS)];
+static int rx_num_pending_disconnects;
+
+static void mule_rx_publish(void);
+
+/*
+ * Host task: a slot for the next event, or NULL if the rx task is behind.
+ * The host task never waits for it.  A dropped notification is a chunk the
+ * sensor sends again; the caller of a dropped connect or handles event ends
+ * the connection.  Notifications leave RX_RING_RESERVE slots free, so that
+ * only happens if the rx task is badly stuck.
+ */
+static struct rx_event *
+mule_rx_claim(uint16_t conn_handle, uint8_t type)
+{
+    struct rx_event *ev;
+    int i;
+
+    /* Disconnects go first, so a handle is never reused before its link is
+     * gone. */
+    for (i = 0; i < rx_num_pending_disconnects; i++) {
+        ev = spsc_ring_claim(&rx_ring);
+        if (ev == NULL) {
+            break;
+        }
+        ev->conn_handle = rx_pending_disconnects[i];
+        ev->type = RX_EV_DISCONNECT;
+        ev->len = 0;
+        mule_rx_publish();
+    }
+    memmove(rx_pending_disconnects, rx_pending_disconnects + i,
+            (rx_num_pending_disconnects - i) * sizeof rx_pending_disconnects[0]);
+    rx_num_pending_disconnects -= i;
+
+    ev = NULL;
+    if (rx_num_pending_disconnects == 0 &&
+            (type != RX_EV_NOTIFY ||
+             spsc_ring_space(&rx_ring) > RX_RING_RESERVE)) {
+        ev = spsc_ring_claim(&rx_ring);
+    }
+    if (ev == NULL) {
+        rx_ring_drops++;
+        NTRACE_WARN(NT_MULE_RX_DROP, conn_handle, type, 0);
+        mule_event_signal(&rx_wake);
+        return NULL;
+    }
+    ev->conn_handle = conn_handle;
+    ev->type = type;
+    ev->len = 0;
+    return ev;
+}
+
+/* Host task: tells the rx task a link is gone, later if the ring is full. */
+static void
+mule_rx_disconnect(uint16_t conn_handle)
+{
+    int i;
+
+    if (mule_rx_claim(conn_handle, RX_EV_DISCONNECT) != NULL) {
+        mule_rx_publish();
+        return;
+    }
+    /* A handle already pending was dropped at connect, so it has no new
+     * link to tear down.  Should the list still fill up, the rx task frees
+     * a stale link when its handle connects again. */
+    for (i = 0; i < rx_num_pending_disconnects; i++) {
+        if (rx_pending_disconnects[i] == conn_handle) {
+            return;
+        }
+    }
+    if (rx_num_pending_disconnects < MYNEWT_VAL(BLE_MAX_CONNECTIONS)) {
+        rx_pending_disconnects[rx_num_pending_disconnects++] = conn_handle;
+    }
+}
+
+static void
+mule_rx_publish(void)
+{
+    spsc_ring_publish(&rx_ring);
+    mule_event_signal(&rx_wake);
+}
+
+/* Rx task: queues a GATT operation for the host task. */
+static void
+mule_tx_push(uint16_t conn_handle, uint8_t type, uint16_t attr_handle,
+             const uint8_t *data, uint8_t len)
+{
+    struct tx_event *ev = spsc_ring_claim(&tx_ring);
+
+    if (ev == NULL) {
+        /* Never block the rx stage on the host; the sensor times out. */
+        tx_ring_drops++;
+        NTRACE_WARN(NT_MULE_TX_DROP, conn_handle, type, 0);
+        return;
+    }
+    ev->conn_handle = conn_handle;
+    ev->type = type;
+    ev->attr_handle = attr_handle;
+    ev->len = len;
+    if (len > 0) {
+        memcpy(ev->data, data, len);
+    }
+    spsc_ring_publish(&tx_ring);
+    ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &tx_drain_ev);
+}
+
+/* rx task: the links' radio; the mule only ever writes the metadata back. */
+static int
+link_radio_send(void *ctx, enum nebula_chr chr, const uint8_t *data,
+                uint16_t len)
+{
+    struct mule_link *link = ctx;
+
+    if (chr != NEBULA_CHR_META || len > sizeof ((struct tx_event *)0)->data) {
+        return NEBULA_XFER_ESIZE;
+    }
+    mule_tx_push(link->conn_handle, TX_EV_WRITE, link->metadata_val_handle,
+                 data, (uint8_t)len);
+    return 0;
+}
+
+/*
+ * Reports a finished transfer to mule_metrics.  Connection events are
+ * estimated from the transfer's duration and the connection interval, so
+ * notifications per event reads as how well each event was packed.
+ */
+static void
+link_rx_metrics(struct mule_link *link)
+{
+    int64_t elapsed;
+    uint32_t events = 0;
+
+    if (link->rx_buf == NULL || link->rx_len < NEBULA_SENSOR_ID_BYTES ||
+            link->rx_notifies == 0) {
+        return;
+    }
+    elapsed = mule_time_us() - link->rx_started_us;
+    if (link->conn_itvl != 0) {
+        events = (uint32_t)(elapsed / (link->conn_itvl * 1250)) + 1;
+    }
+    mule_metrics_transfer(link->rx_buf, link->rx_len, elapsed,
+                          link->rx_notifies, events);
+}
+
+/*
+ * Takes the transfer's first rx_len bytes, which have just grown, through
+ * the hash, the dedup filter and the sensor's key, and starts or keeps up
+ * forwarding them.
+ */
+static void
+link_rx_progress(struct mule_link *link)
+{
+    int verdict = SENSOR_VERIFY_PENDING;
+
+    link_rx_hash(link);
+
+    //start forwarding as soon as the signed hash checks out, if online
+    if (!link_rx_skip_known(link)) {
+        verdict = link_rx_verify(link);
+    }
+    if (link->skipped) {
+        //nothing more to do with this transfer
+    } else if (verdict == SENSOR_VERIFY_REJECT) {
+        link->rejected = 1;
+        link_rx_hash_reset(link);
+        if (link->cut) {
+            cutthrough_abort(link->conn_handle);
+            link->rx_buf = NULL;
+            link->rx_cap = 0;
+            link->cut = 0;
+        }
+        //a FEC transfer is only acked as it decodes; stop it instead
+        if (link->xfer.fec) {
+            nebula_xfer_rx_skip(&link->xfer);
+        }
+    } else if (link->cut) {
+        cutthrough_progress(link->conn_handle, link->rx_len);
+    } else if (verdict == SENSOR_VERIFY_ACCEPT &&
+               wifi_sta_is_connected() &&
+               cutthrough_begin(link->conn_handle, link->rx_buf,
+                                link->rx_len) == 0) {
+        link->cut = 1;
+    }
+}
+
+static void
+link_rx_done(struct mule_link *link)
+{
+    NTRACE_INFO(NT_MULE_DONE, link->conn_handle, link->rx_len, 0);
+    link_rx_metrics(link);
+    link_rx_commit(link);
+    //harvest the sensor's telemetry while the link is quiet
+    mule_tx_push(link->conn_handle, TX_EV_READ_TELEMETRY, 0, NULL, 0);
+}
+
+/*
+ * A data notification of a FEC transfer: a symbol of the block being
+ * decoded, which the engine puts in place or keeps for decoding. Whatever it
+ * has decoded in order goes on through link_rx_progress(), and the transfer
+ * is done when the last block decodes.
+ */
+static void
+link_on_symbol(struct mule_link *link, const uint8_t *data, uint16_t om_len)
+{
+    size_t ready;
+    int ev;
+
+    link->rx_notifies++;
+    if (om_len >= NEBULA_FEC_HEADER_BYTES) {
+        NTRACE_DEBUG(NT_MULE_SYMBOL, link->conn_handle,
+                     data[0] & NEBULA_FEC_BLOCK_MASK,
+                     data[1] & NEBULA_FEC_INDEX_MAX);
+    }
+
+    //repair symbols still on their way after the last block decoded, or
+    //after a skip, are no use
+    if (link->xfer.meta[NEBULA_META_STATE] != NEBULA_META_SENDING) {
+        nebula_xfer_rx_ack(&link->xfer);
+        return;
+    }
+    if (link_rx_prepare(link) != 0 || link->rx_buf == NULL) {
+        //the sensor asks again once it has waited long enough
+        NTRACE_WARN(NT_MULE_CHUNK_DROP, link->conn_handle,
+                    link->xfer.meta[NEBULA_META_ACKED], link->rx_cap);
+        return;
+    }
+
+    ev = nebula_xfer_rx_on_symbol(&link->xfer, data, om_len, link->rx_buf,
+                                  link->rx_cap, &ready);
+    if (ev < 0) {
+        NTRACE_WARN(NT_MULE_CHUNK_DROP, link->conn_handle,
+                    link->xfer.meta[NEBULA_META_ACKED], link->rx_cap);
+    } else if (ready > link->rx_len) {
+        link->rx_len = ready;
+        link_rx_progress(link);
+    }
+
+    NTRACE_DEBUG(NT_MULE_ACK, link->conn_handle,
+                 link->xfer.meta[NEBULA_META_ACKED], 0);
+    //only goes out once a block is decoded or a burst ends short
+    nebula_xfer_rx_ack(&link->xfer);
+
+    if (ev == NEBULA_XFER_RX_DONE && !link->skipped && !link->rejected) {
+        link_rx_done(link);
+    }
+}
+
+/*
+ * Handles a notification on the rx stage: a metadata update or the next
+ * chunk of the transfer, which is reassembled, hashed, checked against the
+ * dedup filter and the sensor's key, and forwarded or stored.
+ */
+static void
+link_on_notify(struct mule_link *link, uint16_t attr_handle,
+               const uint8_t *data, uint16_t om_len)
+{
+    size_t offset;
+    int ev;
+
+    if (attr_handle == link->metadata_val_handle) {
+        ev = nebula_xfer_rx_on_meta(&link->xfer, data, om_len);
+        NTRACE_DEBUG(NT_MULE_META, link->conn_handle,
+                     link->xfer.meta[NEBULA_META_CHUNKS],
+                     link->xfer.meta[NEBULA_META_ACKED]);
+
+        if (ev == NEBULA_XFER_RX_DONE) {
+            link_rx_done(link);
+        } else if (ev == NEBULA_XFER_RX_REPEAT) {
+            //already delivered; just tell the sensor so again
+            nebula_xfer_rx_ack(&link->xfer);
+        } else if (ev != NEBULA_XFER_RX_NONE) {
+            //a sensor that honoured a skip starts over from idle
+            link->skipped = 0;
+            link_rx_prepare(link);
+            if (ev == NEBULA_XFER_RX_START && link->xfer.fec) {
+                //a FEC transfer waits to be asked for its first block
+                link->rx_started_us = mule_time_us();
+                link->rx_notifies = 0;
+                nebula_xfer_rx_ack(&link->xfer);
+            }
+        }
+    }
+    else if (attr_handle == link->data_val_handle && link->xfer.fec) {
+        link_on_symbol(link, data, om_len);
+    }
+    else if (attr_handle == link->data_val_handle) {
+        offset = nebula_xfer_rx_on_chunk(&link->xfer);
+
+        NTRACE_DEBUG(NT_MULE_CHUNK, link->conn_handle,
+                     offset / CHUNK_SIZE, om_len);
+        if (offset == 0) {
+            link->rx_started_us = mule_time_us();
+            link->rx_notifies = 0;
+        }
+        link->rx_notifies++;
+
+        //update the reassembly buffer, dropping anything past its end
+        if (link->rejected || link->skipped) {
+            //still ack so the sensor finishes, but keep nothing
+        } else if (link_rx_prepare(link) == 0 && link->rx_buf != NULL &&
+                offset + om_len <= link->rx_cap) {
+            memcpy(&link->rx_buf[offset], data, om_len);
+            link->rx_len = offset + om_len;
+            link_rx_progress(link);
+        } else {
+            NTRACE_WARN(NT_MULE_CHUNK_DROP, link->conn_handle,
+                        offset / CHUNK_SIZE, link->rx_cap);
+        }
+
+        NTRACE_DEBUG(NT_MULE_ACK, link->conn_handle,
+                     link->xfer.meta[NEBULA_META_ACKED], 0);
+
+        //write an ack to the sensor, from the host task
+        nebula_xfer_rx_ack(&link->xfer);
+    }
+    else {
+        NTRACE_WARN(NT_MULE_UNKNOWN_ATTR, link->conn_handle, attr_handle, 0);
+    }
+}
+
+/* Host task: collects the pieces of a telemetry long read. */
+static int
+mule_on_telemetry(uint16_t conn_handle, const struct ble_gatt_error *error,
+                  struct ble_gatt_attr *attr, void *arg)
+{
+    uint8_t piece[64];
+    uint16_t len;
+    uint16_t off;
+    uint16_t n;
+
+    if (error->status == BLE_HS_EDONE) {
+        sensor_telemetry_finish(conn_handle, 1);
+        return 0;
+    }
+    if (error->status != 0 || attr == NULL) {
+        sensor_telemetry_finish(conn_handle, 0);
+        return 0;
+    }
+
+    len = OS_MBUF_PKTLEN(attr->om);
+    for (off = 0; off < len; off += n) {
+        n = len - off < sizeof piece ? len - off : sizeof piece;
+        os_mbuf_copydata(attr->om, off, n, piece);
+        sensor_telemetry_append(conn_handle, attr->offset + off, piece, n);
+    }
+    return 0;
+}
+
+static void
+mule_read_telemetry(uint16_t conn_handle)
+{
+    const struct peer_chr *chr;
+    const struct peer *peer;
+    struct ble_gap_conn_desc desc;
+    int rc;
+
+    peer = peer_find(conn_handle);
+    if (peer == NULL || ble_gap_conn_find(conn_handle, &desc) != 0) {
+        return;
+    }
+    chr = peer_chr_find_uuid(peer, sensor_svc_uuid, telemetry_chr_uuid);
+    if (chr == NULL ||
+            sensor_telemetry_start(conn_handle, desc.peer_id_addr.val) != 0) {
+        return;
+    }
+    rc = ble_gattc_read_long(conn_handle, chr->chr.val_handle, 0,
+                             mule_on_telemetry, NULL);
+    if (rc != 0) {
+        sensor_telemetry_finish(conn_handle, 0);
+    }
+}
+
+/* Host task: issues the GATT operations queued by the rx task. */
+static void
+mule_tx_drain(struct ble_npl_event *ev)
+{
+    struct tx_event *op;
+    int rc;
+
+    while ((op = spsc_ring_peek(&tx_ring)) != NULL) {
+        if (op->type == TX_EV_TERMINATE) {
+            ble_gap_terminate(op->conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+        } else if (op->type == TX_EV_READ_TELEMETRY) {
+            mule_read_telemetry(op->conn_handle);
+        } else {
+            rc = ble_gattc_write_flat(op->conn_handle, op->attr_handle,
+                                      op->data, op->len, ble_on_write, NULL);
+            if (rc != 0) {
+                NTRACE_ERROR(NT_MULE_TX_FAIL, op->conn_handle, op->attr_handle,
+                             rc);
+            }
+        }
+        spsc_ring_release(&tx_ring);
+    }
+}
+
+static void
+mule_rx_dispatch(const struct rx_event *ev)
+{
+    struct mule_link *link;
+
+    switch (ev->type) {
+    case RX_EV_CONNECT:
+        /* The handle's previous link, should its disconnect have been lost. */
+        if (link_find(ev->conn_handle) != NULL) {
+            link_delete(ev->conn_handle);
+        }
+        link = link_add(ev->conn_handle);
+        if (link == NULL) {
+            MODLOG_DFLT(ERROR, "Failed to allocate link context\n");
+            mule_tx_push(ev->conn_handle, TX_EV_TERMINATE, 0, NULL, 0);
+            break;
+        }
+        link->conn_itvl = ev->conn_itvl;
+        break;
+
+    case RX_EV_HANDLES:
+        link = link_find(ev->conn_handle);
+        if (link != NULL) {
+            link->data_val_handle = ev->data_val_handle;
+            link->metadata_val_handle = ev->metadata_val_handle;
+        }
+        break;
+
+    case RX_EV_NOTIFY:
+        link = link_find(ev->conn_handle);
+        if (link == NULL) {
+            NTRACE_WARN(NT_MULE_UNKNOWN_LINK, ev->conn_handle, 0, 0);
+            break;
+        }
+        link_on_notify(link, ev->attr_handle, ev->data, ev->len);
+        break;
+
+    case RX_EV_DISCONNECT:
+        link_delete(ev->conn_handle);
+        break;
+    }
+}
+
+static void
+mule_rx_task(void *param)
+{
+    struct rx_event *ev;
+
+    while (true) {
+        while ((ev = spsc_ring_peek(&rx_ring)) != NULL) {
+            mule_rx_dispatch(ev);
+            spsc_ring_release(&rx_ring);
+        }
+        mule_event_wait(&rx_wake, 1000);
+    }
+}
+
 /*
 * App call back for read of characteristic has completed
 */
@@ -110,13 +980,20 @@ static int ble_on_read(uint16_t conn_handle, const struct ble_gatt_error *error,
     }
     MODLOG_DFLT(INFO, "\n");
 
+    const struct peer *peer = peer_find(conn_handle);
+    if (peer == NULL || error->status != 0) {
+        return 0;
+    }
+    const struct peer_chr *chr_meta =
+        peer_chr_find_uuid(peer, sensor_svc_uuid, metadata_chr_uuid);
+    const struct peer_chr *chr_data =
+        peer_chr_find_uuid(peer, sensor_svc_uuid, sensor_chr_uuid);
+
     // put data into buffer depending on which characteristic was read
-    if (attr->handle == metadata_attr_handle) {
-        printf("Metadata recieved!\n");
+    if (chr_meta != NULL && attr->handle == chr_meta->chr.val_handle) {
         memcpy(metadata_state, attr->om->om_data, attr->om->om_len);
         sema_metadata = 1;
-    } else if (attr->handle == sensor_attr_handle) {
-        printf("Data recieved!\n");
+    } else if (chr_data != NULL && attr->handle == chr_data->chr.val_handle) {
         memcpy(sensor_state, attr->om->om_data, attr->om->om_len);
         sema_data = 1;
     }
@@ -130,8 +1007,14 @@ static int ble_on_read(uint16_t conn_handle, const struct ble_gatt_error *error,
 static int ble_on_write(uint16_t conn_handle, const struct ble_gatt_error *error,
                         struct ble_gatt_attr *attr, void *arg) {
 
-    MODLOG_DFLT(INFO,"Write complete; status=%d conn_handle=%d attr_handle=%d\n",
-                error->status, conn_handle, attr->handle);
+    uint16_t attr_handle = attr != NULL ? attr->handle : 0;
+
+    /* Every metadata ack ends here, so no console output. */
+    if (error->status != 0) {
+        NTRACE_WARN(NT_MULE_TX_FAIL, conn_handle, attr_handle, error->status);
+    } else {
+        NTRACE_DEBUG(NT_MULE_WRITE_DONE, conn_handle, attr_handle, 0);
+    }
     return 0;
 }
 
@@ -141,11 +1024,35 @@ static int ble_on_write(uint16_t conn_handle, const struct ble_gatt_error *error
 static int ble_on_subscribe(uint16_t conn_handle, const struct ble_gatt_error *error,
                             struct ble_gatt_attr *attr, void *arg) {
 
+    const struct peer_dsc *dsc_meta;
+    const struct peer *peer;
+    uint8_t value_meta[2];
+    int rc;
+
     MODLOG_DFLT(INFO, "Subscribe data complete; status=%d conn_handle=%d attr_handle=%d\n",
                 error->status, conn_handle, attr->handle);
 
     // write out MTU size to console 
     MODLOG_DFLT(INFO, "MTU size: %d\n", ble_att_mtu(conn_handle));
+
+    peer = peer_find(conn_handle);
+    if (error->status != 0 || peer == NULL) {
+        ble_gap_terminate(conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+        return 0;
+    }
+
+    /* Now the metadata characteristic; see ble_subscribe(). */
+    dsc_meta = peer_dsc_find_uuid(peer, sensor_svc_uuid, metadata_chr_uuid,
+                            BLE_UUID16_DECLARE(BLE_GATT_DSC_CLT_CFG_UUID16));
+    value_meta[0] = 1;
+    value_meta[1] = 0;
+    rc = ble_gattc_write_flat(conn_handle, dsc_meta->dsc.handle,
+                              value_meta, sizeof(value_meta), ble_on_subscribe_meta, NULL);
+    if (rc != 0) {
+        MODLOG_DFLT(ERROR, "Error: Failed to subscribe to meta characteristic; "
+                           "rc=%d\n", rc);
+        ble_gap_terminate(conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+    }
     return 0;
 }
 
@@ -216,11 +1123,12 @@ static void ble_write(const struct peer *peer, uint8_t *buf, const struct peer_c
 
 static void ble_subscribe(const struct peer *peer) {
 
-    //const struct peer_chr *chr;
+    const struct peer_chr *chr;
+    const struct peer_chr *chr_meta;
     const struct peer_dsc *dsc;
     const struct peer_dsc *dsc_meta;
+    struct rx_event *ev;
     uint8_t value[2];
-    uint8_t value_meta[2];
     int rc;
 
     /* Find the UUID. */
@@ -238,10 +1146,26 @@ static void ble_subscribe(const struct peer *peer) {
         printf("Error: Peer doesn't support NEBULA metadata\n");
     }
 
-    sensor_attr_handle = dsc->dsc.handle;
-    metadata_attr_handle = dsc_meta->dsc.handle;
+    if (dsc == NULL || dsc_meta == NULL) {
+        ble_gap_terminate(peer->conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+        return;
+    }
+
+    // Notifications arrive on the value handles, not the CCCD handles
+    chr = peer_chr_find_uuid(peer, sensor_svc_uuid, sensor_chr_uuid);
+    chr_meta = peer_chr_find_uuid(peer, sensor_svc_uuid, metadata_chr_uuid);
+    ev = mule_rx_claim(peer->conn_handle, RX_EV_HANDLES);
+    if (ev == NULL) {
+        ble_gap_terminate(peer->conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+        return;
+    }
+    ev->data_val_handle = chr->chr.val_handle;
+    ev->metadata_val_handle = chr_meta->chr.val_handle;
+    mule_rx_publish();
 
-    /* Subscribe to the characteristics. */
+    /* Subscribe to the data characteristic; ble_on_subscribe() subscribes
+     * to the metadata once the sensor has taken this write, so the host
+     * task never sleeps between the two. */
     value[0] = 1;
     value[1] = 0;
     rc = ble_gattc_write_flat(peer->conn_handle, dsc->dsc.handle,
@@ -249,24 +1173,8 @@ static void ble_subscribe(const struct peer *peer) {
     if (rc != 0) {
         MODLOG_DFLT(ERROR, "Error: Failed to subscribe to characteristic; "
                            "rc=%d\n", rc);
+        ble_gap_terminate(peer->conn_handle, BLE_ERR_REM_USER_CONN_TERM);
     }
-
-    printf("subscribing to metadata\n");
-    //delay 1 second
-    vTaskDelay(1000 / portTICK_PERIOD_MS);
-
-    value_meta[0] = 1;
-    value_meta[1] = 0;
-    rc = ble_gattc_write_flat(peer->conn_handle, dsc_meta->dsc.handle,
-                              value_meta, sizeof(value_meta), ble_on_subscribe_meta, NULL);
-
-    if (rc != 0) {
-        MODLOG_DFLT(ERROR, "Error: Failed to subscribe to meta characteristic; "
-                           "rc=%d\n", rc);
-    }
-
-    return;
-
 }
 
 int ble_write_long(void *p_ble_conn_handle, const unsigned char *buf, size_t len)
@@ -374,14 +1282,116 @@ int ble_read_long(void *p_ble_conn_handle, unsigned char *buf, size_t len)
 }
 
 
+/* How often each connection's RSSI is read for its PHY policy. */
+#define MULE_PHY_SAMPLE_MS  200
+
+/* Host task only: each connection's PHY policy (common/nebula_phy.h). */
+struct phy_link {
+    uint8_t in_use;
+    uint16_t conn_handle;
+    struct nebula_phy_policy policy;
+};
+
+static struct phy_link phy_links[MYNEWT_VAL(BLE_MAX_CONNECTIONS)];
+static struct ble_npl_callout phy_callout;
+
+static struct phy_link *
+phy_link_find(uint16_t conn_handle)
+{
+    int i;
+
+    for (i = 0; i < MYNEWT_VAL(BLE_MAX_CONNECTIONS); i++) {
+        if (phy_links[i].in_use && phy_links[i].conn_handle == conn_handle) {
+            return &phy_links[i];
+        }
+    }
+    return NULL;
+}
+
+/* Host task: starts the PHY policy for a new connection. */
+static void
+phy_link_add(uint16_t conn_handle)
+{
+    struct nebula_phy_cfg cfg;
+    uint8_t tx_phy;
+    uint8_t rx_phy;
+    int i;
+
+    if (ble_gap_read_le_phy(conn_handle, &tx_phy, &rx_phy) != 0) {
+        tx_phy = NEBULA_PHY_1M;
+    }
+    for (i = 0; i < MYNEWT_VAL(BLE_MAX_CONNECTIONS); i++) {
+        if (!phy_links[i].in_use) {
+            nebula_phy_cfg_default(&cfg);
+            nebula_phy_init(&phy_links[i].policy, &cfg, tx_phy,
+                            mule_time_us());
+            phy_links[i].conn_handle = conn_handle;
+            phy_links[i].in_use = 1;
+            return;
+        }
+    }
+}
+
+static void
+phy_link_delete(uint16_t conn_handle)
+{
+    struct phy_link *pl = phy_link_find(conn_handle);
+
+    if (pl != NULL) {
+        pl->in_use = 0;
+    }
+}
+
+/*
+ * Host task, every MULE_PHY_SAMPLE_MS: reads each connection's RSSI and asks
+ * for the PHY its policy picks.  Asking for that PHY or slower ones leaves
+ * the sensor free to fall back further on its own readings.
+ */
+static void
+mule_phy_tick(struct ble_npl_event *ev)
+{
+    struct phy_link *pl;
+    int8_t rssi;
+    uint8_t want;
+    uint8_t mask;
+    int rc;
+    int i;
+
+    for (i = 0; i < MYNEWT_VAL(BLE_MAX_CONNECTIONS); i++) {
+        pl = &phy_links[i];
+        if (!pl->in_use || ble_gap_conn_rssi(pl->conn_handle, &rssi) != 0) {
+            continue;
+        }
+        want = nebula_phy_sample(&pl->policy, rssi, mule_time_us());
+        if (want == NEBULA_PHY_NONE) {
+            continue;
+        }
+        mask = nebula_phy_at_most(want);
+        rc = ble_gap_set_prefered_le_phy(pl->conn_handle, mask, mask,
+                                         want == NEBULA_PHY_CODED ?
+                                         BLE_GAP_LE_PHY_CODED_S8 :
+                                         BLE_GAP_LE_PHY_CODED_ANY);
+        NTRACE_INFO(NT_MULE_PHY_REQ, pl->conn_handle, want, rssi);
+        if (rc != 0) {
+            MODLOG_DFLT(DEBUG, "PHY request failed; rc=%d\n", rc);
+        }
+    }
+    ble_npl_callout_reset(&phy_callout,
+                          ble_npl_time_ms_to_ticks32(MULE_PHY_SAMPLE_MS));
+}
+
 /**
- * Initiates the GAP general discovery procedure.
+ * Initiates the GAP general discovery procedure.  Extended scanning picks up
+ * both legacy advertisements and sensors' extended broadcasts, on the coded
+ * PHY as well where the controller has it, so long-range advertising is
+ * heard from further out.
  */
 static void
 sensor_scan(void)
 {
     uint8_t own_addr_type;
-    struct ble_gap_disc_params disc_params;
+    struct ble_gap_ext_disc_params disc_params;
+    struct ble_gap_ext_disc_params coded_params;
     int rc;
 
     //Figure out address to use while advertising TODO: change this??
@@ -391,32 +1401,101 @@ sensor_scan(void)
         return;
     }
 
-    //Tell the controller to filter duplicates
-    disc_params.filter_duplicates = 1;
-
     //Perform a passive scan
     disc_params.passive = 1;
 
     //Use defaults for the rest of the parameters. 
     disc_params.itvl = 0;
     disc_params.window = 0;
-    disc_params.filter_policy = 0;
-    disc_params.limited = 0;
+    coded_params = disc_params;
 
-    rc = ble_gap_disc(own_addr_type, 5000, &disc_params,
-                      mule_ble_gap_event, NULL);
+    //Scan for 5 s (in 10 ms units) and have the controller filter
+    //duplicates; a sensor's broadcast gets a new data ID whenever its
+    //readings change, so those still come through
+    rc = ble_gap_ext_disc(own_addr_type, 500, 0, 1, 0, 0, &disc_params,
+                          &coded_params, mule_ble_gap_event, NULL);
+    if (rc != 0) {
+        //No coded PHY on this controller; 1M only
+        rc = ble_gap_ext_disc(own_addr_type, 500, 0, 1, 0, 0, &disc_params,
+                              NULL, mule_ble_gap_event, NULL);
+    }
     if (rc != 0) {
         MODLOG_DFLT(ERROR, "Error initiating GAP discovery procedure; rc=%d\n",
                     rc);
     }
 }
 
+/* Host task: the broadcast ack list was written, or failed to be. */
+static int
+ble_on_bcast_ack(uint16_t conn_handle, const struct ble_gatt_error *error,
+                 struct ble_gatt_attr *attr, void *arg)
+{
+    struct ble_gap_conn_desc desc;
+    const struct peer *peer;
+
+    if (ble_gap_conn_find(conn_handle, &desc) != 0) {
+        return 0;
+    }
+    if (!bcast_harvest_ack_done(desc.peer_id_addr.val, error->status == 0)) {
+        //nothing else to do here; free the sensor for the next mule
+        ble_gap_terminate(conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+        return 0;
+    }
+
+    //the sensor also has a transfer waiting
+    peer = peer_find(conn_handle);
+    if (peer != NULL) {
+        ble_subscribe(peer);
+    }
+    return 0;
+}
+
+/*
+ * Writes the ack list for the readings harvested from a broadcasting sensor;
+ * ble_on_bcast_ack() carries on from there.
+ *
+ * @return                      0 if the write is under way; nonzero if the
+ *                                  sensor does not take acks, there is
+ *                                  nothing to ack, or the write failed.
+ */
+static int
+ble_write_bcast_acks(const struct peer *peer)
+{
+    uint8_t list[NEBULA_BCAST_ACK_MAX_BYTES];
+    struct ble_gap_conn_desc desc;
+    const struct peer_chr *chr;
+    size_t len;
+    int rc;
+
+    chr = peer_chr_find_uuid(peer, sensor_svc_uuid, bcast_ack_chr_uuid);
+    if (chr == NULL || ble_gap_conn_find(peer->conn_handle, &desc) != 0) {
+        return BLE_HS_ENOENT;
+    }
+    len = bcast_harvest_ack_list(desc.peer_id_addr.val, list);
+    if (len == 0) {
+        return BLE_HS_ENOENT;
+    }
+
+    rc = ble_gattc_write_flat(peer->conn_handle, chr->chr.val_handle,
+                              list, len, ble_on_bcast_ack, NULL);
+    if (rc != 0) {
+        MODLOG_DFLT(ERROR, "Error: Failed to write broadcast acks; rc=%d\n",
+                    rc);
+        bcast_harvest_ack_done(desc.peer_id_addr.val, 0);
+    }
+    return rc;
+}
+
 /**
  * Called when service discovery of the specified peer has completed.
  */
 static void
 ble_on_disc_complete(const struct peer *peer, int status, void *arg)
 {
+    //arg is when discovery started, in ms
+    mule_metrics_time(MULE_METRICS_DISCOVERY,
+                      (int64_t)((uint32_t)(mule_time_us() / 1000) -
+                                (uint32_t)(uintptr_t)arg) * 1000);
 
     if (status != 0) {
         /* Service discovery failed.  Terminate the connection. */
@@ -441,6 +1520,12 @@ ble_on_disc_complete(const struct peer *peer, int status, void *arg)
     //printf("read done\n");
     //ble_write(peer);
     //printf("write done\n");
+
+    //A broadcasting sensor gets its readings acked first; if that is all it
+    //was connected for, the connection ends once the ack is written
+    if (ble_write_bcast_acks(peer) == 0) {
+        return;
+    }
     ble_subscribe(peer); 
     printf("subscribe done\n");
 }
@@ -454,31 +1539,39 @@ ble_uuid_u128(const ble_uuid_t *uuid)
 
 
 /**
- * Checks if the specified advertisement looks like a galaxy sensor.
+ * Checks if the specified advertisement looks like a galaxy sensor worth
+ * connecting to.  Readings in a sensor's broadcast are harvested on the way;
+ * a broadcasting sensor is only connected to when it asks for it.
 **/
 static int
-sensor_should_connect(const struct ble_gap_disc_desc *disc)
+sensor_should_connect(const struct ble_gap_ext_disc_desc *disc)
 {
     struct ble_hs_adv_fields fields;
+    int connect;
     int rc;
     int i;
 
-    /* The device has to be advertising connectability. */
-    if (disc->event_type != BLE_HCI_ADV_RPT_EVTYPE_ADV_IND &&
-            disc->event_type != BLE_HCI_ADV_RPT_EVTYPE_DIR_IND) {
-
-        return 0;
-    }
-
     /* Parse the advertisement data. */
     rc = ble_hs_adv_parse_fields(&fields, disc->data, disc->length_data);
     if (rc != 0) {
-        return rc;
+        return 0;
+    }
+
+    if (fields.svc_data_uuid16 != NULL && fields.svc_data_uuid16_len >= 2 &&
+            get_le16(fields.svc_data_uuid16) == NEBULA_BCAST_SVC_UUID16) {
+        connect = bcast_harvest_on_adv(disc->addr.val,
+                                       fields.svc_data_uuid16 + 2,
+                                       fields.svc_data_uuid16_len - 2);
+        return connect && (disc->props & BLE_HCI_ADV_CONN_MASK);
+    }
+
+    /* The device has to be advertising connectability. */
+    if (!(disc->props & BLE_HCI_ADV_CONN_MASK)) {
+        return 0;
     }
 
     //The device has to advertise support for Galaxy services (0x180a).
     for (i = 0; i < fields.num_uuids16; i++) {
-        printf("uuid16 is=%x\n", ble_uuid_u16(&fields.uuids16[i].u));
         if (ble_uuid_u16(&fields.uuids16[i].u) == 0x180a) { //TODO fix this magic
             return 1;
         }
@@ -494,14 +1587,15 @@ sensor_should_connect(const struct ble_gap_disc_desc *disc)
  * connectability and support for galaxy sensor service.
  */
 static void
-mule_connect_if_sensor(void *disc)
+mule_connect_if_sensor(const struct ble_gap_ext_disc_desc *disc)
 {
     uint8_t own_addr_type;
+    uint8_t phy_mask;
     int rc;
-    ble_addr_t *addr;
+    const ble_addr_t *addr;
 
     //Don't do anything if it is not a sensor 
-    if (!sensor_should_connect((struct ble_gap_disc_desc *)disc)) {
+    if (!sensor_should_connect(disc)) {
         //printf("Not a sensor\n");
         return;
     }
@@ -520,11 +1614,15 @@ mule_connect_if_sensor(void *disc)
         return;
     }
 
-    //Try to connect the the advertiser.
-    addr = &((struct ble_gap_disc_desc *)disc)->addr;
+    //Try to connect the the advertiser, on the PHY it was heard on; a
+    //sensor found on the coded PHY may be out of 1M range
+    addr = &disc->addr;
+    phy_mask = disc->prim_phy == BLE_HCI_LE_PHY_CODED ?
+               BLE_GAP_LE_PHY_CODED_MASK : BLE_GAP_LE_PHY_1M_MASK;
 
-    rc = ble_gap_connect(own_addr_type, addr, 30000, NULL,
-                         mule_ble_gap_event, NULL);
+    connect_started_us = mule_time_us();
+    rc = ble_gap_ext_connect(own_addr_type, addr, 30000, phy_mask, NULL, NULL,
+                             NULL, mule_ble_gap_event, NULL);
     if (rc != 0) {
         MODLOG_DFLT(ERROR, "Error: Failed to connect to device; addr_type=%d "
                     "addr=%s; rc=%d\n",
@@ -551,19 +1649,21 @@ static int
 mule_ble_gap_event(struct ble_gap_event *event, void *arg)
 {
     struct ble_gap_conn_desc desc;
-    struct ble_hs_adv_fields fields;
+    struct phy_link *pl;
+    struct rx_event *ev;
+    uint16_t om_len;
     int rc;
 
     switch (event->type) {
-    case BLE_GAP_EVENT_DISC:
-        rc = ble_hs_adv_parse_fields(&fields, event->disc.data,
-                                     event->disc.length_data);
-        if (rc != 0) {
+    case BLE_GAP_EVENT_EXT_DISC:
+        //Only whole advertisements; sensors' broadcasts are never chained
+        if (event->ext_disc.data_status != BLE_GAP_EXT_ADV_DATA_STATUS_COMPLETE) {
             return 0;
-        };
+        }
 
-        //Try to connect to the advertiser if it looks like a galaxy sensor
-        mule_connect_if_sensor(&event->disc);
+        //Harvest any broadcast readings and connect to the advertiser if it
+        //looks like a galaxy sensor that wants a connection
+        mule_connect_if_sensor(&event->ext_disc);
         return 0;
 
     case BLE_GAP_EVENT_CONNECT:
@@ -584,9 +1684,24 @@ mule_ble_gap_event(struct ble_gap_event *event, void *arg)
                 return 0;
             }
 
+            mule_metrics_time(MULE_METRICS_CONN_SETUP,
+                              mule_time_us() - connect_started_us);
+            phy_link_add(event->connect.conn_handle);
+
+            //The rx task sets up the link and drops the connection if it
+            //cannot
+            ev = mule_rx_claim(event->connect.conn_handle, RX_EV_CONNECT);
+            if (ev == NULL) {
+                ble_gap_terminate(event->connect.conn_handle,
+                                  BLE_ERR_REM_USER_CONN_TERM);
+                return 0;
+            }
+            ev->conn_itvl = desc.conn_itvl;
+            mule_rx_publish();
+
             //Perform service discovery 
-            rc = peer_disc_all(event->connect.conn_handle,
-                        ble_on_disc_complete, NULL);
+            rc = peer_disc_all(event->connect.conn_handle, ble_on_disc_complete,
+                        (void *)(uintptr_t)(uint32_t)(mule_time_us() / 1000));
             if(rc != 0) {
                 MODLOG_DFLT(ERROR, "Failed to discover services; rc=%d\n", rc);
                 return 0;
@@ -610,8 +1725,10 @@ mule_ble_gap_event(struct ble_gap_event *event, void *arg)
         print_conn_desc(&event->disconnect.conn);
         MODLOG_DFLT(INFO, "\n");
 
-        //Forget about peer
+        //Forget about peer; the rx task hands its buffers back to the pool
         peer_delete(event->disconnect.conn.conn_handle);
+        phy_link_delete(event->disconnect.conn.conn_handle);
+        mule_rx_disconnect(event->disconnect.conn.conn_handle);
 
         //Resume scanning
         sensor_scan();
@@ -632,58 +1749,34 @@ mule_ble_gap_event(struct ble_gap_event *event, void *arg)
     //     return 0;
 
     case BLE_GAP_EVENT_NOTIFY_RX:
-        /* Peer sent us a notification or indication. */
-        MODLOG_DFLT(INFO, "received %s; conn_handle=%d attr_handle=%d "
-                    "attr_len=%d; value=",
-                    event->notify_rx.indication ?
-                    "indication" :
-                    "notification",
-                    event->notify_rx.conn_handle,
-                    event->notify_rx.attr_handle,
-                    OS_MBUF_PKTLEN(event->notify_rx.om));
-        
-        print_mbuf(event->notify_rx.om);
-        printf("\n");
- 
-        //if data is sensor state, update sensor state buffer and metadata buffer
-        if (event->notify_rx.attr_handle == metadata_attr_handle -1 ) { //literally no clue why -1
-            //update metadata buffer
-            os_mbuf_copydata(event->notify_rx.om,0,OS_MBUF_PKTLEN(event->notify_rx.om),metadata_state);
-            sema_metadata = 1;
-
-        }
-        else if (event->notify_rx.attr_handle == sensor_attr_handle - 1) { //literally no clue why -1
-            //check metadata to find out where to put the data 
-            int number_of_chunks = metadata_state[0];
-            int number_recieved_chunks = metadata_state[1];
-            int readiness = metadata_state[2];
-
-            printf("number recieved chunks %d\n", number_recieved_chunks);
-            
-            //update sensor state buffer
-            printf("len of recieved data: %d\n", event->notify_rx.om->om_len);
-            os_mbuf_copydata(event->notify_rx.om,0,OS_MBUF_PKTLEN(event->notify_rx.om),&sensor_state_data[number_recieved_chunks*CHUNK_SIZE]);
-            
-            metadata_state[1] += 1; //adding a packet to the metadata
-            sema_data = 1;
-            sema_metadata = 1;
-
-            printf("writing ack to sensor%d\n", metadata_state[1]);
-
-            //write an ack to the sensor
-            struct peer *peer = peer_find(event->notify_rx.conn_handle);
-            struct peer_chr *chr = peer_chr_find_uuid(peer, sensor_svc_uuid, metadata_chr_uuid);
-            ble_write(peer, metadata_state, chr, 3);
-        }
-        else {
-            printf("unknown characteristic data\n");
+        /* Peer sent us a notification or indication; the rx task takes
+         * it from here, so the host task is back on the radio at once. */
+        NTRACE_DEBUG(NT_MULE_NOTIFY, event->notify_rx.conn_handle,
+                     event->notify_rx.attr_handle,
+                     OS_MBUF_PKTLEN(event->notify_rx.om));
+
+        ev = mule_rx_claim(event->notify_rx.conn_handle, RX_EV_NOTIFY);
+        if (ev != NULL) {
+            om_len = OS_MBUF_PKTLEN(event->notify_rx.om);
+            if (om_len > sizeof ev->data) {
+                om_len = sizeof ev->data;
+            }
+            ev->attr_handle = event->notify_rx.attr_handle;
+            ev->len = om_len;
+            os_mbuf_copydata(event->notify_rx.om, 0, om_len, ev->data);
+            mule_rx_publish();
         }
+        return 0;
 
-        printf("metadata total chunks: %d\n",metadata_state[0]);
-        printf("metadata chunks recieved: %d\n",metadata_state[1]);
-        printf("metadata readiness: %d\n",metadata_state[2]);
-
-        
+    case BLE_GAP_EVENT_PHY_UPDATE_COMPLETE:
+        //Whichever side asked for it
+        NTRACE_INFO(NT_MULE_PHY, event->phy_updated.conn_handle,
+                    event->phy_updated.tx_phy, event->phy_updated.status);
+        pl = phy_link_find(event->phy_updated.conn_handle);
+        if (pl != NULL && event->phy_updated.status == 0) {
+            nebula_phy_updated(&pl->policy, event->phy_updated.tx_phy,
+                               mule_time_us());
+        }
         return 0;
 
     case BLE_GAP_EVENT_MTU:
@@ -726,6 +1819,16 @@ static void ble_on_sync(void) {
     rc = ble_hs_util_ensure_addr(0);
     assert(rc == 0);
 
+    /* Take whatever PHY a sensor asks for until a link's own policy says
+     * otherwise. */
+    rc = ble_gap_set_prefered_default_le_phy(BLE_GAP_LE_PHY_ANY_MASK,
+                                             BLE_GAP_LE_PHY_ANY_MASK);
+    if (rc != 0) {
+        MODLOG_DFLT(ERROR, "Failed to set default PHY; rc=%d\n", rc);
+    }
+    ble_npl_callout_reset(&phy_callout,
+                          ble_npl_time_ms_to_ticks32(MULE_PHY_SAMPLE_MS));
+
     /* Begin scanning for a peripheral to connect to. */
     sensor_scan();
 
@@ -963,9 +2066,228 @@ void mule_host_task(void *param)
     nimble_port_freertos_deinit();
 }
 
+#ifndef UPLINK_HOST
+#define UPLINK_HOST             "192.168.1.100"
+#endif
+#ifndef UPLINK_PORT
+#define UPLINK_PORT             8080
+#endif
+#define UPLINK_IDLE_MS          1000
+
+#ifndef PROVIDER_HOST
+#define PROVIDER_HOST           "192.168.1.100"
+#endif
+#ifndef PROVIDER_PORT
+#define PROVIDER_PORT           8000
+#endif
+
+// How often the sensor key cache is refreshed, and retried after a failure
+#define SENSOR_KEYS_REFRESH_MS  (10 * 60 * 1000)
+#define SENSOR_KEYS_RETRY_MS    (30 * 1000)
+
+// How often the appserver's seen hashes are pulled, and how many at a time
+#define DEDUP_DELTA_REFRESH_MS  (30 * 1000)
+#define DEDUP_DELTA_MAX         128
+// How often the trace ring is written to the console, and how much at once
+#define TRACE_DRAIN_MS          200
+#define TRACE_DRAIN_MAX         64
+// Filter writes to flash are batched to spare the NVS partition
+#define DEDUP_SAVE_MS           (5 * 60 * 1000)
+// How often a metrics snapshot goes to the console and the appserver
+#define METRICS_SNAPSHOT_MS     (60 * 1000)
+// Largest batch of harvested broadcast readings in one post
+#define BCAST_UPLOAD_MAX        1024
+
+static void
+mule_on_token(const uint8_t *signed_token_payload, size_t len, void *arg)
+{
+    ESP_LOGI(tag, "payload delivered; %u byte token payload", (unsigned)len);
+
+    //TokenPayload is nonce || token || H(data)
+    if (len >= NEBULA_TOKEN_PAYLOAD_BYTES) {
+        dedup_filter_add(signed_token_payload + NEBULA_DELIVER_NONCE_BYTES +
+                         NEBULA_TOKEN_BYTES);
+    }
+    token_wallet_add(signed_token_payload, len);
+}
+
+static int
+mule_sync_sensor_keys(void)
+{
+    static uint8_t list[SENSOR_KEYS_CAPACITY * NEBULA_SENSOR_KEY_ENTRY_BYTES];
+    size_t len;
+    int rc;
+
+    rc = uplink_fetch("/sensor_keys", list, sizeof list, &len);
+    if (rc == UPLINK_E2BIG) {
+        /* More sensors than the cache holds: keep the ones that fit, but
+         * the cache is no longer the whole registry. */
+        return sensor_keys_load_list(list, sizeof list, len);
+    }
+    if (rc != 0) {
+        ESP_LOGW(tag, "failed to fetch sensor keys; rc=%d", rc);
+        return rc;
+    }
+    return sensor_keys_load_list(list, len, len);
+}
+
+/*
+ * Pulls the payload hashes the appserver has accepted since the last pull
+ * into the dedup filter, so copies delivered by other mules are turned away
+ * at the sensor too.
+ */
+static int
+mule_sync_seen_hashes(void)
+{
+    static uint8_t delta[NEBULA_SEEN_DELTA_HEADER_BYTES +
+                         DEDUP_DELTA_MAX * NEBULA_SHA256_BYTES];
+    char path[96];
+    size_t len;
+    int n;
+    int rc;
+
+    do {
+        dedup_filter_delta_path(path, sizeof path, DEDUP_DELTA_MAX);
+        rc = uplink_fetch(path, delta, sizeof delta, &len);
+        if (rc != 0) {
+            ESP_LOGW(tag, "failed to fetch seen hashes; rc=%d", rc);
+            return rc;
+        }
+        n = dedup_filter_apply_delta(delta, len);
+    } while (n == DEDUP_DELTA_MAX);
+
+    return n < 0 ? n : 0;
+}
+
+/*
+ * Takes a metrics snapshot, prints it, and posts it to the appserver if
+ * Wi-Fi is up.  A failed post is not retried; the next snapshot carries the
+ * same counters.
+ */
+static void
+mule_report_metrics(void)
+{
+    static uint8_t snap[MULE_METRICS_MAX_BYTES];
+    size_t len;
+    int rc;
+
+    len = mule_metrics_snapshot(snap, sizeof snap);
+    mule_metrics_print(snap, len);
+    if (len > sizeof snap || !wifi_sta_is_connected()) {
+        return;
+    }
+    rc = uplink_post("/mule_metrics", snap, len);
+    if (rc != 0) {
+        ESP_LOGW(tag, "failed to post metrics; rc=%d", rc);
+    }
+}
+
+/*
+ * Posts the readings harvested from sensor broadcasts a batch at a time,
+ * dropping each batch once the appserver has it.  The appserver keeps one
+ * copy per sensor and sequence number, so a batch posted twice is harmless.
+ */
+static int
+mule_upload_broadcasts(void)
+{
+    static uint8_t batch[BCAST_UPLOAD_MAX];
+    size_t len;
+    int rc;
+
+    while ((len = bcast_harvest_peek(batch, sizeof batch)) > 0) {
+        rc = uplink_post("/bcast_readings", batch, len);
+        if (rc != 0) {
+            ESP_LOGW(tag, "failed to post broadcast readings; rc=%d", rc);
+            return rc;
+        }
+        bcast_harvest_drop(len);
+    }
+    return 0;
+}
+
+/*
+ * Drains stored transfers to the appserver whenever Wi-Fi is up, keeps the
+ * sensor key cache and dedup filter fresh, redeems earned tokens, posts
+ * harvested broadcast readings, and reports metrics. Runs
+ * beside the NimBLE host task, so sensors can keep handing off data during
+ * uploads.
+ */
+static void
+mule_uplink_task(void *param)
+{
+    int64_t keys_next_sync_us = 0;
+    int64_t seen_next_sync_us = 0;
+    int64_t dedup_next_save_us = 0;
+    int64_t metrics_next_us = 1000LL * METRICS_SNAPSHOT_MS;
+    uint32_t delay_ms;
+
+    for (;;) {
+        if (mule_time_us() >= dedup_next_save_us) {
+            dedup_filter_save();
+            dedup_next_save_us = mule_time_us() + 1000LL * DEDUP_SAVE_MS;
+        }
+
+        if (mule_time_us() >= metrics_next_us) {
+            mule_report_metrics();
+            metrics_next_us = mule_time_us() + 1000LL * METRICS_SNAPSHOT_MS;
+        }
+
+        if (!wifi_sta_wait_connected(UPLINK_IDLE_MS)) {
+            continue;
+        }
+
+        if (mule_time_us() >= keys_next_sync_us) {
+            keys_next_sync_us = mule_time_us() + 1000LL *
+                (mule_sync_sensor_keys() == 0 ? SENSOR_KEYS_REFRESH_MS
+                                              : SENSOR_KEYS_RETRY_MS);
+        }
+
+        if (mule_time_us() >= seen_next_sync_us) {
+            mule_sync_seen_hashes();
+            seen_next_sync_us = mule_time_us() + 1000LL * DEDUP_DELTA_REFRESH_MS;
+        }
+
+        if (token_wallet_due()) {
+            token_wallet_redeem();
+        }
+
+        mule_upload_broadcasts();
+
+        if (payload_store_count() == 0) {
+            vTaskDelay(UPLINK_IDLE_MS / portTICK_PERIOD_MS);
+            continue;
+        }
+
+        if (uplink_drain() < 0) {
+            delay_ms = uplink_backoff_ms();
+            ESP_LOGW(tag, "uplink failed; retrying in %" PRIu32 " ms", delay_ms);
+            vTaskDelay(delay_ms / portTICK_PERIOD_MS);
+        }
+    }
+}
+
+static void
+mule_cutthrough_task(void *param)
+{
+    cutthrough_run();
+}
+
+static void
+mule_verify_task(void *param)
+{
+    sensor_verify_run();
+}
+
+static uint32_t
+mule_trace_now(void)
+{
+    return (uint32_t)mule_time_us();
+}
+
 void app_main() {
 
     printf("Hello!\n");
+    nebula_trace_init(mule_trace_now);
 
     /* Print chip information */
     esp_chip_info_t chip_info;
@@ -1020,7 +2342,80 @@ void app_main() {
     //Init gatt and device name 
     int rc;
 
-    rc = peer_init(MYNEWT_VAL(BLE_MAX_CONNECTIONS), 64, 64, 64);
+    rc = payload_pool_init();
+    if (rc != 0) {
+        ESP_LOGE(tag, "error initializing payload pool");
+        return;
+    }
+
+    rc = payload_store_init();
+    if (rc != 0) {
+        ESP_LOGE(tag, "error initializing payload store");
+        return;
+    }
+
+    struct uplink_config uplink_cfg = {
+        .host = UPLINK_HOST,
+        .port = UPLINK_PORT,
+        .window = 8,
+        .max_attempts = 3,
+        .backoff_min_ms = 500,
+        .backoff_max_ms = 30000,
+        .on_token = mule_on_token,
+    };
+    rc = uplink_init(&uplink_cfg);
+    if (rc != 0) {
+        ESP_LOGE(tag, "error initializing uplink");
+        return;
+    }
+
+    rc = sensor_keys_init();
+    if (rc == 0) {
+        rc = sensor_verify_init();
+    }
+    if (rc != 0) {
+        ESP_LOGE(tag, "error initializing sensor verification");
+        return;
+    }
+
+    rc = dedup_filter_init();
+    if (rc != 0) {
+        ESP_LOGE(tag, "error initializing dedup filter");
+        return;
+    }
+
+    // Tokens are redeemed under an id derived from the station MAC
+    struct token_wallet_config wallet_cfg = {
+        .host = PROVIDER_HOST,
+        .port = PROVIDER_PORT,
+        .appserver_xy = APPSERVER_PUBKEY_XY,
+        .batch_min = 32,
+        .max_hold_ms = 60 * 60 * 1000,
+        .max_attempts = 3,
+    };
+    esp_read_mac(wallet_cfg.mule_id, ESP_MAC_WIFI_STA);
+    rc = token_wallet_init(&wallet_cfg);
+    if (rc != 0) {
+        ESP_LOGE(tag, "error initializing token wallet");
+        return;
+    }
+    mule_metrics_init(wallet_cfg.mule_id);
+
+    struct cutthrough_config cut_cfg = {
+        .host = UPLINK_HOST,
+        .port = UPLINK_PORT,
+        .on_token = mule_on_token,
+    };
+    rc = cutthrough_init(&cut_cfg);
+    if (rc != 0) {
+        ESP_LOGE(tag, "error initializing cut-through");
+        return;
+    }
+
+    rc = peer_init(MYNEWT_VAL(BLE_MAX_CONNECTIONS),
+                   MYNEWT_VAL(BLE_MAX_CONNECTIONS) * PEER_SVCS_PER_LINK,
+                   MYNEWT_VAL(BLE_MAX_CONNECTIONS) * PEER_CHRS_PER_LINK,
+                   MYNEWT_VAL(BLE_MAX_CONNECTIONS) * PEER_DSCS_PER_LINK);
     if (rc != 0) {
         ESP_LOGE(tag, "error initializing gatt server");
         return;
@@ -1036,14 +2431,41 @@ void app_main() {
 
     ble_store_config_init();
 
+    //Set up the rings between the host task and the rx task before either
+    //can run
+    spsc_ring_init(&rx_ring, rx_slots, sizeof rx_slots[0], RX_RING_SLOTS);
+    spsc_ring_init(&tx_ring, tx_slots, sizeof tx_slots[0], TX_RING_SLOTS);
+    mule_event_init(&rx_wake);
+    ble_npl_event_init(&tx_drain_ev, mule_tx_drain, NULL);
+    ble_npl_callout_init(&phy_callout, nimble_port_get_dflt_eventq(),
+                         mule_phy_tick, NULL);
+    xTaskCreatePinnedToCore(mule_rx_task, "rx", 4096, NULL, 6, NULL,
+                            MULE_PIPELINE_CORE);
+
     //Start the muling task 
     nimble_port_freertos_init(mule_host_task);
     
     printf("started connection\n");
 
+    wifi_sta_start();
+    //Everything past the radio runs on the other core
+    xTaskCreatePinnedToCore(mule_uplink_task, "uplink", 6144, NULL, 4, NULL,
+                            MULE_PIPELINE_CORE);
+    xTaskCreatePinnedToCore(mule_cutthrough_task, "cutthrough", 6144, NULL, 5,
+                            NULL, MULE_PIPELINE_CORE);
+    xTaskCreatePinnedToCore(mule_verify_task, "verify", 4096, NULL, 2, NULL,
+                            MULE_PIPELINE_CORE);
+
+    //The trace ring is written out from here, at the lowest priority, so
+    //the data path never waits on the UART; a full batch means more is
+    //waiting, but the idle task still gets its tick
     while (true) {
-        printf(".");
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        mule_metrics_msys(os_msys_num_free());
+        if (nebula_trace_drain(TRACE_DRAIN_MAX) < TRACE_DRAIN_MAX) {
+            vTaskDelay(TRACE_DRAIN_MS / portTICK_PERIOD_MS);
+        } else {
+            vTaskDelay(1);
+        }
     }
 
     //mbedtls handshake
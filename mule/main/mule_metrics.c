@@ -0,0 +1,389 @@
+/*
+ * Mule performance counters.
+ *
+ * The data path reports into a handful of counters and timings; everything
+ * that can be read on demand (heap, tasks, the payload pool and store) is
+ * sampled when a snapshot is taken instead.  A snapshot is a compact binary
+ * record, laid out in mule_metrics.h, that goes to the console as a "#NM"
+ * hex line and to the appserver with the uplink, so fleets of mules can be
+ * compared without a debugger attached.
+ *
+ * Task CPU use is the share of one core each task had since the previous
+ * snapshot, and needs FreeRTOS run time stats; without them the task list
+ * is empty.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "mule_metrics.h"
+#include "mule_port.h"
+#include "payload_pool.h"
+#include "payload_store.h"
+#include "sensor_telemetry.h"
+
+#ifdef ESP_PLATFORM
+#include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define MULE_METRICS_TASK_STATS \
+    (CONFIG_FREERTOS_USE_TRACE_FACILITY && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS)
+#else
+#define MULE_METRICS_TASK_STATS     0
+#endif
+
+static const char *tag = "METRICS";
+
+struct sensor_metrics {
+    uint8_t sensor_id[NEBULA_SENSOR_ID_BYTES];
+    uint32_t transfers;
+    uint32_t bytes;
+    uint32_t busy_ms;
+    int64_t last_us;
+};
+
+struct metrics_writer {
+    uint8_t *buf;
+    size_t cap;
+    size_t len;
+};
+
+static uint8_t mule_id[MULE_METRICS_ID_BYTES];
+static struct mule_metrics_timing timings[MULE_METRICS_TIMINGS];
+static struct sensor_metrics sensors[MULE_METRICS_SENSORS];
+static uint32_t transfers;
+static uint32_t transfer_bytes;
+static uint32_t notifications;
+static uint32_t conn_events;
+static int msys_free_min = -1;
+static uint32_t msys_exhausted;
+static uint32_t telemetry_sent;
+static mule_lock_t metrics_lock = MULE_LOCK_INITIALIZER;
+
+#if MULE_METRICS_TASK_STATS
+/* Headroom over MULE_METRICS_TASKS for the system's own tasks. */
+#define MULE_METRICS_TASK_SLOTS     (MULE_METRICS_TASKS + 8)
+
+struct task_prev {
+    UBaseType_t number;
+    uint32_t runtime;
+};
+
+static TaskStatus_t task_status[MULE_METRICS_TASK_SLOTS];
+static struct task_prev task_prev[MULE_METRICS_TASK_SLOTS];
+static int task_prev_count;
+static uint32_t total_prev;
+#endif
+
+int
+mule_metrics_init(const uint8_t *id)
+{
+    memcpy(mule_id, id, MULE_METRICS_ID_BYTES);
+    return 0;
+}
+
+static uint32_t
+metrics_ms(int64_t us)
+{
+    return us <= 0 ? 0 : (uint32_t)(us / 1000);
+}
+
+void
+mule_metrics_time(enum mule_metrics_timing_id id, int64_t elapsed_us)
+{
+    uint32_t ms = metrics_ms(elapsed_us);
+
+    mule_lock(&metrics_lock);
+    timings[id].count++;
+    timings[id].total_ms += ms;
+    if (ms > timings[id].max_ms) {
+        timings[id].max_ms = ms;
+    }
+    mule_unlock(&metrics_lock);
+}
+
+/**
+ * Records a completed transfer.
+ *
+ * @param conn_events           Connection events the transfer spanned;
+ *                                  notifications / conn_events is how well
+ *                                  the link is packed.
+ */
+void
+mule_metrics_transfer(const uint8_t *sensor_id, uint32_t bytes,
+                      int64_t elapsed_us, uint32_t notified,
+                      uint32_t events)
+{
+    struct sensor_metrics *s = NULL;
+    struct sensor_metrics *oldest = &sensors[0];
+    int i;
+
+    mule_metrics_time(MULE_METRICS_TRANSFER, elapsed_us);
+
+    mule_lock(&metrics_lock);
+    transfers++;
+    transfer_bytes += bytes;
+    notifications += notified;
+    conn_events += events;
+
+    for (i = 0; i < MULE_METRICS_SENSORS; i++) {
+        if (sensors[i].transfers != 0 &&
+                memcmp(sensors[i].sensor_id, sensor_id,
+                       NEBULA_SENSOR_ID_BYTES) == 0) {
+            s = &sensors[i];
+            break;
+        }
+        if (sensors[i].last_us < oldest->last_us) {
+            oldest = &sensors[i];
+        }
+    }
+    if (s == NULL) {
+        s = oldest;
+        memset(s, 0, sizeof *s);
+        memcpy(s->sensor_id, sensor_id, NEBULA_SENSOR_ID_BYTES);
+    }
+    s->transfers++;
+    s->bytes += bytes;
+    s->busy_ms += metrics_ms(elapsed_us);
+    s->last_us = mule_time_us();
+    mule_unlock(&metrics_lock);
+}
+
+/**
+ * Samples the free block count of the BLE stack's mbuf pool.
+ */
+void
+mule_metrics_msys(int free_blocks)
+{
+    mule_lock(&metrics_lock);
+    if (msys_free_min < 0 || free_blocks < msys_free_min) {
+        msys_free_min = free_blocks;
+    }
+    if (free_blocks == 0) {
+        msys_exhausted++;
+    }
+    mule_unlock(&metrics_lock);
+}
+
+static void
+metrics_put(struct metrics_writer *w, const void *data, size_t len)
+{
+    if (w->len + len <= w->cap) {
+        memcpy(w->buf + w->len, data, len);
+    }
+    w->len += len;
+}
+
+static void
+metrics_put8(struct metrics_writer *w, uint8_t v)
+{
+    metrics_put(w, &v, 1);
+}
+
+static void
+metrics_put16(struct metrics_writer *w, uint16_t v)
+{
+    uint8_t b[2] = { (uint8_t)v, (uint8_t)(v >> 8) };
+
+    metrics_put(w, b, sizeof b);
+}
+
+static void
+metrics_put32(struct metrics_writer *w, uint32_t v)
+{
+    uint8_t b[4] = {
+        (uint8_t)v, (uint8_t)(v >> 8), (uint8_t)(v >> 16), (uint8_t)(v >> 24)
+    };
+
+    metrics_put(w, b, sizeof b);
+}
+
+static uint16_t
+metrics_sat16(uint32_t v)
+{
+    return v > UINT16_MAX ? UINT16_MAX : (uint16_t)v;
+}
+
+#if MULE_METRICS_TASK_STATS
+static uint32_t
+metrics_task_prev(UBaseType_t number)
+{
+    int i;
+
+    for (i = 0; i < task_prev_count; i++) {
+        if (task_prev[i].number == number) {
+            return task_prev[i].runtime;
+        }
+    }
+    return 0;
+}
+
+static int
+metrics_put_tasks(struct metrics_writer *w)
+{
+    char name[MULE_METRICS_TASK_NAME];
+    uint32_t total;
+    uint32_t delta;
+    uint32_t cpu;
+    BaseType_t core;
+    UBaseType_t n;
+    UBaseType_t i;
+
+    n = uxTaskGetSystemState(task_status, MULE_METRICS_TASK_SLOTS, &total);
+    delta = total - total_prev;
+    for (i = 0; i < n && i < MULE_METRICS_TASKS; i++) {
+        cpu = delta == 0 ? 0 :
+              (uint32_t)((uint64_t)(task_status[i].ulRunTimeCounter -
+                         metrics_task_prev(task_status[i].xTaskNumber)) *
+                         100 / delta);
+        core = xTaskGetAffinity(task_status[i].xHandle);
+
+        memset(name, 0, sizeof name);
+        strncpy(name, task_status[i].pcTaskName, sizeof name);
+        metrics_put(w, name, sizeof name);
+        metrics_put16(w, metrics_sat16(task_status[i].usStackHighWaterMark));
+        metrics_put8(w, cpu > 100 ? 100 : (uint8_t)cpu);
+        metrics_put8(w, core == tskNO_AFFINITY ? 0xff : (uint8_t)core);
+    }
+
+    for (i = 0; i < n; i++) {
+        task_prev[i].number = task_status[i].xTaskNumber;
+        task_prev[i].runtime = task_status[i].ulRunTimeCounter;
+    }
+    task_prev_count = n;
+    total_prev = total;
+    return n < MULE_METRICS_TASKS ? (int)n : MULE_METRICS_TASKS;
+}
+#endif
+
+/**
+ * Writes a snapshot of the counters and the sampled state.  Call from one
+ * task only; task CPU use is measured between successive calls.
+ *
+ * @return                      The snapshot length; if it exceeds cap the
+ *                                  buffer holds a truncated snapshot.
+ */
+size_t
+mule_metrics_snapshot(uint8_t *buf, size_t cap)
+{
+    static struct sensor_telemetry_record telemetry[MULE_METRICS_TELEMETRY];
+    struct metrics_writer w = { buf, cap, 0 };
+    struct sensor_telemetry_stats tstats;
+    struct payload_pool_stats pst;
+    uint32_t pool_fails = 0;
+    uint16_t pool_in_use = 0;
+    uint16_t pool_blocks = 0;
+    uint16_t pool_high = 0;
+    uint32_t heap_free = 0;
+    uint32_t heap_min = 0;
+    int store_count;
+    size_t counts_at;
+    int nsensors = 0;
+    int ntasks = 0;
+    int ntelemetry;
+    int i;
+
+#ifdef ESP_PLATFORM
+    heap_free = esp_get_free_heap_size();
+    heap_min = esp_get_minimum_free_heap_size();
+#endif
+    store_count = payload_store_count();
+    for (i = 0; i < PAYLOAD_POOL_NUM_CLASSES; i++) {
+        if (payload_pool_stats(i, &pst) == 0) {
+            pool_in_use += pst.in_use;
+            pool_blocks += pst.blocks;
+            pool_high += pst.high_water;
+            pool_fails += pst.alloc_fails;
+        }
+    }
+
+    /* Only telemetry harvested since the last snapshot goes out. */
+    sensor_telemetry_get_stats(&tstats);
+    ntelemetry = (int)(tstats.harvested - telemetry_sent);
+    if (ntelemetry > MULE_METRICS_TELEMETRY) {
+        ntelemetry = MULE_METRICS_TELEMETRY;
+    }
+    ntelemetry = sensor_telemetry_latest(telemetry, ntelemetry);
+    telemetry_sent = tstats.harvested;
+
+    counts_at = w.len;
+    metrics_put8(&w, MULE_METRICS_VERSION);
+    metrics_put8(&w, 0);
+    metrics_put8(&w, 0);
+    metrics_put8(&w, (uint8_t)ntelemetry);
+    metrics_put(&w, mule_id, sizeof mule_id);
+    metrics_put32(&w, (uint32_t)(mule_time_us() / 1000000));
+    metrics_put32(&w, heap_free);
+    metrics_put32(&w, heap_min);
+
+    mule_lock(&metrics_lock);
+    metrics_put16(&w, msys_free_min < 0 ? 0 : metrics_sat16(msys_free_min));
+    metrics_put16(&w, metrics_sat16(msys_exhausted));
+    metrics_put16(&w, metrics_sat16(store_count));
+    metrics_put16(&w, pool_in_use);
+    metrics_put16(&w, pool_blocks);
+    metrics_put16(&w, pool_high);
+    metrics_put32(&w, pool_fails);
+    for (i = 0; i < MULE_METRICS_TIMINGS; i++) {
+        metrics_put32(&w, timings[i].count);
+        metrics_put32(&w, timings[i].total_ms);
+        metrics_put32(&w, timings[i].max_ms);
+    }
+    metrics_put32(&w, transfers);
+    metrics_put32(&w, transfer_bytes);
+    metrics_put32(&w, notifications);
+    metrics_put32(&w, conn_events);
+    for (i = 0; i < MULE_METRICS_SENSORS; i++) {
+        if (sensors[i].transfers == 0) {
+            continue;
+        }
+        metrics_put(&w, sensors[i].sensor_id, NEBULA_SENSOR_ID_BYTES);
+        metrics_put32(&w, sensors[i].transfers);
+        metrics_put32(&w, sensors[i].bytes);
+        metrics_put32(&w, sensors[i].busy_ms);
+        nsensors++;
+    }
+    /* The low water mark is per snapshot. */
+    msys_free_min = -1;
+    mule_unlock(&metrics_lock);
+
+#if MULE_METRICS_TASK_STATS
+    ntasks = metrics_put_tasks(&w);
+#endif
+
+    for (i = 0; i < ntelemetry; i++) {
+        metrics_put(&w, telemetry[i].addr, SENSOR_TELEMETRY_ADDR_BYTES);
+        metrics_put16(&w, (uint16_t)sizeof telemetry[i].telemetry);
+        metrics_put(&w, &telemetry[i].telemetry, sizeof telemetry[i].telemetry);
+    }
+
+    if (counts_at + 3 <= cap) {
+        buf[counts_at + 1] = (uint8_t)nsensors;
+        buf[counts_at + 2] = (uint8_t)ntasks;
+    }
+    return w.len;
+}
+
+/**
+ * Writes a snapshot to the console as a "#NM" hex line, for
+ * host/metrics_decode.py.
+ */
+void
+mule_metrics_print(const uint8_t *snap, size_t len)
+{
+    static const char digits[] = "0123456789abcdef";
+    static char line[4 + 2 * MULE_METRICS_MAX_BYTES + 1];
+    size_t i;
+
+    if (len > MULE_METRICS_MAX_BYTES) {
+        ESP_LOGW(tag, "snapshot too large to print; %u bytes", (unsigned)len);
+        return;
+    }
+    memcpy(line, "#NM ", 4);
+    for (i = 0; i < len; i++) {
+        line[4 + 2 * i] = digits[snap[i] >> 4];
+        line[4 + 2 * i + 1] = digits[snap[i] & 0xf];
+    }
+    line[4 + 2 * len] = '\0';
+    puts(line);
+}
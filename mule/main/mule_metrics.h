@@ -0,0 +1,83 @@
+/*
+ * Mule performance counters, exported as a compact binary snapshot.
+ */
+
+#ifndef H_MULE_METRICS_
+#define H_MULE_METRICS_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "nebula_proto.h"
+#include "nebula_telemetry.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Sensors tracked individually; the least recently seen is replaced. */
+#ifndef MULE_METRICS_SENSORS
+#define MULE_METRICS_SENSORS        8
+#endif
+
+/** Tasks reported in a snapshot. */
+#ifndef MULE_METRICS_TASKS
+#define MULE_METRICS_TASKS          16
+#endif
+
+/** Harvested sensor telemetry snapshots carried per mule snapshot. */
+#ifndef MULE_METRICS_TELEMETRY
+#define MULE_METRICS_TELEMETRY      4
+#endif
+
+#define MULE_METRICS_VERSION        1
+#define MULE_METRICS_ID_BYTES       16
+#define MULE_METRICS_TASK_NAME      12
+
+/** Largest snapshot with every section full. */
+#define MULE_METRICS_MAX_BYTES \
+    (100 + MULE_METRICS_SENSORS * 28 + MULE_METRICS_TASKS * 16 + \
+     MULE_METRICS_TELEMETRY * (8 + sizeof(struct nebula_telemetry)))
+
+/*
+ * Snapshot layout, little-endian (cloud/payloads.py MuleMetrics):
+ *
+ *   u8 version, u8 sensors, u8 tasks, u8 telemetry
+ *   mule_id[16]
+ *   u32 uptime_s, u32 heap_free, u32 heap_min_free
+ *   u16 msys_free_min, u16 msys_exhausted
+ *   u16 store_count, u16 pool_in_use, u16 pool_blocks, u16 pool_high_water
+ *   u32 pool_alloc_fails
+ *   3 x timing { u32 count, u32 total_ms, u32 max_ms }
+ *   u32 transfers, u32 transfer_bytes, u32 notifications, u32 conn_events
+ *   sensors x { sensor_id[16], u32 transfers, u32 bytes, u32 busy_ms }
+ *   tasks x { name[12], u16 stack_free_min, u8 cpu_percent, u8 core }
+ *   telemetry x { addr[6], u16 len, struct nebula_telemetry }
+ */
+
+enum mule_metrics_timing_id {
+    MULE_METRICS_CONN_SETUP,    /* ble_gap_connect() to the connect event */
+    MULE_METRICS_DISCOVERY,     /* connect event to discovery complete */
+    MULE_METRICS_TRANSFER,      /* first chunk to the sensor's done */
+    MULE_METRICS_TIMINGS
+};
+
+struct mule_metrics_timing {
+    uint32_t count;
+    uint32_t total_ms;
+    uint32_t max_ms;
+};
+
+int mule_metrics_init(const uint8_t *mule_id);
+void mule_metrics_time(enum mule_metrics_timing_id id, int64_t elapsed_us);
+void mule_metrics_transfer(const uint8_t *sensor_id, uint32_t bytes,
+                           int64_t elapsed_us, uint32_t notifications,
+                           uint32_t conn_events);
+void mule_metrics_msys(int free_blocks);
+size_t mule_metrics_snapshot(uint8_t *buf, size_t cap);
+void mule_metrics_print(const uint8_t *snap, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,204 @@
+/*
+ * Thin portability layer so that the mule's protocol and buffer modules can
+ * be compiled both under ESP-IDF and as plain Linux host code.
+ */
+
+#ifndef H_MULE_PORT_
+#define H_MULE_PORT_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "mbedtls/sha256.h"
+
+typedef portMUX_TYPE mule_lock_t;
+#define MULE_LOCK_INITIALIZER   portMUX_INITIALIZER_UNLOCKED
+#define mule_lock(l)            taskENTER_CRITICAL(l)
+#define mule_unlock(l)          taskEXIT_CRITICAL(l)
+
+static inline int64_t
+mule_time_us(void)
+{
+    return esp_timer_get_time();
+}
+
+static inline void
+mule_sleep_ms(uint32_t ms)
+{
+    vTaskDelay(ms / portTICK_PERIOD_MS);
+}
+
+/* Auto-resetting wakeup flag for handing work from one task to another. */
+typedef SemaphoreHandle_t mule_event_t;
+
+static inline void
+mule_event_init(mule_event_t *ev)
+{
+    *ev = xSemaphoreCreateBinary();
+}
+
+static inline void
+mule_event_signal(mule_event_t *ev)
+{
+    xSemaphoreGive(*ev);
+}
+
+/** @return 1 if signalled, 0 on timeout. */
+static inline int
+mule_event_wait(mule_event_t *ev, uint32_t timeout_ms)
+{
+    return xSemaphoreTake(*ev, timeout_ms / portTICK_PERIOD_MS) == pdTRUE;
+}
+
+/*
+ * Incremental SHA-256.  With CONFIG_MBEDTLS_HARDWARE_SHA the context runs on
+ * the SHA accelerator; a context that cannot get the engine falls back to
+ * software, so several can be open at once.  Every started context must be
+ * finished or aborted to release the engine.
+ */
+typedef mbedtls_sha256_context mule_sha256_t;
+
+static inline void
+mule_sha256_start(mule_sha256_t *ctx)
+{
+    mbedtls_sha256_init(ctx);
+    mbedtls_sha256_starts(ctx, 0);
+}
+
+static inline void
+mule_sha256_update(mule_sha256_t *ctx, const uint8_t *buf, size_t len)
+{
+    mbedtls_sha256_update(ctx, buf, len);
+}
+
+static inline void
+mule_sha256_finish(mule_sha256_t *ctx, uint8_t digest[32])
+{
+    mbedtls_sha256_finish(ctx, digest);
+    mbedtls_sha256_free(ctx);
+}
+
+static inline void
+mule_sha256_abort(mule_sha256_t *ctx)
+{
+    mbedtls_sha256_free(ctx);
+}
+
+#else /* host build */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#define OPENSSL_SUPPRESS_DEPRECATED
+#include <openssl/sha.h>
+
+typedef pthread_mutex_t mule_lock_t;
+#define MULE_LOCK_INITIALIZER   PTHREAD_MUTEX_INITIALIZER
+#define mule_lock(l)            pthread_mutex_lock(l)
+#define mule_unlock(l)          pthread_mutex_unlock(l)
+
+#define ESP_LOGE(tag, fmt, ...) fprintf(stderr, "E %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) fprintf(stderr, "W %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) fprintf(stderr, "I %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) do { } while (0)
+
+static inline int64_t
+mule_time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline void
+mule_sleep_ms(uint32_t ms)
+{
+    usleep(ms * 1000);
+}
+
+typedef struct {
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    int set;
+} mule_event_t;
+
+static inline void
+mule_event_init(mule_event_t *ev)
+{
+    pthread_mutex_init(&ev->mtx, NULL);
+    pthread_cond_init(&ev->cond, NULL);
+    ev->set = 0;
+}
+
+static inline void
+mule_event_signal(mule_event_t *ev)
+{
+    pthread_mutex_lock(&ev->mtx);
+    ev->set = 1;
+    pthread_cond_signal(&ev->cond);
+    pthread_mutex_unlock(&ev->mtx);
+}
+
+static inline int
+mule_event_wait(mule_event_t *ev, uint32_t timeout_ms)
+{
+    struct timespec ts;
+    int signalled;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&ev->mtx);
+    while (!ev->set) {
+        if (pthread_cond_timedwait(&ev->cond, &ev->mtx, &ts) != 0) {
+            break;
+        }
+    }
+    signalled = ev->set;
+    ev->set = 0;
+    pthread_mutex_unlock(&ev->mtx);
+    return signalled;
+}
+
+typedef SHA256_CTX mule_sha256_t;
+
+static inline void
+mule_sha256_start(mule_sha256_t *ctx)
+{
+    SHA256_Init(ctx);
+}
+
+static inline void
+mule_sha256_update(mule_sha256_t *ctx, const uint8_t *buf, size_t len)
+{
+    SHA256_Update(ctx, buf, len);
+}
+
+static inline void
+mule_sha256_finish(mule_sha256_t *ctx, uint8_t digest[32])
+{
+    SHA256_Final(digest, ctx);
+}
+
+static inline void
+mule_sha256_abort(mule_sha256_t *ctx)
+{
+}
+
+#endif
+
+#endif
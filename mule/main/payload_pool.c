@@ -0,0 +1,329 @@
+/*
+ * Size-class slab allocator for in-flight payloads and per-connection state.
+ *
+ * All slabs are carved out of a single arena at boot, so the allocator never
+ * touches the system heap afterwards and cannot fragment it no matter how
+ * links come and go.  On modules with PSRAM the arena is placed there and the
+ * block counts are scaled up.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "payload_pool.h"
+#include "mule_port.h"
+
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#include "esp_heap_caps.h"
+#endif
+
+static const char *tag = "PAYLOAD_POOL";
+
+struct pool_hdr {
+    struct pool_hdr *next;      /* free list link, NULL while allocated */
+    uint16_t owner;
+    uint8_t cls;
+    uint8_t in_use;
+};
+
+/* Keep the user area 8-byte aligned on both the ESP32 and 64-bit hosts. */
+#define POOL_HDR_SIZE   ((sizeof (struct pool_hdr) + 7) & ~(size_t)7)
+
+struct pool_class {
+    uint8_t *base;
+    struct pool_hdr *free;
+    struct payload_pool_stats stats;
+};
+
+static const uint32_t class_sizes[PAYLOAD_POOL_NUM_CLASSES] = {
+    PAYLOAD_POOL_CLASS0_SIZE, PAYLOAD_POOL_CLASS1_SIZE,
+    PAYLOAD_POOL_CLASS2_SIZE, PAYLOAD_POOL_CLASS3_SIZE,
+};
+
+static const uint16_t class_counts[PAYLOAD_POOL_NUM_CLASSES] = {
+    PAYLOAD_POOL_CLASS0_COUNT, PAYLOAD_POOL_CLASS1_COUNT,
+    PAYLOAD_POOL_CLASS2_COUNT, PAYLOAD_POOL_CLASS3_COUNT,
+};
+
+static struct pool_class classes[PAYLOAD_POOL_NUM_CLASSES];
+static void *pool_arena;
+static int pool_in_spiram;
+static mule_lock_t pool_lock = MULE_LOCK_INITIALIZER;
+
+static inline struct pool_hdr *
+pool_hdr_of(const void *p)
+{
+    return (struct pool_hdr *)((uint8_t *)p - POOL_HDR_SIZE);
+}
+
+static inline size_t
+pool_stride(int cls)
+{
+    return POOL_HDR_SIZE + class_sizes[cls];
+}
+
+static void *
+pool_arena_alloc(size_t bytes)
+{
+#ifdef ESP_PLATFORM
+    void *mem = NULL;
+
+#if CONFIG_SPIRAM
+    mem = heap_caps_malloc(bytes, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (mem != NULL) {
+        pool_in_spiram = 1;
+        return mem;
+    }
+#endif
+    pool_in_spiram = 0;
+    mem = heap_caps_malloc(bytes, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    return mem;
+#else
+    pool_in_spiram = 0;
+    return malloc(bytes);
+#endif
+}
+
+static void
+pool_arena_free(void)
+{
+#ifdef ESP_PLATFORM
+    heap_caps_free(pool_arena);
+#else
+    free(pool_arena);
+#endif
+    pool_arena = NULL;
+}
+
+static uint16_t
+pool_class_count(int cls)
+{
+#if defined(ESP_PLATFORM) && CONFIG_SPIRAM
+    return class_counts[cls] * PAYLOAD_POOL_SPIRAM_SCALE;
+#else
+    return class_counts[cls];
+#endif
+}
+
+/**
+ * Carves the arena into per-class slabs.  Safe to call more than once; any
+ * outstanding blocks are invalidated.
+ */
+int
+payload_pool_init(void)
+{
+    struct pool_hdr *hdr;
+    size_t total;
+    uint8_t *cur;
+    int cls;
+    int i;
+
+    if (pool_arena != NULL) {
+        pool_arena_free();
+    }
+
+    total = 0;
+    for (cls = 0; cls < PAYLOAD_POOL_NUM_CLASSES; cls++) {
+        total += pool_stride(cls) * pool_class_count(cls);
+    }
+
+    pool_arena = pool_arena_alloc(total);
+    if (pool_arena == NULL) {
+        ESP_LOGE(tag, "failed to allocate %u byte arena", (unsigned)total);
+        return -1;
+    }
+
+    cur = pool_arena;
+    for (cls = 0; cls < PAYLOAD_POOL_NUM_CLASSES; cls++) {
+        struct pool_class *pc = &classes[cls];
+
+        memset(pc, 0, sizeof *pc);
+        pc->base = cur;
+        pc->stats.block_size = class_sizes[cls];
+        pc->stats.blocks = pool_class_count(cls);
+
+        /* Thread the free list back to front so the first alloc is lowest. */
+        for (i = pc->stats.blocks - 1; i >= 0; i--) {
+            hdr = (struct pool_hdr *)(cur + (size_t)i * pool_stride(cls));
+            hdr->cls = cls;
+            hdr->in_use = 0;
+            hdr->owner = PAYLOAD_POOL_OWNER_NONE;
+            hdr->next = pc->free;
+            pc->free = hdr;
+        }
+        cur += (size_t)pc->stats.blocks * pool_stride(cls);
+    }
+
+    ESP_LOGI(tag, "%u byte arena in %s", (unsigned)total,
+             pool_in_spiram ? "PSRAM" : "internal RAM");
+    return 0;
+}
+
+/**
+ * Returns a block of at least len bytes from the smallest class that has a
+ * free block, or NULL when every large-enough class is exhausted.
+ */
+void *
+payload_pool_alloc(size_t len, uint16_t owner)
+{
+    struct pool_class *pc;
+    struct pool_hdr *hdr;
+    int first;
+    int cls;
+
+    first = -1;
+    hdr = NULL;
+    mule_lock(&pool_lock);
+    for (cls = 0; cls < PAYLOAD_POOL_NUM_CLASSES; cls++) {
+        if (class_sizes[cls] < len) {
+            continue;
+        }
+        if (first < 0) {
+            first = cls;
+        }
+
+        pc = &classes[cls];
+        hdr = pc->free;
+        if (hdr != NULL) {
+            break;
+        }
+    }
+
+    if (hdr == NULL) {
+        if (first >= 0) {
+            classes[first].stats.alloc_fails++;
+        }
+        mule_unlock(&pool_lock);
+        return NULL;
+    }
+
+    /* Every class between the first that fits and this one was full. */
+    for (; first < cls; first++) {
+        classes[first].stats.spills++;
+    }
+    pc->free = hdr->next;
+    hdr->next = NULL;
+    hdr->in_use = 1;
+    hdr->owner = owner;
+    pc->stats.in_use++;
+    if (pc->stats.in_use > pc->stats.high_water) {
+        pc->stats.high_water = pc->stats.in_use;
+    }
+    mule_unlock(&pool_lock);
+
+    return (uint8_t *)hdr + POOL_HDR_SIZE;
+}
+
+void
+payload_pool_free(void *p)
+{
+    struct pool_class *pc;
+    struct pool_hdr *hdr;
+
+    if (p == NULL) {
+        return;
+    }
+
+    hdr = pool_hdr_of(p);
+    assert(hdr->cls < PAYLOAD_POOL_NUM_CLASSES);
+    pc = &classes[hdr->cls];
+
+    mule_lock(&pool_lock);
+    assert(hdr->in_use);
+    hdr->in_use = 0;
+    hdr->owner = PAYLOAD_POOL_OWNER_NONE;
+    hdr->next = pc->free;
+    pc->free = hdr;
+    pc->stats.in_use--;
+    mule_unlock(&pool_lock);
+}
+
+/**
+ * Re-tags a block.  Takes the pool lock because payload_pool_release_owner()
+ * may be walking the slabs from another task at the same time.
+ *
+ * @return                      The owner the block had.
+ */
+uint16_t
+payload_pool_set_owner(void *p, uint16_t owner)
+{
+    uint16_t previous;
+
+    mule_lock(&pool_lock);
+    previous = pool_hdr_of(p)->owner;
+    pool_hdr_of(p)->owner = owner;
+    mule_unlock(&pool_lock);
+    return previous;
+}
+
+size_t
+payload_pool_block_size(const void *p)
+{
+    return class_sizes[pool_hdr_of(p)->cls];
+}
+
+/**
+ * Returns every block tagged with the given owner to its free list.  Called on
+ * disconnect so that a dropped link never leaks its reassembly buffers.
+ *
+ * @return                      The number of blocks released.
+ */
+int
+payload_pool_release_owner(uint16_t owner)
+{
+    struct pool_class *pc;
+    struct pool_hdr *hdr;
+    int released;
+    int cls;
+    int i;
+
+    released = 0;
+    mule_lock(&pool_lock);
+    for (cls = 0; cls < PAYLOAD_POOL_NUM_CLASSES; cls++) {
+        pc = &classes[cls];
+        for (i = 0; i < pc->stats.blocks; i++) {
+            hdr = (struct pool_hdr *)(pc->base + (size_t)i * pool_stride(cls));
+            if (!hdr->in_use || hdr->owner != owner) {
+                continue;
+            }
+            hdr->in_use = 0;
+            hdr->owner = PAYLOAD_POOL_OWNER_NONE;
+            hdr->next = pc->free;
+            pc->free = hdr;
+            pc->stats.in_use--;
+            released++;
+        }
+    }
+    mule_unlock(&pool_lock);
+
+    return released;
+}
+
+int
+payload_pool_stats(int cls, struct payload_pool_stats *out)
+{
+    if (cls < 0 || cls >= PAYLOAD_POOL_NUM_CLASSES) {
+        return -1;
+    }
+
+    mule_lock(&pool_lock);
+    *out = classes[cls].stats;
+    mule_unlock(&pool_lock);
+    return 0;
+}
+
+void
+payload_pool_log_stats(void)
+{
+    struct payload_pool_stats st;
+    int cls;
+
+    for (cls = 0; cls < PAYLOAD_POOL_NUM_CLASSES; cls++) {
+        payload_pool_stats(cls, &st);
+        ESP_LOGI(tag, "class %d: size=%u in_use=%u/%u high_water=%u spills=%u fails=%u",
+                 cls, (unsigned)st.block_size, st.in_use, st.blocks,
+                 st.high_water, (unsigned)st.spills,
+                 (unsigned)st.alloc_fails);
+    }
+}
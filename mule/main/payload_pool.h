@@ -0,0 +1,74 @@
+/*
+ * Size-class slab allocator for in-flight payloads and per-connection state.
+ */
+
+#ifndef H_PAYLOAD_POOL_
+#define H_PAYLOAD_POOL_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Every block carries the handle of the connection that owns it, so that a
+ * disconnect can hand all of a link's memory back in one call.  Blocks that
+ * outlive a connection (e.g. completed payloads) are re-tagged with
+ * PAYLOAD_POOL_OWNER_NONE.
+ */
+#define PAYLOAD_POOL_OWNER_NONE     0xffff
+
+/**
+ * Block sizes and counts per class.  Counts are multiplied by
+ * PAYLOAD_POOL_SPIRAM_SCALE when the slabs are carved out of PSRAM.
+ */
+#define PAYLOAD_POOL_NUM_CLASSES    4
+
+#ifndef PAYLOAD_POOL_CLASS0_SIZE
+#define PAYLOAD_POOL_CLASS0_SIZE    256
+#define PAYLOAD_POOL_CLASS0_COUNT   12
+#endif
+#ifndef PAYLOAD_POOL_CLASS1_SIZE
+#define PAYLOAD_POOL_CLASS1_SIZE    1024
+#define PAYLOAD_POOL_CLASS1_COUNT   6
+#endif
+#ifndef PAYLOAD_POOL_CLASS2_SIZE
+#define PAYLOAD_POOL_CLASS2_SIZE    4096
+#define PAYLOAD_POOL_CLASS2_COUNT   4
+#endif
+#ifndef PAYLOAD_POOL_CLASS3_SIZE
+#define PAYLOAD_POOL_CLASS3_SIZE    16384
+#define PAYLOAD_POOL_CLASS3_COUNT   1
+#endif
+
+#ifndef PAYLOAD_POOL_SPIRAM_SCALE
+#define PAYLOAD_POOL_SPIRAM_SCALE   8
+#endif
+
+struct payload_pool_stats {
+    uint32_t block_size;
+    uint16_t blocks;
+    uint16_t in_use;
+    uint16_t high_water;
+    uint32_t spills;        /* requests this class was full for that a larger
+                             * class served */
+    uint32_t alloc_fails;   /* requests no class could serve, charged to the
+                             * smallest class large enough */
+};
+
+int payload_pool_init(void);
+void *payload_pool_alloc(size_t len, uint16_t owner);
+void payload_pool_free(void *p);
+uint16_t payload_pool_set_owner(void *p, uint16_t owner);
+size_t payload_pool_block_size(const void *p);
+int payload_pool_release_owner(uint16_t owner);
+int payload_pool_stats(int cls, struct payload_pool_stats *out);
+void payload_pool_log_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,158 @@
+/*
+ * Queue of completed sensor transfers awaiting upload.
+ *
+ * Records reference the pool block the transfer was reassembled into, so
+ * storing a payload never copies it.  The uplink claims records oldest first;
+ * a claimed record cannot be removed or handed out twice, and a record keeps
+ * its upload state when released so that an interrupted upload resumes
+ * where it stopped.
+ */
+
+#include <string.h>
+#include "payload_store.h"
+#include "payload_pool.h"
+#include "mule_port.h"
+
+static const char *tag = "PAYLOAD_STORE";
+
+static struct payload_record records[PAYLOAD_STORE_CAPACITY];
+static uint32_t next_seq;
+static mule_lock_t store_lock = MULE_LOCK_INITIALIZER;
+
+int
+payload_store_init(void)
+{
+    memset(records, 0, sizeof records);
+    next_seq = 1;
+    return 0;
+}
+
+/**
+ * Adds a completed transfer.  On success the store owns the pool block and
+ * frees it when the record is removed.
+ *
+ * @param block                 Pool block: SignedHashPayload || data.
+ * @param len                   Total bytes in the block, header included.
+ * @param digest                SHA-256 of the data if the caller already
+ *                                  hashed it while receiving, or NULL to have
+ *                                  it computed here.
+ *
+ * @return                      0 on success; -1 if the transfer is too short
+ *                                  or the store is full.
+ */
+int
+payload_store_add(uint8_t *block, uint32_t len, const uint8_t *digest)
+{
+    struct payload_record *rec;
+    uint8_t computed[NEBULA_SHA256_BYTES];
+    mule_sha256_t sha;
+    uint16_t owner;
+    int i;
+
+    if (len <= NEBULA_SIGNED_HASH_PAYLOAD_BYTES) {
+        return -1;
+    }
+
+    if (digest == NULL) {
+        mule_sha256_start(&sha);
+        mule_sha256_update(&sha, block + NEBULA_SIGNED_HASH_PAYLOAD_BYTES,
+                           len - NEBULA_SIGNED_HASH_PAYLOAD_BYTES);
+        mule_sha256_finish(&sha, computed);
+        digest = computed;
+    }
+
+    /* Untagged before it is published: from then on the uplink may free
+     * the block and the rx task reuse it for another link, whose tag a late
+     * re-tag here would wipe. */
+    owner = payload_pool_set_owner(block, PAYLOAD_POOL_OWNER_NONE);
+
+    mule_lock(&store_lock);
+    for (i = 0; i < PAYLOAD_STORE_CAPACITY; i++) {
+        if (records[i].block == NULL) {
+            break;
+        }
+    }
+    if (i == PAYLOAD_STORE_CAPACITY) {
+        mule_unlock(&store_lock);
+        payload_pool_set_owner(block, owner);
+        ESP_LOGW(tag, "store full, dropping %u byte payload", (unsigned)len);
+        return -1;
+    }
+
+    rec = &records[i];
+    memset(rec, 0, sizeof *rec);
+    rec->block = block;
+    rec->data_len = len - NEBULA_SIGNED_HASH_PAYLOAD_BYTES;
+    rec->seq = next_seq++;
+    rec->state = PAYLOAD_NEW;
+    memcpy(rec->digest, digest, NEBULA_SHA256_BYTES);
+    mule_unlock(&store_lock);
+    return 0;
+}
+
+int
+payload_store_count(void)
+{
+    int count;
+    int i;
+
+    count = 0;
+    mule_lock(&store_lock);
+    for (i = 0; i < PAYLOAD_STORE_CAPACITY; i++) {
+        if (records[i].block != NULL) {
+            count++;
+        }
+    }
+    mule_unlock(&store_lock);
+    return count;
+}
+
+/**
+ * Hands out the oldest record that is not already claimed, or NULL.
+ */
+struct payload_record *
+payload_store_claim(void)
+{
+    struct payload_record *best;
+    int i;
+
+    best = NULL;
+    mule_lock(&store_lock);
+    for (i = 0; i < PAYLOAD_STORE_CAPACITY; i++) {
+        if (records[i].block == NULL || records[i].busy) {
+            continue;
+        }
+        if (best == NULL || records[i].seq < best->seq) {
+            best = &records[i];
+        }
+    }
+    if (best != NULL) {
+        best->busy = 1;
+    }
+    mule_unlock(&store_lock);
+    return best;
+}
+
+void
+payload_store_release(struct payload_record *rec)
+{
+    mule_lock(&store_lock);
+    rec->busy = 0;
+    mule_unlock(&store_lock);
+}
+
+void
+payload_store_remove(struct payload_record *rec)
+{
+    uint8_t *block;
+    uint8_t *predelivery;
+
+    mule_lock(&store_lock);
+    block = rec->block;
+    predelivery = rec->predelivery;
+    memset(rec, 0, sizeof *rec);
+    mule_unlock(&store_lock);
+
+    payload_pool_free(predelivery);
+    payload_pool_free(block);
+}
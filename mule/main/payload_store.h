@@ -0,0 +1,70 @@
+/*
+ * Queue of completed sensor transfers awaiting upload.
+ */
+
+#ifndef H_PAYLOAD_STORE_
+#define H_PAYLOAD_STORE_
+
+#include <stdint.h>
+#include "nebula_proto.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef PAYLOAD_STORE_CAPACITY
+#define PAYLOAD_STORE_CAPACITY  32
+#endif
+
+/** Upload progress of a stored payload. */
+#define PAYLOAD_NEW             0   /* nothing sent yet */
+#define PAYLOAD_PREDELIVERED    1   /* /deliver_hash accepted */
+
+struct payload_record {
+    /** Pool block holding the SignedHashPayload followed by the data. */
+    uint8_t *block;
+    uint32_t data_len;
+    uint32_t seq;
+
+    /** SHA-256 of the data, as the appserver computes it. */
+    uint8_t digest[NEBULA_SHA256_BYTES];
+
+    uint8_t state;
+    uint8_t attempts;
+    uint8_t busy;
+
+    /** Signed predelivery response, kept for complaints; pool allocated. */
+    uint8_t *predelivery;
+    uint16_t predelivery_len;
+};
+
+static inline const uint8_t *
+payload_record_signed_hash(const struct payload_record *rec)
+{
+    return rec->block;
+}
+
+static inline const uint8_t *
+payload_record_data_hash(const struct payload_record *rec)
+{
+    return rec->block + NEBULA_SENSOR_ID_BYTES;
+}
+
+static inline const uint8_t *
+payload_record_data(const struct payload_record *rec)
+{
+    return rec->block + NEBULA_SIGNED_HASH_PAYLOAD_BYTES;
+}
+
+int payload_store_init(void);
+int payload_store_add(uint8_t *block, uint32_t len, const uint8_t *digest);
+int payload_store_count(void);
+struct payload_record *payload_store_claim(void);
+void payload_store_release(struct payload_record *rec);
+void payload_store_remove(struct payload_record *rec);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,210 @@
+/*
+ * Cache of registered sensor public keys for on-mule signature checks.
+ *
+ * The appserver serves its registry as a SensorKeyList (sensor_id || X || Y
+ * per sensor); the mule keeps it sorted by sensor id, 80 bytes an entry, so
+ * a lookup is a binary search.  On ESP the list is also kept in NVS so a mule
+ * that boots out of Wi-Fi range still knows who to trust.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "sensor_keys.h"
+#include "mule_port.h"
+
+#ifdef ESP_PLATFORM
+#include "nvs.h"
+
+#define SENSOR_KEYS_NVS_NAMESPACE   "nebula"
+#define SENSOR_KEYS_NVS_KEY         "sensor_keys"
+#endif
+
+static const char *tag = "SENSOR_KEYS";
+
+static struct sensor_key keys[SENSOR_KEYS_CAPACITY];
+static int num_keys;
+static int synced;
+static mule_lock_t keys_lock = MULE_LOCK_INITIALIZER;
+
+static int
+sensor_key_cmp(const void *a, const void *b)
+{
+    return memcmp(((const struct sensor_key *)a)->id,
+                  ((const struct sensor_key *)b)->id, NEBULA_SENSOR_ID_BYTES);
+}
+
+/*
+ * Parses a SensorKeyList into a sorted table.  Entries past the capacity are
+ * dropped with a warning, and *complete is cleared.
+ */
+static int
+sensor_keys_parse(const uint8_t *list, size_t len, struct sensor_key *out,
+                  int *complete)
+{
+    size_t n;
+    size_t i;
+
+    if (len % NEBULA_SENSOR_KEY_ENTRY_BYTES != 0) {
+        return -1;
+    }
+    n = len / NEBULA_SENSOR_KEY_ENTRY_BYTES;
+    if (n > SENSOR_KEYS_CAPACITY) {
+        ESP_LOGW(tag, "%u sensor keys, caching %u", (unsigned)n,
+                 SENSOR_KEYS_CAPACITY);
+        n = SENSOR_KEYS_CAPACITY;
+        *complete = 0;
+    }
+
+    for (i = 0; i < n; i++) {
+        memcpy(out[i].id, list, NEBULA_SENSOR_ID_BYTES);
+        memcpy(out[i].xy, list + NEBULA_SENSOR_ID_BYTES,
+               NEBULA_P256_PUBKEY_BYTES);
+        list += NEBULA_SENSOR_KEY_ENTRY_BYTES;
+    }
+    qsort(out, n, sizeof *out, sensor_key_cmp);
+    return (int)n;
+}
+
+/*
+ * Installs a parsed list.  Only a complete list is authoritative; with part
+ * of the registry cached, a sensor missing from it may still be registered.
+ */
+static int
+sensor_keys_install(const uint8_t *list, size_t len, int complete)
+{
+    static struct sensor_key parsed[SENSOR_KEYS_CAPACITY];
+    int n;
+
+    n = sensor_keys_parse(list, len, parsed, &complete);
+    if (n < 0) {
+        return -1;
+    }
+
+    mule_lock(&keys_lock);
+    memcpy(keys, parsed, n * sizeof *parsed);
+    num_keys = n;
+    synced = complete;
+    mule_unlock(&keys_lock);
+    return 0;
+}
+
+int
+sensor_keys_init(void)
+{
+    num_keys = 0;
+    synced = 0;
+
+#ifdef ESP_PLATFORM
+    static uint8_t saved[SENSOR_KEYS_CAPACITY * NEBULA_SENSOR_KEY_ENTRY_BYTES];
+    size_t len = sizeof saved;
+    nvs_handle_t nvs;
+
+    if (nvs_open(SENSOR_KEYS_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        if (nvs_get_blob(nvs, SENSOR_KEYS_NVS_KEY, saved, &len) == ESP_OK &&
+                sensor_keys_install(saved, len, 1) == 0) {
+            ESP_LOGI(tag, "loaded %d sensor keys from nvs", num_keys);
+        }
+        nvs_close(nvs);
+    }
+#endif
+
+    return 0;
+}
+
+/**
+ * Replaces the cache with a SensorKeyList fetched from the appserver.
+ *
+ * @param total_len             The length of the whole list as served; more
+ *                                  than len if only its start was fetched.
+ *                                  The cache is authoritative only if the
+ *                                  whole list fits in it.
+ *
+ * @return                      0 on success; -1 if the list is malformed.
+ */
+int
+sensor_keys_load_list(const uint8_t *list, size_t len, size_t total_len)
+{
+    int complete;
+
+    complete = total_len <= len;
+    if (total_len % NEBULA_SENSOR_KEY_ENTRY_BYTES != 0 ||
+            sensor_keys_install(list, len - len % NEBULA_SENSOR_KEY_ENTRY_BYTES,
+                                complete) != 0) {
+        ESP_LOGW(tag, "malformed sensor key list; %u bytes", (unsigned)total_len);
+        return -1;
+    }
+
+#ifdef ESP_PLATFORM
+    nvs_handle_t nvs;
+
+    /* NVS only ever holds a complete list, since it is trusted at boot. */
+    if (nvs_open(SENSOR_KEYS_NVS_NAMESPACE, NVS_READWRITE, &nvs) == ESP_OK) {
+        esp_err_t err;
+
+        if (synced) {
+            err = nvs_set_blob(nvs, SENSOR_KEYS_NVS_KEY, list, len);
+        } else {
+            err = nvs_erase_key(nvs, SENSOR_KEYS_NVS_KEY);
+            if (err == ESP_ERR_NVS_NOT_FOUND) {
+                err = ESP_OK;
+            }
+        }
+        if (err != ESP_OK || nvs_commit(nvs) != ESP_OK) {
+            ESP_LOGW(tag, "failed to persist sensor keys");
+        }
+        nvs_close(nvs);
+    }
+#endif
+
+    if (synced) {
+        ESP_LOGI(tag, "cached %d sensor keys", num_keys);
+    } else {
+        ESP_LOGW(tag, "cached %d of %u sensor keys; unknown sensors go unchecked",
+                 num_keys, (unsigned)(total_len / NEBULA_SENSOR_KEY_ENTRY_BYTES));
+    }
+    return 0;
+}
+
+/**
+ * Looks up a sensor's public key.
+ *
+ * @param xy_out                Receives X || Y on success.
+ *
+ * @return                      0 if the sensor is registered; -1 otherwise.
+ */
+int
+sensor_keys_find(const uint8_t *sensor_id, uint8_t *xy_out)
+{
+    const struct sensor_key *key;
+    struct sensor_key probe;
+    int rc;
+
+    memcpy(probe.id, sensor_id, NEBULA_SENSOR_ID_BYTES);
+
+    rc = -1;
+    mule_lock(&keys_lock);
+    key = bsearch(&probe, keys, num_keys, sizeof *keys, sensor_key_cmp);
+    if (key != NULL) {
+        memcpy(xy_out, key->xy, NEBULA_P256_PUBKEY_BYTES);
+        rc = 0;
+    }
+    mule_unlock(&keys_lock);
+    return rc;
+}
+
+int
+sensor_keys_count(void)
+{
+    return num_keys;
+}
+
+/**
+ * Whether the cache holds an authoritative list (from the appserver or NVS),
+ * i.e. whether a sensor missing from it can be treated as unregistered.  A
+ * list too long for the cache never is.
+ */
+int
+sensor_keys_synced(void)
+{
+    return synced;
+}
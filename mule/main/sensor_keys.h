@@ -0,0 +1,35 @@
+/*
+ * Cache of registered sensor public keys for on-mule signature checks.
+ */
+
+#ifndef H_SENSOR_KEYS_
+#define H_SENSOR_KEYS_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "nebula_proto.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SENSOR_KEYS_CAPACITY
+#define SENSOR_KEYS_CAPACITY    32
+#endif
+
+struct sensor_key {
+    uint8_t id[NEBULA_SENSOR_ID_BYTES];
+    uint8_t xy[NEBULA_P256_PUBKEY_BYTES];
+};
+
+int sensor_keys_init(void);
+int sensor_keys_load_list(const uint8_t *list, size_t len, size_t total_len);
+int sensor_keys_find(const uint8_t *sensor_id, uint8_t *xy_out);
+int sensor_keys_count(void);
+int sensor_keys_synced(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,178 @@
+/*
+ * Telemetry harvested from sensors.
+ *
+ * After each completed transfer the host task reads the sensor's telemetry
+ * characteristic with a long read, which arrives in MTU-sized pieces; they
+ * are assembled per connection here.  Finished snapshots go into a small
+ * ring of the latest ones for the uplink to pick up.  A sensor with a newer
+ * layout is accepted as long as the fields this mule knows are unchanged;
+ * anything after them is ignored.
+ */
+
+#include <inttypes.h>
+#include <string.h>
+#include "sensor_telemetry.h"
+#include "mule_port.h"
+
+static const char *tag = "TELEMETRY";
+
+struct telemetry_read {
+    uint8_t in_use;
+    uint16_t conn_handle;
+    struct sensor_telemetry_record rec;
+};
+
+/* Host task only. */
+static struct telemetry_read reads[SENSOR_TELEMETRY_READS];
+
+static struct sensor_telemetry_record kept[SENSOR_TELEMETRY_KEEP];
+static uint32_t kept_next;
+static struct sensor_telemetry_stats stats;
+static mule_lock_t kept_lock = MULE_LOCK_INITIALIZER;
+
+static struct telemetry_read *
+telemetry_read_find(uint16_t conn_handle)
+{
+    int i;
+
+    for (i = 0; i < SENSOR_TELEMETRY_READS; i++) {
+        if (reads[i].in_use && reads[i].conn_handle == conn_handle) {
+            return &reads[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Starts assembling a snapshot read from a connection, replacing any read
+ * still in progress on it.
+ *
+ * @return                      0 on success; -1 if every read slot is busy.
+ */
+int
+sensor_telemetry_start(uint16_t conn_handle, const uint8_t *addr)
+{
+    struct telemetry_read *read = telemetry_read_find(conn_handle);
+    int i;
+
+    for (i = 0; read == NULL && i < SENSOR_TELEMETRY_READS; i++) {
+        if (!reads[i].in_use) {
+            read = &reads[i];
+        }
+    }
+    if (read == NULL) {
+        mule_lock(&kept_lock);
+        stats.busy++;
+        mule_unlock(&kept_lock);
+        return -1;
+    }
+
+    memset(read, 0, sizeof *read);
+    read->in_use = 1;
+    read->conn_handle = conn_handle;
+    memcpy(read->rec.addr, addr, SENSOR_TELEMETRY_ADDR_BYTES);
+    return 0;
+}
+
+/**
+ * Adds one piece of a long read at its attribute offset.
+ */
+int
+sensor_telemetry_append(uint16_t conn_handle, uint16_t offset,
+                        const uint8_t *data, size_t len)
+{
+    struct telemetry_read *read = telemetry_read_find(conn_handle);
+    size_t room;
+
+    if (read == NULL) {
+        return -1;
+    }
+    if (offset < sizeof read->rec.telemetry) {
+        room = sizeof read->rec.telemetry - offset;
+        memcpy((uint8_t *)&read->rec.telemetry + offset, data,
+               len < room ? len : room);
+    }
+    if (offset + len > read->rec.len) {
+        read->rec.len = (uint16_t)(offset + len);
+    }
+    return 0;
+}
+
+/**
+ * Ends a read; a complete, well-formed snapshot is kept.
+ *
+ * @param ok                    Whether the read itself succeeded.
+ *
+ * @return                      0 if the snapshot was kept; -1 otherwise.
+ */
+int
+sensor_telemetry_finish(uint16_t conn_handle, int ok)
+{
+    struct telemetry_read *read = telemetry_read_find(conn_handle);
+    struct nebula_telemetry *t;
+    int valid;
+
+    if (read == NULL) {
+        return -1;
+    }
+    read->in_use = 0;
+    if (!ok) {
+        return -1;
+    }
+
+    t = &read->rec.telemetry;
+    valid = read->rec.len >= sizeof *t &&
+            t->version >= NEBULA_TELEMETRY_VERSION &&
+            t->hist_count == NEBULA_HIST_COUNT &&
+            t->buckets == NEBULA_TELEMETRY_BUCKETS;
+    read->rec.harvested_us = mule_time_us();
+
+    mule_lock(&kept_lock);
+    if (valid) {
+        kept[kept_next++ % SENSOR_TELEMETRY_KEEP] = read->rec;
+        stats.harvested++;
+    } else {
+        stats.malformed++;
+    }
+    mule_unlock(&kept_lock);
+
+    if (!valid) {
+        ESP_LOGW(tag, "malformed telemetry; %u bytes conn_handle=%d",
+                 (unsigned)read->rec.len, conn_handle);
+        return -1;
+    }
+    ESP_LOGI(tag, "conn_handle=%d transfers=%" PRIu32 " skipped=%" PRIu32
+             " bytes=%" PRIu32 " chunks=%" PRIu32 " retransmitted=%" PRIu32
+             " hvx_full=%" PRIu32, conn_handle, t->transfers,
+             t->transfers_skipped, t->bytes_sent, t->chunks_sent,
+             t->chunks_retransmitted, t->hvx_queue_full);
+    return 0;
+}
+
+/**
+ * Copies out the newest harvested snapshots, newest first.
+ *
+ * @return                      The number copied.
+ */
+int
+sensor_telemetry_latest(struct sensor_telemetry_record *out, int max)
+{
+    uint32_t avail;
+    int n;
+
+    mule_lock(&kept_lock);
+    avail = kept_next < SENSOR_TELEMETRY_KEEP ? kept_next : SENSOR_TELEMETRY_KEEP;
+    for (n = 0; n < max && (uint32_t)n < avail; n++) {
+        out[n] = kept[(kept_next - 1 - n) % SENSOR_TELEMETRY_KEEP];
+    }
+    mule_unlock(&kept_lock);
+    return n;
+}
+
+void
+sensor_telemetry_get_stats(struct sensor_telemetry_stats *out)
+{
+    mule_lock(&kept_lock);
+    *out = stats;
+    mule_unlock(&kept_lock);
+}
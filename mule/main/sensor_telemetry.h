@@ -0,0 +1,53 @@
+/*
+ * Telemetry harvested from sensors' telemetry characteristic.
+ */
+
+#ifndef H_SENSOR_TELEMETRY_
+#define H_SENSOR_TELEMETRY_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "nebula_telemetry.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Reads in progress at once; one per connection. */
+#ifndef SENSOR_TELEMETRY_READS
+#define SENSOR_TELEMETRY_READS      4
+#endif
+
+/** Harvested snapshots kept, newest replacing oldest. */
+#ifndef SENSOR_TELEMETRY_KEEP
+#define SENSOR_TELEMETRY_KEEP       8
+#endif
+
+#define SENSOR_TELEMETRY_ADDR_BYTES 6
+
+struct sensor_telemetry_record {
+    /** Sensor's BLE identity address. */
+    uint8_t addr[SENSOR_TELEMETRY_ADDR_BYTES];
+    uint16_t len;
+    int64_t harvested_us;
+    struct nebula_telemetry telemetry;
+};
+
+struct sensor_telemetry_stats {
+    uint32_t harvested;
+    uint32_t malformed;
+    uint32_t busy;
+};
+
+int sensor_telemetry_start(uint16_t conn_handle, const uint8_t *addr);
+int sensor_telemetry_append(uint16_t conn_handle, uint16_t offset,
+                            const uint8_t *data, size_t len);
+int sensor_telemetry_finish(uint16_t conn_handle, int ok);
+int sensor_telemetry_latest(struct sensor_telemetry_record *out, int max);
+void sensor_telemetry_get_stats(struct sensor_telemetry_stats *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,411 @@
+/*
+ * Background verification of sensor SignedHashPayloads.
+ *
+ * The appserver only rejects a forged or unregistered SignedHashPayload after
+ * the mule has carried the whole transfer and uploaded it.  The signed hash
+ * is the first thing a sensor sends, though, so the BLE task submits it here
+ * as soon as the first chunk lands and a verifier task checks the P-256
+ * signature against the sensor key cache while the rest of the transfer is
+ * still arriving.  With CONFIG_MBEDTLS_HARDWARE_MPI the point arithmetic
+ * runs on the RSA/MPI accelerator.
+ *
+ * The BLE task polls for the verdict and never blocks on it: a transfer that
+ * finishes before its verdict is handed over with sensor_verify_defer(), and
+ * the verifier stores or frees it once the check is done.
+ */
+
+#include <string.h>
+#include "sensor_verify.h"
+#include "sensor_keys.h"
+#include "dedup_filter.h"
+#include "payload_pool.h"
+#include "payload_store.h"
+#include "mule_port.h"
+
+#ifdef ESP_PLATFORM
+#include "mbedtls/ecdsa.h"
+#include "mbedtls/ecp.h"
+#else
+#define OPENSSL_SUPPRESS_DEPRECATED
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/obj_mac.h>
+#endif
+
+static const char *tag = "SENSOR_VERIFY";
+
+#define VERIFY_POLL_MS      1000
+
+/* Slot lifecycle: FREE -> QUEUED -> DONE -> FREE. */
+#define SLOT_FREE           0
+#define SLOT_QUEUED         1
+#define SLOT_DONE           2
+
+struct verify_slot {
+    uint8_t state;
+    uint8_t verdict;
+    uint8_t gen;
+    uint8_t released;
+
+    uint8_t signed_hash[NEBULA_SIGNED_HASH_PAYLOAD_BYTES];
+
+    /* Set by sensor_verify_defer(): the verifier now owns the transfer. */
+    uint8_t *block;
+    uint32_t len;
+    uint8_t digest[NEBULA_SHA256_BYTES];
+};
+
+static struct verify_slot slots[SENSOR_VERIFY_SLOTS];
+static struct sensor_verify_stats stats;
+static mule_lock_t slots_lock = MULE_LOCK_INITIALIZER;
+static mule_event_t verify_wake;
+
+#ifdef ESP_PLATFORM
+/* Read-only once loaded (the generator tables are precomputed), so any task
+ * may verify with it. */
+static mbedtls_ecp_group p256;
+#endif
+
+int
+sensor_verify_init(void)
+{
+    memset(slots, 0, sizeof slots);
+    memset(&stats, 0, sizeof stats);
+    mule_event_init(&verify_wake);
+
+#ifdef ESP_PLATFORM
+    mbedtls_ecp_group_init(&p256);
+    if (mbedtls_ecp_group_load(&p256, MBEDTLS_ECP_DP_SECP256R1) != 0) {
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+void
+sensor_verify_get_stats(struct sensor_verify_stats *out)
+{
+    *out = stats;
+}
+
+/* Tickets carry a generation so a stale one never matches a reused slot. */
+static struct verify_slot *
+verify_slot_get(int ticket)
+{
+    struct verify_slot *slot;
+
+    if (ticket < 0 || (ticket & 0xff) >= SENSOR_VERIFY_SLOTS) {
+        return NULL;
+    }
+    slot = &slots[ticket & 0xff];
+    if (slot->state == SLOT_FREE || slot->gen != (uint8_t)(ticket >> 8)) {
+        return NULL;
+    }
+    return slot;
+}
+
+/**
+ * Verifies an ECDSA-P256/SHA-256 signature as produced by util.sign_ecdsa():
+ * the signature is r || s, 32 bytes each.  Besides sensor hash payloads this
+ * checks the appserver's signed token payloads.
+ *
+ * @return                      0 if the signature is valid; -1 otherwise.
+ */
+int
+sensor_verify_ecdsa(const uint8_t *msg, size_t len, const uint8_t *sig,
+                    const uint8_t *pubkey_xy)
+{
+    uint8_t hash[NEBULA_SHA256_BYTES];
+    mule_sha256_t sha;
+    int rc;
+
+    mule_sha256_start(&sha);
+    mule_sha256_update(&sha, msg, len);
+    mule_sha256_finish(&sha, hash);
+
+#ifdef ESP_PLATFORM
+    uint8_t point[1 + NEBULA_P256_PUBKEY_BYTES];
+    mbedtls_ecp_point q;
+    mbedtls_mpi r;
+    mbedtls_mpi s;
+
+    point[0] = 0x04;
+    memcpy(point + 1, pubkey_xy, NEBULA_P256_PUBKEY_BYTES);
+
+    mbedtls_ecp_point_init(&q);
+    mbedtls_mpi_init(&r);
+    mbedtls_mpi_init(&s);
+
+    rc = mbedtls_ecp_point_read_binary(&p256, &q, point, sizeof point);
+    if (rc == 0) {
+        rc = mbedtls_mpi_read_binary(&r, sig, NEBULA_SIGNATURE_BYTES / 2);
+    }
+    if (rc == 0) {
+        rc = mbedtls_mpi_read_binary(&s, sig + NEBULA_SIGNATURE_BYTES / 2,
+                                     NEBULA_SIGNATURE_BYTES / 2);
+    }
+    if (rc == 0) {
+        rc = mbedtls_ecdsa_verify(&p256, hash, sizeof hash, &q, &r, &s);
+    }
+
+    mbedtls_mpi_free(&s);
+    mbedtls_mpi_free(&r);
+    mbedtls_ecp_point_free(&q);
+    return rc == 0 ? 0 : -1;
+#else
+    uint8_t point[1 + NEBULA_P256_PUBKEY_BYTES];
+    EC_KEY *key;
+    EC_POINT *q;
+    ECDSA_SIG *ecdsa_sig;
+    BIGNUM *r;
+    BIGNUM *s;
+
+    point[0] = 0x04;
+    memcpy(point + 1, pubkey_xy, NEBULA_P256_PUBKEY_BYTES);
+
+    rc = -1;
+    key = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    q = key != NULL ? EC_POINT_new(EC_KEY_get0_group(key)) : NULL;
+    ecdsa_sig = ECDSA_SIG_new();
+    r = BN_bin2bn(sig, NEBULA_SIGNATURE_BYTES / 2, NULL);
+    s = BN_bin2bn(sig + NEBULA_SIGNATURE_BYTES / 2, NEBULA_SIGNATURE_BYTES / 2,
+                  NULL);
+
+    if (q != NULL && ecdsa_sig != NULL && r != NULL && s != NULL &&
+            EC_POINT_oct2point(EC_KEY_get0_group(key), q, point, sizeof point,
+                               NULL) == 1 &&
+            EC_KEY_set_public_key(key, q) == 1 &&
+            ECDSA_SIG_set0(ecdsa_sig, r, s) == 1) {
+        r = s = NULL;
+        rc = ECDSA_do_verify(hash, sizeof hash, ecdsa_sig, key) == 1 ? 0 : -1;
+    }
+
+    BN_free(r);
+    BN_free(s);
+    ECDSA_SIG_free(ecdsa_sig);
+    EC_POINT_free(q);
+    EC_KEY_free(key);
+    return rc;
+#endif
+}
+
+/**
+ * Verifies the sensor's signature over a HashPayload.
+ *
+ * @return                      0 if the signature is valid; -1 otherwise.
+ */
+int
+sensor_verify_signature(const uint8_t *signed_hash_payload,
+                        const uint8_t *pubkey_xy)
+{
+    return sensor_verify_ecdsa(signed_hash_payload, NEBULA_HASH_PAYLOAD_BYTES,
+                               signed_hash_payload + NEBULA_HASH_PAYLOAD_BYTES,
+                               pubkey_xy);
+}
+
+/**
+ * Queues a transfer's SignedHashPayload for checking.  The payload is copied,
+ * so the caller's buffer may change afterwards.
+ *
+ * @return                      A ticket for sensor_verify_result(), or -1 if
+ *                                  every slot is busy.
+ */
+int
+sensor_verify_submit(const uint8_t *signed_hash_payload)
+{
+    struct verify_slot *slot;
+    int ticket;
+    int i;
+
+    mule_lock(&slots_lock);
+    for (i = 0; i < SENSOR_VERIFY_SLOTS; i++) {
+        if (slots[i].state == SLOT_FREE) {
+            break;
+        }
+    }
+    if (i == SENSOR_VERIFY_SLOTS) {
+        stats.unchecked++;
+        mule_unlock(&slots_lock);
+        return -1;
+    }
+
+    slot = &slots[i];
+    slot->state = SLOT_QUEUED;
+    slot->verdict = SENSOR_VERIFY_PENDING;
+    slot->released = 0;
+    slot->gen++;
+    slot->block = NULL;
+    memcpy(slot->signed_hash, signed_hash_payload,
+           NEBULA_SIGNED_HASH_PAYLOAD_BYTES);
+    ticket = i | (slot->gen << 8);
+    mule_unlock(&slots_lock);
+
+    mule_event_signal(&verify_wake);
+    return ticket;
+}
+
+/**
+ * @return                      SENSOR_VERIFY_PENDING, _ACCEPT or _REJECT.
+ *                                  An unknown ticket is treated as accepted.
+ */
+int
+sensor_verify_result(int ticket)
+{
+    struct verify_slot *slot;
+    int verdict;
+
+    mule_lock(&slots_lock);
+    slot = verify_slot_get(ticket);
+    verdict = slot != NULL ? slot->verdict : SENSOR_VERIFY_ACCEPT;
+    mule_unlock(&slots_lock);
+    return verdict;
+}
+
+/**
+ * Gives up interest in a ticket, e.g. on disconnect.  A slot still being
+ * checked is freed by the verifier when it finishes.
+ */
+void
+sensor_verify_release(int ticket)
+{
+    struct verify_slot *slot;
+
+    mule_lock(&slots_lock);
+    slot = verify_slot_get(ticket);
+    if (slot != NULL && slot->block == NULL) {
+        if (slot->state == SLOT_DONE) {
+            slot->state = SLOT_FREE;
+        } else {
+            slot->released = 1;
+        }
+    }
+    mule_unlock(&slots_lock);
+}
+
+/* As the receive path does for a transfer verified in line: stored payloads
+ * go into the dedup filter so the sensor's re-offers are turned away. */
+static void
+verify_commit(uint8_t *block, uint32_t len, const uint8_t *digest, int verdict)
+{
+    if (verdict == SENSOR_VERIFY_ACCEPT &&
+            payload_store_add(block, len, digest) == 0) {
+        dedup_filter_add(digest);
+        return;
+    }
+    payload_pool_free(block);
+}
+
+/**
+ * Hands a finished transfer whose verdict is still pending to the verifier,
+ * which adds it to the payload store if accepted and frees it otherwise.
+ * The ticket is consumed either way.
+ *
+ * @return                      0 if the verifier took the block; -1 if the
+ *                                  ticket is unknown and the caller still
+ *                                  owns it.
+ */
+int
+sensor_verify_defer(int ticket, uint8_t *block, uint32_t len,
+                    const uint8_t *digest)
+{
+    struct verify_slot *slot;
+    int verdict;
+
+    payload_pool_set_owner(block, PAYLOAD_POOL_OWNER_NONE);
+
+    mule_lock(&slots_lock);
+    slot = verify_slot_get(ticket);
+    if (slot == NULL) {
+        mule_unlock(&slots_lock);
+        return -1;
+    }
+    if (slot->state == SLOT_QUEUED) {
+        slot->block = block;
+        slot->len = len;
+        memcpy(slot->digest, digest, NEBULA_SHA256_BYTES);
+        mule_unlock(&slots_lock);
+        return 0;
+    }
+
+    /* The verdict came in since the caller last looked. */
+    verdict = slot->verdict;
+    slot->state = SLOT_FREE;
+    mule_unlock(&slots_lock);
+
+    verify_commit(block, len, digest, verdict);
+    return 0;
+}
+
+static int
+verify_check(const uint8_t *signed_hash)
+{
+    uint8_t xy[NEBULA_P256_PUBKEY_BYTES];
+
+    if (sensor_keys_find(signed_hash, xy) != 0) {
+        if (!sensor_keys_synced()) {
+            /* Nothing to check against yet; let the appserver decide. */
+            stats.unchecked++;
+            return SENSOR_VERIFY_ACCEPT;
+        }
+        stats.unknown_sensor++;
+        ESP_LOGW(tag, "rejecting transfer from unknown sensor");
+        return SENSOR_VERIFY_REJECT;
+    }
+
+    if (sensor_verify_signature(signed_hash, xy) != 0) {
+        stats.bad_signature++;
+        ESP_LOGW(tag, "rejecting transfer with bad signature");
+        return SENSOR_VERIFY_REJECT;
+    }
+    stats.verified++;
+    return SENSOR_VERIFY_ACCEPT;
+}
+
+/**
+ * Verifier loop; run it in its own low-priority task so signature checks
+ * never hold up the BLE host.
+ */
+void
+sensor_verify_run(void)
+{
+    uint8_t signed_hash[NEBULA_SIGNED_HASH_PAYLOAD_BYTES];
+    struct verify_slot *slot;
+    uint8_t digest[NEBULA_SHA256_BYTES];
+    uint8_t *block;
+    uint32_t len;
+    int verdict;
+    int i;
+
+    for (;;) {
+        mule_event_wait(&verify_wake, VERIFY_POLL_MS);
+
+        for (i = 0; i < SENSOR_VERIFY_SLOTS; i++) {
+            slot = &slots[i];
+
+            mule_lock(&slots_lock);
+            if (slot->state != SLOT_QUEUED) {
+                mule_unlock(&slots_lock);
+                continue;
+            }
+            memcpy(signed_hash, slot->signed_hash, sizeof signed_hash);
+            mule_unlock(&slots_lock);
+
+            verdict = verify_check(signed_hash);
+
+            mule_lock(&slots_lock);
+            slot->verdict = verdict;
+            slot->state = SLOT_DONE;
+            block = slot->block;
+            len = slot->len;
+            memcpy(digest, slot->digest, sizeof digest);
+            if (block != NULL || slot->released) {
+                slot->state = SLOT_FREE;
+            }
+            mule_unlock(&slots_lock);
+
+            if (block != NULL) {
+                verify_commit(block, len, digest, verdict);
+            }
+        }
+    }
+}
@@ -0,0 +1,53 @@
+/*
+ * Background verification of sensor SignedHashPayloads.
+ */
+
+#ifndef H_SENSOR_VERIFY_
+#define H_SENSOR_VERIFY_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "nebula_proto.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Transfers that can be awaiting a verdict at once. */
+#ifndef SENSOR_VERIFY_SLOTS
+#define SENSOR_VERIFY_SLOTS     8
+#endif
+
+#define SENSOR_VERIFY_PENDING   0
+#define SENSOR_VERIFY_ACCEPT    1
+#define SENSOR_VERIFY_REJECT    2
+
+struct sensor_verify_stats {
+    uint32_t verified;
+    uint32_t bad_signature;
+    uint32_t unknown_sensor;
+    /** Accepted without a check: no key list yet, or no free slot. */
+    uint32_t unchecked;
+};
+
+int sensor_verify_init(void);
+void sensor_verify_run(void);
+
+int sensor_verify_submit(const uint8_t *signed_hash_payload);
+int sensor_verify_result(int ticket);
+void sensor_verify_release(int ticket);
+int sensor_verify_defer(int ticket, uint8_t *block, uint32_t len,
+                        const uint8_t *digest);
+
+int sensor_verify_ecdsa(const uint8_t *msg, size_t len, const uint8_t *sig,
+                        const uint8_t *pubkey_xy);
+int sensor_verify_signature(const uint8_t *signed_hash_payload,
+                            const uint8_t *pubkey_xy);
+
+void sensor_verify_get_stats(struct sensor_verify_stats *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
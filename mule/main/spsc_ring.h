@@ -0,0 +1,106 @@
+/*
+ * Lock-free single-producer/single-consumer ring of fixed-size slots, for
+ * handing work between two tasks on different cores without either one
+ * masking interrupts or blocking.
+ *
+ * The producer fills a slot in place between spsc_ring_claim() and
+ * spsc_ring_publish(); the consumer reads one in place between
+ * spsc_ring_peek() and spsc_ring_release().  head is only written by the
+ * producer and tail only by the consumer, so release/acquire ordering on
+ * the two indices is all the synchronisation needed.
+ */
+
+#ifndef H_SPSC_RING_
+#define H_SPSC_RING_
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct spsc_ring {
+    uint8_t *slots;
+    size_t slot_size;
+    uint32_t mask;
+
+    _Atomic uint32_t head;      /* next slot to publish */
+    _Atomic uint32_t tail;      /* next slot to release */
+};
+
+/**
+ * @param slots                 count * slot_size bytes of storage.
+ * @param count                 Number of slots; a power of two.
+ */
+static inline void
+spsc_ring_init(struct spsc_ring *ring, void *slots, size_t slot_size,
+               uint32_t count)
+{
+    ring->slots = slots;
+    ring->slot_size = slot_size;
+    ring->mask = count - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+}
+
+/** Producer: the slot to fill next, or NULL if the ring is full. */
+static inline void *
+spsc_ring_claim(struct spsc_ring *ring)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head - tail > ring->mask) {
+        return NULL;
+    }
+    return ring->slots + (size_t)(head & ring->mask) * ring->slot_size;
+}
+
+/** Producer: how many slots are free; more may free up meanwhile. */
+static inline uint32_t
+spsc_ring_space(struct spsc_ring *ring)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    return ring->mask + 1 - (head - tail);
+}
+
+/** Producer: hands the claimed slot to the consumer. */
+static inline void
+spsc_ring_publish(struct spsc_ring *ring)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/** Consumer: the oldest published slot, or NULL if the ring is empty. */
+static inline void *
+spsc_ring_peek(struct spsc_ring *ring)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (head == tail) {
+        return NULL;
+    }
+    return ring->slots + (size_t)(tail & ring->mask) * ring->slot_size;
+}
+
+/** Consumer: returns the peeked slot to the producer. */
+static inline void
+spsc_ring_release(struct spsc_ring *ring)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,570 @@
+/*
+ * Durable store of earned delivery tokens, redeemed with the provider in
+ * batches.
+ *
+ * Every delivery earns a SignedTokenPayload from the appserver.  The wallet
+ * checks the appserver's signature, keeps the 64 byte token and persists it
+ * straight away, one record per slot, so a reboot never costs a mule its
+ * earnings.  Once enough tokens are held (or the oldest has waited long
+ * enough) they go to the provider's /redeem_tokens as one TokenList.  The
+ * provider answers with the tokens it found invalid.  Those are kept for
+ * another try, up to max_attempts.  Everything else in the batch is settled,
+ * redeemed or a duplicate, and is removed.
+ *
+ * A slot is owned by whoever moved it out of SLOT_FREE or SLOT_HELD, so
+ * records are written and erased outside the lock; NVS writes cannot run
+ * with interrupts masked.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "mule_port.h"
+#include "sensor_verify.h"
+#include "token_wallet.h"
+
+#ifdef ESP_PLATFORM
+#include "nvs.h"
+
+#define TOKEN_WALLET_NVS_NAMESPACE  "wallet"
+#else
+#include <errno.h>
+#endif
+
+/* Wait after a failed redemption before token_wallet_due() says go again. */
+#define TOKEN_WALLET_RETRY_MS   (30 * 1000)
+
+#define SLOT_FREE               0
+#define SLOT_WRITING            1   /* being persisted by token_wallet_add() */
+#define SLOT_HELD               2
+#define SLOT_REDEEMING          3   /* in a /redeem_tokens request */
+
+struct wallet_slot {
+    uint8_t state;
+    uint8_t attempts;
+    int64_t held_since_us;
+    uint8_t token[NEBULA_TOKEN_BYTES];
+};
+
+/* What is persisted for a held token. */
+struct wallet_record {
+    uint8_t token[NEBULA_TOKEN_BYTES];
+    uint8_t attempts;
+};
+
+static const char *tag = "WALLET";
+
+static struct token_wallet_config cfg;
+static struct wallet_slot slots[TOKEN_WALLET_CAPACITY];
+static struct token_wallet_stats stats;
+static int64_t next_try_us;
+static mule_lock_t wallet_lock = MULE_LOCK_INITIALIZER;
+
+static struct http_conn conn;
+
+/* mule_id || TokenList, and the provider's TokenList of invalid tokens */
+static uint8_t request[TOKEN_WALLET_MULE_ID_BYTES + 4 +
+                       TOKEN_WALLET_BATCH_MAX * NEBULA_TOKEN_BYTES];
+static uint8_t response[4 + TOKEN_WALLET_BATCH_MAX * NEBULA_TOKEN_BYTES];
+
+/* Tokens from before a reboot have waited long enough already. */
+static void
+wallet_slot_restore(int slot, const struct wallet_record *rec)
+{
+    memcpy(slots[slot].token, rec->token, NEBULA_TOKEN_BYTES);
+    slots[slot].attempts = rec->attempts;
+    slots[slot].held_since_us = 0;
+    slots[slot].state = SLOT_HELD;
+}
+
+#ifdef ESP_PLATFORM
+
+static void
+wallet_record_key(int slot, char *key, size_t cap)
+{
+    snprintf(key, cap, "tok%03d", slot);
+}
+
+static int
+wallet_record_put(int slot, const struct wallet_record *rec)
+{
+    char key[16];
+    nvs_handle_t nvs;
+    esp_err_t err;
+
+    wallet_record_key(slot, key, sizeof key);
+    err = nvs_open(TOKEN_WALLET_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(nvs, key, rec, sizeof *rec);
+        if (err == ESP_OK) {
+            err = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+    return err == ESP_OK ? 0 : -1;
+}
+
+static int
+wallet_record_erase(int slot)
+{
+    char key[16];
+    nvs_handle_t nvs;
+    esp_err_t err;
+
+    wallet_record_key(slot, key, sizeof key);
+    err = nvs_open(TOKEN_WALLET_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err == ESP_OK) {
+        err = nvs_erase_key(nvs, key);
+        if (err == ESP_OK || err == ESP_ERR_NVS_NOT_FOUND) {
+            err = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+    return err == ESP_OK ? 0 : -1;
+}
+
+static int
+wallet_records_load(void)
+{
+    struct wallet_record rec;
+    nvs_handle_t nvs;
+    char key[16];
+    size_t len;
+    int loaded = 0;
+    int i;
+
+    if (nvs_open(TOKEN_WALLET_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return 0;
+    }
+    for (i = 0; i < TOKEN_WALLET_CAPACITY; i++) {
+        wallet_record_key(i, key, sizeof key);
+        len = sizeof rec;
+        if (nvs_get_blob(nvs, key, &rec, &len) == ESP_OK && len == sizeof rec) {
+            wallet_slot_restore(i, &rec);
+            loaded++;
+        }
+    }
+    nvs_close(nvs);
+    return loaded;
+}
+
+#else
+
+static void
+wallet_record_path(int slot, char *path, size_t cap, const char *suffix)
+{
+    snprintf(path, cap, "%s/tok%03d%s", cfg.store_dir, slot, suffix);
+}
+
+static int
+wallet_record_put(int slot, const struct wallet_record *rec)
+{
+    char tmp[256];
+    char path[256];
+    FILE *f;
+    int ok;
+
+    if (cfg.store_dir == NULL) {
+        return 0;
+    }
+
+    /* Write then rename, so a crash leaves the old record or the new one. */
+    wallet_record_path(slot, tmp, sizeof tmp, ".tmp");
+    wallet_record_path(slot, path, sizeof path, "");
+    f = fopen(tmp, "wb");
+    if (f == NULL) {
+        return -1;
+    }
+    ok = fwrite(rec, sizeof *rec, 1, f) == 1;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp, path) != 0) {
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+wallet_record_erase(int slot)
+{
+    char path[256];
+
+    if (cfg.store_dir == NULL) {
+        return 0;
+    }
+    wallet_record_path(slot, path, sizeof path, "");
+    return remove(path) == 0 || errno == ENOENT ? 0 : -1;
+}
+
+static int
+wallet_records_load(void)
+{
+    struct wallet_record rec;
+    char path[256];
+    FILE *f;
+    int loaded = 0;
+    int i;
+
+    if (cfg.store_dir == NULL) {
+        return 0;
+    }
+    for (i = 0; i < TOKEN_WALLET_CAPACITY; i++) {
+        wallet_record_path(i, path, sizeof path, "");
+        f = fopen(path, "rb");
+        if (f == NULL) {
+            continue;
+        }
+        if (fread(&rec, sizeof rec, 1, f) == 1) {
+            wallet_slot_restore(i, &rec);
+            loaded++;
+        }
+        fclose(f);
+    }
+    return loaded;
+}
+
+#endif
+
+int
+token_wallet_init(const struct token_wallet_config *config)
+{
+    int loaded;
+
+    cfg = *config;
+    if (cfg.batch_min == 0) {
+        cfg.batch_min = 1;
+    }
+    if (cfg.max_attempts == 0) {
+        cfg.max_attempts = 1;
+    }
+    memset(slots, 0, sizeof slots);
+    memset(&stats, 0, sizeof stats);
+    next_try_us = 0;
+    http_conn_init(&conn, cfg.host, cfg.port);
+
+    loaded = wallet_records_load();
+    if (loaded > 0) {
+        ESP_LOGI(tag, "loaded %d unredeemed tokens", loaded);
+    }
+    return 0;
+}
+
+/**
+ * Checks the appserver's signature on a token payload and keeps its token.
+ *
+ * @return                      0 if the token was added or is already held;
+ *                                  -1 if the payload is malformed or forged,
+ *                                  or the wallet is full.
+ */
+int
+token_wallet_add(const uint8_t *signed_token_payload, size_t len)
+{
+    const uint8_t *token = signed_token_payload + NEBULA_DELIVER_NONCE_BYTES;
+    struct wallet_record rec;
+    int slot = -1;
+    int i;
+
+    if (len != NEBULA_SIGNED_TOKEN_PAYLOAD_BYTES ||
+            sensor_verify_ecdsa(signed_token_payload,
+                                NEBULA_TOKEN_PAYLOAD_BYTES,
+                                signed_token_payload + NEBULA_TOKEN_PAYLOAD_BYTES,
+                                cfg.appserver_xy) != 0) {
+        mule_lock(&wallet_lock);
+        stats.bad_signature++;
+        mule_unlock(&wallet_lock);
+        ESP_LOGW(tag, "dropping token with bad appserver signature");
+        return -1;
+    }
+
+    mule_lock(&wallet_lock);
+    for (i = 0; i < TOKEN_WALLET_CAPACITY; i++) {
+        if (slots[i].state == SLOT_FREE) {
+            if (slot < 0) {
+                slot = i;
+            }
+        } else if (memcmp(slots[i].token, token, NEBULA_TOKEN_BYTES) == 0) {
+            stats.duplicates++;
+            mule_unlock(&wallet_lock);
+            return 0;
+        }
+    }
+    if (slot < 0) {
+        stats.full++;
+        mule_unlock(&wallet_lock);
+        ESP_LOGW(tag, "wallet full; dropping token");
+        return -1;
+    }
+    slots[slot].state = SLOT_WRITING;
+    slots[slot].attempts = 0;
+    memcpy(slots[slot].token, token, NEBULA_TOKEN_BYTES);
+    mule_unlock(&wallet_lock);
+
+    memcpy(rec.token, token, NEBULA_TOKEN_BYTES);
+    rec.attempts = 0;
+    if (wallet_record_put(slot, &rec) != 0) {
+        ESP_LOGW(tag, "failed to persist token in slot %d", slot);
+    }
+
+    mule_lock(&wallet_lock);
+    slots[slot].held_since_us = mule_time_us();
+    slots[slot].state = SLOT_HELD;
+    stats.earned++;
+    mule_unlock(&wallet_lock);
+    return 0;
+}
+
+int
+token_wallet_count(void)
+{
+    int n = 0;
+    int i;
+
+    mule_lock(&wallet_lock);
+    for (i = 0; i < TOKEN_WALLET_CAPACITY; i++) {
+        n += slots[i].state != SLOT_FREE;
+    }
+    mule_unlock(&wallet_lock);
+    return n;
+}
+
+/**
+ * Whether a redemption is worth a request: enough tokens are held, or one
+ * has waited max_hold_ms, and no recent attempt failed.
+ */
+int
+token_wallet_due(void)
+{
+    int64_t now = mule_time_us();
+    int64_t oldest = now;
+    int held = 0;
+    int i;
+
+    if (now < next_try_us) {
+        return 0;
+    }
+
+    mule_lock(&wallet_lock);
+    for (i = 0; i < TOKEN_WALLET_CAPACITY; i++) {
+        if (slots[i].state == SLOT_HELD) {
+            held++;
+            if (slots[i].held_since_us < oldest) {
+                oldest = slots[i].held_since_us;
+            }
+        }
+    }
+    mule_unlock(&wallet_lock);
+
+    return held >= cfg.batch_min ||
+           (held > 0 && now - oldest >= 1000LL * cfg.max_hold_ms);
+}
+
+static int
+wallet_open(void)
+{
+    if (http_conn_is_open(&conn) && !http_conn_alive(&conn)) {
+        http_conn_close(&conn);
+    }
+    if (http_conn_is_open(&conn)) {
+        return 0;
+    }
+    return http_conn_open(&conn);
+}
+
+static uint32_t
+wallet_load_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+           (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/*
+ * Posts one batch and returns the provider's invalid tokens in response.
+ * The TokenList header is the token length; an empty list says 0.
+ */
+static int
+wallet_post_batch(int n, const uint8_t **invalid, int *num_invalid)
+{
+    size_t body_len = TOKEN_WALLET_MULE_ID_BYTES + 4 +
+                      (size_t)n * NEBULA_TOKEN_BYTES;
+    uint32_t token_len;
+    size_t len;
+    int server_close;
+    int status;
+    int rc;
+
+    memcpy(request, cfg.mule_id, TOKEN_WALLET_MULE_ID_BYTES);
+    request[TOKEN_WALLET_MULE_ID_BYTES] = NEBULA_TOKEN_BYTES;
+    memset(&request[TOKEN_WALLET_MULE_ID_BYTES + 1], 0, 3);
+
+    rc = wallet_open();
+    if (rc == 0) {
+        rc = http_conn_post(&conn, "/redeem_tokens", request, body_len);
+    }
+    if (rc == 0) {
+        rc = http_conn_flush(&conn);
+    }
+    if (rc == 0) {
+        stats.requests++;
+        rc = http_conn_read_response(&conn, &status, response, sizeof response,
+                                     &len, &server_close);
+    }
+    if (rc != 0 || server_close) {
+        http_conn_close(&conn);
+    }
+    if (rc == HTTP_CONN_E2BIG) {
+        /* More invalid tokens than were sent; the provider is confused. */
+        return TOKEN_WALLET_EPROTO;
+    }
+    if (rc != 0) {
+        return rc;
+    }
+
+    if (status != 200 || len < 4) {
+        return TOKEN_WALLET_EPROTO;
+    }
+    token_len = wallet_load_le32(response);
+    if (len == 4) {
+        *num_invalid = 0;
+    } else if (token_len == NEBULA_TOKEN_BYTES &&
+               (len - 4) % NEBULA_TOKEN_BYTES == 0) {
+        *num_invalid = (int)((len - 4) / NEBULA_TOKEN_BYTES);
+    } else {
+        return TOKEN_WALLET_EPROTO;
+    }
+    *invalid = response + 4;
+    return 0;
+}
+
+static int
+wallet_is_listed(const uint8_t *token, const uint8_t *list, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (memcmp(token, list + (size_t)i * NEBULA_TOKEN_BYTES,
+                   NEBULA_TOKEN_BYTES) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Applies the provider's verdict to the slots of one batch: listed tokens
+ * are kept for another attempt until they run out, the rest are settled.
+ */
+static int
+wallet_settle_batch(const int *batch, int n, const uint8_t *invalid,
+                    int num_invalid)
+{
+    struct wallet_record rec;
+    struct wallet_slot *slot;
+    int redeemed = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        slot = &slots[batch[i]];
+
+        if (!wallet_is_listed(slot->token, invalid, num_invalid)) {
+            wallet_record_erase(batch[i]);
+            mule_lock(&wallet_lock);
+            slot->state = SLOT_FREE;
+            stats.redeemed++;
+            mule_unlock(&wallet_lock);
+            redeemed++;
+            continue;
+        }
+
+        if (slot->attempts + 1 >= cfg.max_attempts) {
+            ESP_LOGW(tag, "provider keeps refusing token in slot %d; dropping",
+                     batch[i]);
+            wallet_record_erase(batch[i]);
+            mule_lock(&wallet_lock);
+            slot->state = SLOT_FREE;
+            stats.invalid++;
+            stats.dropped++;
+            mule_unlock(&wallet_lock);
+            continue;
+        }
+
+        memcpy(rec.token, slot->token, NEBULA_TOKEN_BYTES);
+        rec.attempts = slot->attempts + 1;
+        wallet_record_put(batch[i], &rec);
+        mule_lock(&wallet_lock);
+        slot->attempts = rec.attempts;
+        slot->state = SLOT_HELD;
+        stats.invalid++;
+        mule_unlock(&wallet_lock);
+    }
+    return redeemed;
+}
+
+/**
+ * Redeems every token held when called, TOKEN_WALLET_BATCH_MAX per request
+ * over one keep-alive connection to the provider.  Call it from one task
+ * only.
+ *
+ * @return                      The number of tokens redeemed, or a negative
+ *                                  TOKEN_WALLET_E* code if a request failed;
+ *                                  its batch stays in the wallet.
+ */
+int
+token_wallet_redeem(void)
+{
+    static int batch[TOKEN_WALLET_BATCH_MAX];
+    const uint8_t *invalid;
+    int num_invalid;
+    int redeemed = 0;
+    int next = 0;
+    int n;
+    int rc;
+    int i;
+
+    while (next < TOKEN_WALLET_CAPACITY) {
+        n = 0;
+        mule_lock(&wallet_lock);
+        for (; next < TOKEN_WALLET_CAPACITY && n < TOKEN_WALLET_BATCH_MAX;
+                next++) {
+            if (slots[next].state == SLOT_HELD) {
+                slots[next].state = SLOT_REDEEMING;
+                memcpy(&request[TOKEN_WALLET_MULE_ID_BYTES + 4 +
+                                (size_t)n * NEBULA_TOKEN_BYTES],
+                       slots[next].token, NEBULA_TOKEN_BYTES);
+                batch[n++] = next;
+            }
+        }
+        mule_unlock(&wallet_lock);
+
+        if (n == 0) {
+            break;
+        }
+
+        rc = wallet_post_batch(n, &invalid, &num_invalid);
+        if (rc != 0) {
+            /* Safe to send again even if the provider took the batch and
+             * only the response was lost: it credits a token once per mule. */
+            mule_lock(&wallet_lock);
+            for (i = 0; i < n; i++) {
+                slots[batch[i]].state = SLOT_HELD;
+            }
+            mule_unlock(&wallet_lock);
+            next_try_us = mule_time_us() + 1000LL * TOKEN_WALLET_RETRY_MS;
+            ESP_LOGW(tag, "redemption failed; rc=%d", rc);
+            return rc;
+        }
+
+        redeemed += wallet_settle_batch(batch, n, invalid, num_invalid);
+    }
+
+    if (redeemed > 0) {
+        ESP_LOGI(tag, "redeemed %d tokens", redeemed);
+    }
+    return redeemed;
+}
+
+void
+token_wallet_get_stats(struct token_wallet_stats *out)
+{
+    mule_lock(&wallet_lock);
+    *out = stats;
+    mule_unlock(&wallet_lock);
+}
@@ -0,0 +1,80 @@
+/*
+ * Durable store of earned delivery tokens, redeemed with the provider in
+ * batches.
+ */
+
+#ifndef H_TOKEN_WALLET_
+#define H_TOKEN_WALLET_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "http_conn.h"
+#include "nebula_proto.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef TOKEN_WALLET_CAPACITY
+#define TOKEN_WALLET_CAPACITY   256
+#endif
+
+/** Most tokens sent in one /redeem_tokens request. */
+#ifndef TOKEN_WALLET_BATCH_MAX
+#define TOKEN_WALLET_BATCH_MAX  64
+#endif
+
+#define TOKEN_WALLET_MULE_ID_BYTES  16
+
+#define TOKEN_WALLET_EIO        HTTP_CONN_EIO
+#define TOKEN_WALLET_ECONNECT   HTTP_CONN_ECONNECT
+#define TOKEN_WALLET_EPROTO     HTTP_CONN_EPROTO
+
+struct token_wallet_config {
+    /** Provider serving /redeem_tokens. */
+    const char *host;
+    uint16_t port;
+
+    /** Identifies this mule to the provider; redeemed tokens count for it. */
+    uint8_t mule_id[TOKEN_WALLET_MULE_ID_BYTES];
+
+    /** Appserver key that signs token payloads: X || Y. */
+    uint8_t appserver_xy[NEBULA_P256_PUBKEY_BYTES];
+
+    /** Redeem once this many tokens are held... */
+    uint16_t batch_min;
+    /** ...or once the oldest has waited this long. */
+    uint32_t max_hold_ms;
+
+    /** Redemptions a token the provider calls invalid gets before it is
+     *  dropped. */
+    uint8_t max_attempts;
+
+    /** Host builds only: directory keeping one file per token; NULL keeps the
+     *  wallet in memory.  ESP builds keep tokens in NVS. */
+    const char *store_dir;
+};
+
+struct token_wallet_stats {
+    uint32_t earned;
+    uint32_t bad_signature;
+    uint32_t duplicates;
+    uint32_t full;
+    uint32_t requests;
+    uint32_t redeemed;
+    uint32_t invalid;
+    uint32_t dropped;
+};
+
+int token_wallet_init(const struct token_wallet_config *cfg);
+int token_wallet_add(const uint8_t *signed_token_payload, size_t len);
+int token_wallet_count(void);
+int token_wallet_due(void);
+int token_wallet_redeem(void);
+void token_wallet_get_stats(struct token_wallet_stats *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
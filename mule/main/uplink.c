@@ -0,0 +1,374 @@
+/*
+ * Pipelined HTTP/1.1 client that drains the payload store to the appserver.
+ *
+ * The appserver protocol is two requests per payload, /deliver_hash followed
+ * by /deliver_data.  Rather than paying two round trips per payload, the
+ * uplink keeps one keep-alive connection and writes the request pairs for a
+ * whole window of payloads back to back; the server answers them in order,
+ * so each response is matched against a FIFO of outstanding requests and the
+ * window is refilled as responses come in.  Upload time is then bounded by
+ * bandwidth rather than latency.
+ *
+ * Nothing in here is ESP-specific, so the same code runs on Linux against a
+ * local appserver (see host/).
+ */
+
+#include <string.h>
+#include "uplink.h"
+#include "http_conn.h"
+#include "payload_pool.h"
+#include "mule_port.h"
+
+static const char *tag = "UPLINK";
+
+#define UPLINK_REQ_HASH     0
+#define UPLINK_REQ_DATA     1
+
+#define UPLINK_MAX_BODY     512
+
+struct uplink_req {
+    struct payload_record *rec;
+    uint8_t kind;
+};
+
+static struct uplink_config cfg;
+static struct uplink_stats stats;
+static struct http_conn conn;
+static uint32_t backoff_ms;
+
+/* FIFO of requests written but not yet answered. */
+static struct uplink_req pending[2 * UPLINK_MAX_WINDOW];
+static int pending_head;
+static int pending_count;
+static int window_payloads;
+
+int
+uplink_init(const struct uplink_config *config)
+{
+    cfg = *config;
+    if (cfg.window <= 0 || cfg.window > UPLINK_MAX_WINDOW) {
+        cfg.window = UPLINK_MAX_WINDOW;
+    }
+    if (cfg.max_attempts == 0) {
+        cfg.max_attempts = 3;
+    }
+    memset(&stats, 0, sizeof stats);
+    http_conn_init(&conn, cfg.host, cfg.port);
+    backoff_ms = 0;
+    return 0;
+}
+
+void
+uplink_get_stats(struct uplink_stats *out)
+{
+    *out = stats;
+}
+
+uint32_t
+uplink_backoff_ms(void)
+{
+    return backoff_ms;
+}
+
+void
+uplink_close(void)
+{
+    http_conn_close(&conn);
+}
+
+static void
+uplink_push(struct payload_record *rec, uint8_t kind)
+{
+    int idx = (pending_head + pending_count) % (2 * UPLINK_MAX_WINDOW);
+
+    pending[idx].rec = rec;
+    pending[idx].kind = kind;
+    pending_count++;
+}
+
+static struct uplink_req
+uplink_pop(void)
+{
+    struct uplink_req req = pending[pending_head];
+
+    pending_head = (pending_head + 1) % (2 * UPLINK_MAX_WINDOW);
+    pending_count--;
+    return req;
+}
+
+/**
+ * Queues the requests still needed for a payload.  A payload whose hash was
+ * accepted on an earlier visit only needs its data delivered.
+ */
+static int
+uplink_queue_payload(struct payload_record *rec)
+{
+    int rc;
+
+    if (rec->state == PAYLOAD_NEW) {
+        rc = http_conn_post(&conn, "/deliver_hash", payload_record_signed_hash(rec),
+                         NEBULA_SIGNED_HASH_PAYLOAD_BYTES);
+        if (rc != 0) {
+            return rc;
+        }
+        uplink_push(rec, UPLINK_REQ_HASH);
+        stats.requests++;
+    }
+
+    rc = http_conn_post(&conn, "/deliver_data", payload_record_data(rec),
+                        rec->data_len);
+    if (rc != 0) {
+        return rc;
+    }
+    uplink_push(rec, UPLINK_REQ_DATA);
+    stats.requests++;
+    window_payloads++;
+    return 0;
+}
+
+static void
+uplink_fail_payload(struct payload_record *rec)
+{
+    payload_pool_free(rec->predelivery);
+    rec->predelivery = NULL;
+    rec->predelivery_len = 0;
+    rec->state = PAYLOAD_NEW;
+
+    if (++rec->attempts >= cfg.max_attempts) {
+        ESP_LOGW(tag, "appserver refused payload %u %u times, dropping",
+                 (unsigned)rec->seq, rec->attempts);
+        stats.rejected++;
+        payload_store_remove(rec);
+        return;
+    }
+    payload_store_release(rec);
+}
+
+static void
+uplink_on_hash(struct payload_record *rec, int status, const uint8_t *body,
+               size_t len)
+{
+    if (status != 200 || len < NEBULA_DELIVER_NONCE_BYTES + NEBULA_SHA256_BYTES ||
+            memcmp(body + NEBULA_DELIVER_NONCE_BYTES,
+                   payload_record_data_hash(rec), NEBULA_SHA256_BYTES) != 0) {
+        /* The paired /deliver_data will fail too and account for it. */
+        return;
+    }
+
+    rec->predelivery = payload_pool_alloc(len, PAYLOAD_POOL_OWNER_NONE);
+    if (rec->predelivery != NULL) {
+        memcpy(rec->predelivery, body, len);
+        rec->predelivery_len = len;
+    }
+    rec->state = PAYLOAD_PREDELIVERED;
+}
+
+static int
+uplink_on_data(struct payload_record *rec, int status, const uint8_t *body,
+               size_t len)
+{
+    window_payloads--;
+
+    /* The token payload must echo the nonce and hash of our predelivery. */
+    if (status != 200 || len != NEBULA_SIGNED_TOKEN_PAYLOAD_BYTES ||
+            memcmp(body + NEBULA_DELIVER_NONCE_BYTES + NEBULA_TOKEN_BYTES,
+                   payload_record_data_hash(rec), NEBULA_SHA256_BYTES) != 0 ||
+            (rec->predelivery != NULL &&
+             memcmp(body, rec->predelivery, NEBULA_DELIVER_NONCE_BYTES) != 0)) {
+        uplink_fail_payload(rec);
+        return 0;
+    }
+
+    if (cfg.on_token != NULL) {
+        cfg.on_token(body, len, cfg.on_token_arg);
+    }
+    stats.delivered++;
+    payload_store_remove(rec);
+    return 1;
+}
+
+/*
+ * Gives every record with outstanding requests back to the store after the
+ * connection broke.  Progress already confirmed (an accepted hash) is kept.
+ */
+static void
+uplink_abort_pending(void)
+{
+    struct uplink_req req;
+
+    while (pending_count > 0) {
+        req = uplink_pop();
+        if (req.kind == UPLINK_REQ_DATA) {
+            payload_store_release(req.rec);
+        }
+    }
+    window_payloads = 0;
+}
+
+static int
+uplink_open(void)
+{
+    int rc;
+
+    if (http_conn_is_open(&conn) && !http_conn_alive(&conn)) {
+        http_conn_close(&conn);
+    }
+    if (http_conn_is_open(&conn)) {
+        return 0;
+    }
+    rc = http_conn_open(&conn);
+    if (rc == 0) {
+        stats.connects++;
+    }
+    return rc;
+}
+
+/* One request/response on the uplink's connection; a GET without req. */
+static int
+uplink_request(const char *path, const uint8_t *req, size_t req_len,
+               uint8_t *body, size_t body_cap, size_t *body_len)
+{
+    int server_close;
+    int status;
+    int rc;
+
+    rc = uplink_open();
+    if (rc == 0) {
+        rc = req == NULL ? http_conn_get(&conn, path) :
+                           http_conn_post(&conn, path, req, req_len);
+    }
+    if (rc == 0) {
+        rc = http_conn_flush(&conn);
+    }
+    if (rc == 0) {
+        rc = http_conn_read_response(&conn, &status, body, body_cap, body_len,
+                                     &server_close);
+    }
+    /* An oversized body was still read in full, so the connection is fine. */
+    if ((rc != 0 && rc != UPLINK_E2BIG) || server_close) {
+        http_conn_close(&conn);
+    }
+    if ((rc == 0 || rc == UPLINK_E2BIG) && status != 200) {
+        rc = UPLINK_EPROTO;
+    }
+    return rc;
+}
+
+/**
+ * Fetches a resource from the appserver over the uplink's connection, e.g.
+ * the sensor key list.  Must not be called while uplink_drain() runs.
+ *
+ * @return                      0 on a 200 response; UPLINK_E2BIG, with
+ *                                  *body_len set to the full length, if the
+ *                                  body does not fit in body_cap; another
+ *                                  negative UPLINK_E* code otherwise.
+ */
+int
+uplink_fetch(const char *path, uint8_t *body, size_t body_cap,
+             size_t *body_len)
+{
+    return uplink_request(path, NULL, 0, body, body_cap, body_len);
+}
+
+/**
+ * Posts a body to the appserver over the uplink's connection, e.g. a metrics
+ * snapshot, discarding the response body.  Must not be called while
+ * uplink_drain() runs.
+ *
+ * @return                      0 on a 200 response; a negative UPLINK_E* code
+ *                                  otherwise.
+ */
+int
+uplink_post(const char *path, const uint8_t *req, size_t req_len)
+{
+    uint8_t body[64];
+    size_t body_len;
+    int rc;
+
+    rc = uplink_request(path, req, req_len, body, sizeof body, &body_len);
+    return rc == UPLINK_E2BIG ? 0 : rc;
+}
+
+/**
+ * Uploads everything currently in the payload store over one keep-alive
+ * connection.
+ *
+ * @return                      The number of payloads delivered, or a
+ *                                  negative UPLINK_E* code if the connection
+ *                                  failed.  On failure the caller should wait
+ *                                  uplink_backoff_ms() before retrying.
+ */
+int
+uplink_drain(void)
+{
+    static uint8_t body[UPLINK_MAX_BODY];
+    struct payload_record *rec;
+    struct uplink_req req;
+    size_t body_len;
+    int server_close;
+    int delivered;
+    int status;
+    int rc;
+
+    rc = uplink_open();
+    if (rc != 0) {
+        goto err;
+    }
+
+    delivered = 0;
+    server_close = 0;
+    for (;;) {
+        while (!server_close && window_payloads < cfg.window &&
+                (rec = payload_store_claim()) != NULL) {
+            rc = uplink_queue_payload(rec);
+            if (rc != 0) {
+                payload_store_release(rec);
+                goto err;
+            }
+        }
+        rc = http_conn_flush(&conn);
+        if (rc != 0) {
+            goto err;
+        }
+
+        if (pending_count == 0) {
+            break;
+        }
+
+        rc = http_conn_read_response(&conn, &status, body, sizeof body,
+                                     &body_len, &server_close);
+        if (rc != 0) {
+            goto err;
+        }
+
+        req = uplink_pop();
+        if (req.kind == UPLINK_REQ_HASH) {
+            uplink_on_hash(req.rec, status, body, body_len);
+        } else {
+            delivered += uplink_on_data(req.rec, status, body, body_len);
+        }
+
+        if (server_close) {
+            /* Anything still outstanding will not be answered; resend later. */
+            uplink_abort_pending();
+            uplink_close();
+            break;
+        }
+    }
+
+    backoff_ms = 0;
+    return delivered;
+
+err:
+    stats.io_errors++;
+    uplink_abort_pending();
+    uplink_close();
+    if (backoff_ms == 0) {
+        backoff_ms = cfg.backoff_min_ms;
+    } else if (backoff_ms < cfg.backoff_max_ms / 2) {
+        backoff_ms *= 2;
+    } else {
+        backoff_ms = cfg.backoff_max_ms;
+    }
+    return rc;
+}
@@ -0,0 +1,71 @@
+/*
+ * Pipelined HTTP/1.1 client that drains the payload store to the appserver.
+ */
+
+#ifndef H_UPLINK_
+#define H_UPLINK_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "http_conn.h"
+#include "payload_store.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Maximum payloads with requests outstanding on the connection. */
+#ifndef UPLINK_MAX_WINDOW
+#define UPLINK_MAX_WINDOW       16
+#endif
+
+#define UPLINK_EIO              HTTP_CONN_EIO
+#define UPLINK_ECONNECT         HTTP_CONN_ECONNECT
+#define UPLINK_EPROTO           HTTP_CONN_EPROTO
+#define UPLINK_E2BIG            HTTP_CONN_E2BIG
+
+/** Receives the SignedTokenPayload the appserver returned for a delivery. */
+typedef void uplink_token_fn(const uint8_t *signed_token_payload, size_t len,
+                             void *arg);
+
+struct uplink_config {
+    const char *host;
+    uint16_t port;
+
+    /** Payloads pipelined at once; clamped to UPLINK_MAX_WINDOW. */
+    int window;
+
+    /** Delivery attempts before a payload the appserver refuses is dropped. */
+    uint8_t max_attempts;
+
+    /** Exponential backoff bounds applied after connection errors. */
+    uint32_t backoff_min_ms;
+    uint32_t backoff_max_ms;
+
+    /** Receives the SignedTokenPayload for every delivered payload. */
+    uplink_token_fn *on_token;
+    void *on_token_arg;
+};
+
+struct uplink_stats {
+    uint32_t connects;
+    uint32_t requests;
+    uint32_t delivered;
+    uint32_t rejected;
+    uint32_t io_errors;
+};
+
+int uplink_init(const struct uplink_config *cfg);
+int uplink_drain(void);
+int uplink_fetch(const char *path, uint8_t *body, size_t body_cap,
+                 size_t *body_len);
+int uplink_post(const char *path, const uint8_t *body, size_t body_len);
+uint32_t uplink_backoff_ms(void);
+void uplink_close(void);
+void uplink_get_stats(struct uplink_stats *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
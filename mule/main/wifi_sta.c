@@ -0,0 +1,88 @@
+/*
+ * Wi-Fi station bring-up for the mule's uplink.
+ *
+ * Credentials live in wifi_credentials.h, which is kept out of git:
+ *
+ *     #define WIFI_SSID       "..."
+ *     #define WIFI_PASSWORD   "..."
+ *
+ * The station reconnects on its own whenever it drops off the access point;
+ * the uplink task only needs to wait for an IP before draining the store.
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "esp_event.h"
+#include "esp_log.h"
+#include "esp_netif.h"
+#include "esp_wifi.h"
+#include "wifi_sta.h"
+#include "wifi_credentials.h"
+
+static const char *tag = "WIFI_STA";
+
+#define WIFI_CONNECTED_BIT  BIT0
+
+static EventGroupHandle_t wifi_events;
+
+static void
+wifi_sta_event(void *arg, esp_event_base_t base, int32_t id, void *data)
+{
+    if (base == WIFI_EVENT && id == WIFI_EVENT_STA_START) {
+        esp_wifi_connect();
+    } else if (base == WIFI_EVENT && id == WIFI_EVENT_STA_DISCONNECTED) {
+        xEventGroupClearBits(wifi_events, WIFI_CONNECTED_BIT);
+        esp_wifi_connect();
+    } else if (base == IP_EVENT && id == IP_EVENT_STA_GOT_IP) {
+        ip_event_got_ip_t *event = (ip_event_got_ip_t *)data;
+        ESP_LOGI(tag, "got ip " IPSTR, IP2STR(&event->ip_info.ip));
+        xEventGroupSetBits(wifi_events, WIFI_CONNECTED_BIT);
+    }
+}
+
+int
+wifi_sta_start(void)
+{
+    wifi_init_config_t init_cfg = WIFI_INIT_CONFIG_DEFAULT();
+    wifi_config_t wifi_cfg;
+
+    wifi_events = xEventGroupCreate();
+
+    ESP_ERROR_CHECK(esp_netif_init());
+    ESP_ERROR_CHECK(esp_event_loop_create_default());
+    esp_netif_create_default_wifi_sta();
+
+    ESP_ERROR_CHECK(esp_wifi_init(&init_cfg));
+    ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID,
+                                               wifi_sta_event, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP,
+                                               wifi_sta_event, NULL));
+
+    memset(&wifi_cfg, 0, sizeof wifi_cfg);
+    strncpy((char *)wifi_cfg.sta.ssid, WIFI_SSID, sizeof wifi_cfg.sta.ssid);
+    strncpy((char *)wifi_cfg.sta.password, WIFI_PASSWORD,
+            sizeof wifi_cfg.sta.password);
+
+    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_cfg));
+    ESP_ERROR_CHECK(esp_wifi_start());
+
+    return 0;
+}
+
+bool
+wifi_sta_wait_connected(uint32_t timeout_ms)
+{
+    EventBits_t bits;
+
+    bits = xEventGroupWaitBits(wifi_events, WIFI_CONNECTED_BIT, pdFALSE, pdTRUE,
+                               timeout_ms / portTICK_PERIOD_MS);
+    return (bits & WIFI_CONNECTED_BIT) != 0;
+}
+
+bool
+wifi_sta_is_connected(void)
+{
+    return (xEventGroupGetBits(wifi_events) & WIFI_CONNECTED_BIT) != 0;
+}
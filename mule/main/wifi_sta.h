@@ -0,0 +1,23 @@
+/*
+ * Wi-Fi station bring-up for the mule's uplink.
+ */
+
+#ifndef H_WIFI_STA_
+#define H_WIFI_STA_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int wifi_sta_start(void);
+bool wifi_sta_wait_connected(uint32_t timeout_ms);
+bool wifi_sta_is_connected(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
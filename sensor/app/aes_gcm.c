@@ -1,4 +1,5 @@
 #include "aes_gcm.h"
+#include "telemetry.h"
 #include "nrf_crypto.h"
 #include "nrf_crypto_aes.h"
 
@@ -33,7 +34,9 @@ void encrypt_character_array(const uint8_t *key, const uint8_t *iv, const uint8_
 
     // Encrypt the plaintext using AES-128 GCM
     uint8_t ciphertext[length];
+    uint32_t start = telemetry_cycles();
     ret_val = nrf_crypto_aes_update(&aes_ctx, plaintext, length, ciphertext);
+    telemetry_record(NEBULA_HIST_AES, telemetry_cycles() - start);
     if (ret_val != NRF_SUCCESS)
     {
         printf("Encryption failed. Error: 0x%x\n", ret_val);
@@ -41,8 +44,8 @@ void encrypt_character_array(const uint8_t *key, const uint8_t *iv, const uint8_
     }
 
     // Compute the authentication tag
-    uint8_t tag[NRF_CRYPTO_AES_IV_SIZE];
-    //ret_val = nrf_crypto_aes_finalize(&aes_ctx, tag, NRF_CRYPTO_AES_IV_SIZE);
+    uint8_t tag[NRF_CRYPTO_AES_GCM_TAG_SIZE] = {0};
+    //ret_val = nrf_crypto_aes_finalize(&aes_ctx, tag, NRF_CRYPTO_AES_GCM_TAG_SIZE);
     if (ret_val != NRF_SUCCESS)
     {
         printf("Failed to compute authentication tag. Error: 0x%x\n", ret_val);
@@ -52,6 +55,6 @@ void encrypt_character_array(const uint8_t *key, const uint8_t *iv, const uint8_
     // Create the payload with the structure: IV || Ciphertext || Authentication Tag
     memcpy(payload, iv, NRF_CRYPTO_AES_IV_SIZE);
     memcpy(payload + NRF_CRYPTO_AES_IV_SIZE, ciphertext, length);
-    memcpy(payload + NRF_CRYPTO_AES_IV_SIZE + length, tag, NRF_CRYPTO_AES_IV_SIZE);
+    memcpy(payload + NRF_CRYPTO_AES_IV_SIZE + length, tag, NRF_CRYPTO_AES_GCM_TAG_SIZE);
 }
 
@@ -6,6 +6,7 @@
 
 #define NRF_CRYPTO_AES_KEY_SIZE 16 // AES-128 bit key size
 #define NRF_CRYPTO_AES_IV_SIZE 12 // AES GCM uses a 12-byte IV
+#define NRF_CRYPTO_AES_GCM_TAG_SIZE 16 // full-length tag, as cloud/aes_decrypt.py expects
 
 void encrypt_character_array(const uint8_t *key, const uint8_t *iv, const uint8_t *plaintext, uint8_t *payload, size_t length);
 
@@ -0,0 +1,224 @@
+// Broadcast mode: small readings sealed for the appserver ride in the
+// sensor's extended advertising (common/nebula_bcast.h), so passing mules
+// pick them up without connecting. The advertising stays connectable; a mule
+// connects to write back an ack list, and acked readings leave the air.
+//
+// The s140 SoftDevice has one advertising set and no periodic advertising,
+// so this takes the place of simple_ble's advertising rather than running
+// beside it, in the normal mode too: there the set carries no readings, just
+// the flag asking mules to connect for a transfer.
+//
+// Advertising is on the coded PHY by default, so mules scanning it hear the
+// sensor several times further out than on 1M; phy.c moves a connection up
+// once the signal allows.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "app_error.h"
+#include "app_util.h"
+#include "ble.h"
+#include "ble_gap.h"
+#include "nrf_drv_rng.h"
+#include "aes_gcm.h"
+#include "bcast.h"
+#include "nebula_trace.h"
+
+#define BCAST_ADV_INTERVAL MSEC_TO_UNITS(1000, UNIT_0_625_MS)
+#define BCAST_ADV_DATA_MAX BLE_GAP_ADV_SET_DATA_SIZE_EXTENDED_CONNECTABLE_MAX_SUPPORTED
+// UUID list and service data header ahead of the broadcast itself
+#define BCAST_AD_HEADER 8
+
+struct bcast_slot {
+    uint8_t live;
+    uint8_t len;
+    uint16_t seq;
+    uint8_t sealed[NEBULA_BCAST_SEALED_MAX];
+};
+
+static struct bcast_slot slots[BCAST_SLOTS];
+static uint16_t next_seq;
+static bool bulk;
+
+static uint8_t sensor_id[NEBULA_SENSOR_ID_BYTES];
+static uint8_t seal_key[NRF_CRYPTO_AES_KEY_SIZE];
+// Random per boot; with the sequence number it makes each reading's IV
+static uint8_t iv_salt[8];
+
+static uint8_t adv_handle = BLE_GAP_ADV_SET_HANDLE_NOT_SET;
+// The SoftDevice reads the advertising data in place while it is on the air,
+// so each update goes into the other buffer
+static uint8_t adv_buf[2][BCAST_ADV_DATA_MAX];
+static int adv_cur;
+
+// Written from the SoftDevice event handler by bcast_on_ack()
+static uint8_t ack_list[NEBULA_BCAST_ACK_MAX_BYTES];
+static volatile uint16_t ack_len;
+
+void bcast_init(const uint8_t *id, const uint8_t *key) {
+    memset(slots, 0, sizeof slots);
+    memcpy(sensor_id, id, sizeof sensor_id);
+    memcpy(seal_key, key, sizeof seal_key);
+    nrf_drv_rng_block_rand(iv_salt, sizeof iv_salt);
+    // a restart is told apart from stale readings by a jump in sequence
+    nrf_drv_rng_block_rand((uint8_t *)&next_seq, sizeof next_seq);
+}
+
+static int bcast_live(void) {
+    int live = 0;
+
+    for (int i = 0; i < BCAST_SLOTS; i++) {
+        live += slots[i].live;
+    }
+    return live;
+}
+
+// Lays out the advertising data: the service UUID mules look for, then as
+// many live readings as fit, oldest first, as service data under it
+static uint16_t bcast_build(uint8_t *out) {
+    uint8_t *svc = &out[BCAST_AD_HEADER];
+    uint8_t flags = 0;
+    size_t n;
+
+    out[0] = 3;
+    out[1] = BLE_GAP_AD_TYPE_16BIT_SERVICE_UUID_COMPLETE;
+    out[2] = (uint8_t)NEBULA_BCAST_SVC_UUID16;
+    out[3] = (uint8_t)(NEBULA_BCAST_SVC_UUID16 >> 8);
+
+    // ask for acks before unacked readings start being pushed out
+    if (bcast_live() >= BCAST_SLOTS / 2) {
+        flags |= NEBULA_BCAST_F_ACK;
+    }
+    if (bulk) {
+        flags |= NEBULA_BCAST_F_BULK;
+    }
+    n = nebula_bcast_begin(svc, flags, sensor_id);
+    for (uint16_t i = 0; i < BCAST_SLOTS; i++) {
+        struct bcast_slot *slot = &slots[(uint16_t)(next_seq + i) % BCAST_SLOTS];
+        if (slot->live) {
+            n = nebula_bcast_add(svc, n, NEBULA_BCAST_SVC_DATA_MAX, slot->seq,
+                                 slot->sealed, slot->len);
+        }
+    }
+
+    out[4] = (uint8_t)(3 + n);
+    out[5] = BLE_GAP_AD_TYPE_SERVICE_DATA;
+    out[6] = (uint8_t)NEBULA_BCAST_SVC_UUID16;
+    out[7] = (uint8_t)(NEBULA_BCAST_SVC_UUID16 >> 8);
+    return (uint16_t)(BCAST_AD_HEADER + n);
+}
+
+// Puts the current readings on the air; the first call also sets up the
+// advertising set
+static ret_code_t bcast_update(void) {
+    ble_gap_adv_params_t params;
+    ble_gap_adv_data_t data;
+
+    adv_cur = !adv_cur;
+    memset(&data, 0, sizeof data);
+    data.adv_data.p_data = adv_buf[adv_cur];
+    data.adv_data.len = bcast_build(adv_buf[adv_cur]);
+
+    if (adv_handle != BLE_GAP_ADV_SET_HANDLE_NOT_SET) {
+        return sd_ble_gap_adv_set_configure(&adv_handle, &data, NULL);
+    }
+
+    memset(&params, 0, sizeof params);
+    params.properties.type = BLE_GAP_ADV_TYPE_EXTENDED_CONNECTABLE_NONSCANNABLE_UNDIRECTED;
+    params.filter_policy = BLE_GAP_ADV_FP_ANY;
+    params.interval = BCAST_ADV_INTERVAL;
+    params.duration = BLE_GAP_ADV_TIMEOUT_GENERAL_UNLIMITED;
+    params.primary_phy = BCAST_ADV_PHY;
+    params.secondary_phy = BCAST_ADV_PHY;
+    return sd_ble_gap_adv_set_configure(&adv_handle, &data, &params);
+}
+
+// Starts broadcasting, in place of advertising_start()
+int bcast_start(void) {
+    ret_code_t error_code = bcast_update();
+    APP_ERROR_CHECK(error_code);
+
+    error_code = sd_ble_gap_adv_start(adv_handle, BLE_CONN_CFG_TAG_DEFAULT);
+    APP_ERROR_CHECK(error_code);
+    return 0;
+}
+
+// Tells mules whether a transfer is waiting for them to connect; takes
+// effect at the next update, or at bcast_start()
+void bcast_set_bulk(bool on) {
+    bulk = on;
+}
+
+// A connection stops connectable advertising; picks it up again afterwards
+void bcast_resume(void) {
+    ret_code_t error_code;
+
+    if (adv_handle == BLE_GAP_ADV_SET_HANDLE_NOT_SET) {
+        return;
+    }
+    error_code = sd_ble_gap_adv_start(adv_handle, BLE_CONN_CFG_TAG_DEFAULT);
+    if (error_code != NRF_SUCCESS && error_code != NRF_ERROR_INVALID_STATE) {
+        printf("failed to resume broadcast: 0x%x\n", error_code);
+    }
+}
+
+// Seals a reading and puts it on the air, replacing the oldest if every
+// slot is taken
+int bcast_publish(const uint8_t *reading, size_t len) {
+    struct bcast_slot *slot = &slots[next_seq % BCAST_SLOTS];
+    uint8_t iv[NRF_CRYPTO_AES_IV_SIZE];
+    ret_code_t error_code;
+
+    if (len > BCAST_READING_MAX) {
+        return -1;
+    }
+
+    memset(iv, 0, sizeof iv);
+    memcpy(iv, iv_salt, sizeof iv_salt);
+    iv[8] = (uint8_t)next_seq;
+    iv[9] = (uint8_t)(next_seq >> 8);
+    encrypt_character_array(seal_key, iv, reading, slot->sealed, len);
+    slot->len = (uint8_t)(len + NEBULA_BCAST_SEAL_OVERHEAD);
+    slot->seq = next_seq++;
+    slot->live = 1;
+    NTRACE_INFO(NT_SENSOR_BCAST, slot->seq, bcast_live(), 0);
+
+    error_code = bcast_update();
+    if (error_code != NRF_SUCCESS) {
+        printf("failed to update broadcast: 0x%x\n", error_code);
+        return -1;
+    }
+    return 0;
+}
+
+// Takes an ack list a mule wrote. Only records it, so it is safe to call
+// from the SoftDevice's event handler; bcast_poll() applies it
+void bcast_on_ack(const uint8_t *list, uint16_t len) {
+    if (len > sizeof ack_list) {
+        len = sizeof ack_list;
+    }
+    memcpy(ack_list, list, len);
+    ack_len = len;
+}
+
+// Takes acked readings off the air
+void bcast_poll(void) {
+    uint16_t len = ack_len;
+    int acked = 0;
+
+    if (len == 0) {
+        return;
+    }
+    for (int i = 0; i < BCAST_SLOTS; i++) {
+        if (slots[i].live && nebula_bcast_ack_contains(ack_list, len, slots[i].seq)) {
+            slots[i].live = 0;
+            acked++;
+        }
+    }
+    ack_len = 0;
+    NTRACE_INFO(NT_SENSOR_BCAST_ACK, acked, bcast_live(), 0);
+
+    if (acked > 0 && bcast_update() != NRF_SUCCESS) {
+        printf("failed to update broadcast\n");
+    }
+}
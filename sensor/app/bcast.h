@@ -0,0 +1,26 @@
+#ifndef BCAST_H
+#define BCAST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "nebula_bcast.h"
+
+// Readings kept on the air until acked; the oldest is pushed out by a new one
+#define BCAST_SLOTS 8
+// Advertising PHY; BLE_GAP_PHY_1MBPS for mules without the coded PHY
+#ifndef BCAST_ADV_PHY
+#define BCAST_ADV_PHY BLE_GAP_PHY_CODED
+#endif
+// Largest reading before sealing
+#define BCAST_READING_MAX (NEBULA_BCAST_SEALED_MAX - NEBULA_BCAST_SEAL_OVERHEAD)
+
+void bcast_init(const uint8_t *sensor_id, const uint8_t *key);
+void bcast_set_bulk(bool on);
+int bcast_start(void);
+void bcast_resume(void);
+int bcast_publish(const uint8_t *reading, size_t len);
+void bcast_on_ack(const uint8_t *list, uint16_t len);
+void bcast_poll(void);
+
+#endif // BCAST_H
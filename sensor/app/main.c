@@ -33,14 +33,50 @@
 #include "ble_advertising.h"
 #include "ble_conn_state.h"
 #include "ble.h"
+#include "aes_gcm.h"
+#include "bcast.h"
 #include "certs.h"
 #include "data.h"
+#include "nebula_trace.h"
+#include "nebula_xfer.h"
+#include "phy.h"
+#include "telemetry.h"
 
 
 // Pin definitions
 #define LED NRF_GPIO_PIN_MAP(0,13)
 #define CHUNK_SIZE 200
 #define READ_TIMEOUT_MS 10000   /* 10 seconds */
+#define TRACE_DRAIN_MAX 64      /* trace records written out per idle wait */
+#define ACK_POLL_MS 10          /* how often a transfer checks for the mule's ack */
+
+// FEC transfers (common/nebula_fec.h): each mule ack lets a block of up to 16
+// chunks go out at once, with XFER_FEC_REPAIR repair symbols on top so a few
+// lost notifications cost no extra round trip; build with -DSENSOR_XFER_FEC=1
+#ifndef SENSOR_XFER_FEC
+#define SENSOR_XFER_FEC 0
+#endif
+#define XFER_FEC_REPAIR 1
+
+// Broadcast mode (bcast.c): readings go out in extended advertising instead
+// of over connections; build with -DSENSOR_BCAST_MODE=1
+#ifndef SENSOR_BCAST_MODE
+#define SENSOR_BCAST_MODE 0
+#endif
+#define BCAST_PERIOD_MS 5000    /* how often a reading is published */
+#define BCAST_POLL_MS 100       /* how often acks from mules are applied */
+#define BCAST_READING_BYTES 16  /* bytes of each data.h sample published */
+
+// Identity and sealing key the appserver knows this sensor by
+// TODO: provision per sensor instead of sharing the test values
+static const uint8_t sensor_id[NEBULA_SENSOR_ID_BYTES] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01
+};
+static const uint8_t sensor_key[NRF_CRYPTO_AES_KEY_SIZE] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F
+};
 
 // Intervals for advertising and connections
 static simple_ble_config_t ble_config = {
@@ -69,6 +105,21 @@ static simple_ble_char_t metadata_state_char = {.uuid16 = 0x8912};
 
 uint8_t metadata_state [3]; // [0] = number of chunks to send, [1] = chunks recieved
 
+//Outgoing transfers to the mule; acks arrive as writes to metadata_state_char
+static struct nebula_xfer_tx xfer;
+
+//Read-only telemetry characteristic for mules to harvest; its value is the
+//live telemetry struct
+static simple_ble_char_t telemetry_char = {.uuid16 = NEBULA_TELEMETRY_UUID16};
+
+//Write-only ack list for broadcast readings, added in broadcast mode only
+static simple_ble_char_t bcast_ack_char = {.uuid16 = NEBULA_BCAST_ACK_UUID16};
+
+uint8_t bcast_ack [NEBULA_BCAST_ACK_MAX_BYTES];
+
+//Cycle count when the last chunk was notified, for the ack latency
+static volatile uint32_t chunk_sent_at;
+
 simple_ble_app_t* simple_ble_app;
 
 uint8_t *read_buf;
@@ -79,6 +130,12 @@ APP_TIMER_DEF(dtls_fin_timer_id);
 // Prototype functions
 int ble_write(uint16_t *buf, uint16_t len, simple_ble_char_t *characteristic, int offset);
 
+// Trace timestamps come from the Cortex-M4 cycle counter (64 MHz), which
+// telemetry_init() starts
+static void trace_init(void) {
+    nebula_trace_init(telemetry_cycles);
+}
+
 int logging_init() {
     ret_code_t error_code = NRF_SUCCESS;
     error_code = NRF_LOG_INIT(NULL);
@@ -105,11 +162,21 @@ void ble_evt_write(ble_evt_t const * p_ble_evt) {
     
     //Check if data is metadata or data and store in correct variable
     if (p_ble_evt->evt.gatts_evt.params.write.handle == metadata_state_char.char_handle.value_handle) {
-        printf("Metadata recieved!\n");
         memcpy(metadata_state, p_ble_evt->evt.gatts_evt.params.write.data, p_ble_evt->evt.gatts_evt.params.write.len);
+        NTRACE_DEBUG(NT_SENSOR_ACK, metadata_state[1], 0, 0);
+        if (nebula_xfer_tx_on_meta(&xfer, p_ble_evt->evt.gatts_evt.params.write.data,
+                                   p_ble_evt->evt.gatts_evt.params.write.len) &&
+                chunk_sent_at != 0) {
+            telemetry_record(NEBULA_HIST_ACK, telemetry_cycles() - chunk_sent_at);
+            chunk_sent_at = 0;
+        }
     } 
+    if (p_ble_evt->evt.gatts_evt.params.write.handle == bcast_ack_char.char_handle.value_handle) {
+        bcast_on_ack(p_ble_evt->evt.gatts_evt.params.write.data,
+                     p_ble_evt->evt.gatts_evt.params.write.len);
+        return;
+    }
     if (p_ble_evt->evt.gatts_evt.params.write.handle == sensor_state_char.char_handle.value_handle) {
-        printf("Data recieved!\n");
         //check metadata to see where to store data and store data 
         int num_chunks = metadata_state[0];
         int num_recieved_chunks = metadata_state[1];
@@ -122,11 +189,48 @@ void ble_evt_write(ble_evt_t const * p_ble_evt) {
  
 }
 
+// Connectable broadcasting stops on a connection; start it again after
+void ble_evt_disconnected(ble_evt_t const * p_ble_evt) {
+    bcast_resume();
+}
+
+// Every BLE event; phy.c follows the connection and its PHY
+void ble_evt_user_handler(ble_evt_t const * p_ble_evt) {
+    phy_on_evt(p_ble_evt);
+}
+
+// Sends the transfer engine's notifications; counts chunks for telemetry
+static int sensor_radio_send(void *ctx, enum nebula_chr chr, const uint8_t *data, uint16_t len)
+{
+    simple_ble_char_t *characteristic = chr == NEBULA_CHR_DATA ? &sensor_state_char : &metadata_state_char;
+    int error_code;
+
+    if (simple_ble_app->conn_handle == BLE_CONN_HANDLE_INVALID) {
+        return NEBULA_XFER_ELINK;
+    }
+
+    if (chr == NEBULA_CHR_DATA) {
+        chunk_sent_at = telemetry_cycles() | 1;
+    }
+    error_code = ble_write((uint16_t *)data, len, characteristic, 0);
+    if (error_code != NRF_SUCCESS) {
+        return NEBULA_XFER_ELINK;
+    }
+
+    if (chr == NEBULA_CHR_DATA) {
+        NTRACE_DEBUG(NT_SENSOR_CHUNK, xfer.sent, len, error_code);
+        telemetry.chunks_sent++;
+        telemetry.bytes_sent += len;
+        telemetry.backlog_bytes -= len;
+    }
+    return 0;
+}
+
 int ble_write_long(void *p_ble_conn_handle, const unsigned char *buf, size_t len) 
 {
-    int error_code = 0;
-    int original_len = len;
-    uint16_t len_for_write = (uint16_t)len;
+    uint32_t start = telemetry_cycles();
+    int waiting_for = -1;
+    int status;
 
     //check we're in a connection
     if (simple_ble_app->conn_handle == BLE_CONN_HANDLE_INVALID) {
@@ -134,55 +238,44 @@ int ble_write_long(void *p_ble_conn_handle, const unsigned char *buf, size_t len
         return -1;
     }
 
-    //now we can read and write the metadata state 
-    if (metadata_state[2] != 0x00) {
-        printf("ESP32 is not ready to receive data\n");
+    if (nebula_xfer_tx_start(&xfer, buf, len) != 0) {
+        NTRACE_WARN(NT_SENSOR_NOT_READY, xfer.status, 0, 0);
         return -1;
     }
-    
-    //write metadata test 
-    printf("writing metadata[0]%d\n", metadata_state[0]);
-
-    metadata_state[0] = ceil(len/(float)CHUNK_SIZE); //number of full packets to send
-    metadata_state[1] = 0x00;
-    metadata_state[2] = 0x01;
-    error_code = ble_write(metadata_state, 3, &metadata_state_char, 0);
-
-    //Now that sensor has a lock with metadata 
-    //Send data packets in chunks of 510 bytes
-    //TODO: change to for loop on both sensor and esp32 side
-    int counter = 0;
-    int num_sent_packets = 0;
-    while (len_for_write >= CHUNK_SIZE) {
-        int temp = counter + CHUNK_SIZE;
-        error_code = ble_write(&buf[counter],CHUNK_SIZE, &sensor_state_char, 0);
-        len_for_write -= CHUNK_SIZE;
-        counter = counter + CHUNK_SIZE;
-        num_sent_packets += 1;
-
-        //wait for ack to send next packet
-        while (metadata_state[1] != num_sent_packets) {
-            printf("waiting for ack\n");
-            printf("metadata state: %d\n", metadata_state[1]);
-            printf("num sent packets: %d\n", num_sent_packets);
-            nrf_delay_ms(500);
+    NTRACE_INFO(NT_SENSOR_START, len, xfer.chunks, 0);
+    telemetry.transfers++;
+    telemetry.backlog_bytes = len;
+
+    //the engine sends each chunk once the previous one is acked, or with FEC
+    //each block once the mule asks for it
+    while ((status = nebula_xfer_tx_poll(&xfer)) == NEBULA_XFER_TX_SENDING) {
+        if (simple_ble_app->conn_handle == BLE_CONN_HANDLE_INVALID) {
+            nebula_xfer_tx_abort(&xfer);
+            continue;
         }
-
-        printf("number sent packets: %d\n", metadata_state[1]);
+        if (waiting_for != xfer.sent) {
+            waiting_for = xfer.sent;
+            NTRACE_DEBUG(NT_SENSOR_ACK_WAIT, xfer.sent, xfer.acked, 0);
+        }
+        nebula_trace_drain(TRACE_DRAIN_MAX);
+        phy_poll();
+        nrf_delay_ms(ACK_POLL_MS);
     }
+    telemetry.backlog_bytes = 0;
 
-    //wait for final ack from sensor
-    while (metadata_state[1] != num_sent_packets) {
-        printf("waiting for final ack\n");
-        nrf_delay_ms(500);
+    if (status == NEBULA_XFER_TX_SKIPPED) {
+        // the mule already has this payload
+        NTRACE_INFO(NT_SENSOR_SKIPPED, len, 0, 0);
+        telemetry.transfers_skipped++;
+        return len;
+    }
+    if (status != NEBULA_XFER_TX_DONE) {
+        printf("transfer failed\n");
+        return -1;
     }
 
-    //set metadata state to signal that we are done sending data
-    metadata_state[1] = 0;
-    metadata_state[2] = 0x02;
-
-    error_code = ble_write(metadata_state, 3, &metadata_state_char, 0);
-
+    NTRACE_INFO(NT_SENSOR_DONE, len, 0, 0);
+    telemetry_record(NEBULA_HIST_TRANSFER, telemetry_cycles() - start);
     return len;
 }
 
@@ -237,10 +330,19 @@ int ble_write(uint16_t *buf, uint16_t len, simple_ble_char_t *characteristic, in
     hvx_params.p_len = &len;
     hvx_params.p_data = buf;
 
+    uint32_t start = telemetry_cycles();
     ret_code = sd_ble_gatts_hvx(simple_ble_app->conn_handle, &hvx_params);
-    while (ret_code == NRF_ERROR_INVALID_STATE) {
-        printf("Error writing try again\n");
-        nrf_delay_ms(1000);
+    telemetry_record(NEBULA_HIST_HVX, telemetry_cycles() - start);
+    while (ret_code == NRF_ERROR_INVALID_STATE || ret_code == NRF_ERROR_RESOURCES) {
+        if (ret_code == NRF_ERROR_RESOURCES) {
+            //notification queue full; it drains at the next connection event
+            telemetry.hvx_queue_full++;
+            nrf_delay_ms(10);
+        } else {
+            printf("Error writing try again\n");
+            nrf_delay_ms(1000);
+        }
+        telemetry.chunks_retransmitted++;
         ret_code = sd_ble_gatts_hvx(simple_ble_app->conn_handle, &hvx_params);
     }
 
@@ -372,6 +474,8 @@ int main(void) {
 
     // Logging initialization
     error_code = logging_init();
+    telemetry_init();
+    trace_init();
 
     // Crypto initialization
     error_code = nrf_crypto_init();
@@ -553,8 +657,43 @@ int main(void) {
         sizeof(metadata_state), (char*)&metadata_state,
         &sensor_service, &metadata_state_char);
 
-    // Start Advertising
-    advertising_start();
+    simple_ble_add_characteristic(1, 0, 0, 0,
+        sizeof(telemetry), (char*)&telemetry,
+        &sensor_service, &telemetry_char);
+
+    struct nebula_radio radio = { sensor_radio_send, NULL };
+    nebula_xfer_tx_init(&xfer, &radio, CHUNK_SIZE);
+#if SENSOR_XFER_FEC
+    nebula_xfer_tx_fec(&xfer, XFER_FEC_REPAIR);
+#endif
+
+#if SENSOR_BCAST_MODE
+    simple_ble_add_characteristic(0, 1, 0, 1,
+        sizeof(bcast_ack), (char*)&bcast_ack,
+        &sensor_service, &bcast_ack_char);
+
+    // Publish readings from data.h; mules harvest them from the
+    // advertisements and only connect to ack them
+    bcast_init(sensor_id, sensor_key);
+    bcast_start();
+    for (uint32_t i = 0; ; i++) {
+        bcast_publish(data[i % (sizeof data / sizeof data[0])],
+                      sizeof data[0] < BCAST_READING_BYTES ? sizeof data[0]
+                                                           : BCAST_READING_BYTES);
+        for (int t = 0; t < BCAST_PERIOD_MS; t += BCAST_POLL_MS) {
+            bcast_poll();
+            phy_poll();
+            nebula_trace_drain(TRACE_DRAIN_MAX);
+            nrf_delay_ms(BCAST_POLL_MS);
+        }
+    }
+#endif
+
+    // Start advertising, through the broadcast set so it can go out on the
+    // coded PHY; with no readings, it just asks mules to connect
+    bcast_init(sensor_id, sensor_key);
+    bcast_set_bulk(true);
+    bcast_start();
 
     //Wait for connection
     uint16_t ble_conn_handle = simple_ble_app->conn_handle;
@@ -616,6 +755,8 @@ int main(void) {
         error_code = ble_write(data, CHUNK_SIZE, &sensor_state_char, 0);
         printf("  write returned %d\n", error_code);
         printf("connected....doot doot....\n");
+        nebula_trace_drain(TRACE_DRAIN_MAX);
+        phy_poll();
         nrf_delay_ms(500);
 
         // if (metadata_state[2] == 2 ) {
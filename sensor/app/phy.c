@@ -0,0 +1,134 @@
+// Adaptive PHY for the connection to a mule (common/nebula_phy.h). Every
+// PHY_SAMPLE_MS the connection's RSSI goes to the policy, and the sensor asks
+// for the PHY it picks: down to coded near the edge of range, back up through
+// 1M to 2M as the mule comes closer. The mule runs the same policy on its own
+// readings, and as central has the last word on moving up.
+//
+// The SoftDevice's events only record what changed; phy_poll(), from the
+// main loop, runs the policy.
+
+#include <stdio.h>
+#include "ble.h"
+#include "ble_gap.h"
+#include "bcast.h"
+#include "nebula_phy.h"
+#include "nebula_trace.h"
+#include "phy.h"
+#include "telemetry.h"
+
+// Cortex-M4 cycles per microsecond
+#define PHY_CYCLES_PER_US 64
+
+// Written from the SoftDevice event handler
+static volatile uint16_t link_conn = BLE_CONN_HANDLE_INVALID;
+static volatile uint8_t link_gen;
+static volatile uint8_t link_phy;
+
+static struct nebula_phy_policy policy;
+static uint8_t policy_gen;
+static uint64_t sampled_us;
+
+// The cycle counter wraps every 67 s; phy_poll() runs far more often
+static uint64_t cycles;
+static uint32_t last_cycles;
+
+static uint64_t phy_now_us(void) {
+    uint32_t now = telemetry_cycles();
+
+    cycles += (uint32_t)(now - last_cycles);
+    last_cycles = now;
+    return cycles / PHY_CYCLES_PER_US;
+}
+
+static uint8_t phy_from_sd(uint8_t sd_phy) {
+    switch (sd_phy) {
+    case BLE_GAP_PHY_2MBPS:
+        return NEBULA_PHY_2M;
+    case BLE_GAP_PHY_CODED:
+        return NEBULA_PHY_CODED;
+    default:
+        return NEBULA_PHY_1M;
+    }
+}
+
+// Takes every BLE event; only connection and PHY ones matter here
+void phy_on_evt(ble_evt_t const *p_ble_evt) {
+    ble_gap_evt_t const *gap = &p_ble_evt->evt.gap_evt;
+
+    switch (p_ble_evt->header.evt_id) {
+    case BLE_GAP_EVT_CONNECTED:
+        // a connection comes up on the advertising's PHY
+        link_phy = phy_from_sd(BCAST_ADV_PHY);
+        link_gen++;
+        link_conn = gap->conn_handle;
+        sd_ble_gap_rssi_start(gap->conn_handle, BLE_GAP_RSSI_THRESHOLD_INVALID, 0);
+        break;
+
+    case BLE_GAP_EVT_DISCONNECTED:
+        link_conn = BLE_CONN_HANDLE_INVALID;
+        break;
+
+    case BLE_GAP_EVT_PHY_UPDATE_REQUEST: {
+        // go with the mule's choice; the policy asks again if it disagrees
+        ble_gap_phys_t const phys = {
+            .tx_phys = BLE_GAP_PHY_AUTO,
+            .rx_phys = BLE_GAP_PHY_AUTO,
+        };
+        sd_ble_gap_phy_update(gap->conn_handle, &phys);
+        break;
+    }
+
+    case BLE_GAP_EVT_PHY_UPDATE:
+        NTRACE_INFO(NT_SENSOR_PHY, phy_from_sd(gap->params.phy_update.tx_phy),
+                    gap->params.phy_update.status, 0);
+        if (gap->params.phy_update.status == BLE_HCI_STATUS_CODE_SUCCESS) {
+            link_phy = phy_from_sd(gap->params.phy_update.tx_phy);
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+// Samples the connection's RSSI and asks for another PHY if the policy
+// wants one; call often, it keeps to PHY_SAMPLE_MS itself
+void phy_poll(void) {
+    uint64_t now = phy_now_us();
+    uint16_t conn = link_conn;
+    struct nebula_phy_cfg cfg;
+    ble_gap_phys_t phys;
+    ret_code_t error_code;
+    uint8_t ch_index;
+    int8_t rssi;
+    uint8_t want;
+
+    if (conn == BLE_CONN_HANDLE_INVALID || now - sampled_us < PHY_SAMPLE_MS * 1000) {
+        return;
+    }
+    sampled_us = now;
+
+    if (policy_gen != link_gen) {
+        policy_gen = link_gen;
+        nebula_phy_cfg_default(&cfg);
+        nebula_phy_init(&policy, &cfg, link_phy, now);
+    } else if (link_phy != policy.phy) {
+        nebula_phy_updated(&policy, link_phy, now);
+    }
+
+    if (sd_ble_gap_rssi_get(conn, &rssi, &ch_index) != NRF_SUCCESS) {
+        return;
+    }
+    want = nebula_phy_sample(&policy, rssi, now);
+    if (want == NEBULA_PHY_NONE) {
+        return;
+    }
+
+    phys.tx_phys = nebula_phy_bit(want);
+    phys.rx_phys = nebula_phy_bit(want);
+    NTRACE_INFO(NT_SENSOR_PHY_REQ, want, rssi, 0);
+    error_code = sd_ble_gap_phy_update(conn, &phys);
+    if (error_code != NRF_SUCCESS) {
+        printf("failed to request PHY %u: 0x%x\n", want, error_code);
+    }
+}
@@ -0,0 +1,14 @@
+#ifndef PHY_H
+#define PHY_H
+
+#include <stdint.h>
+#include "ble.h"
+
+// How often the connection's RSSI is read for the PHY policy
+#define PHY_SAMPLE_MS 200
+
+void phy_on_connected(ble_evt_t const *p_ble_evt);
+void phy_on_evt(ble_evt_t const *p_ble_evt);
+void phy_poll(void);
+
+#endif // PHY_H
@@ -0,0 +1,54 @@
+#include <string.h>
+#include "telemetry.h"
+
+struct nebula_telemetry telemetry;
+
+// Smallest bucket of each histogram, as log2 cycles at 64 MHz
+static const uint8_t hist_shift[NEBULA_HIST_COUNT] = {
+    [NEBULA_HIST_HVX] = 6,          // 1 us
+    [NEBULA_HIST_ACK] = 16,         // 1 ms
+    [NEBULA_HIST_TRANSFER] = 20,    // 16 ms
+    [NEBULA_HIST_AES] = 8,          // 4 us
+};
+
+void telemetry_init(void) {
+    int i;
+
+    memset(&telemetry, 0, sizeof telemetry);
+    telemetry.version = NEBULA_TELEMETRY_VERSION;
+    telemetry.hist_count = NEBULA_HIST_COUNT;
+    telemetry.buckets = NEBULA_TELEMETRY_BUCKETS;
+    telemetry.cycles_hz = SystemCoreClock;
+    for (i = 0; i < NEBULA_HIST_COUNT; i++) {
+        telemetry.hist[i].shift = hist_shift[i];
+    }
+
+    // Start the DWT cycle counter
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+// Adds a sample; called from thread and SoftDevice event context, each for
+// its own histograms
+void telemetry_record(enum nebula_telemetry_hist_id id, uint32_t cycles) {
+    struct nebula_telemetry_hist *hist = &telemetry.hist[id];
+    int bucket = 0;
+
+    if (cycles != 0) {
+        bucket = 31 - __builtin_clz(cycles) - hist->shift;
+    }
+    if (bucket < 0) {
+        bucket = 0;
+    } else if (bucket >= NEBULA_TELEMETRY_BUCKETS) {
+        bucket = NEBULA_TELEMETRY_BUCKETS - 1;
+    }
+
+    hist->count++;
+    if (cycles > hist->max) {
+        hist->max = cycles;
+    }
+    if (hist->buckets[bucket] != UINT16_MAX) {
+        hist->buckets[bucket]++;
+    }
+}
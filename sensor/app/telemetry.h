@@ -0,0 +1,19 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+#include "nrf.h"
+#include "nebula_telemetry.h"
+
+// Live telemetry; also the value buffer of the telemetry characteristic
+extern struct nebula_telemetry telemetry;
+
+void telemetry_init(void);
+void telemetry_record(enum nebula_telemetry_hist_id id, uint32_t cycles);
+
+// Cortex-M4 cycle counter, started by telemetry_init()
+static inline uint32_t telemetry_cycles(void) {
+    return DWT->CYCCNT;
+}
+
+#endif // TELEMETRY_H